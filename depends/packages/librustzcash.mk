@@ -9,6 +9,7 @@ $(package)_dependencies=rust
 ifeq ($(LIBRUSTZCASH_OVERRIDE),)
 $(package)_dependencies+=$(rust_crates)
 $(package)_patches=cargo.config 0001-Start-using-cargo-clippy-for-CI.patch remove-dev-dependencies.diff
+$(package)_patches+=sapling-proving-ctx-merge-prover.rs sapling-proving-ctx-merge-rustzcash.rs sapling-proving-ctx-merge.h
 endif
 
 $(package)_rust_target=$(if $(rust_rust_target_$(canonical_host)),$(rust_rust_target_$(canonical_host)),$(canonical_host))
@@ -56,6 +57,9 @@ else
 define $(package)_preprocess_cmds
   patch -p1 -d pairing < $($(package)_patch_dir)/0001-Start-using-cargo-clippy-for-CI.patch && \
   patch -p1 < $($(package)_patch_dir)/remove-dev-dependencies.diff && \
+  cat $($(package)_patch_dir)/sapling-proving-ctx-merge-prover.rs >> zcash_proofs/src/sapling/prover.rs && \
+  cat $($(package)_patch_dir)/sapling-proving-ctx-merge-rustzcash.rs >> librustzcash/src/rustzcash.rs && \
+  sed -i.old '/void librustzcash_sapling_proving_ctx_free/r $($(package)_patch_dir)/sapling-proving-ctx-merge.h' librustzcash/include/librustzcash.h && \
   mkdir .cargo && \
   cat $($(package)_patch_dir)/cargo.config | sed 's|CRATE_REGISTRY|$(host_prefix)/$(CRATE_REGISTRY)|' > .cargo/config
 endef
@@ -0,0 +1,10 @@
+
+impl SaplingProvingContext {
+    /// Adds the value commitment randomness and value commitments accumulated
+    /// by another context, so that proofs created on separate contexts (for
+    /// example on separate threads) can share one binding signature.
+    pub fn merge(&mut self, other: &SaplingProvingContext, params: &::sapling_crypto::jubjub::JubjubBls12) {
+        self.bsk.add_assign(&other.bsk);
+        self.bvk = self.bvk.add(&other.bvk, params);
+    }
+}
@@ -0,0 +1,10 @@
+
+/// Adds the value commitments and randomness accumulated by the proving
+/// context `src` to `dst`. `src` still has to be freed by the caller.
+#[no_mangle]
+pub extern "system" fn librustzcash_sapling_proving_ctx_merge(
+    dst: *mut SaplingProvingContext,
+    src: *const SaplingProvingContext,
+) {
+    unsafe { &mut *dst }.merge(unsafe { &*src }, &JUBJUB);
+}
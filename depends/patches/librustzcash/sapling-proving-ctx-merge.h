@@ -0,0 +1,5 @@
+
+    /// Adds the value commitments and randomness accumulated by the proving
+    /// context `src` to `dst`, so that proofs created on several contexts
+    /// share one binding signature. `src` still has to be freed.
+    void librustzcash_sapling_proving_ctx_merge(void *dst, const void *src);
@@ -18,6 +18,7 @@ testScripts=(
     'wallet_changeaddresses.py'
     'wallet_changeindicator.py'
     'wallet_import_export.py'
+    'wallet_importkeys.py'
     'wallet_protectcoinbase.py'
     'wallet_shieldcoinbase_sprout.py'
     'wallet_shieldcoinbase_sapling.py'
@@ -46,6 +47,7 @@ testScripts=(
     'mempool_reorg.py'
     'mempool_nu_activation.py'
     'mempool_tx_expiry.py'
+    'mempool_persist.py'
     'httpbasics.py'
     'zapwallettxes.py'
     'proxy_test.py'
@@ -60,6 +62,7 @@ testScripts=(
     'addressindex.py'
     'spentindex.py'
     'timestampindex.py'
+    'indexbuilder.py'
     'decodescript.py'
     'blockchain.py'
     'disablewallet.py'
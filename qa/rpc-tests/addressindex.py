@@ -284,6 +284,18 @@ class AddressIndexTest(BitcoinTestFramework):
         # set(txids_all) removes its (expected) duplicates
         assert_equal(set(multitxids), set(txids_all))
 
+        # Paging through the same txids with a limit and cursor
+        paged_txids = []
+        params = {'addresses': [addr1, addr_p2sh, addr_p2pkh], 'limit': 7}
+        while True:
+            page = self.nodes[1].getaddresstxids(params)
+            assert(len(page['txids']) <= 7)
+            paged_txids += page['txids']
+            if 'cursor' not in page:
+                break
+            params['cursor'] = page['cursor']
+        assert_equal(paged_txids, multitxids)
+
         deltas = self.nodes[1].getaddressdeltas({'addresses': [addr1]})
         assert_equal(len(deltas), len(expected_deltas))
         for i in range(len(deltas)):
@@ -303,6 +315,12 @@ class AddressIndexTest(BitcoinTestFramework):
         deltas_limited = getaddressdeltas(1, [addr1], 109, 109)
         assert_equal(deltas_limited, deltas[3:4])
 
+        # the same deltas, a page at a time
+        page = self.nodes[1].getaddressdeltas({'addresses': [addr1], 'limit': 2})
+        assert_equal(page['deltas'], deltas[0:2])
+        page = self.nodes[1].getaddressdeltas({'addresses': [addr1], 'limit': 2, 'cursor': page['cursor']})
+        assert_equal(page['deltas'], deltas[2:4])
+
         # the full range (also the default)
         deltas_info = getaddressdeltas(1, [addr1], 106, 111, chainInfo=True)
         assert_equal(deltas_info['deltas'], deltas)
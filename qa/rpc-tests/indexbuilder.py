@@ -0,0 +1,74 @@
+#!/usr/bin/env python
+# Copyright (c) 2019 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or https://www.opensource.org/licenses/mit-license.php .
+#
+# Test enabling -txindex and -insightexplorer on a node whose chain was
+# synced without them; the indexes are built in the background.
+
+import sys; assert sys.version_info < (3,), ur"This script does not run under Python 3. Please use Python 2.7.x."
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.authproxy import JSONRPCException
+from test_framework.util import (
+    assert_equal,
+    initialize_chain_clean,
+    start_node,
+    stop_node,
+)
+
+import time
+
+
+class IndexBuilderTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self):
+        self.nodes = [start_node(0, self.options.tmpdir, ['-debug'])]
+        self.is_network_split = False
+
+    def run_test(self):
+        node = self.nodes[0]
+        node.generate(105)
+        addr = node.getnewaddress()
+        txid = node.sendtoaddress(addr, 2)
+        node.generate(1)
+
+        stop_node(node, 0)
+        args = ['-debug', '-txindex', '-experimentalfeatures', '-insightexplorer']
+        node = self.nodes[0] = start_node(0, self.options.tmpdir, args)
+
+        # Wait for the background builders to catch up with the tip
+        for i in range(60):
+            try:
+                if node.getaddresstxids(addr) == [txid]:
+                    break
+            except JSONRPCException:
+                pass
+            time.sleep(1)
+        assert_equal(node.getaddresstxids(addr), [txid])
+        assert_equal(node.getaddressbalance(addr)['balance'], 2 * 100000000)
+
+        # Blocks after the hand-over are indexed by the node itself
+        txid2 = node.sendtoaddress(addr, 1)
+        node.generate(1)
+        assert_equal(sorted(node.getaddresstxids(addr)), sorted([txid, txid2]))
+        for i in range(60):
+            try:
+                node.getrawtransaction(txid)
+                break
+            except JSONRPCException:
+                time.sleep(1)
+        assert_equal(node.getrawtransaction(txid, 1)['txid'], txid)
+
+        # The indexes stay enabled after a restart
+        stop_node(node, 0)
+        node = self.nodes[0] = start_node(0, self.options.tmpdir, args)
+        assert_equal(sorted(node.getaddresstxids(addr)), sorted([txid, txid2]))
+
+
+if __name__ == '__main__':
+    IndexBuilderTest().main()
@@ -0,0 +1,65 @@
+#!/usr/bin/env python
+# Copyright (c) 2019 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#
+# Test that the mempool is saved on shutdown and reloaded on restart,
+# unless -persistmempool=0 is given.
+#
+
+import sys; assert sys.version_info < (3,), ur"This script does not run under Python 3. Please use Python 2.7.x."
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, connect_nodes_bi, \
+    start_node, start_nodes, stop_node, sync_mempools
+
+import time
+
+class MempoolPersistTest(BitcoinTestFramework):
+
+    def setup_network(self):
+        self.nodes = start_nodes(2, self.options.tmpdir, [["-debug=mempool"]] * 2)
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def restart_node0(self, extra_args=[]):
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir, ["-debug=mempool"] + extra_args)
+
+    def wait_for_mempool_size(self, node, size):
+        # The mempool is loaded in the background after startup
+        for i in range(50):
+            if len(node.getrawmempool()) == size:
+                return
+            time.sleep(0.2)
+        assert_equal(len(node.getrawmempool()), size)
+
+    def run_test(self):
+        # Node 1's wallet creates the transactions, so that node 0 only gets
+        # them back from mempool.dat
+        address = self.nodes[1].getnewaddress()
+        txids = [self.nodes[1].sendtoaddress(address, 1) for i in range(3)]
+        sync_mempools(self.nodes)
+        entries = self.nodes[0].getrawmempool(True)
+        assert_equal(sorted(entries.keys()), sorted(txids))
+
+        print "Restarting node 0..."
+        self.restart_node0()
+        self.wait_for_mempool_size(self.nodes[0], 3)
+        reloaded = self.nodes[0].getrawmempool(True)
+        for txid in txids:
+            assert_equal(reloaded[txid]['time'], entries[txid]['time'])
+
+        print "Restarting node 0 with -persistmempool=0..."
+        self.restart_node0(["-persistmempool=0"])
+        assert_equal(len(self.nodes[0].getrawmempool()), 0)
+
+        # mempool.dat was neither loaded nor overwritten by that run
+        print "Restarting node 0 again..."
+        self.restart_node0()
+        self.wait_for_mempool_size(self.nodes[0], 3)
+
+if __name__ == '__main__':
+    MempoolPersistTest().main()
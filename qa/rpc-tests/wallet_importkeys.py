@@ -0,0 +1,85 @@
+#!/usr/bin/env python
+# Copyright (c) 2019 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or https://www.opensource.org/licenses/mit-license.php .
+#
+# Test z_importkeys, in particular that a batch containing an invalid entry
+# imports none of its keys.
+
+import sys; assert sys.version_info < (3,), ur"This script does not run under Python 3. Please use Python 2.7.x."
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.authproxy import JSONRPCException
+from test_framework.util import (
+    assert_equal,
+    assert_true,
+    connect_nodes_bi,
+    initialize_chain_clean,
+    start_nodes,
+)
+
+
+class WalletImportKeysTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(2, self.options.tmpdir)
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def assert_import_fails(self, node, keys, message):
+        try:
+            node.z_importkeys(keys)
+            assert(False)
+        except JSONRPCException as e:
+            assert_true(message in e.error['message'], e.error['message'])
+
+    def run_test(self):
+        self.nodes[0].generate(101)
+        self.sync_all()
+
+        taddr = self.nodes[0].getnewaddress()
+        tkey = self.nodes[0].dumpprivkey(taddr)
+        zaddr = self.nodes[0].z_getnewaddress('sapling')
+        zkey = self.nodes[0].z_exportkey(zaddr)
+
+        self.nodes[0].sendtoaddress(taddr, 1)
+        self.sync_all()
+        self.nodes[0].generate(1)
+        self.sync_all()
+        height = self.nodes[0].getblockcount()
+
+        # An invalid key after valid ones: nothing is imported
+        self.assert_import_fails(self.nodes[1], [
+            {'key': tkey, 'birthheight': 100},
+            {'key': zkey},
+            {'key': 'notakey'},
+        ], 'Invalid private key or spending key 2')
+        assert_true(not self.nodes[1].validateaddress(taddr)['ismine'])
+        assert_true(not self.nodes[1].z_validateaddress(zaddr)['ismine'])
+
+        # An out of range birth height after a valid key: nothing is imported
+        self.assert_import_fails(self.nodes[1], [
+            {'key': zkey},
+            {'key': tkey, 'birthheight': height + 1},
+        ], 'Block height out of range for key 1')
+        assert_true(not self.nodes[1].validateaddress(taddr)['ismine'])
+        assert_true(not self.nodes[1].z_validateaddress(zaddr)['ismine'])
+
+        # The same keys in a valid batch are imported and rescanned
+        result = self.nodes[1].z_importkeys([
+            {'key': tkey, 'birthheight': 100},
+            {'key': zkey},
+        ])
+        assert_equal([taddr, zaddr], result)
+        assert_true(self.nodes[1].validateaddress(taddr)['ismine'])
+        assert_true(self.nodes[1].z_validateaddress(zaddr)['ismine'])
+        assert_equal(1, self.nodes[1].z_getbalance(taddr))
+
+
+if __name__ == '__main__':
+    WalletImportKeysTest().main()
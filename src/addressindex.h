@@ -8,6 +8,7 @@
 
 #include "uint256.h"
 #include "amount.h"
+#include "compat/byteswap.h"
 #include "script/script.h"
 
 struct CAddressUnspentKey {
@@ -151,6 +152,31 @@ struct CAddressIndexKey {
 
 };
 
+/**
+ * Orders the address index entries of several addresses by height and position
+ * in the block, in the order the index stores the entries of each one address,
+ * so that the per-address LevelDB iterators can be merged. The output index is
+ * stored little-endian, hence compared byte-swapped.
+ */
+struct CAddressIndexKeyCompareByHeight
+{
+    bool operator()(const CAddressIndexKey& a, const CAddressIndexKey& b) const {
+        if (a.blockHeight != b.blockHeight)
+            return a.blockHeight < b.blockHeight;
+        if (a.txindex != b.txindex)
+            return a.txindex < b.txindex;
+        if (a.txhash != b.txhash)
+            return a.txhash < b.txhash;
+        if (a.index != b.index)
+            return bswap_32(a.index) < bswap_32(b.index);
+        if (a.spending != b.spending)
+            return a.spending < b.spending;
+        if (a.type != b.type)
+            return a.type < b.type;
+        return a.hashBytes < b.hashBytes;
+    }
+};
+
 struct CAddressIndexIteratorKey {
     unsigned int type;
     uint160 hashBytes;
@@ -182,6 +208,10 @@ struct CAddressIndexIteratorKey {
         type = 0;
         hashBytes.SetNull();
     }
+
+    friend bool operator<(const CAddressIndexIteratorKey& a, const CAddressIndexIteratorKey& b) {
+        return a.type < b.type || (a.type == b.type && a.hashBytes < b.hashBytes);
+    }
 };
 
 struct CAddressIndexIteratorHeightKey {
@@ -222,6 +252,36 @@ struct CAddressIndexIteratorHeightKey {
     }
 };
 
+/** The running totals of an address, kept by the address balance index */
+struct CAddressBalanceValue {
+    CAmount balance;
+    CAmount received;
+    int64_t txCount; //!< Number of transactions paying to or spending from the address
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(balance);
+        READWRITE(received);
+        READWRITE(txCount);
+    }
+
+    CAddressBalanceValue() {
+        SetNull();
+    }
+
+    void SetNull() {
+        balance = 0;
+        received = 0;
+        txCount = 0;
+    }
+
+    bool IsNull() const {
+        return balance == 0 && received == 0 && txCount == 0;
+    }
+};
+
 struct CMempoolAddressDelta
 {
     int64_t time;
@@ -244,6 +304,20 @@ struct CMempoolAddressDelta
     }
 };
 
+/** A transaction input or output in a per-address bucket of the mempool address index */
+struct CMempoolAddressEntry
+{
+    uint256 txhash;
+    unsigned int index;
+    int spending;
+    CMempoolAddressDelta delta;
+
+    CMempoolAddressEntry(uint256 hash, unsigned int i, int s, const CMempoolAddressDelta& d) :
+        txhash(hash), index(i), spending(s), delta(d) {}
+
+    CMempoolAddressEntry() : index(0), spending(0), delta(0, 0) {}
+};
+
 struct CMempoolAddressDeltaKey
 {
     int type;
@@ -11,11 +11,31 @@
 #include <string>
 #include <ctime>
 #include <chrono>
+#include <time.h>
 
 using namespace std;
 
 static boost::uuids::random_generator uuidgen;
 
+static std::map<OperationPriority, std::string> OperationPriorityMap = {
+    {OperationPriority::LOW, "low"},
+    {OperationPriority::NORMAL, "normal"},
+    {OperationPriority::HIGH, "high"}
+};
+
+/**
+ * CPU time consumed by the process, in seconds. An operation's proofs are
+ * created on other threads (some of them inside the prover), so the time of
+ * the thread running it would miss most of the work.
+ */
+static double GetProcessCPUTime() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) {
+        return 0;
+    }
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 static std::map<OperationStatus, std::string> OperationStatusMap = {
     {OperationStatus::READY, "queued"},
     {OperationStatus::EXECUTING, "executing"},
@@ -27,7 +47,8 @@ static std::map<OperationStatus, std::string> OperationStatusMap = {
 /**
  * Every operation instance should have a globally unique id
  */
-AsyncRPCOperation::AsyncRPCOperation() : error_code_(0), error_message_() {
+AsyncRPCOperation::AsyncRPCOperation() : error_code_(0), error_message_(),
+        cancel_requested_(false), start_cpu_secs_(0), cpu_secs_(0), proving_micros_(0) {
     // Set a unique reference for each operation
     boost::uuids::uuid uuid = uuidgen();
     id_ = "opid-" + boost::uuids::to_string(uuid);
@@ -39,7 +60,9 @@ AsyncRPCOperation::AsyncRPCOperation(const AsyncRPCOperation& o) :
         id_(o.id_), creation_time_(o.creation_time_), state_(o.state_.load()),
         start_time_(o.start_time_), end_time_(o.end_time_),
         error_code_(o.error_code_), error_message_(o.error_message_),
-        result_(o.result_)
+        result_(o.result_), cancel_requested_(o.cancel_requested_.load()),
+        start_cpu_secs_(o.start_cpu_secs_), cpu_secs_(o.cpu_secs_),
+        proving_micros_(o.proving_micros_.load())
 {
 }
 
@@ -52,6 +75,10 @@ AsyncRPCOperation& AsyncRPCOperation::operator=( const AsyncRPCOperation& other
     this->error_code_ = other.error_code_;
     this->error_message_ = other.error_message_;
     this->result_ = other.result_;
+    this->cancel_requested_.store(other.cancel_requested_.load());
+    this->start_cpu_secs_ = other.start_cpu_secs_;
+    this->cpu_secs_ = other.cpu_secs_;
+    this->proving_micros_.store(other.proving_micros_.load());
     return *this;
 }
 
@@ -60,11 +87,14 @@ AsyncRPCOperation::~AsyncRPCOperation() {
 }
 
 /**
- * Override this cancel() method if you can interrupt main() when executing.
+ * Cancel the operation if it hasn't started yet. If it is executing, it stops
+ * at its next call to interruption_point().
  */
 void AsyncRPCOperation::cancel() {
     if (isReady()) {
         set_state(OperationStatus::CANCELLED);
+    } else if (isExecuting()) {
+        cancel_requested_.store(true);
     }
 }
 
@@ -74,6 +104,7 @@ void AsyncRPCOperation::cancel() {
 void AsyncRPCOperation::start_execution_clock() {
     std::lock_guard<std::mutex> guard(lock_);
     start_time_ = std::chrono::system_clock::now();
+    start_cpu_secs_ = GetProcessCPUTime();
 }
 
 /**
@@ -82,6 +113,7 @@ void AsyncRPCOperation::start_execution_clock() {
 void AsyncRPCOperation::stop_execution_clock() {
     std::lock_guard<std::mutex> guard(lock_);
     end_time_ = std::chrono::system_clock::now();
+    cpu_secs_ = GetProcessCPUTime() - start_cpu_secs_;
 }
 
 /**
@@ -155,6 +187,7 @@ UniValue AsyncRPCOperation::getStatus() const {
     obj.push_back(Pair("id", this->id_));
     obj.push_back(Pair("status", OperationStatusMap[status]));
     obj.push_back(Pair("creation_time", this->creation_time_));
+    obj.push_back(Pair("priority", OperationPriorityMap[this->getPriority()]));
     // TODO: Issue #1354: There may be other useful metadata to return to the user.
     UniValue err = this->getError();
     if (!err.isNull()) {
@@ -169,6 +202,12 @@ UniValue AsyncRPCOperation::getStatus() const {
         obj.push_back(Pair("execution_secs", elapsed_seconds.count()));
 
     }
+    if (status == OperationStatus::SUCCESS || status == OperationStatus::FAILED ||
+            (status == OperationStatus::CANCELLED && isCancelRequested())) {
+        std::lock_guard<std::mutex> guard(lock_);
+        obj.push_back(Pair("cpu_secs", this->cpu_secs_));
+        obj.push_back(Pair("proving_secs", this->proving_micros_.load() / 1e6));
+    }
     return obj;
 }
 
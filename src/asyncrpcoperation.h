@@ -14,6 +14,7 @@
 #include <thread>
 #include <utility>
 #include <future>
+#include <stdexcept>
 
 #include <univalue.h>
 
@@ -37,6 +38,26 @@ typedef enum class operationStateEnum {
     SUCCESS
 } OperationStatus;
 
+/**
+ * Operations of a higher priority are started first. When the queue has more
+ * than one worker, low priority operations are kept off the last free worker,
+ * so that long running consolidations don't hold up payments.
+ */
+typedef enum class operationPriorityEnum {
+    LOW = 0,
+    NORMAL,
+    HIGH
+} OperationPriority;
+
+/**
+ * Thrown from a cancellation point of an operation that was cancelled while
+ * it was executing.
+ */
+class AsyncRPCOperationCancelled : public std::runtime_error {
+public:
+    AsyncRPCOperationCancelled() : std::runtime_error("operation cancelled") {}
+};
+
 class AsyncRPCOperation {
 public:
     AsyncRPCOperation();
@@ -45,8 +66,14 @@ public:
     // You must implement this method in your subclass.
     virtual void main();
 
-    // Override this method if you can interrupt execution of main() in your subclass.
-    void cancel();
+    // Cancel a queued operation, or ask an executing one to stop at its next
+    // cancellation point (see interruption_point()).
+    virtual void cancel();
+
+    // Override this method to schedule the operation ahead of or behind others.
+    virtual OperationPriority getPriority() const {
+        return OperationPriority::NORMAL;
+    }
     
     // Getters and setters
 
@@ -85,6 +112,10 @@ public:
         return OperationStatus::CANCELLED == getState();
     }
 
+    bool isCancelRequested() const {
+        return cancel_requested_.load();
+    }
+
     bool isExecuting() const {
         return OperationStatus::EXECUTING == getState();
     }
@@ -115,10 +146,50 @@ protected:
     std::string error_message_;
     std::atomic<OperationStatus> state_;
     std::chrono::time_point<std::chrono::system_clock> start_time_, end_time_;  
+    std::atomic<bool> cancel_requested_;
+    // CPU time of the whole process while main() ran (so it includes the
+    // proving threads, and anything else running at the same time), and wall
+    // time spent proving
+    double start_cpu_secs_, cpu_secs_;
+    std::atomic<int64_t> proving_micros_;
 
     void start_execution_clock();
     void stop_execution_clock();
 
+    // Adds the time spent in its scope to the proving time of the operation,
+    // which is reported separately from the execution time.
+    class ProvingTimer {
+    public:
+        explicit ProvingTimer(AsyncRPCOperation& op) : op_(op), start_(std::chrono::steady_clock::now()), stopped_(false) {}
+        ~ProvingTimer() {
+            stop();
+        }
+        void stop() {
+            if (!stopped_) {
+                op_.proving_micros_ += std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start_).count();
+                stopped_ = true;
+            }
+        }
+    private:
+        AsyncRPCOperation& op_;
+        std::chrono::time_point<std::chrono::steady_clock> start_;
+        bool stopped_;
+    };
+
+    // Call this from long running loops in main(); throws
+    // AsyncRPCOperationCancelled if the operation has been cancelled.
+    void interruption_point() const {
+        if (isCancelRequested()) {
+            throw AsyncRPCOperationCancelled();
+        }
+    }
+
+    // The state an operation ends in when main() didn't succeed
+    OperationStatus unsuccessful_state() const {
+        return isCancelRequested() ? OperationStatus::CANCELLED : OperationStatus::FAILED;
+    }
+
     void set_state(OperationStatus state) {
         this->state_.store(state);
     }
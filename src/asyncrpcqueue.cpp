@@ -15,13 +15,30 @@ shared_ptr<AsyncRPCQueue> AsyncRPCQueue::sharedInstance() {
     return q;
 }
 
-AsyncRPCQueue::AsyncRPCQueue() : closed_(false), finish_(false) {
+AsyncRPCQueue::AsyncRPCQueue() : closed_(false), finish_(false), operation_sequence_(0), executing_low_priority_(0) {
 }
 
 AsyncRPCQueue::~AsyncRPCQueue() {
     closeAndWait();     // join on all worker threads
 }
 
+/**
+ * Return the queued operation to start next, or the end of the queue if
+ * there is none that may start now. Requires lock_.
+ */
+AsyncRPCOperationIdQueue::iterator AsyncRPCQueue::next_runnable_operation() {
+    auto it = operation_id_queue_.begin();
+    if (it == operation_id_queue_.end()) {
+        return it;
+    }
+    // Everything after a low priority operation is low priority as well
+    if (static_cast<OperationPriority>(-it->first.first) == OperationPriority::LOW &&
+            workers_.size() > 1 && executing_low_priority_ + 1 >= workers_.size()) {
+        return operation_id_queue_.end();
+    }
+    return it;
+}
+
 /**
  * A worker will execute this method on a new thread
  */
@@ -29,10 +46,13 @@ void AsyncRPCQueue::run(size_t workerId) {
 
     while (true) {
         AsyncRPCOperationId key;
+        OperationPriority priority;
         std::shared_ptr<AsyncRPCOperation> operation;
         {
             std::unique_lock<std::mutex> guard(lock_);
-            while (operation_id_queue_.empty() && !isClosed() && !isFinishing()) {
+            AsyncRPCOperationIdQueue::iterator next;
+            while ((next = next_runnable_operation()) == operation_id_queue_.end() &&
+                    !isClosed() && !(isFinishing() && operation_id_queue_.empty())) {
                 this->condition_.wait(guard);
             }
 
@@ -43,15 +63,17 @@ void AsyncRPCQueue::run(size_t workerId) {
 
             // Exit if the queue is closing.
             if (isClosed()) {
-                while (!operation_id_queue_.empty()) {
-                    operation_id_queue_.pop();
-                }
+                operation_id_queue_.clear();
                 break;
             }
 
             // Get operation id
-            key = operation_id_queue_.front();
-            operation_id_queue_.pop();
+            priority = static_cast<OperationPriority>(-next->first.first);
+            key = next->second;
+            operation_id_queue_.erase(next);
+            if (priority == OperationPriority::LOW) {
+                executing_low_priority_++;
+            }
 
             // Search operation map
             AsyncRPCOperationMap::const_iterator iter = operation_map_.find(key);
@@ -67,6 +89,14 @@ void AsyncRPCQueue::run(size_t workerId) {
         } else {
             operation->main();
         }
+
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            if (priority == OperationPriority::LOW) {
+                executing_low_priority_--;
+            }
+            this->condition_.notify_all();
+        }
     }
 }
 
@@ -91,8 +121,9 @@ void AsyncRPCQueue::addOperation(const std::shared_ptr<AsyncRPCOperation> &ptrOp
 
     AsyncRPCOperationId id = ptrOperation->getId();
     operation_map_.emplace(id, ptrOperation);
-    operation_id_queue_.push(id);
-    this->condition_.notify_one();
+    int priority = static_cast<int>(ptrOperation->getPriority());
+    operation_id_queue_.emplace(std::make_pair(-priority, operation_sequence_++), id);
+    this->condition_.notify_all();
 }
 
 /**
@@ -153,12 +184,15 @@ void AsyncRPCQueue::finish() {
 }
 
 /**
- *  Call cancel() on all operations
+ * Cancel all operations that haven't started. Executing operations are left
+ * to finish, so that closing the queue at shutdown still waits for them.
  */
 void AsyncRPCQueue::cancelAllOperations() {
     std::lock_guard<std::mutex> guard(lock_);
     for (auto key : operation_map_) {
-        key.second->cancel();
+        if (key.second->isReady()) {
+            key.second->cancel();
+        }
     }
     this->condition_.notify_all();
 }
@@ -10,7 +10,7 @@
 #include <iostream>
 #include <string>
 #include <chrono>
-#include <queue>
+#include <map>
 #include <unordered_map>
 #include <vector>
 #include <future>
@@ -19,7 +19,12 @@
 #include <memory>
 
 
+static const int DEFAULT_RPC_ASYNC_THREADS = 1;
+
 typedef std::unordered_map<AsyncRPCOperationId, std::shared_ptr<AsyncRPCOperation> > AsyncRPCOperationMap; 
+// Queued operation ids, in the order they are to be started: highest priority
+// first, then in the order they were added.
+typedef std::map<std::pair<int, uint64_t>, AsyncRPCOperationId> AsyncRPCOperationIdQueue;
 
 
 class AsyncRPCQueue {
@@ -39,11 +44,11 @@ public:
     size_t getNumberOfWorkers() const;
     bool isClosed() const;
     bool isFinishing() const;
-    void close(); // close queue and cancel all operations
+    void close(); // close queue and cancel all operations that haven't started
     void finish(); // close queue but finishing existing operations
     void closeAndWait(); // block thread until all threads have terminated.
     void finishAndWait(); // block thread until existing operations have finished, threads terminated
-    void cancelAllOperations(); // mark all operations in the queue as cancelled
+    void cancelAllOperations(); // mark all operations that haven't started as cancelled
     size_t getOperationCount() const;
     std::shared_ptr<AsyncRPCOperation> getOperationForId(AsyncRPCOperationId) const;
     std::shared_ptr<AsyncRPCOperation> popOperationForId(AsyncRPCOperationId);
@@ -54,6 +59,7 @@ private:
     // addWorker() will spawn a new thread on run())
     void run(size_t workerId);
     void wait_for_worker_threads();
+    AsyncRPCOperationIdQueue::iterator next_runnable_operation();
 
     // Why this is not a recursive lock: http://www.zaval.org/resources/library/butenhof1.html
     mutable std::mutex lock_;
@@ -61,7 +67,9 @@ private:
     std::atomic<bool> closed_;
     std::atomic<bool> finish_;
     AsyncRPCOperationMap operation_map_;
-    std::queue <AsyncRPCOperationId> operation_id_queue_;
+    AsyncRPCOperationIdQueue operation_id_queue_;
+    uint64_t operation_sequence_;
+    size_t executing_low_priority_;
     std::vector<std::thread> workers_;
 };
 
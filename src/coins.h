@@ -260,6 +260,18 @@ public:
     }
 };
 
+/** Salted hasher for outpoints, mixing the output index into the hash of the txid */
+class COutPointHasher
+{
+private:
+    CCoinsKeyHasher hasher;
+
+public:
+    size_t operator()(const COutPoint& outpoint) const {
+        return hasher(outpoint.hash) ^ outpoint.n;
+    }
+};
+
 struct CCoinsCacheEntry
 {
     CCoins coins; // The actual cached data.
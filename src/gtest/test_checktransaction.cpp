@@ -510,6 +510,20 @@ TEST(checktransaction_tests, bad_txns_invalid_joinsplit_signature) {
     ContextualCheckTransaction(tx, state, chainparams, 0, 100, [](const CChainParams&) { return false; });
 }
 
+TEST(checktransaction_tests, skip_shielded_checks) {
+    SelectParams(CBaseChainParams::REGTEST);
+    auto chainparams = Params();
+
+    CMutableTransaction mtx = GetValidTransaction();
+    mtx.joinSplitSig[0] += 1;
+    CTransaction tx(mtx);
+
+    // The signature isn't checked again when the caller already has
+    MockCValidationState state;
+    EXPECT_CALL(state, DoS(::testing::_, ::testing::_, ::testing::_, ::testing::_, ::testing::_)).Times(0);
+    EXPECT_TRUE(ContextualCheckTransaction(tx, state, chainparams, 0, 100, [](const CChainParams&) { return false; }, false));
+}
+
 TEST(checktransaction_tests, non_canonical_ed25519_signature) {
     SelectParams(CBaseChainParams::REGTEST);
     auto chainparams = Params();
@@ -509,6 +509,40 @@ TEST(joinsplit, full_api_test)
     test_full_api(params);
 }
 
+TEST(joinsplit, deferred_proofs)
+{
+    SproutSpendingKey key = SproutSpendingKey::random();
+    SproutPaymentAddress addr = key.address();
+    uint256 joinSplitPubKey = random_uint256();
+    SproutMerkleTree tree;
+
+    // Chain two JoinSplits without proving the first one
+    std::array<JSInput, 2> inputs = {JSInput(), JSInput()};
+    std::array<JSOutput, 2> outputs = {JSOutput(addr, 10), JSOutput()};
+    ZCJSProofWitness proofWitness1;
+    JSDescription jsdesc1(*params, joinSplitPubKey, tree.root(), inputs, outputs,
+                          10, 0, false, nullptr, &proofWitness1);
+    ASSERT_FALSE(verifySproutProof(*params, jsdesc1, joinSplitPubKey));
+    ASSERT_EQ(jsdesc1.commitments[0], proofWitness1.notes[0].cm());
+
+    tree.append(jsdesc1.commitments[0]);
+    SproutWitness witness = tree.witness();
+    witness.append(jsdesc1.commitments[1]);
+    tree.append(jsdesc1.commitments[1]);
+
+    inputs = {JSInput(witness, proofWitness1.notes[0], key), JSInput()};
+    outputs = {JSOutput(), JSOutput()};
+    ZCJSProofWitness proofWitness2;
+    JSDescription jsdesc2(*params, joinSplitPubKey, tree.root(), inputs, outputs,
+                          0, 10, false, nullptr, &proofWitness2);
+
+    // Both proofs can then be created from their witnesses
+    jsdesc2.proof = params->prove(proofWitness2);
+    jsdesc1.proof = params->prove(proofWitness1);
+    ASSERT_TRUE(verifySproutProof(*params, jsdesc1, joinSplitPubKey));
+    ASSERT_TRUE(verifySproutProof(*params, jsdesc2, joinSplitPubKey));
+}
+
 TEST(joinsplit, note_plaintexts)
 {
     uint252 a_sk = uint252(uint256S("f6da8716682d600f74fc16bd0187faad6a26b4aa4c24d5c055b216d94516840e"));
@@ -227,6 +227,26 @@ TEST(keystore_tests, StoreAndRetrieveSaplingSpendingKey) {
     EXPECT_EQ(ivk, ivkOut);
 }
 
+TEST(keystore_tests, RemoveSaplingKeys) {
+    CBasicKeyStore keyStore;
+    auto sk = GetTestMasterSaplingSpendingKey();
+    auto fvk = sk.expsk.full_viewing_key();
+    auto ivk = fvk.in_viewing_key();
+    auto addr = sk.DefaultAddress();
+
+    // Removing the spending key keeps the viewing keys
+    ASSERT_TRUE(keyStore.AddSaplingSpendingKey(sk, addr));
+    EXPECT_TRUE(keyStore.RemoveSaplingSpendingKey(sk));
+    EXPECT_FALSE(keyStore.HaveSaplingSpendingKey(fvk));
+    EXPECT_TRUE(keyStore.HaveSaplingFullViewingKey(ivk));
+    EXPECT_TRUE(keyStore.HaveSaplingIncomingViewingKey(addr));
+
+    EXPECT_TRUE(keyStore.RemoveSaplingFullViewingKey(fvk));
+    EXPECT_FALSE(keyStore.HaveSaplingFullViewingKey(ivk));
+    EXPECT_TRUE(keyStore.RemoveSaplingIncomingViewingKey(addr));
+    EXPECT_FALSE(keyStore.HaveSaplingIncomingViewingKey(addr));
+}
+
 #ifdef ENABLE_WALLET
 class TestCCryptoKeyStore : public CCryptoKeyStore
 {
@@ -369,4 +389,23 @@ TEST(keystore_tests, store_and_retrieve_spending_key_in_encrypted_store) {
     ASSERT_EQ(1, addrs.count(addr));
     ASSERT_EQ(1, addrs.count(addr2));
 }
+
+TEST(keystore_tests, RemoveSaplingSpendingKeyFromEncryptedStore) {
+    TestCCryptoKeyStore keyStore;
+    CKeyingMaterial vMasterKey(32, 0);
+    GetRandBytes(vMasterKey.data(), 32);
+
+    ASSERT_TRUE(keyStore.AddSproutSpendingKey(libzcash::SproutSpendingKey::random()));
+    ASSERT_TRUE(keyStore.EncryptKeys(vMasterKey));
+    ASSERT_TRUE(keyStore.Unlock(vMasterKey));
+
+    auto sk = GetTestMasterSaplingSpendingKey();
+    auto fvk = sk.expsk.full_viewing_key();
+    ASSERT_TRUE(keyStore.AddSaplingSpendingKey(sk, sk.DefaultAddress()));
+    EXPECT_TRUE(keyStore.HaveSaplingSpendingKey(fvk));
+    EXPECT_TRUE(keyStore.RemoveSaplingSpendingKey(sk));
+    EXPECT_FALSE(keyStore.HaveSaplingSpendingKey(fvk));
+    EXPECT_TRUE(keyStore.HaveSaplingFullViewingKey(fvk.in_viewing_key()));
+}
+
 #endif
@@ -150,6 +150,57 @@ TEST(TransactionBuilder, SaplingToSapling) {
     RegtestDeactivateSapling();
 }
 
+TEST(TransactionBuilder, ManySaplingSpendsAndOutputs) {
+    auto consensusParams = RegtestActivateSapling();
+
+    auto sk = libzcash::SaplingSpendingKey::random();
+    auto expsk = sk.expanded_spending_key();
+    auto fvk = sk.full_viewing_key();
+    auto pa = sk.default_address();
+
+    // Four notes in one tree, so that they share an anchor
+    SaplingMerkleTree tree;
+    std::vector<libzcash::SaplingNote> notes;
+    std::vector<SaplingWitness> witnesses;
+    for (int i = 0; i < 4; i++) {
+        libzcash::SaplingNote note(pa, 10000);
+        uint256 cm = note.cm().get();
+        tree.append(cm);
+        for (auto& witness : witnesses) {
+            witness.append(cm);
+        }
+        notes.push_back(note);
+        witnesses.push_back(tree.witness());
+    }
+
+    // The spend and output proofs are created in parallel on separate
+    // proving contexts, which have to add up to a valid binding signature
+    // 0.0004 z-ZEC in, 3 x 0.00008 z-ZEC out, 0.0001 t-ZEC fee, 0.00006 z-ZEC change
+    auto builder = TransactionBuilder(consensusParams, 2);
+    for (int i = 0; i < 4; i++) {
+        builder.AddSaplingSpend(expsk, notes[i], tree.root(), witnesses[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        builder.AddSaplingOutput(fvk.ovk, pa, 8000, {});
+    }
+    auto tx = builder.Build().GetTxOrThrow();
+
+    EXPECT_EQ(tx.vShieldedSpend.size(), 4);
+    EXPECT_EQ(tx.vShieldedOutput.size(), 4);
+    EXPECT_EQ(tx.valueBalance, 10000);
+    // The descriptions keep the order in which they were added
+    for (int i = 0; i < 4; i++) {
+        EXPECT_EQ(tx.vShieldedSpend[i].nullifier, notes[i].nullifier(fvk, witnesses[i].position()).get());
+    }
+
+    CValidationState state;
+    EXPECT_TRUE(ContextualCheckTransaction(tx, state, Params(), 3, 0));
+    EXPECT_EQ(state.GetRejectReason(), "");
+
+    // Revert to default
+    RegtestDeactivateSapling();
+}
+
 TEST(TransactionBuilder, SaplingToSprout) {
     auto consensusParams = RegtestActivateSapling();
 
@@ -0,0 +1,344 @@
+// Copyright (c) 2019 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "indexbuilder.h"
+
+#include "addressindex.h"
+#include "chainparams.h"
+#include "main.h"
+#include "spentindex.h"
+#include "timestampindex.h"
+#include "txdb.h"
+#include "txmempool.h"
+#include "undo.h"
+#include "util.h"
+
+#include <memory>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+
+CIndexBuilder::CIndexBuilder(const std::string& nameIn) : name(nameIn), pindexBest(NULL)
+{
+}
+
+bool CIndexBuilder::Connect(const CBlockIndex* pindex)
+{
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex, Params().GetConsensus()))
+        return error("%s: %s: failed to read block %s", __func__, name, pindex->GetBlockHash().ToString());
+    if (!WriteBlock(block, pindex))
+        return false;
+    // The entries are written before the progress, so that after a crash the
+    // block is indexed again; writing the same entries twice is harmless.
+    if (!pblocktree->WriteIndexBuilderBest(name, pindex->GetBlockHash()))
+        return error("%s: %s: failed to write progress", __func__, name);
+    pindexBest = pindex;
+    return true;
+}
+
+bool CIndexBuilder::Rewind(const CBlockIndex* pindex)
+{
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex, Params().GetConsensus()))
+        return error("%s: %s: failed to read block %s", __func__, name, pindex->GetBlockHash().ToString());
+    if (!EraseBlock(block, pindex))
+        return false;
+    if (!pblocktree->WriteIndexBuilderBest(name, pindex->pprev->GetBlockHash()))
+        return error("%s: %s: failed to write progress", __func__, name);
+    pindexBest = pindex->pprev;
+    return true;
+}
+
+void CIndexBuilder::ThreadBuild()
+{
+    {
+        LOCK(cs_main);
+        uint256 hashBest;
+        if (pblocktree->ReadIndexBuilderBest(name, hashBest)) {
+            BlockMap::iterator mi = mapBlockIndex.find(hashBest);
+            if (mi != mapBlockIndex.end())
+                pindexBest = mi->second;
+        }
+        // ConnectBlock doesn't index the genesis block either
+        if (pindexBest == NULL)
+            pindexBest = chainActive.Genesis();
+        LogPrintf("%s: building %s from height %d\n", __func__, name, pindexBest ? pindexBest->nHeight : -1);
+    }
+
+    int64_t nLastLogTime = GetTime();
+    while (true) {
+        boost::this_thread::interruption_point();
+
+        const CBlockIndex* pindexNext = NULL;
+        bool fRewind = false;
+        {
+            LOCK(cs_main);
+            if (pindexBest == NULL)
+                pindexBest = chainActive.Genesis();
+            if (pindexBest == NULL) {
+                // Nothing to index yet
+            } else if (!chainActive.Contains(pindexBest)) {
+                fRewind = true;
+            } else {
+                pindexNext = chainActive.Next(pindexBest);
+                if (pindexNext == NULL) {
+                    // Caught up: no block can be connected while we hold
+                    // cs_main, so ConnectBlock takes over from the next one.
+                    if (!Enable()) {
+                        error("%s: %s: failed to enable the index", __func__, name);
+                        return;
+                    }
+                    pblocktree->EraseIndexBuilderBest(name);
+                    LogPrintf("%s: %s is built up to height %d and enabled\n", __func__, name, pindexBest->nHeight);
+                    return;
+                }
+            }
+        }
+
+        if (pindexBest == NULL) {
+            MilliSleep(1000);
+            continue;
+        }
+        if (fRewind ? !Rewind(pindexBest) : !Connect(pindexNext)) {
+            LogPrintf("%s: %s: stopped building the index, -reindex to build it\n", __func__, name);
+            return;
+        }
+
+        if (GetTime() - nLastLogTime >= 60) {
+            LogPrintf("%s: %s is built up to height %d\n", __func__, name, pindexBest->nHeight);
+            nLastLogTime = GetTime();
+        }
+    }
+}
+
+/** Builds the transaction index (-txindex) */
+class CTxIndexBuilder : public CIndexBuilder
+{
+protected:
+    bool WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+    {
+        CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+        std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+        vPos.reserve(block.vtx.size());
+        for (const CTransaction& tx : block.vtx) {
+            vPos.push_back(std::make_pair(tx.GetHash(), pos));
+            pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+        }
+        if (!pblocktree->WriteTxIndex(vPos))
+            return error("%s: failed to write transaction index", __func__);
+        return true;
+    }
+
+    bool EraseBlock(const CBlock& block, const CBlockIndex* pindex)
+    {
+        // As in DisconnectBlock, the entries are left to be overwritten if
+        // the transactions are mined again.
+        return true;
+    }
+
+    bool Enable()
+    {
+        AssertLockHeld(cs_main);
+        if (!pblocktree->WriteFlag("txindex", true))
+            return false;
+        fTxIndex = true;
+        return true;
+    }
+
+public:
+    CTxIndexBuilder() : CIndexBuilder("txindex") {}
+};
+
+/** Builds the address, address unspent, spent and timestamp indexes (-insightexplorer) */
+class CInsightIndexBuilder : public CIndexBuilder
+{
+private:
+    bool ReadUndo(CBlockUndo& blockundo, const CBlock& block, const CBlockIndex* pindex)
+    {
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (pos.IsNull() || !UndoReadFromDisk(blockundo, pos, pindex->pprev->GetBlockHash()))
+            return error("%s: failed to read undo data of block %s", __func__, pindex->GetBlockHash().ToString());
+        if (blockundo.vtxundo.size() + 1 != block.vtx.size())
+            return error("%s: block and undo data inconsistent", __func__);
+        return true;
+    }
+
+protected:
+    // The entries are those ConnectBlock and DisconnectBlock write, with the
+    // spent outputs taken from the undo data instead of the coins view.
+    bool WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+    {
+        CBlockUndo blockundo;
+        if (!ReadUndo(blockundo, block, pindex))
+            return false;
+
+        std::vector<CAddressIndexDbEntry> addressIndex;
+        std::vector<CAddressUnspentDbEntry> addressUnspentIndex;
+        std::vector<CSpentIndexDbEntry> spentIndex;
+        for (unsigned int i = 0; i < block.vtx.size(); i++) {
+            const CTransaction& tx = block.vtx[i];
+            const uint256 hash = tx.GetHash();
+
+            if (i > 0) {
+                const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+                if (txundo.vprevout.size() != tx.vin.size())
+                    return error("%s: transaction and undo data inconsistent", __func__);
+                for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                    const CTxIn& input = tx.vin[j];
+                    const CTxOut& prevout = txundo.vprevout[j].txout;
+                    CScript::ScriptType scriptType = prevout.scriptPubKey.GetType();
+                    const uint160 addrHash = prevout.scriptPubKey.AddressHash();
+                    if (scriptType != CScript::UNKNOWN) {
+                        addressIndex.push_back(std::make_pair(
+                            CAddressIndexKey(scriptType, addrHash, pindex->nHeight, i, hash, j, true),
+                            prevout.nValue * -1));
+                        addressUnspentIndex.push_back(std::make_pair(
+                            CAddressUnspentKey(scriptType, addrHash, input.prevout.hash, input.prevout.n),
+                            CAddressUnspentValue()));
+                    }
+                    spentIndex.push_back(std::make_pair(
+                        CSpentIndexKey(input.prevout.hash, input.prevout.n),
+                        CSpentIndexValue(hash, j, pindex->nHeight, prevout.nValue, scriptType, addrHash)));
+                }
+            }
+
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                const CTxOut& out = tx.vout[k];
+                CScript::ScriptType scriptType = out.scriptPubKey.GetType();
+                if (scriptType != CScript::UNKNOWN) {
+                    const uint160 addrHash = out.scriptPubKey.AddressHash();
+                    addressIndex.push_back(std::make_pair(
+                        CAddressIndexKey(scriptType, addrHash, pindex->nHeight, i, hash, k, false),
+                        out.nValue));
+                    addressUnspentIndex.push_back(std::make_pair(
+                        CAddressUnspentKey(scriptType, addrHash, hash, k),
+                        CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
+                }
+            }
+        }
+
+        if (!pblocktree->WriteAddressIndex(addressIndex))
+            return error("%s: failed to write address index", __func__);
+        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex))
+            return error("%s: failed to write address unspent index", __func__);
+        if (!pblocktree->UpdateSpentIndex(spentIndex))
+            return error("%s: failed to write spent index", __func__);
+
+        unsigned int logicalTS = pindex->nTime;
+        unsigned int prevLogicalTS = 0;
+        if (pindex->pprev)
+            pblocktree->ReadTimestampBlockIndex(pindex->pprev->GetBlockHash(), prevLogicalTS);
+        if (logicalTS <= prevLogicalTS)
+            logicalTS = prevLogicalTS + 1;
+        if (!pblocktree->WriteTimestampIndex(CTimestampIndexKey(logicalTS, pindex->GetBlockHash())))
+            return error("%s: failed to write timestamp index", __func__);
+        if (!pblocktree->WriteTimestampBlockIndex(CTimestampBlockIndexKey(pindex->GetBlockHash()), CTimestampBlockIndexValue(logicalTS)))
+            return error("%s: failed to write blockhash index", __func__);
+        return true;
+    }
+
+    bool EraseBlock(const CBlock& block, const CBlockIndex* pindex)
+    {
+        CBlockUndo blockundo;
+        if (!ReadUndo(blockundo, block, pindex))
+            return false;
+
+        std::vector<CAddressIndexDbEntry> addressIndex;
+        std::vector<CAddressUnspentDbEntry> addressUnspentIndex;
+        std::vector<CSpentIndexDbEntry> spentIndex;
+        for (int i = block.vtx.size() - 1; i >= 0; i--) {
+            const CTransaction& tx = block.vtx[i];
+            const uint256 hash = tx.GetHash();
+
+            for (unsigned int k = tx.vout.size(); k-- > 0;) {
+                const CTxOut& out = tx.vout[k];
+                CScript::ScriptType scriptType = out.scriptPubKey.GetType();
+                if (scriptType != CScript::UNKNOWN) {
+                    const uint160 addrHash = out.scriptPubKey.AddressHash();
+                    addressIndex.push_back(std::make_pair(
+                        CAddressIndexKey(scriptType, addrHash, pindex->nHeight, i, hash, k, false),
+                        out.nValue));
+                    addressUnspentIndex.push_back(std::make_pair(
+                        CAddressUnspentKey(scriptType, addrHash, hash, k),
+                        CAddressUnspentValue()));
+                }
+            }
+
+            if (i > 0) {
+                const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+                if (txundo.vprevout.size() != tx.vin.size())
+                    return error("%s: transaction and undo data inconsistent", __func__);
+                for (unsigned int j = tx.vin.size(); j-- > 0;) {
+                    const CTxIn& input = tx.vin[j];
+                    const CTxInUndo& undo = txundo.vprevout[j];
+                    const CTxOut& prevout = undo.txout;
+                    CScript::ScriptType scriptType = prevout.scriptPubKey.GetType();
+                    if (scriptType != CScript::UNKNOWN) {
+                        const uint160 addrHash = prevout.scriptPubKey.AddressHash();
+                        addressIndex.push_back(std::make_pair(
+                            CAddressIndexKey(scriptType, addrHash, pindex->nHeight, i, hash, j, true),
+                            prevout.nValue * -1));
+                        addressUnspentIndex.push_back(std::make_pair(
+                            CAddressUnspentKey(scriptType, addrHash, input.prevout.hash, input.prevout.n),
+                            CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight)));
+                    }
+                    spentIndex.push_back(std::make_pair(
+                        CSpentIndexKey(input.prevout.hash, input.prevout.n),
+                        CSpentIndexValue()));
+                }
+            }
+        }
+
+        if (!pblocktree->EraseAddressIndex(addressIndex))
+            return error("%s: failed to delete address index", __func__);
+        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex))
+            return error("%s: failed to write address unspent index", __func__);
+        if (!pblocktree->UpdateSpentIndex(spentIndex))
+            return error("%s: failed to write spent index", __func__);
+        return true;
+    }
+
+    bool Enable()
+    {
+        AssertLockHeld(cs_main);
+        if (!pblocktree->WriteFlag("insightexplorer", true) ||
+            !pblocktree->WriteFlag("addressbalanceindex", true) ||
+            !pblocktree->WriteFlag("insightindexdbs", true))
+            return false;
+        fAddressIndex = true;
+        fSpentIndex = true;
+        fTimestampIndex = true;
+
+        // Index the transactions that entered the mempool while the indexes
+        // were being built, as AcceptToMemoryPool does from now on.
+        LOCK(mempool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+        CCoinsViewCache view(&viewMemPool);
+        for (const CTxMemPoolEntry& entry : mempool.mapTx) {
+            mempool.addAddressIndex(entry, view);
+            mempool.addSpentIndex(entry, view);
+        }
+        return true;
+    }
+
+public:
+    CInsightIndexBuilder() : CIndexBuilder("insightexplorer") {}
+};
+
+static std::vector<std::unique_ptr<CIndexBuilder>> vIndexBuilders;
+
+void StartIndexBuilders(boost::thread_group& threadGroup, bool fBuildTxIndex, bool fBuildInsightExplorer)
+{
+    if (fBuildTxIndex)
+        vIndexBuilders.emplace_back(new CTxIndexBuilder());
+    if (fBuildInsightExplorer)
+        vIndexBuilders.emplace_back(new CInsightIndexBuilder());
+
+    for (const std::unique_ptr<CIndexBuilder>& builder : vIndexBuilders) {
+        boost::function<void()> buildLoop = boost::bind(&CIndexBuilder::ThreadBuild, builder.get());
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()>>, builder->GetName().c_str(), buildLoop));
+    }
+}
@@ -0,0 +1,61 @@
+// Copyright (c) 2019 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef BITCOIN_INDEXBUILDER_H
+#define BITCOIN_INDEXBUILDER_H
+
+#include <string>
+
+#include <boost/thread.hpp>
+
+class CBlock;
+class CBlockIndex;
+
+/**
+ * Builds an index that was enabled on a node whose chain was synced without
+ * it, in a background thread from the block and undo files, instead of
+ * requiring -reindex.
+ *
+ * The builder records the last block it has indexed, so it resumes where it
+ * left off after a restart, and rewinds blocks that a reorg took off the
+ * active chain. Once it has caught up with the tip it enables the index while
+ * holding cs_main, so that ConnectBlock and DisconnectBlock maintain it from
+ * the next block on, and exits. Until then the index reads as disabled.
+ */
+class CIndexBuilder
+{
+private:
+    const std::string name;
+    //! The last block indexed, which need not be on the active chain
+    const CBlockIndex* pindexBest;
+
+    bool Rewind(const CBlockIndex* pindex);
+    bool Connect(const CBlockIndex* pindex);
+
+protected:
+    //! Add the index entries of a block on top of pindexBest
+    virtual bool WriteBlock(const CBlock& block, const CBlockIndex* pindex) = 0;
+    //! Remove the index entries of pindexBest
+    virtual bool EraseBlock(const CBlock& block, const CBlockIndex* pindex) = 0;
+    //! Start maintaining the index in ConnectBlock; called with cs_main held
+    virtual bool Enable() = 0;
+
+public:
+    explicit CIndexBuilder(const std::string& nameIn);
+    virtual ~CIndexBuilder() {}
+
+    const std::string& GetName() const { return name; }
+
+    //! Index blocks until caught up with the tip, then enable the index
+    void ThreadBuild();
+};
+
+/**
+ * Start building the transaction index and/or the insight explorer indexes
+ * in the background. The corresponding index flags stay unset until the
+ * builder catches up with the tip.
+ */
+void StartIndexBuilders(boost::thread_group& threadGroup, bool fBuildTxIndex, bool fBuildInsightExplorer);
+
+#endif // BITCOIN_INDEXBUILDER_H
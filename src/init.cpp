@@ -11,12 +11,14 @@
 #include "crypto/common.h"
 #include "addrman.h"
 #include "amount.h"
+#include "asyncrpcqueue.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
 #include "consensus/upgrades.h"
 #include "consensus/validation.h"
 #include "httpserver.h"
 #include "httprpc.h"
+#include "indexbuilder.h"
 #include "key.h"
 #ifdef ENABLE_MINING
 #include "key_io.h"
@@ -136,6 +138,8 @@ CClientUIInterface uiInterface; // Declared but not defined in ui_interface.h
 //
 
 std::atomic<bool> fRequestShutdown(false);
+//! Set once the mempool was loaded from disk, so that it is not overwritten before then
+static std::atomic<bool> fDumpMempoolLater(false);
 
 void StartShutdown()
 {
@@ -209,6 +213,8 @@ void Shutdown()
     StopNode();
     StopTorControl();
     UnregisterNodeSignals(GetNodeSignals());
+    if (fDumpMempoolLater)
+        DumpMempool();
 
     if (fFeeEstimatesInitialized)
     {
@@ -353,9 +359,11 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt("-maxorphantxsize=<n>", strprintf(_("Keep at most <n> megabytes of unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE));
     strUsage += HelpMessageOpt("-mempooltxinputlimit=<n>", _("[DEPRECATED FROM OVERWINTER] Set the maximum number of transparent inputs in a transaction that the mempool will accept (default: 0 = no limit applied)"));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
+    strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), "asofed.pid"));
 #endif
@@ -366,7 +374,7 @@ std::string HelpMessage(HelpMessageMode mode)
 #if !defined(WIN32)
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
-    strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call; enabling it on an existing node builds it in the background (default: %u)"), 0));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
     strUsage += HelpMessageOpt("-addnode=<ip>", _("Add a node to connect to and attempt to keep the connection open"));
@@ -405,6 +413,7 @@ std::string HelpMessage(HelpMessageMode mode)
 
 #ifdef ENABLE_WALLET
     strUsage += HelpMessageGroup(_("Wallet options:"));
+    strUsage += HelpMessageOpt("-convertwallet", _("Convert the wallet to the format given by -walletformat, keeping the original as wallet.{timestamp}.bak") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-disablewallet", _("Do not load the wallet and disable wallet RPC calls"));
     strUsage += HelpMessageOpt("-keypool=<n>", strprintf(_("Set key pool size to <n> (default: %u)"), 100));
     strUsage += HelpMessageOpt("-migration", _("Enable the Sprout to Sapling migration"));
@@ -418,12 +427,14 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-salvagewallet", _("Attempt to recover private keys from a corrupt wallet.dat") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-sendfreetransactions", strprintf(_("Send transactions as zero-fee transactions if possible (default: %u)"), 0));
     strUsage += HelpMessageOpt("-spendzeroconfchange", strprintf(_("Spend unconfirmed change when sending transactions (default: %u)"), 1));
+    strUsage += HelpMessageOpt("-witnesscache", strprintf(_("Cache witnesses for the notes in the wallet as blocks are connected; if disabled, only note positions are kept and witnesses are built from the blocks on disk when spending (default: %u)"), DEFAULT_CACHE_NOTE_WITNESSES));
     strUsage += HelpMessageOpt("-txconfirmtarget=<n>", strprintf(_("If paytxfee is not set, include enough fee so transactions begin confirmation on average within n blocks (default: %u)"), DEFAULT_TX_CONFIRM_TARGET));
     strUsage += HelpMessageOpt("-txexpirydelta", strprintf(_("Set the number of blocks after which a transaction that has not been mined will become invalid (min: %u, default: %u (pre-Blossom) or %u (post-Blossom))"), TX_EXPIRING_SOON_THRESHOLD + 1, DEFAULT_PRE_BLOSSOM_TX_EXPIRY_DELTA, DEFAULT_POST_BLOSSOM_TX_EXPIRY_DELTA));
     strUsage += HelpMessageOpt("-maxtxfee=<amt>", strprintf(_("Maximum total fees (in %s) to use in a single wallet transaction; setting this too low may abort large transactions (default: %s)"),
         CURRENCY_UNIT, FormatMoney(maxTxFee)));
     strUsage += HelpMessageOpt("-upgradewallet", _("Upgrade wallet to latest format") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-wallet=<file>", _("Specify wallet file (within data directory)") + " " + strprintf(_("(default: %s)"), "wallet.dat"));
+    strUsage += HelpMessageOpt("-walletformat=<format>", _("Storage format of new wallets: bdb (Berkeley DB) or log (append-only record log)") + " " + strprintf(_("(default: %s)"), "bdb"));
     strUsage += HelpMessageOpt("-walletbroadcast", _("Make the wallet broadcast transactions") + " " + strprintf(_("(default: %u)"), true));
     strUsage += HelpMessageOpt("-walletnotify=<cmd>", _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)"));
     strUsage += HelpMessageOpt("-zapwallettxes=<mode>", _("Delete all wallet transactions and only recover those parts of the blockchain through -rescan on startup") +
@@ -528,8 +539,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-rpcservertimeout=<n>", strprintf("Timeout during HTTP requests (default: %d)", DEFAULT_HTTP_SERVER_TIMEOUT));
     }
 
-    // Disabled until we can lock notes and also tune performance of the prover which by default uses multiple threads
-    //strUsage += HelpMessageOpt("-rpcasyncthreads=<n>", strprintf(_("Set the number of threads to service Async RPC calls (default: %d)"), 1));
+    strUsage += HelpMessageOpt("-rpcasyncthreads=<n>", strprintf(_("Set the number of threads to service Async RPC calls such as z_sendmany; with more than one, low priority operations (z_mergetoaddress, z_shieldcoinbase) leave a thread free for the others (default: %d)"), DEFAULT_RPC_ASYNC_THREADS));
 
     if (mode == HMM_BITCOIND) {
         strUsage += HelpMessageGroup(_("Metrics Options (only if -daemon and -printtoconsole are not set):"));
@@ -662,6 +672,17 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         LogPrintf("Stopping after block import\n");
         StartShutdown();
     }
+
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        LoadMempool();
+        fDumpMempoolLater = !fRequestShutdown;
+    }
+}
+
+static void PeriodicDumpMempool()
+{
+    if (fDumpMempoolLater)
+        DumpMempool();
 }
 
 void ThreadNotifyRecentlyAdded()
@@ -737,18 +758,27 @@ static void ZC_LoadParams(
     LogPrintf("Loading Sapling (Sprout Groth16) parameters from %s\n", sprout_groth16.string().c_str());
     gettimeofday(&tv_start, 0);
 
+    const std::string sapling_spend_hash = "8270785a1a0d0bc77196f000ee6d221c9c9894f55307bd9357c3f0105d31ca63991ab91324160d8f53e2bbd3c2633a6eb8bdf5205d822e7f3f73edac51b2b70c";
+    const std::string sapling_output_hash = "657e3d38dbb5cb5e7dd2970e8b03d69b4787dd907285b5a7f0790dcc8072f60bf593b32cc2d1c030e00ff5ae64bf84c5c3beb84ddc841d48264b4a171744d028";
+    const std::string sprout_groth16_hash = "e9b238411bd6c0ec4791e9d04245ec350c9c5744f5610dfcce4365d5ca49dfefd5054e371842b3f88fa1b9d7e8e075249b3ebabd167fa8b0f3161292d36c180a";
+
     librustzcash_init_zksnark_params(
         reinterpret_cast<const codeunit*>(sapling_spend_str.c_str()),
         sapling_spend_str.length(),
-        "8270785a1a0d0bc77196f000ee6d221c9c9894f55307bd9357c3f0105d31ca63991ab91324160d8f53e2bbd3c2633a6eb8bdf5205d822e7f3f73edac51b2b70c",
+        sapling_spend_hash.c_str(),
         reinterpret_cast<const codeunit*>(sapling_output_str.c_str()),
         sapling_output_str.length(),
-        "657e3d38dbb5cb5e7dd2970e8b03d69b4787dd907285b5a7f0790dcc8072f60bf593b32cc2d1c030e00ff5ae64bf84c5c3beb84ddc841d48264b4a171744d028",
+        sapling_output_hash.c_str(),
         reinterpret_cast<const codeunit*>(sprout_groth16_str.c_str()),
         sprout_groth16_str.length(),
-        "e9b238411bd6c0ec4791e9d04245ec350c9c5744f5610dfcce4365d5ca49dfefd5054e371842b3f88fa1b9d7e8e075249b3ebabd167fa8b0f3161292d36c180a"
+        sprout_groth16_hash.c_str()
     );
 
+    // The parameter files were checked against these hashes, so they
+    // identify what proofs are verified with from now on
+    std::string params_hashes = sapling_spend_hash + sapling_output_hash + sprout_groth16_hash;
+    hashProofParams = Hash(params_hashes.begin(), params_hashes.end());
+
     gettimeofday(&tv_end, 0);
     elapsed = float(tv_end.tv_sec-tv_start.tv_sec) + (tv_end.tv_usec-tv_start.tv_usec)/float(1000000);
     LogPrintf("Loaded Sapling parameters in %fs seconds.\n", elapsed);
@@ -933,6 +963,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         if (GetBoolArg("-txindex", false))
             return InitError(_("Prune mode is incompatible with -txindex."));
 #ifdef ENABLE_WALLET
+        // Without the cache, spends witness notes from the blocks on disk
+        if (!GetBoolArg("-witnesscache", DEFAULT_CACHE_NOTE_WITNESSES))
+            return InitError(_("Prune mode is incompatible with -witnesscache=0."));
         if (!GetBoolArg("-disablewallet", false)) {
             if (SoftSetBoolArg("-disablewallet", true))
                 LogPrintf("%s : parameter interaction: -prune -> setting -disablewallet=1\n", __func__);
@@ -1084,6 +1117,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
     bSpendZeroConfChange = GetBoolArg("-spendzeroconfchange", true);
     fSendFreeTransactions = GetBoolArg("-sendfreetransactions", false);
+    fCacheNoteWitnesses = GetBoolArg("-witnesscache", DEFAULT_CACHE_NOTE_WITNESSES);
 
     std::string strWalletFile = GetArg("-wallet", "wallet.dat");
     // Check Sapling migration address if set and is a valid Sapling address
@@ -1454,6 +1488,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     nTotalCache = std::max(nTotalCache, nMinDbCache << 20); // total cache cannot be less than nMinDbCache
     nTotalCache = std::min(nTotalCache, nMaxDbCache << 20); // total cache cannot be greated than nMaxDbcache
     int64_t nBlockTreeDBCache = nTotalCache / 8;
+    int64_t nInsightDBCache = 0;
     if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
 
@@ -1462,24 +1497,31 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         if (!GetBoolArg("-txindex", false)) {
             return InitError(_("-insightexplorer requires -txindex."));
         }
-        // increase cache if additional indices are needed
-        nBlockTreeDBCache = nTotalCache * 3 / 4;
+        // the additional indices have databases of their own, which share
+        // what the block index database doesn't use of the increased cache
+        nInsightDBCache = nTotalCache * 3 / 4 - nBlockTreeDBCache;
     }
-    nTotalCache -= nBlockTreeDBCache;
+    nTotalCache -= nBlockTreeDBCache + nInsightDBCache;
     int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheUsage = nTotalCache; // the rest goes to in-memory cache
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
+    if (nInsightDBCache > 0)
+        LogPrintf("* Using %.1fMiB for insight explorer index databases\n", nInsightDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set\n", nCoinCacheUsage * (1.0 / 1024 / 1024));
 
     bool clearWitnessCaches = false;
+    bool fBuildTxIndex = false;
+    bool fBuildInsightExplorer = false;
 
     bool fLoaded = false;
     while (!fLoaded) {
         bool fReset = fReindex;
         std::string strLoadError;
+        fBuildTxIndex = false;
+        fBuildInsightExplorer = false;
 
         uiInterface.InitMessage(_("Loading block index..."));
 
@@ -1492,7 +1534,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 delete pcoinscatcher;
                 delete pblocktree;
 
-                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
+                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex, nInsightDBCache);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
@@ -1520,16 +1562,26 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                     break;
                 }
 
-                // Check for changed -txindex state
+                // Check for changed -txindex state. A newly enabled index is
+                // built in the background (see indexbuilder.h).
                 if (fTxIndex != GetBoolArg("-txindex", false)) {
-                    strLoadError = _("You need to rebuild the database using -reindex to change -txindex");
-                    break;
+                    if (fTxIndex) {
+                        strLoadError = _("You need to rebuild the database using -reindex to disable -txindex");
+                        break;
+                    }
+                    fBuildTxIndex = true;
                 }
 
                 // Check for changed -insightexplorer state
                 if (fInsightExplorer != GetBoolArg("-insightexplorer", false)) {
-                    strLoadError = _("You need to rebuild the database using -reindex to change -insightexplorer");
-                    break;
+                    if (fInsightExplorer) {
+                        strLoadError = _("You need to rebuild the database using -reindex to disable -insightexplorer");
+                        break;
+                    }
+                    // The RPC methods are available, and report that the
+                    // indexes aren't, until they are built.
+                    fInsightExplorer = true;
+                    fBuildInsightExplorer = true;
                 }
 
                 // Check for changed -prune state.  What we are concerned about is a user who has pruned blocks
@@ -1704,6 +1756,14 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         RegisterValidationInterface(pwalletMain);
 
         CBlockIndex *pindexRescan = chainActive.Tip();
+        if (!fCacheNoteWitnesses) {
+            pwalletMain->TrimNoteWitnessCache();
+        } else if (pwalletMain->nWitnessCacheSize == 0 && pwalletMain->HasNoteWitnesses()) {
+            // The wallet was last used with -witnesscache=0, so it only has
+            // the positions of its notes; rebuild the cache from the chain.
+            LogPrintf("Rebuilding the witness cache of a wallet used with -witnesscache=0\n");
+            clearWitnessCaches = true;
+        }
         if (clearWitnessCaches || GetBoolArg("-rescan", false))
         {
             pwalletMain->ClearNoteWitnessCache();
@@ -1855,6 +1915,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("mapAddressBook.size() = %u\n",  pwalletMain ? pwalletMain->mapAddressBook.size() : 0);
 #endif
 
+    if (fBuildTxIndex || fBuildInsightExplorer)
+        StartIndexBuilders(threadGroup, fBuildTxIndex, fBuildInsightExplorer);
+
     // Start the thread that notifies listeners of transactions that have been
     // recently added to the mempool.
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "txnotify", &ThreadNotifyRecentlyAdded));
@@ -1869,6 +1932,13 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                                          boost::ref(cs_main), boost::cref(pindexBestHeader));
     scheduler.scheduleEvery(f, 60);
 
+    // Copy the mempool changes that readers of a large pool left for later (see CTxMemPool::GetSnapshot)
+    scheduler.scheduleEvery(boost::bind(&CTxMemPool::UpdateSnapshot, &mempool, true), MEMPOOL_SNAPSHOT_INTERVAL / 1000);
+
+    // Save the mempool regularly, so that little of it is lost if we don't shut down cleanly
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        scheduler.scheduleEvery(&PeriodicDumpMempool, MEMPOOL_DUMP_INTERVAL);
+
 #ifdef ENABLE_MINING
     // Generate coins in the background
     GenerateBitcoins(GetBoolArg("-gen", false), GetArg("-genproclimit", 1), chainparams);
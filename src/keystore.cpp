@@ -118,7 +118,7 @@ bool CBasicKeyStore::AddSproutSpendingKey(const libzcash::SproutSpendingKey &sk)
     LOCK(cs_SpendingKeyStore);
     auto address = sk.address();
     mapSproutSpendingKeys[address] = sk;
-    mapNoteDecryptors.insert(std::make_pair(address, ZCNoteDecryption(sk.receiving_key())));
+    AddNoteDecryptor(address, sk.receiving_key());
     return true;
 }
 
@@ -145,7 +145,43 @@ bool CBasicKeyStore::AddSproutViewingKey(const libzcash::SproutViewingKey &vk)
     LOCK(cs_SpendingKeyStore);
     auto address = vk.address();
     mapSproutViewingKeys[address] = vk;
-    mapNoteDecryptors.insert(std::make_pair(address, ZCNoteDecryption(vk.sk_enc)));
+    AddNoteDecryptor(address, vk.sk_enc);
+    return true;
+}
+
+void CBasicKeyStore::AddNoteDecryptor(
+    const libzcash::SproutPaymentAddress &address,
+    const libzcash::ReceivingKey &rk)
+{
+    AssertLockHeld(cs_SpendingKeyStore);
+    if (mapNoteDecryptors.count(address) == 0) {
+        mapPendingNoteDecryptors.insert(std::make_pair(address, rk));
+    }
+}
+
+const NoteDecryptorMap& CBasicKeyStore::GetNoteDecryptors() const
+{
+    AssertLockHeld(cs_SpendingKeyStore);
+    for (const auto& item : mapPendingNoteDecryptors) {
+        mapNoteDecryptors.insert(std::make_pair(item.first, ZCNoteDecryption(item.second)));
+    }
+    mapPendingNoteDecryptors.clear();
+    return mapNoteDecryptors;
+}
+
+bool CBasicKeyStore::GetNoteDecryptor(const libzcash::SproutPaymentAddress &address, ZCNoteDecryption &decOut) const
+{
+    LOCK(cs_SpendingKeyStore);
+    NoteDecryptorMap::const_iterator mi = mapNoteDecryptors.find(address);
+    if (mi == mapNoteDecryptors.end()) {
+        auto pending = mapPendingNoteDecryptors.find(address);
+        if (pending == mapPendingNoteDecryptors.end()) {
+            return false;
+        }
+        mi = mapNoteDecryptors.insert(std::make_pair(address, ZCNoteDecryption(pending->second))).first;
+        mapPendingNoteDecryptors.erase(pending);
+    }
+    decOut = mi->second;
     return true;
 }
 
@@ -175,6 +211,27 @@ bool CBasicKeyStore::AddSaplingIncomingViewingKey(
     return true;
 }
 
+bool CBasicKeyStore::RemoveSaplingSpendingKey(const libzcash::SaplingExtendedSpendingKey &sk)
+{
+    LOCK(cs_SpendingKeyStore);
+    mapSaplingSpendingKeys.erase(sk.expsk.full_viewing_key());
+    return true;
+}
+
+bool CBasicKeyStore::RemoveSaplingFullViewingKey(const libzcash::SaplingFullViewingKey &fvk)
+{
+    LOCK(cs_SpendingKeyStore);
+    mapSaplingFullViewingKeys.erase(fvk.in_viewing_key());
+    return true;
+}
+
+bool CBasicKeyStore::RemoveSaplingIncomingViewingKey(const libzcash::SaplingPaymentAddress &addr)
+{
+    LOCK(cs_SpendingKeyStore);
+    mapSaplingIncomingViewingKeys.erase(addr);
+    return true;
+}
+
 bool CBasicKeyStore::RemoveSproutViewingKey(const libzcash::SproutViewingKey &vk)
 {
     LOCK(cs_SpendingKeyStore);
@@ -91,6 +91,11 @@ public:
         libzcash::SaplingIncomingViewingKey& ivkOut) const =0;
     virtual void GetSaplingPaymentAddresses(std::set<libzcash::SaplingPaymentAddress> &setAddress) const =0;
 
+    //! Undo the Sapling additions above, for keys that weren't saved after all
+    virtual bool RemoveSaplingSpendingKey(const libzcash::SaplingExtendedSpendingKey &sk) =0;
+    virtual bool RemoveSaplingFullViewingKey(const libzcash::SaplingFullViewingKey &fvk) =0;
+    virtual bool RemoveSaplingIncomingViewingKey(const libzcash::SaplingPaymentAddress &addr) =0;
+
     //! Support for Sprout viewing keys
     virtual bool AddSproutViewingKey(const libzcash::SproutViewingKey &vk) =0;
     virtual bool RemoveSproutViewingKey(const libzcash::SproutViewingKey &vk) =0;
@@ -124,7 +129,16 @@ protected:
     WatchOnlySet setWatchOnly;
     SproutSpendingKeyMap mapSproutSpendingKeys;
     SproutViewingKeyMap mapSproutViewingKeys;
-    NoteDecryptorMap mapNoteDecryptors;
+    // Deriving a note decryptor takes a scalar multiplication, so decryptors
+    // are only created the first time they are needed (which is usually not
+    // while the wallet is loading).
+    mutable NoteDecryptorMap mapNoteDecryptors;
+    mutable std::map<libzcash::SproutPaymentAddress, libzcash::ReceivingKey> mapPendingNoteDecryptors;
+
+    /** Queue the decryptor for address, unless there already is one. Requires cs_SpendingKeyStore. */
+    void AddNoteDecryptor(const libzcash::SproutPaymentAddress &address, const libzcash::ReceivingKey &rk);
+    /** All note decryptors, creating any that are still pending. Requires cs_SpendingKeyStore. */
+    const NoteDecryptorMap& GetNoteDecryptors() const;
 
     SaplingSpendingKeyMap mapSaplingSpendingKeys;
     SaplingFullViewingKeyMap mapSaplingFullViewingKeys;
@@ -203,19 +217,7 @@ public:
         }
         return false;
     }
-    bool GetNoteDecryptor(const libzcash::SproutPaymentAddress &address, ZCNoteDecryption &decOut) const
-    {
-        {
-            LOCK(cs_SpendingKeyStore);
-            NoteDecryptorMap::const_iterator mi = mapNoteDecryptors.find(address);
-            if (mi != mapNoteDecryptors.end())
-            {
-                decOut = mi->second;
-                return true;
-            }
-        }
-        return false;
-    }
+    bool GetNoteDecryptor(const libzcash::SproutPaymentAddress &address, ZCNoteDecryption &decOut) const;
     void GetSproutPaymentAddresses(std::set<libzcash::SproutPaymentAddress> &setAddress) const
     {
         setAddress.clear();
@@ -298,6 +300,10 @@ public:
         }
     }
 
+    virtual bool RemoveSaplingSpendingKey(const libzcash::SaplingExtendedSpendingKey &sk);
+    virtual bool RemoveSaplingFullViewingKey(const libzcash::SaplingFullViewingKey &fvk);
+    virtual bool RemoveSaplingIncomingViewingKey(const libzcash::SaplingPaymentAddress &addr);
+
     virtual bool AddSproutViewingKey(const libzcash::SproutViewingKey &vk);
     virtual bool RemoveSproutViewingKey(const libzcash::SproutViewingKey &vk);
     virtual bool HaveSproutViewingKey(const libzcash::SproutPaymentAddress &address) const;
@@ -32,6 +32,7 @@
 
 #include <algorithm>
 #include <atomic>
+#include <functional>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -82,6 +83,7 @@ bool fAlerts = DEFAULT_ALERTS;
 /* If the tip is older than this (in seconds), the node is considered to be in initial block download.
  */
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
+uint256 hashProofParams;
 
 boost::optional<unsigned int> expiryDeltaArg = boost::none;
 
@@ -93,9 +95,14 @@ CTxMemPool mempool(::minRelayTxFee);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    size_t nUsage;
+    uint32_t nBranchId; //!< Branch ID its proofs and signatures were checked against when it arrived
 };
 map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);;
+//! The orphans spending each outpoint, so that accepting a parent finds exactly its children
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);;
+//! Memory usage of the transactions in mapOrphanTransactions
+size_t nOrphanTransactionsUsage GUARDED_BY(cs_main) = 0;
 void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
 /**
@@ -611,13 +618,17 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nUsage = sizeof(COrphanTx) + RecursiveDynamicUsage(tx);
+    orphan.nBranchId = CurrentEpochBranchId(chainActive.Height() + 1, Params().GetConsensus());
+    nOrphanTransactionsUsage += orphan.nUsage;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u usage %u)\n", hash.ToString(),
+             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanTransactionsUsage);
     return true;
 }
 
@@ -628,13 +639,14 @@ void static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
         return;
     BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
     {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
         itPrev->second.erase(hash);
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    nOrphanTransactionsUsage -= it->second.nUsage;
     mapOrphanTransactions.erase(it);
 }
 
@@ -655,10 +667,10 @@ void EraseOrphansFor(NodeId peer)
 }
 
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphansUsage) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsUsage > nMaxOrphansUsage)
     {
         // Evict a random orphan:
         uint256 randomhash = GetRandHash();
@@ -671,6 +683,100 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRE
     return nEvicted;
 }
 
+/**
+ * Retry the orphans spending outputs of txParent, which was just added to the
+ * mempool, and then those spending outputs of the orphans accepted in turn.
+ * Each round takes every orphan that the previous round may have made
+ * resolvable as one batch. Orphans passed their proof and shielded signature
+ * checks when they arrived; only those whose branch has changed since are
+ * checked again, in parallel, before the batch is added to the mempool.
+ */
+void static ProcessOrphansOf(const CTransaction& txParent) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    std::vector<CTransaction> vAccepted = {txParent};
+    set<NodeId> setMisbehaving;
+    while (!vAccepted.empty())
+    {
+        set<uint256> setCandidates;
+        BOOST_FOREACH(const CTransaction& tx, vAccepted) {
+            const uint256& hash = tx.GetHash();
+            for (uint32_t i = 0; i < tx.vout.size(); i++) {
+                map<COutPoint, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(COutPoint(hash, i));
+                if (itByPrev != mapOrphanTransactionsByPrev.end())
+                    setCandidates.insert(itByPrev->second.begin(), itByPrev->second.end());
+            }
+        }
+        vAccepted.clear();
+
+        int nHeight = chainActive.Height() + 1;
+        uint32_t nBranchId = CurrentEpochBranchId(nHeight, Params().GetConsensus());
+        // IsInitialBlockDownload() takes cs_main, which the workers below
+        // can't get while we hold it
+        InitialBlockDownloadCheck isInitBlockDownload = FixedInitialBlockDownload(IsInitialBlockDownload(Params()));
+        std::vector<COrphanTx> vBatch;
+        std::vector<char> vProofsChecked;
+        std::vector<size_t> vRecheck;
+        BOOST_FOREACH(const uint256& orphanHash, setCandidates) {
+            const COrphanTx& orphan = mapOrphanTransactions[orphanHash];
+            if (setMisbehaving.count(orphan.fromPeer))
+                continue;
+            bool fShielded = !orphan.tx.vJoinSplit.empty() || !orphan.tx.vShieldedSpend.empty() || !orphan.tx.vShieldedOutput.empty();
+            if (fShielded && orphan.nBranchId != nBranchId)
+                vRecheck.push_back(vBatch.size());
+            vProofsChecked.push_back(fShielded && orphan.nBranchId == nBranchId);
+            vBatch.push_back(orphan);
+        }
+
+        // A failed check is not final here: AcceptToMemoryPool checks those
+        // transactions again and reports the failure.
+        ForEachIndexInParallel(vRecheck.size(), [&](size_t i) {
+            CValidationState state;
+            vProofsChecked[vRecheck[i]] = CheckTransactionProofs(vBatch[vRecheck[i]].tx, state, Params(), nHeight, isInitBlockDownload);
+        });
+
+        for (size_t i = 0; i < vBatch.size(); i++)
+        {
+            const CTransaction& orphanTx = vBatch[i].tx;
+            const uint256& orphanHash = orphanTx.GetHash();
+            NodeId fromPeer = vBatch[i].fromPeer;
+            bool fMissingInputs = false;
+            // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+            // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+            // anyone relaying LegitTxX banned)
+            CValidationState stateDummy;
+
+            if (setMisbehaving.count(fromPeer))
+                continue;
+            if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs, false, vProofsChecked[i]))
+            {
+                LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                RelayTransaction(orphanTx);
+                vAccepted.push_back(orphanTx);
+                EraseOrphanTx(orphanHash);
+            }
+            else if (!fMissingInputs)
+            {
+                int nDos = 0;
+                if (stateDummy.IsInvalid(nDos) && nDos > 0)
+                {
+                    // Punish peer that gave us an invalid orphan tx
+                    Misbehaving(fromPeer, nDos);
+                    setMisbehaving.insert(fromPeer);
+                    LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                }
+                // Has inputs but not accepted to mempool
+                // Probably non-standard or insufficient fee/priority
+                LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                EraseOrphanTx(orphanHash);
+                assert(recentRejects);
+                recentRejects->insert(orphanHash);
+            }
+            // Orphans still missing inputs stay, and are retried when another parent is accepted
+            mempool.check(pcoinsTip);
+        }
+    }
+}
+
 
 bool IsStandardTx(const CTransaction& tx, string& reason, const CChainParams& chainparams, const int nHeight)
 {
@@ -908,7 +1014,8 @@ bool ContextualCheckTransaction(
         const CChainParams& chainparams,
         const int nHeight,
         const int dosLevel,
-        bool (*isInitBlockDownload)(const CChainParams&))
+        bool (*isInitBlockDownload)(const CChainParams&),
+        bool fShieldedChecks)
 {
     bool overwinterActive = chainparams.GetConsensus().NetworkUpgradeActive(nHeight, Consensus::UPGRADE_OVERWINTER);
     bool overwinterCurrentHeight = nHeight >= chainparams.GetConsensus().vUpgrades[Consensus::UPGRADE_OVERWINTER].nActivationHeight;
@@ -994,6 +1101,11 @@ bool ContextualCheckTransaction(
                             REJECT_INVALID, "bad-txns-oversize");
     }
 
+    // The remaining checks are the expensive ones
+    if (!fShieldedChecks) {
+        return true;
+    }
+
     uint256 dataToBeSigned;
 
     if (!tx.vJoinSplit.empty() ||
@@ -1104,6 +1216,15 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state,
     }
 }
 
+bool CheckTransactionProofs(const CTransaction& tx, CValidationState& state,
+                            const CChainParams& chainparams, int nHeight,
+                            bool (*isInitBlockDownload)(const CChainParams&))
+{
+    auto verifier = libzcash::ProofVerifier::Strict();
+    return CheckTransaction(tx, state, verifier) &&
+           ContextualCheckTransaction(tx, state, chainparams, nHeight, 10, isInitBlockDownload);
+}
+
 bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state)
 {
     // Basic checks that don't depend on any context
@@ -1369,7 +1490,8 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 
 
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+                        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fProofsChecked,
+                        int64_t nAcceptTime)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1398,13 +1520,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         return false;
     }
 
-    auto verifier = libzcash::ProofVerifier::Strict();
+    auto verifier = fProofsChecked ? libzcash::ProofVerifier::Disabled() : libzcash::ProofVerifier::Strict();
     if (!CheckTransaction(tx, state, verifier))
         return error("AcceptToMemoryPool: CheckTransaction failed");
 
     // DoS level set to 10 to be more forgiving.
     // Check transaction contextually against the set of consensus rules which apply in the next block to be mined.
-    if (!ContextualCheckTransaction(tx, state, Params(), nextBlockHeight, 10)) {
+    if (!ContextualCheckTransaction(tx, state, Params(), nextBlockHeight, 10, IsInitialBlockDownload, !fProofsChecked)) {
         return error("AcceptToMemoryPool: ContextualCheckTransaction failed");
     }
 
@@ -1439,29 +1561,9 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         return false;
 
     // Check for conflicts with in-memory transactions
-    {
-    LOCK(pool.cs); // protect pool.mapNextTx
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
-    {
-        COutPoint outpoint = tx.vin[i].prevout;
-        if (pool.mapNextTx.count(outpoint))
-        {
-            // Disable replacement feature for now
-            return false;
-        }
-    }
-    BOOST_FOREACH(const JSDescription &joinsplit, tx.vJoinSplit) {
-        BOOST_FOREACH(const uint256 &nf, joinsplit.nullifiers) {
-            if (pool.nullifierExists(nf, SPROUT)) {
-                return false;
-            }
-        }
-    }
-    for (const SpendDescription &spendDescription : tx.vShieldedSpend) {
-        if (pool.nullifierExists(spendDescription.nullifier, SAPLING)) {
-            return false;
-        }
-    }
+    if (pool.HasConflicts(tx)) {
+        // Disable replacement feature for now
+        return false;
     }
 
     {
@@ -1545,7 +1647,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         // it has passed ContextualCheckInputs and therefore this is correct.
         auto consensusBranchId = CurrentEpochBranchId(chainActive.Height() + 1, Params().GetConsensus());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), fSpendsCoinbase, consensusBranchId);
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime ? nAcceptTime : GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), fSpendsCoinbase, consensusBranchId);
         unsigned int nSize = entry.GetTxSize();
 
         // Accept a tx if it contains joinsplits and has at least the default fee specified by z_sendmany.
@@ -1683,6 +1785,17 @@ bool GetAddressIndex(const uint160& addressHash, int type,
     return true;
 }
 
+bool GetAddressBalance(const uint160& addressHash, int type, CAddressBalanceValue& balance)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!pblocktree->ReadAddressBalance(addressHash, type, balance))
+        return error("unable to get balance for address");
+
+    return true;
+}
+
 bool GetAddressUnspent(const uint160& addressHash, int type,
                        std::vector<CAddressUnspentDbEntry>& unspentOutputs)
 {
@@ -1695,6 +1808,32 @@ bool GetAddressUnspent(const uint160& addressHash, int type,
     return true;
 }
 
+bool ForEachAddressIndex(const std::vector<std::pair<uint160, int> >& addresses, int start, int end,
+                         const CAddressIndexKey* pAfter,
+                         boost::function<bool(const CAddressIndexKey&, CAmount)> visit)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!pblocktree->ForEachAddressIndex(addresses, start, end, pAfter, visit))
+        return error("unable to get txids for address");
+
+    return true;
+}
+
+bool ForEachAddressUnspent(const std::vector<std::pair<uint160, int> >& addresses,
+                           const CAddressUnspentKey* pAfter,
+                           boost::function<bool(const CAddressUnspentKey&, const CAddressUnspentValue&)> visit)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!pblocktree->ForEachAddressUnspent(addresses, pAfter, visit))
+        return error("unable to get txids for address");
+
+    return true;
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1822,6 +1961,150 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
+/**
+ * Witness note commitments at the end of pindexAnchor by replaying the note
+ * commitments of the active chain, starting from the tree state before the
+ * block of the earliest note. The coins database keeps the tree state for
+ * every anchor, so only the blocks from that one up to pindexAnchor are read,
+ * and blocks that added no commitments to the tree are skipped.
+ *
+ * cs_main is only held to take that tree state and the positions of the
+ * blocks to read; the blocks are read and replayed without it.
+ */
+template<typename Tree, typename Witness>
+static bool BuildNoteWitnesses(
+    const std::vector<std::pair<uint256, uint256>>& vNotes,
+    const CBlockIndex* pindexAnchor,
+    std::vector<boost::optional<Witness>>& witnesses,
+    std::function<bool(const CBlockIndex*, Tree&)> getTreeBefore,
+    std::function<bool(const CBlockIndex*)> hasCommitments,
+    std::function<void(const CTransaction&, std::vector<uint256>&)> getCommitments)
+{
+    witnesses.assign(vNotes.size(), boost::none);
+
+    struct BlockToReplay {
+        uint256 hash;
+        CDiskBlockPos pos;
+        // Commitments of the notes in the block, and the notes they witness
+        std::map<uint256, std::vector<size_t>> mapNotes;
+    };
+    std::vector<BlockToReplay> vBlocks;
+    Tree tree;
+    {
+        LOCK(cs_main);
+        if (!pindexAnchor || !chainActive.Contains(pindexAnchor))
+            return false;
+
+        // Notes to witness, by the height of their block and their commitment
+        std::map<int, std::map<uint256, std::vector<size_t>>> mapNotesByHeight;
+        for (size_t i = 0; i < vNotes.size(); i++) {
+            BlockMap::const_iterator mi = mapBlockIndex.find(vNotes[i].first);
+            if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second) ||
+                    mi->second->nHeight > pindexAnchor->nHeight)
+                continue;
+            mapNotesByHeight[mi->second->nHeight][vNotes[i].second].push_back(i);
+        }
+        if (mapNotesByHeight.empty())
+            return true;
+
+        const CBlockIndex* pindexStart = chainActive[mapNotesByHeight.begin()->first];
+        if (!getTreeBefore(pindexStart, tree))
+            return error("%s: No tree state before block %s", __func__, pindexStart->GetBlockHash().ToString());
+
+        for (int nHeight = pindexStart->nHeight; nHeight <= pindexAnchor->nHeight; nHeight++) {
+            const CBlockIndex* pindex = chainActive[nHeight];
+            auto itNotes = mapNotesByHeight.find(nHeight);
+            if (itNotes == mapNotesByHeight.end() && !hasCommitments(pindex))
+                continue;
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+                return error("%s: Block %s was pruned", __func__, pindex->GetBlockHash().ToString());
+
+            BlockToReplay block {pindex->GetBlockHash(), pindex->GetBlockPos()};
+            if (itNotes != mapNotesByHeight.end())
+                block.mapNotes.swap(itNotes->second);
+            vBlocks.push_back(block);
+        }
+    }
+
+    std::vector<size_t> vWitnessed;
+    std::vector<uint256> vCommitments;
+    for (const BlockToReplay& blockToReplay : vBlocks) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, blockToReplay.pos, Params().GetConsensus()) ||
+                block.GetHash() != blockToReplay.hash)
+            return error("%s: Can't read block %s", __func__, blockToReplay.hash.ToString());
+        for (const CTransaction& tx : block.vtx) {
+            vCommitments.clear();
+            getCommitments(tx, vCommitments);
+            for (const uint256& cm : vCommitments) {
+                tree.append(cm);
+                for (size_t i : vWitnessed) {
+                    witnesses[i]->append(cm);
+                }
+                auto itNote = blockToReplay.mapNotes.find(cm);
+                if (itNote != blockToReplay.mapNotes.end()) {
+                    for (size_t i : itNote->second) {
+                        witnesses[i] = tree.witness();
+                        vWitnessed.push_back(i);
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool BuildSproutWitnesses(const std::vector<std::pair<uint256, uint256>>& vNotes,
+                          const CBlockIndex* pindexAnchor,
+                          std::vector<boost::optional<SproutWitness>>& witnesses)
+{
+    bool fOk = BuildNoteWitnesses<SproutMerkleTree, SproutWitness>(vNotes, pindexAnchor, witnesses,
+        [](const CBlockIndex* pindex, SproutMerkleTree& tree) {
+            return pcoinsTip->GetSproutAnchorAt(pindex->hashSproutAnchor, tree);
+        },
+        [](const CBlockIndex* pindex) {
+            return pindex->hashFinalSproutRoot != pindex->hashSproutAnchor;
+        },
+        [](const CTransaction& tx, std::vector<uint256>& vCommitments) {
+            for (const JSDescription& jsdesc : tx.vJoinSplit) {
+                vCommitments.insert(vCommitments.end(), jsdesc.commitments.begin(), jsdesc.commitments.end());
+            }
+        });
+    for (const auto& witness : witnesses) {
+        if (witness && !pindexAnchor->hashFinalSproutRoot.IsNull() && witness->root() != pindexAnchor->hashFinalSproutRoot)
+            return error("%s: Witness root doesn't match block %s", __func__, pindexAnchor->GetBlockHash().ToString());
+    }
+    return fOk;
+}
+
+bool BuildSaplingWitnesses(const std::vector<std::pair<uint256, uint256>>& vNotes,
+                           const CBlockIndex* pindexAnchor,
+                           std::vector<boost::optional<SaplingWitness>>& witnesses)
+{
+    bool fOk = BuildNoteWitnesses<SaplingMerkleTree, SaplingWitness>(vNotes, pindexAnchor, witnesses,
+        [](const CBlockIndex* pindex, SaplingMerkleTree& tree) {
+            // Blocks before Sapling activation have a null root
+            if (!pindex->pprev || pindex->pprev->hashFinalSaplingRoot.IsNull()) {
+                tree = SaplingMerkleTree();
+                return true;
+            }
+            return pcoinsTip->GetSaplingAnchorAt(pindex->pprev->hashFinalSaplingRoot, tree);
+        },
+        [](const CBlockIndex* pindex) {
+            return !pindex->pprev || pindex->hashFinalSaplingRoot != pindex->pprev->hashFinalSaplingRoot;
+        },
+        [](const CTransaction& tx, std::vector<uint256>& vCommitments) {
+            for (const OutputDescription& output : tx.vShieldedOutput) {
+                vCommitments.push_back(output.cm);
+            }
+        });
+    for (const auto& witness : witnesses) {
+        if (witness && witness->root() != pindexAnchor->hashFinalSaplingRoot)
+            return error("%s: Witness root doesn't match block %s", __func__, pindexAnchor->GetBlockHash().ToString());
+    }
+    return fOk;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     CAmount nSubsidy = 1250 * COIN;
@@ -1861,6 +2144,21 @@ CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
     }
 }
 
+static bool InInitialBlockDownload(const CChainParams& chainParams)
+{
+    return true;
+}
+
+static bool NotInInitialBlockDownload(const CChainParams& chainParams)
+{
+    return false;
+}
+
+InitialBlockDownloadCheck FixedInitialBlockDownload(bool fInitialBlockDownload)
+{
+    return fInitialBlockDownload ? InInitialBlockDownload : NotInInitialBlockDownload;
+}
+
 bool IsInitialBlockDownload(const CChainParams& chainParams)
 {
     // Once this function has returned false, it must remain false.
@@ -2263,6 +2561,8 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
     return true;
 }
 
+} // anon namespace
+
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
     // Open history file to read
@@ -2290,8 +2590,6 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uin
     return true;
 }
 
-} // anon namespace
-
 /**
  * Apply the undo operation of a CTxInUndo to the given chain state.
  * @param undo The undo object.
@@ -2922,6 +3220,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             return AbortNode(state, "Failed to write transaction index");
 
     // START insightexplorer
+    // These writes are synchronous: the balance updates in WriteAddressIndex
+    // and the logical timestamp of the next block read what earlier blocks
+    // wrote, so deferring them to another thread would need a read-through
+    // overlay of the pending batches. They go to the insight databases
+    // without a sync, which SyncInsightIndexes does when the state is flushed.
     if (fAddressIndex) {
         if (!pblocktree->WriteAddressIndex(addressIndex)) {
             return AbortNode(state, "Failed to write address index");
@@ -3102,6 +3405,7 @@ void static UpdateTip(CBlockIndex *pindexNew, const CChainParams& chainParams) {
     // New best block
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
+    mempool.SetChainHeight(pindexNew->nHeight);
 
     LogPrintf("%s: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n", __func__,
       chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
@@ -4502,6 +4806,32 @@ bool static LoadBlockIndexDB()
     fSpentIndex = fInsightExplorer;
     fTimestampIndex = fInsightExplorer;
 
+    // Indexes written before they had databases of their own are moved there
+    // once; the databases are only opened with -insightexplorer.
+    if (fInsightExplorer && GetBoolArg("-insightexplorer", false)) {
+        bool fInsightIndexDBs = false;
+        pblocktree->ReadFlag("insightindexdbs", fInsightIndexDBs);
+        if (!fInsightIndexDBs) {
+            LogPrintf("%s: moving insight explorer indexes to their own databases\n", __func__);
+            uiInterface.InitMessage(_("Moving insight explorer indexes..."));
+            if (!pblocktree->MoveInsightIndexes())
+                return error("%s: failed to move insight explorer indexes", __func__);
+            pblocktree->WriteFlag("insightindexdbs", true);
+        }
+    }
+
+    // Address indexes created before the address balance index need it built once
+    if (fAddressIndex) {
+        bool fAddressBalanceIndex = false;
+        pblocktree->ReadFlag("addressbalanceindex", fAddressBalanceIndex);
+        if (!fAddressBalanceIndex) {
+            LogPrintf("%s: building address balance index\n", __func__);
+            if (!pblocktree->BuildAddressBalanceIndex())
+                return error("%s: failed to build address balance index", __func__);
+            pblocktree->WriteFlag("addressbalanceindex", true);
+        }
+    }
+
     // Fill in-memory data
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
     {
@@ -4521,6 +4851,7 @@ bool static LoadBlockIndexDB()
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    mempool.SetChainHeight(it->second->nHeight);
     // Set hashFinalSproutRoot for the end of best chain
     it->second->hashFinalSproutRoot = pcoinsTip->GetBestAnchor(SPROUT);
 
@@ -4796,6 +5127,7 @@ void UnloadBlockIndex()
     mempool.clear();
     mapOrphanTransactions.clear();
     mapOrphanTransactionsByPrev.clear();
+    nOrphanTransactionsUsage = 0;
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -4843,6 +5175,8 @@ bool InitBlockIndex(const CChainParams& chainparams)
     // Use the provided setting for -insightexplorer in the new database
     fInsightExplorer = GetBoolArg("-insightexplorer", false);
     pblocktree->WriteFlag("insightexplorer", fInsightExplorer);
+    pblocktree->WriteFlag("addressbalanceindex", fInsightExplorer);
+    pblocktree->WriteFlag("insightindexdbs", fInsightExplorer);
     fAddressIndex = fInsightExplorer;
     fSpentIndex = fInsightExplorer;
     fTimestampIndex = fInsightExplorer;
@@ -4978,6 +5312,169 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
     return nLoaded > 0;
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+/** Depth of a mempool transaction in its chain of unconfirmed parents */
+static int GetMempoolDepth(const uint256& hash, std::map<uint256, int>& mapDepth)
+{
+    AssertLockHeld(mempool.cs);
+    std::map<uint256, int>::iterator it = mapDepth.find(hash);
+    if (it != mapDepth.end())
+        return it->second;
+
+    int nDepth = 0;
+    const CTransaction& tx = mempool.mapTx.find(hash)->GetTx();
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        if (mempool.mapTx.count(txin.prevout.hash))
+            nDepth = std::max(nDepth, GetMempoolDepth(txin.prevout.hash, mapDepth) + 1);
+    }
+    mapDepth[hash] = nDepth;
+    return nDepth;
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    std::vector<std::pair<int, CTxMemPoolEntry> > vEntries;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    {
+        LOCK(mempool.cs);
+        std::map<uint256, int> mapDepth;
+        vEntries.reserve(mempool.mapTx.size());
+        for (CTxMemPool::indexed_transaction_set::const_iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end(); it++) {
+            vEntries.push_back(std::make_pair(GetMempoolDepth(it->GetTx().GetHash(), mapDepth), *it));
+        }
+        mapDeltas = mempool.mapDeltas;
+    }
+    // Write parents before their children so that LoadMempool finds their inputs
+    std::stable_sort(vEntries.begin(), vEntries.end(),
+        [](const std::pair<int, CTxMemPoolEntry>& a, const std::pair<int, CTxMemPoolEntry>& b) {
+            return a.first < b.first;
+        });
+
+    int64_t nMid = GetTimeMicros();
+
+    try {
+        boost::filesystem::path pathTemp = GetDataDir() / "mempool.dat.new";
+        FILE* filestr = fopen(pathTemp.string().c_str(), "wb");
+        if (!filestr) {
+            return false;
+        }
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+        uint64_t version = MEMPOOL_DUMP_VERSION;
+        file << version;
+        file << hashProofParams;
+        file << (uint64_t)vEntries.size();
+        BOOST_FOREACH(const PAIRTYPE(int, CTxMemPoolEntry)& item, vEntries) {
+            const CTxMemPoolEntry& entry = item.second;
+            const uint256& hash = entry.GetTx().GetHash();
+            std::pair<double, CAmount> deltas(0, 0);
+            std::map<uint256, std::pair<double, CAmount> >::iterator it = mapDeltas.find(hash);
+            if (it != mapDeltas.end()) {
+                deltas = it->second;
+                mapDeltas.erase(it);
+            }
+            file << entry.GetTx();
+            file << entry.GetTime();
+            file << entry.GetValidatedBranchId();
+            file << deltas;
+        }
+        // Prioritisations of transactions that are not in the mempool
+        file << mapDeltas;
+
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(pathTemp, GetDataDir() / "mempool.dat");
+        int64_t nLast = GetTimeMicros();
+        LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (nMid-nStart)*0.000001, (nLast-nMid)*0.000001);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+bool LoadMempool()
+{
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    FILE* filestr = fopen(path.string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    int64_t nAccepted = 0, nTrusted = 0, nFailed = 0, nAlreadyThere = 0;
+
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != MEMPOOL_DUMP_VERSION) {
+            return false;
+        }
+        uint256 hashParams;
+        file >> hashParams;
+        uint64_t num;
+        file >> num;
+        while (num--) {
+            CTransaction tx;
+            int64_t nTime;
+            uint32_t nBranchId;
+            std::pair<double, CAmount> deltas;
+            file >> tx;
+            file >> nTime;
+            file >> nBranchId;
+            file >> deltas;
+
+            const uint256& hash = tx.GetHash();
+            if (deltas.first != 0 || deltas.second != 0) {
+                mempool.PrioritiseTransaction(hash, hash.ToString(), deltas.first, deltas.second);
+            }
+
+            {
+                LOCK(cs_main);
+                if (mempool.exists(hash)) {
+                    ++nAlreadyThere;
+                } else {
+                    // The proofs were verified when the transaction was first
+                    // accepted, and still hold if neither the branch nor the
+                    // parameters they were verified against changed. The
+                    // relay policy was checked then as well, so don't let the
+                    // free transaction rate limiter drop them now.
+                    bool fProofsChecked = hashParams == hashProofParams &&
+                        nBranchId == CurrentEpochBranchId(chainActive.Height() + 1, Params().GetConsensus());
+                    CValidationState state;
+                    if (AcceptToMemoryPool(mempool, state, tx, false, NULL, false, fProofsChecked, nTime)) {
+                        ++nAccepted;
+                        if (fProofsChecked)
+                            ++nTrusted;
+                    } else {
+                        ++nFailed;
+                    }
+                }
+            }
+            if (ShutdownRequested())
+                return false;
+        }
+
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (const auto& item : mapDeltas) {
+            mempool.PrioritiseTransaction(item.first, item.first.ToString(), item.second.first, item.second.second);
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes (%i without reverifying proofs), %i failed, %i already there, %dms\n",
+        nAccepted, nTrusted, nFailed, nAlreadyThere, GetTimeMillis() - nStart);
+    return true;
+}
+
 void static CheckBlockIndex(const Consensus::Params& consensusParams)
 {
     if (!fCheckBlockIndex) {
@@ -5836,8 +6333,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
@@ -5856,78 +6351,25 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
 
             LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
                 pfrom->id, pfrom->cleanSubVer,
                 tx.GetHash().ToString(),
                 mempool.mapTx.size());
 
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        assert(recentRejects);
-                        recentRejects->insert(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            // Process any orphan transactions that depended on this one
+            ProcessOrphansOf(tx);
         }
-        // TODO: currently, prohibit joinsplits and shielded spends/outputs from entering mapOrphans
-        else if (fMissingInputs &&
-                 tx.vJoinSplit.empty() &&
-                 tx.vShieldedSpend.empty() &&
-                 tx.vShieldedOutput.empty())
+        // Shielded orphans are kept too. Their proofs were checked above, and
+        // are not checked again when their parents arrive on the same branch.
+        else if (fMissingInputs)
         {
             AddOrphanTx(tx, pfrom->GetId());
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            size_t nMaxOrphanTxUsage = (size_t)std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE)) * 1000000;
+            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanTxUsage);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
         } else {
@@ -44,6 +44,7 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CBlockUndo;
 class CBloomFilter;
 class CChainParams;
 class CInv;
@@ -72,7 +73,9 @@ static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** Default for -minrelaytxfee, minimum relay fee for transactions */
 static const unsigned int DEFAULT_MIN_RELAY_TX_FEE = 100;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
-static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 10000;
+/** Default for -maxorphantxsize, maximum memory usage of orphan transactions in megabytes */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE = 10;
 /** Default for -txexpirydelta, in number of blocks */
 static const unsigned int DEFAULT_PRE_BLOSSOM_TX_EXPIRY_DELTA = 20;
 static const unsigned int DEFAULT_POST_BLOSSOM_TX_EXPIRY_DELTA = DEFAULT_PRE_BLOSSOM_TX_EXPIRY_DELTA * Consensus::BLOSSOM_POW_TARGET_SPACING_RATIO;
@@ -107,6 +110,10 @@ static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 static const int64_t DEFAULT_MAX_TIP_AGE = 24 * 60 * 60;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Time to wait (in seconds) between periodic dumps of the mempool to disk. */
+static const unsigned int MEMPOOL_DUMP_INTERVAL = 15 * 60;
 
 // Sanity check the magic numbers when we change them
 BOOST_STATIC_ASSERT(DEFAULT_BLOCK_MAX_SIZE <= MAX_BLOCK_SIZE);
@@ -143,7 +150,8 @@ extern bool fInsightExplorer;
 
 // The following flags enable specific indices (DB tables), but are not exposed as
 // separate command-line options; instead they are enabled by experimental feature "-insightexplorer"
-// and are always equal to the overall controlling flag, fInsightExplorer.
+// and are equal to the overall controlling flag, fInsightExplorer, except while the indices
+// are being built in the background (see indexbuilder.h).
 
 // Maintain a full address index, used to query for the balance, txids and unspent outputs for addresses
 extern bool fAddressIndex;
@@ -166,6 +174,8 @@ extern size_t nCoinCacheUsage;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 extern int64_t nMaxTipAge;
+/** Identifies the zk-SNARK parameters proofs are verified with, set when they are loaded. */
+extern uint256 hashProofParams;
 
 /** Best header we've seen so far (used for getheaders queries' starting points). */
 extern CBlockIndex *pindexBestHeader;
@@ -242,6 +252,12 @@ void ThreadScriptCheck();
 void PartitionCheck(bool (*initialDownloadCheck)(const CChainParams&), CCriticalSection& cs, const CBlockIndex *const &bestHeader);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload(const CChainParams& chainParams);
+/**
+ * An isInitBlockDownload callback that returns fInitialBlockDownload without
+ * taking cs_main, for checks that run on other threads while it is held.
+ */
+typedef bool (*InitialBlockDownloadCheck)(const CChainParams&);
+InitialBlockDownloadCheck FixedInitialBlockDownload(bool fInitialBlockDownload);
 /** Format a string that describes several potential problems detected by the core */
 std::string GetWarnings(const std::string& strFor);
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
@@ -283,9 +299,23 @@ void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
-/** (try to) add transaction to memory pool **/
+/**
+ * (try to) add transaction to memory pool.
+ * fProofsChecked skips the zk-SNARK proofs and shielded signatures, for callers that
+ * already checked them with CheckTransactionProofs() at the next block's height.
+ * nAcceptTime overrides the entry time if non-zero.
+ */
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+                        bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool fProofsChecked=false,
+                        int64_t nAcceptTime=0);
+
+/** Dump the mempool to mempool.dat in the data directory. */
+bool DumpMempool();
+/**
+ * Load the mempool from mempool.dat. Proofs are not checked again if the
+ * mempool was dumped for the same consensus branch and zk-SNARK parameters.
+ */
+bool LoadMempool();
 
 
 struct CNodeStateStats {
@@ -345,10 +375,15 @@ bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, cons
                            const Consensus::Params& consensusParams, uint32_t consensusBranchId,
                            std::vector<CScriptCheck> *pvChecks = NULL);
 
-/** Check a transaction contextually against a set of consensus rules */
+/**
+ * Check a transaction contextually against a set of consensus rules.
+ * fShieldedChecks can be unset to skip the JoinSplit signature and the Sapling
+ * proofs and signatures, when they are known to have been checked at nHeight.
+ */
 bool ContextualCheckTransaction(const CTransaction& tx, CValidationState &state,
                                 const CChainParams& chainparams, int nHeight, int dosLevel,
-                                bool (*isInitBlockDownload)(const CChainParams&) = IsInitialBlockDownload);
+                                bool (*isInitBlockDownload)(const CChainParams&) = IsInitialBlockDownload,
+                                bool fShieldedChecks = true);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
@@ -358,6 +393,16 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
 /** Context-independent validity checks */
 bool CheckTransaction(const CTransaction& tx, CValidationState& state, libzcash::ProofVerifier& verifier);
 bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state);
+/**
+ * The checks AcceptToMemoryPool makes of a transaction that don't depend on the
+ * mempool or the UTXO set, including its proofs and signatures, as of nHeight.
+ * Takes no locks as long as isInitBlockDownload takes none (see
+ * FixedInitialBlockDownload), so that many transactions can be checked in
+ * parallel.
+ */
+bool CheckTransactionProofs(const CTransaction& tx, CValidationState& state,
+                            const CChainParams& chainparams, int nHeight,
+                            bool (*isInitBlockDownload)(const CChainParams&));
 
 /** Check for standard transaction types
  * @return True if all outputs (scriptPubKeys) use only standard transaction forms
@@ -448,6 +493,15 @@ bool GetAddressIndex(const uint160& addressHash, int type,
         int start = 0, int end = 0);
 bool GetAddressUnspent(const uint160& addressHash, int type,
         std::vector<CAddressUnspentDbEntry>& unspentOutputs);
+bool GetAddressBalance(const uint160& addressHash, int type, CAddressBalanceValue& balance);
+/** Stream the address index entries of several addresses in height order, see CBlockTreeDB::ForEachAddressIndex */
+bool ForEachAddressIndex(const std::vector<std::pair<uint160, int> >& addresses, int start, int end,
+        const CAddressIndexKey* pAfter,
+        boost::function<bool(const CAddressIndexKey&, CAmount)> visit);
+/** Stream the unspent outputs of several addresses in index order, see CBlockTreeDB::ForEachAddressUnspent */
+bool ForEachAddressUnspent(const std::vector<std::pair<uint160, int> >& addresses,
+        const CAddressUnspentKey* pAfter,
+        boost::function<bool(const CAddressUnspentKey&, const CAddressUnspentValue&)> visit);
 bool GetTimestampIndex(unsigned int high, unsigned int low, bool fActiveOnly,
     std::vector<std::pair<uint256, unsigned int> > &hashes);
 
@@ -455,6 +509,21 @@ bool GetTimestampIndex(unsigned int high, unsigned int low, bool fActiveOnly,
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock);
+
+/**
+ * Witness note commitments, given with the hash of the block that contains
+ * them, at the end of pindexAnchor from the blocks on disk. Notes that are not
+ * in the active chain at or below pindexAnchor are left unwitnessed. Takes
+ * cs_main only to look up the blocks to replay, which are then read without
+ * it; the cost grows with the number of blocks since the earliest note.
+ */
+bool BuildSproutWitnesses(const std::vector<std::pair<uint256, uint256>>& vNotes,
+                          const CBlockIndex* pindexAnchor,
+                          std::vector<boost::optional<SproutWitness>>& witnesses);
+bool BuildSaplingWitnesses(const std::vector<std::pair<uint256, uint256>>& vNotes,
+                           const CBlockIndex* pindexAnchor,
+                           std::vector<boost::optional<SaplingWitness>>& witnesses);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -20,7 +20,8 @@ JSDescription::JSDescription(
     CAmount vpub_old,
     CAmount vpub_new,
     bool computeProof,
-    uint256 *esk // payment disclosure
+    uint256 *esk, // payment disclosure
+    ZCJSProofWitness *proofWitness
 ) : vpub_old(vpub_old), vpub_new(vpub_new), anchor(anchor)
 {
     std::array<libzcash::SproutNote, ZC_NUM_JS_OUTPUTS> notes;
@@ -40,7 +41,8 @@ JSDescription::JSDescription(
         vpub_new,
         anchor,
         computeProof,
-        esk // payment disclosure
+        esk, // payment disclosure
+        proofWitness
     );
 }
 
@@ -56,7 +58,8 @@ JSDescription JSDescription::Randomized(
     CAmount vpub_new,
     bool computeProof,
     uint256 *esk, // payment disclosure
-    std::function<int(int)> gen
+    std::function<int(int)> gen,
+    ZCJSProofWitness *proofWitness
 )
 {
     // Randomize the order of the inputs and outputs
@@ -71,7 +74,8 @@ JSDescription JSDescription::Randomized(
     return JSDescription(
         params, joinSplitPubKey, anchor, inputs, outputs,
         vpub_old, vpub_new, computeProof,
-        esk // payment disclosure
+        esk, // payment disclosure
+        proofWitness
     );
 }
 
@@ -239,7 +239,8 @@ public:
             CAmount vpub_old,
             CAmount vpub_new,
             bool computeProof = true, // Set to false in some tests
-            uint256 *esk = nullptr // payment disclosure
+            uint256 *esk = nullptr, // payment disclosure
+            ZCJSProofWitness *proofWitness = nullptr // to create the proof later
     );
 
     static JSDescription Randomized(
@@ -254,7 +255,8 @@ public:
             CAmount vpub_new,
             bool computeProof = true, // Set to false in some tests
             uint256 *esk = nullptr, // payment disclosure
-            std::function<int(int)> gen = GetRandInt
+            std::function<int(int)> gen = GetRandInt,
+            ZCJSProofWitness *proofWitness = nullptr // to create the proof later
     );
 
     // Verifies that the JoinSplit proof is correct.
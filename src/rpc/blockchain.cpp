@@ -316,27 +316,25 @@ UniValue getdifficulty(const UniValue& params, bool fHelp)
 
 UniValue mempoolToJSON(bool fVerbose = false)
 {
+    // Reads a published snapshot, so neither cs_main nor mempool.cs is held
+    // while the (potentially large) result is built.
+    std::shared_ptr<const CMempoolSnapshot> snapshot = mempool.GetSnapshot();
     if (fVerbose)
     {
-        LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx)
+        for (const CMempoolSnapshotEntry& e : snapshot->vEntries)
         {
-            const uint256& hash = e.GetTx().GetHash();
             UniValue info(UniValue::VOBJ);
-            info.push_back(Pair("size", (int)e.GetTxSize()));
-            info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
-            info.push_back(Pair("time", e.GetTime()));
-            info.push_back(Pair("height", (int)e.GetHeight()));
-            info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
-            info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
-            const CTransaction& tx = e.GetTx();
+            info.push_back(Pair("size", (int)e.nTxSize));
+            info.push_back(Pair("fee", ValueFromAmount(e.nFee)));
+            info.push_back(Pair("time", e.nTime));
+            info.push_back(Pair("height", (int)e.nHeight));
+            info.push_back(Pair("startingpriority", e.dStartingPriority));
+            info.push_back(Pair("currentpriority", e.dCurrentPriority));
+
             set<string> setDepends;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                if (mempool.exists(txin.prevout.hash))
-                    setDepends.insert(txin.prevout.hash.ToString());
-            }
+            for (const uint256& dep : e.vDepends)
+                setDepends.insert(dep.ToString());
 
             UniValue depends(UniValue::VARR);
             BOOST_FOREACH(const string& dep, setDepends)
@@ -345,18 +343,15 @@ UniValue mempoolToJSON(bool fVerbose = false)
             }
 
             info.push_back(Pair("depends", depends));
-            o.push_back(Pair(hash.ToString(), info));
+            o.push_back(Pair(e.hash.ToString(), info));
         }
         return o;
     }
     else
     {
-        vector<uint256> vtxid;
-        mempool.queryHashes(vtxid);
-
         UniValue a(UniValue::VARR);
-        BOOST_FOREACH(const uint256& hash, vtxid)
-            a.push_back(hash.ToString());
+        for (const CMempoolSnapshotEntry& e : snapshot->vEntries)
+            a.push_back(e.hash.ToString());
 
         return a;
     }
@@ -368,6 +363,8 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
         throw runtime_error(
             "getrawmempool ( verbose )\n"
             "\nReturns all transaction ids in memory pool as a json array of string transaction ids.\n"
+            "When the memory pool holds more than " + std::to_string(MEMPOOL_SNAPSHOT_EAGER_TXS) + " transactions, the result can trail it by up to a second,\n"
+            "so a transaction that sendrawtransaction just accepted may not be listed yet.\n"
             "\nArguments:\n"
             "1. verbose           (boolean, optional, default=false) true for a json object, false for array of transaction ids\n"
             "\nResult: (for verbose = false):\n"
@@ -394,8 +391,6 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getrawmempool", "true")
         );
 
-    LOCK(cs_main);
-
     bool fVerbose = false;
     if (params.size() > 0)
         fVerbose = params[0].get_bool();
@@ -1180,10 +1175,11 @@ UniValue getchaintips(const UniValue& params, bool fHelp)
 
 UniValue mempoolInfoToJSON()
 {
+    std::shared_ptr<const CMempoolSnapshot> snapshot = mempool.GetSnapshot();
     UniValue ret(UniValue::VOBJ);
-    ret.push_back(Pair("size", (int64_t) mempool.size()));
-    ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
-    ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    ret.push_back(Pair("size", (int64_t) snapshot->vEntries.size()));
+    ret.push_back(Pair("bytes", (int64_t) snapshot->nTotalTxSize));
+    ret.push_back(Pair("usage", (int64_t) snapshot->nUsage));
 
     if (Params().NetworkIDString() == "regtest") {
         ret.push_back(Pair("fullyNotified", mempool.IsFullyNotified()));
@@ -10,6 +10,7 @@
 #include "net.h"
 #include "netbase.h"
 #include "rpc/server.h"
+#include "streams.h"
 #include "timedata.h"
 #include "txmempool.h"
 #include "util.h"
@@ -554,6 +555,53 @@ static bool getAddressesFromParams(
     return true;
 }
 
+// insightexplorer
+// The optional "limit" on the number of results returned per call (0 if none).
+static int getLimitFromParams(const UniValue& params)
+{
+    if (!params[0].isObject())
+        return 0;
+    UniValue limitValue = find_value(params[0].get_obj(), "limit");
+    if (limitValue.isNull())
+        return 0;
+    int limit = limitValue.get_int();
+    if (limit <= 0) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Limit is expected to be greater than zero");
+    }
+    return limit;
+}
+
+// insightexplorer
+// The optional "cursor" returned by a previous call: the hex encoded index
+// key of the last result, after which the next page of results starts.
+template <typename Key>
+static bool getCursorFromParams(const UniValue& params, Key& key)
+{
+    if (!params[0].isObject())
+        return false;
+    UniValue cursorValue = find_value(params[0].get_obj(), "cursor");
+    if (cursorValue.isNull())
+        return false;
+    CDataStream ssKey(ParseHexV(cursorValue, "cursor"), SER_DISK, CLIENT_VERSION);
+    try {
+        ssKey >> key;
+    } catch (const std::exception&) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+    }
+    if (!ssKey.empty()) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+    }
+    return true;
+}
+
+template <typename Key>
+static std::string encodeCursor(const Key& key)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << key;
+    return HexStr(ssKey.begin(), ssKey.end());
+}
+
 // insightexplorer
 UniValue getaddressmempool(const UniValue& params, bool fHelp)
 {
@@ -606,7 +654,7 @@ UniValue getaddressmempool(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
     std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>> indexes;
-    mempool.getAddressIndex(addresses, indexes);
+    mempool.GetSnapshot()->getAddressIndex(addresses, indexes);
     std::sort(indexes.begin(), indexes.end(),
         [](const std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>& a,
            const std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>& b) -> bool {
@@ -646,8 +694,10 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
     }
     if (fHelp || params.size() != 1)
         throw runtime_error(
-            "getaddressutxos {\"addresses\": [\"taddr\", ...], (\"chainInfo\": true|false)}\n"
+            "getaddressutxos {\"addresses\": [\"taddr\", ...], (\"chainInfo\": true|false), (\"limit\": n), (\"cursor\": \"hex\")}\n"
             "\nReturns all unspent outputs for an address.\n"
+            "\nIf a limit or cursor is given, returns at most limit outputs in index order (by address,\n"
+            "\ntxid and output index) and a cursor to pass to the next call to continue after them.\n"
             + disabledMsg +
             "\nArguments:\n"
             "{\n"
@@ -657,6 +707,8 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
             "      ,...\n"
             "    ],\n"
             "  \"chainInfo\"  (boolean, optional, default=false) Include chain info with results\n"
+            "  \"limit\"      (number, optional) The maximum number of outputs to return\n"
+            "  \"cursor\"     (string, optional) The cursor returned by the previous call\n"
             "}\n"
             "(or)\n"
             "\"address\"  (string) The base58check encoded address\n"
@@ -686,9 +738,15 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
             "    ],\n"
             "  \"hash\"              (string)  The block hash\n"
             "  \"height\"            (numeric) The block height\n"
+            "}\n\n"
+            "(or, if limit or cursor is given, as above with chain info only if chainInfo is true, and):\n\n"
+            "{\n"
+            "  \"utxos\": [ ... ],\n"
+            "  \"cursor\"            (string)  Where to continue, present only if there are more outputs\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"chainInfo\": true}'")
+            + HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"limit\": 1000}'")
             + HelpExampleRpc("getaddressutxos", "{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"chainInfo\": true}")
             );
 
@@ -704,20 +762,42 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
             includeChainInfo = chainInfo.get_bool();
         }
     }
+    const int limit = getLimitFromParams(params);
+    CAddressUnspentKey cursor;
+    const bool fCursor = getCursorFromParams(params, cursor);
+    const bool fPaged = limit > 0 || fCursor;
+
     std::vector<std::pair<uint160, int>> addresses;
     if (!getAddressesFromParams(params, addresses)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
     std::vector<CAddressUnspentDbEntry> unspentOutputs;
-    for (const auto& it : addresses) {
-        if (!GetAddressUnspent(it.first, it.second, unspentOutputs)) {
+    bool fMore = false;
+    if (fPaged) {
+        // The unspent index isn't keyed by height, so pages follow the index
+        // order and only read as far into it as the page needs.
+        if (!ForEachAddressUnspent(addresses, fCursor ? &cursor : NULL,
+                [&](const CAddressUnspentKey& key, const CAddressUnspentValue& value) {
+                    if (limit > 0 && unspentOutputs.size() == (size_t)limit) {
+                        fMore = true;
+                        return false;
+                    }
+                    unspentOutputs.push_back(std::make_pair(key, value));
+                    return true;
+                })) {
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
         }
+    } else {
+        for (const auto& it : addresses) {
+            if (!GetAddressUnspent(it.first, it.second, unspentOutputs)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            }
+        }
+        std::sort(unspentOutputs.begin(), unspentOutputs.end(),
+            [](const CAddressUnspentDbEntry& a, const CAddressUnspentDbEntry& b) -> bool {
+                return a.second.blockHeight < b.second.blockHeight;
+            });
     }
-    std::sort(unspentOutputs.begin(), unspentOutputs.end(),
-        [](const CAddressUnspentDbEntry& a, const CAddressUnspentDbEntry& b) -> bool {
-            return a.second.blockHeight < b.second.blockHeight;
-        });
 
     UniValue utxos(UniValue::VARR);
     for (const auto& it : unspentOutputs) {
@@ -736,11 +816,15 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
         utxos.push_back(output);
     }
 
-    if (!includeChainInfo)
+    if (!includeChainInfo && !fPaged)
         return utxos;
 
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("utxos", utxos));
+    if (fMore)
+        result.push_back(Pair("cursor", encodeCursor(unspentOutputs.back().first)));
+    if (!includeChainInfo)
+        return result;
 
     LOCK(cs_main);  // for chainActive
     result.push_back(Pair("hash", chainActive.Tip()->GetBlockHash().GetHex()));
@@ -776,21 +860,21 @@ static void getHeightRange(const UniValue& params, int& start, int& end)
     }
 }
 
-// Parse an address list then fetch the corresponding addressindex information.
-static void getAddressesInHeightRange(
+// Parse an address list then stream the corresponding addressindex entries,
+// merged across the addresses in height order, until visit returns false.
+static void forEachAddressInHeightRange(
     const UniValue& params,
     int start, int end,
-    std::vector<std::pair<uint160, int>>& addresses,
-    std::vector<std::pair<CAddressIndexKey, CAmount>> &addressIndex)
+    const CAddressIndexKey* pAfter,
+    boost::function<bool(const CAddressIndexKey&, CAmount)> visit)
 {
+    std::vector<std::pair<uint160, int>> addresses;
     if (!getAddressesFromParams(params, addresses)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
-    for (const auto& it : addresses) {
-        if (!GetAddressIndex(it.first, it.second, addressIndex, start, end)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY,
-                "No information available for address");
-        }
+    if (!ForEachAddressIndex(addresses, start, end, pAfter, visit)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY,
+            "No information available for address");
     }
 }
 
@@ -805,10 +889,12 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
     }
     if (fHelp || params.size() != 1)
         throw runtime_error(
-            "getaddressdeltas {\"addresses\": [\"taddr\", ...], (\"start\": n), (\"end\": n), (\"chainInfo\": true|false)}\n"
+            "getaddressdeltas {\"addresses\": [\"taddr\", ...], (\"start\": n), (\"end\": n), (\"chainInfo\": true|false), (\"limit\": n), (\"cursor\": \"hex\")}\n"
             "\nReturns all changes for an address.\n"
             "\nReturns information about all changes to the given transparent addresses within the given (inclusive)\n"
             "\nblock height range, default is the full blockchain.\n"
+            "\nIf a limit or cursor is given, returns at most limit changes and a cursor to pass to the next call\n"
+            "\nto continue after them.\n"
             + disabledMsg +
             "\nArguments:\n"
             "{\n"
@@ -820,6 +906,8 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
             "  \"start\"       (number, optional) The start block height\n"
             "  \"end\"         (number, optional) The end block height\n"
             "  \"chainInfo\"   (boolean, optional, default=false) Include chain info in results, only applies if start and end specified\n"
+            "  \"limit\"       (number, optional) The maximum number of changes to return\n"
+            "  \"cursor\"      (string, optional) The cursor returned by the previous call\n"
             "}\n"
             "(or)\n"
             "\"address\"       (string) The base58check encoded address\n"
@@ -855,9 +943,15 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
             "      \"hash\"          (string)  The end block hash\n"
             "      \"height\"        (numeric) The height of the end block\n"
             "    }\n"
+            "}\n\n"
+            "(or, if limit or cursor is given, as above with start and end only if chainInfo is true, and):\n\n"
+            "{\n"
+            "  \"deltas\": [ ... ],\n"
+            "  \"cursor\"          (string)  Where to continue, present only if there are more changes\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"start\": 1000, \"end\": 2000, \"chainInfo\": true}'")
+            + HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"limit\": 1000}'")
             + HelpExampleRpc("getaddressdeltas", "{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"start\": 1000, \"end\": 2000, \"chainInfo\": true}")
         );
 
@@ -870,9 +964,10 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
     int end = 0;
     getHeightRange(params, start, end);
 
-    std::vector<std::pair<uint160, int>> addresses;
-    std::vector<std::pair<CAddressIndexKey, CAmount>> addressIndex;
-    getAddressesInHeightRange(params, start, end, addresses, addressIndex);
+    const int limit = getLimitFromParams(params);
+    CAddressIndexKey cursor;
+    const bool fCursor = getCursorFromParams(params, cursor);
+    const bool fPaged = limit > 0 || fCursor;
 
     bool includeChainInfo = false;
     if (params[0].isObject()) {
@@ -883,26 +978,41 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
     }
 
     UniValue deltas(UniValue::VARR);
-    for (const auto& it : addressIndex) {
-        std::string address;
-        if (!getAddressFromIndex(it.first.type, it.first.hashBytes, address)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
-        }
+    CAddressIndexKey lastKey;
+    bool fMore = false;
+    forEachAddressInHeightRange(params, start, end, fCursor ? &cursor : NULL,
+        [&](const CAddressIndexKey& key, CAmount nValue) {
+            if (limit > 0 && deltas.size() == (size_t)limit) {
+                fMore = true;
+                return false;
+            }
+            std::string address;
+            if (!getAddressFromIndex(key.type, key.hashBytes, address)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+            }
 
-        UniValue delta(UniValue::VOBJ);
-        delta.push_back(Pair("address", address));
-        delta.push_back(Pair("blockindex", (int)it.first.txindex));
-        delta.push_back(Pair("height", it.first.blockHeight));
-        delta.push_back(Pair("index", (int)it.first.index));
-        delta.push_back(Pair("satoshis", it.second));
-        delta.push_back(Pair("txid", it.first.txhash.GetHex()));
-        deltas.push_back(delta);
-    }
+            UniValue delta(UniValue::VOBJ);
+            delta.push_back(Pair("address", address));
+            delta.push_back(Pair("blockindex", (int)key.txindex));
+            delta.push_back(Pair("height", key.blockHeight));
+            delta.push_back(Pair("index", (int)key.index));
+            delta.push_back(Pair("satoshis", nValue));
+            delta.push_back(Pair("txid", key.txhash.GetHex()));
+            deltas.push_back(delta);
+            lastKey = key;
+            return true;
+        });
 
     UniValue result(UniValue::VOBJ);
 
+    if (fPaged) {
+        result.push_back(Pair("deltas", deltas));
+        if (fMore)
+            result.push_back(Pair("cursor", encodeCursor(lastKey)));
+    }
+
     if (!(includeChainInfo && start > 0 && end > 0)) {
-        return deltas;
+        return fPaged ? result : deltas;
     }
 
     UniValue startInfo(UniValue::VOBJ);
@@ -918,7 +1028,8 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
     startInfo.push_back(Pair("height", start));
     endInfo.push_back(Pair("height", end));
 
-    result.push_back(Pair("deltas", deltas));
+    if (!fPaged)
+        result.push_back(Pair("deltas", deltas));
     result.push_back(Pair("start", startInfo));
     result.push_back(Pair("end", endInfo));
 
@@ -965,18 +1076,21 @@ UniValue getaddressbalance(const UniValue& params, bool fHelp)
     }
 
     std::vector<std::pair<uint160, int>> addresses;
-    std::vector<std::pair<CAddressIndexKey, CAmount>> addressIndex;
-    // this method doesn't take start and end block height params, so set
-    // to zero (full range, entire blockchain)
-    getAddressesInHeightRange(params, 0, 0, addresses, addressIndex);
+    if (!getAddressesFromParams(params, addresses)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+    }
 
+    // Read the running totals kept by the address balance index, rather
+    // than summing every entry in the address index
     CAmount balance = 0;
     CAmount received = 0;
-    for (const auto& it : addressIndex) {
-        if (it.second > 0) {
-            received += it.second;
+    for (const auto& it : addresses) {
+        CAddressBalanceValue value;
+        if (!GetAddressBalance(it.first, it.second, value)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
         }
-        balance += it.second;
+        balance += value.balance;
+        received += value.received;
     }
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("balance", balance));
@@ -995,9 +1109,11 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
     }
     if (fHelp || params.size() != 1)
         throw runtime_error(
-            "getaddresstxids {\"addresses\": [\"taddr\", ...], (\"start\": n), (\"end\": n)}\n"
+            "getaddresstxids {\"addresses\": [\"taddr\", ...], (\"start\": n), (\"end\": n), (\"limit\": n), (\"cursor\": \"hex\")}\n"
             "\nReturns the txids for given transparent addresses within the given (inclusive)\n"
             "\nblock height range, default is the full blockchain.\n"
+            "\nIf a limit or cursor is given, returns at most limit txids and a cursor to pass to the next call\n"
+            "\nto continue after them.\n"
             + disabledMsg +
             "\nArguments:\n"
             "{\n"
@@ -1008,6 +1124,8 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
             "    ]\n"
             "  \"start\" (number, optional) The start block height\n"
             "  \"end\" (number, optional) The end block height\n"
+            "  \"limit\" (number, optional) The maximum number of txids to return\n"
+            "  \"cursor\" (string, optional) The cursor returned by the previous call\n"
             "}\n"
             "(or)\n"
             "\"address\"  (string) The base58check encoded address\n"
@@ -1015,9 +1133,15 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
             "[\n"
             "  \"transactionid\"  (string) The transaction id\n"
             "  ,...\n"
-            "]\n"
+            "]\n\n"
+            "(or, if limit or cursor is given):\n\n"
+            "{\n"
+            "  \"txids\": [ ... ],\n"
+            "  \"cursor\"  (string) Where to continue, present only if there are more txids\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"start\": 1000, \"end\": 2000}'")
+            + HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"limit\": 1000}'")
             + HelpExampleRpc("getaddresstxids", "{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"start\": 1000, \"end\": 2000}")
         );
 
@@ -1030,24 +1154,37 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
     int end = 0;
     getHeightRange(params, start, end);
 
-    std::vector<std::pair<uint160, int>> addresses;
-    std::vector<std::pair<CAddressIndexKey, CAmount>> addressIndex;
-    getAddressesInHeightRange(params, start, end, addresses, addressIndex);
+    const int limit = getLimitFromParams(params);
+    CAddressIndexKey cursor;
+    const bool fCursor = getCursorFromParams(params, cursor);
+
+    // The entries arrive sorted by height and position in the block, so all
+    // the entries of a transaction are adjacent. Duplicates (two addresses in
+    // the same tx) are suppressed, and a page always ends after the last
+    // entry of its last transaction.
+    UniValue txids(UniValue::VARR);
+    CAddressIndexKey lastKey;
+    bool fMore = false;
+    forEachAddressInHeightRange(params, start, end, fCursor ? &cursor : NULL,
+        [&](const CAddressIndexKey& key, CAmount nValue) {
+            if (txids.empty() || key.txhash != lastKey.txhash) {
+                if (limit > 0 && txids.size() == (size_t)limit) {
+                    fMore = true;
+                    return false;
+                }
+                txids.push_back(key.txhash.GetHex());
+            }
+            lastKey = key;
+            return true;
+        });
 
-    // This is an ordered set, sorted by height, so result also sorted by height.
-    std::set<std::pair<int, std::string>> txids;
+    if (!(limit > 0 || fCursor))
+        return txids;
 
-    for (const auto& it : addressIndex) {
-        const int height = it.first.blockHeight;
-        const std::string txid = it.first.txhash.GetHex();
-        // Duplicate entries (two addresses in same tx) are suppressed
-        txids.insert(std::make_pair(height, txid));
-    }
-    UniValue result(UniValue::VARR);
-    for (const auto& it : txids) {
-        // only push the txid, not the height
-        result.push_back(it.second);
-    }
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("txids", txids));
+    if (fMore)
+        result.push_back(Pair("cursor", encodeCursor(lastKey)));
     return result;
 }
 
@@ -303,20 +303,16 @@ bool StartRPC()
     fRPCRunning = true;
     g_rpcSignals.Started();
 
-    // Launch one async rpc worker.  The ability to launch multiple workers is not recommended at present and thus the option is disabled.
-    getAsyncRPCQueue()->addWorker();
-/*
-    int n = GetArg("-rpcasyncthreads", 1);
-    if (n<1) {
-        LogPrintf("ERROR: Invalid value %d for -rpcasyncthreads.  Must be at least 1.\n", n);
-        strerr = strprintf(_("An error occurred while setting up the Async RPC threads, invalid parameter value of %d (must be at least 1)."), n);
-        uiInterface.ThreadSafeMessageBox(strerr, "", CClientUIInterface::MSG_ERROR);
-        StartShutdown();
-        return;
+    // Async RPC workers run z_sendmany and friends, separately from the -par
+    // script verification threads. Operations lock the utxos and notes they
+    // spend, so that workers running at the same time don't pick the same ones.
+    int nThreads = GetArg("-rpcasyncthreads", DEFAULT_RPC_ASYNC_THREADS);
+    if (nThreads < 1) {
+        LogPrintf("ERROR: Invalid value %d for -rpcasyncthreads.  Must be at least 1.\n", nThreads);
+        return false;
     }
-    for (int i = 0; i < n; i++)
+    for (int i = 0; i < nThreads; i++)
         getAsyncRPCQueue()->addWorker();
-*/
     return true;
 }
 
@@ -30,13 +30,16 @@
 // Tests this internal-to-main.cpp method:
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphansUsage);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    size_t nUsage;
+    uint32_t nBranchId;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<COutPoint, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern size_t nOrphanTransactionsUsage;
 
 CService ip(uint32_t i)
 {
@@ -148,6 +151,8 @@ BOOST_DATA_TEST_CASE(DoS_mapOrphans, boost::unit_test::data::xrange(static_cast<
     for (int i = 0; i < 50; i++)
     {
         CTransaction txPrev = RandomOrphan();
+        size_t nChildren = mapOrphanTransactionsByPrev.count(COutPoint(txPrev.GetHash(), 0)) ?
+            mapOrphanTransactionsByPrev[COutPoint(txPrev.GetHash(), 0)].size() : 0;
 
         CMutableTransaction tx;
         tx.vin.resize(1);
@@ -159,6 +164,9 @@ BOOST_DATA_TEST_CASE(DoS_mapOrphans, boost::unit_test::data::xrange(static_cast<
         SignSignature(keystore, txPrev, tx, 0, SIGHASH_ALL, consensusBranchId);
 
         AddOrphanTx(tx, i);
+        // Orphans are indexed by the outpoints they spend
+        BOOST_CHECK_EQUAL(mapOrphanTransactionsByPrev[COutPoint(txPrev.GetHash(), 0)].size(), nChildren + 1);
+        BOOST_CHECK(!mapOrphanTransactionsByPrev.count(COutPoint(txPrev.GetHash(), 1)));
     }
 
     // This really-big orphan should be ignored:
@@ -194,13 +202,22 @@ BOOST_DATA_TEST_CASE(DoS_mapOrphans, boost::unit_test::data::xrange(static_cast<
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    size_t nMaxUsage = std::numeric_limits<size_t>::max();
+    LimitOrphanTxSize(40, nMaxUsage);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, nMaxUsage);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    size_t nUsage = 0;
+    BOOST_FOREACH(const PAIRTYPE(uint256, COrphanTx)& item, mapOrphanTransactions)
+        nUsage += item.second.nUsage;
+    BOOST_CHECK_EQUAL(nOrphanTransactionsUsage, nUsage);
+    LimitOrphanTxSize(10, nUsage / 2);
+    BOOST_CHECK(nOrphanTransactionsUsage <= nUsage / 2);
+    BOOST_CHECK(!mapOrphanTransactions.empty());
+    LimitOrphanTxSize(10, 0);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsUsage, 0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,217 @@
+// Copyright (c) 2019 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "addressindex.h"
+#include "main.h"
+#include "spentindex.h"
+#include "timestampindex.h"
+#include "txdb.h"
+#include "utilstrencodings.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(addressindex_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(AddressBalanceIndex)
+{
+    CBlockTreeDB db(1 << 20, true);
+    uint160 addr = uint160(ParseHex("0102030405060708090a0b0c0d0e0f1011121314"));
+    uint160 other = uint160(ParseHex("1111111111111111111111111111111111111111"));
+    uint256 tx1 = GetRandHash();
+    uint256 tx2 = GetRandHash();
+    int type = CScript::P2PKH;
+
+    // Two outputs to addr in one transaction, then a spend of one of them
+    std::vector<CAddressIndexDbEntry> block1 = {
+        std::make_pair(CAddressIndexKey(type, addr, 1, 1, tx1, 0, false), 3 * COIN),
+        std::make_pair(CAddressIndexKey(type, addr, 1, 1, tx1, 1, false), 2 * COIN),
+        std::make_pair(CAddressIndexKey(type, other, 1, 1, tx1, 2, false), 1 * COIN),
+    };
+    std::vector<CAddressIndexDbEntry> block2 = {
+        std::make_pair(CAddressIndexKey(type, addr, 2, 1, tx2, 0, true), -3 * COIN),
+    };
+    BOOST_CHECK(db.WriteAddressIndex(block1));
+    BOOST_CHECK(db.WriteAddressIndex(block2));
+
+    CAddressBalanceValue value;
+    BOOST_CHECK(db.ReadAddressBalance(addr, type, value));
+    BOOST_CHECK_EQUAL(value.balance, 2 * COIN);
+    BOOST_CHECK_EQUAL(value.received, 5 * COIN);
+    BOOST_CHECK_EQUAL(value.txCount, 2);
+
+    // Writing a block again, as when it is reconnected after an unclean
+    // shutdown, doesn't count it twice
+    BOOST_CHECK(db.WriteAddressIndex(block2));
+    BOOST_CHECK(db.ReadAddressBalance(addr, type, value));
+    BOOST_CHECK_EQUAL(value.balance, 2 * COIN);
+    BOOST_CHECK_EQUAL(value.txCount, 2);
+
+    // Rebuilding from the address index gives the same totals
+    BOOST_CHECK(db.BuildAddressBalanceIndex());
+    BOOST_CHECK(db.ReadAddressBalance(addr, type, value));
+    BOOST_CHECK_EQUAL(value.balance, 2 * COIN);
+    BOOST_CHECK_EQUAL(value.received, 5 * COIN);
+    BOOST_CHECK_EQUAL(value.txCount, 2);
+
+    BOOST_CHECK(db.EraseAddressIndex(block2));
+    BOOST_CHECK(db.ReadAddressBalance(addr, type, value));
+    BOOST_CHECK_EQUAL(value.balance, 5 * COIN);
+    BOOST_CHECK_EQUAL(value.txCount, 1);
+
+    // Addresses without activity read as empty
+    BOOST_CHECK(db.EraseAddressIndex(block1));
+    BOOST_CHECK(db.ReadAddressBalance(addr, type, value));
+    BOOST_CHECK(value.IsNull());
+    BOOST_CHECK(db.ReadAddressBalance(other, type, value));
+    BOOST_CHECK(value.IsNull());
+}
+
+static bool CollectAddressIndex(std::vector<CAddressIndexKey>& keys, size_t nLimit, const CAddressIndexKey& key, CAmount nValue)
+{
+    if (keys.size() == nLimit)
+        return false;
+    keys.push_back(key);
+    return true;
+}
+
+static bool SameAddressIndexKey(const CAddressIndexKey& a, const CAddressIndexKey& b)
+{
+    return !CAddressIndexKeyCompareByHeight()(a, b) && !CAddressIndexKeyCompareByHeight()(b, a);
+}
+
+BOOST_AUTO_TEST_CASE(AddressIndexMergeAndCursor)
+{
+    CBlockTreeDB db(1 << 20, true);
+    uint160 addr1 = uint160(ParseHex("0102030405060708090a0b0c0d0e0f1011121314"));
+    uint160 addr2 = uint160(ParseHex("1111111111111111111111111111111111111111"));
+    uint256 tx1 = GetRandHash();
+    uint256 tx2 = GetRandHash();
+    uint256 tx3 = GetRandHash();
+    int type = CScript::P2PKH;
+
+    // Output index 256 is stored before output index 1
+    std::vector<CAddressIndexDbEntry> entries = {
+        std::make_pair(CAddressIndexKey(type, addr1, 1, 1, tx1, 1, false), 1),
+        std::make_pair(CAddressIndexKey(type, addr1, 1, 1, tx1, 256, false), 2),
+        std::make_pair(CAddressIndexKey(type, addr2, 1, 1, tx1, 2, false), 3),
+        std::make_pair(CAddressIndexKey(type, addr2, 2, 1, tx2, 0, false), 4),
+        std::make_pair(CAddressIndexKey(type, addr1, 3, 2, tx3, 0, false), 5),
+        std::make_pair(CAddressIndexKey(type, addr1, 3, 1, tx2, 0, true), -2),
+    };
+    BOOST_CHECK(db.WriteAddressIndex(entries));
+
+    std::vector<std::pair<uint160, int>> addresses = {
+        std::make_pair(addr2, type), std::make_pair(addr1, type), std::make_pair(addr1, type)};
+    std::vector<CAddressIndexKey> all;
+    BOOST_CHECK(db.ForEachAddressIndex(addresses, 0, 0, NULL,
+        boost::bind(CollectAddressIndex, boost::ref(all), (size_t)-1, _1, _2)));
+    BOOST_CHECK_EQUAL(all.size(), entries.size());
+    for (size_t i = 1; i < all.size(); i++) {
+        BOOST_CHECK(CAddressIndexKeyCompareByHeight()(all[i - 1], all[i]));
+    }
+    BOOST_CHECK_EQUAL(all[0].index, 256);
+    BOOST_CHECK_EQUAL(all[4].blockHeight, 3);
+    BOOST_CHECK(all[4].spending);
+
+    // Paging with the last key as the cursor visits every entry once, in order
+    std::vector<CAddressIndexKey> paged;
+    while (true) {
+        std::vector<CAddressIndexKey> page;
+        BOOST_CHECK(db.ForEachAddressIndex(addresses, 0, 0, paged.empty() ? NULL : &paged.back(),
+            boost::bind(CollectAddressIndex, boost::ref(page), 2, _1, _2)));
+        if (page.empty())
+            break;
+        paged.insert(paged.end(), page.begin(), page.end());
+    }
+    BOOST_CHECK_EQUAL(paged.size(), all.size());
+    for (size_t i = 0; i < all.size() && i < paged.size(); i++) {
+        BOOST_CHECK(SameAddressIndexKey(all[i], paged[i]));
+    }
+
+    // Height ranges apply to every address, and to a cursor before the range
+    std::vector<CAddressIndexKey> range;
+    BOOST_CHECK(db.ForEachAddressIndex(addresses, 2, 2, &all[0],
+        boost::bind(CollectAddressIndex, boost::ref(range), (size_t)-1, _1, _2)));
+    BOOST_CHECK_EQUAL(range.size(), 1);
+    BOOST_CHECK(range[0].txhash == tx2);
+
+    // Unspent outputs resume after the cursor, one address after another
+    std::vector<CAddressUnspentDbEntry> unspent = {
+        std::make_pair(CAddressUnspentKey(type, addr1, tx1, 1), CAddressUnspentValue(1, CScript(), 1)),
+        std::make_pair(CAddressUnspentKey(type, addr1, tx3, 0), CAddressUnspentValue(5, CScript(), 3)),
+        std::make_pair(CAddressUnspentKey(type, addr2, tx2, 0), CAddressUnspentValue(4, CScript(), 2)),
+    };
+    BOOST_CHECK(db.UpdateAddressUnspentIndex(unspent));
+    std::vector<CAddressUnspentKey> outputs;
+    auto collect = [&outputs](const CAddressUnspentKey& key, const CAddressUnspentValue& value) {
+        outputs.push_back(key);
+        return true;
+    };
+    BOOST_CHECK(db.ForEachAddressUnspent(addresses, NULL, collect));
+    BOOST_CHECK_EQUAL(outputs.size(), 3);
+    CAddressUnspentKey cursor = outputs[0];
+    outputs.clear();
+    BOOST_CHECK(db.ForEachAddressUnspent(addresses, &cursor, collect));
+    BOOST_CHECK_EQUAL(outputs.size(), 2);
+    BOOST_CHECK(outputs[0].txhash != cursor.txhash || outputs[0].hashBytes != cursor.hashBytes);
+}
+
+BOOST_AUTO_TEST_CASE(MoveInsightIndexes)
+{
+    boost::filesystem::create_directories(GetDataDir() / "blocks");
+    uint160 addr = uint160(ParseHex("0102030405060708090a0b0c0d0e0f1011121314"));
+    uint256 tx = GetRandHash();
+    uint256 hashBlock = GetRandHash();
+    int type = CScript::P2PKH;
+    std::vector<CAddressIndexDbEntry> entries = {
+        std::make_pair(CAddressIndexKey(type, addr, 1, 1, tx, 0, false), 3 * COIN),
+    };
+
+    // Indexes written to the block database, as by earlier versions
+    {
+        CBlockTreeDB db(1 << 20, false, true);
+        BOOST_CHECK(db.WriteAddressIndex(entries));
+        BOOST_CHECK(db.UpdateSpentIndex({std::make_pair(CSpentIndexKey(tx, 0), CSpentIndexValue(tx, 0, 2, 3 * COIN, type, addr))}));
+        BOOST_CHECK(db.WriteTimestampBlockIndex(CTimestampBlockIndexKey(hashBlock), CTimestampBlockIndexValue(1234)));
+    }
+
+    {
+        CBlockTreeDB db(1 << 20, false, false, 1 << 20);
+        std::vector<CAddressIndexDbEntry> found;
+        BOOST_CHECK(db.ReadAddressIndex(addr, type, found));
+        BOOST_CHECK(found.empty());
+
+        BOOST_CHECK(db.MoveInsightIndexes());
+        BOOST_CHECK(db.ReadAddressIndex(addr, type, found));
+        BOOST_CHECK_EQUAL(found.size(), 1);
+        CAddressBalanceValue value;
+        BOOST_CHECK(db.ReadAddressBalance(addr, type, value));
+        BOOST_CHECK_EQUAL(value.balance, 3 * COIN);
+        CSpentIndexKey spentKey(tx, 0);
+        CSpentIndexValue spentValue;
+        BOOST_CHECK(db.ReadSpentIndex(spentKey, spentValue));
+        BOOST_CHECK_EQUAL(spentValue.blockHeight, 2);
+        unsigned int logicalTS = 0;
+        BOOST_CHECK(db.ReadTimestampBlockIndex(hashBlock, logicalTS));
+        BOOST_CHECK_EQUAL(logicalTS, 1234);
+
+        // Moving again finds nothing left to move
+        BOOST_CHECK(db.MoveInsightIndexes());
+        found.clear();
+        BOOST_CHECK(db.ReadAddressIndex(addr, type, found));
+        BOOST_CHECK_EQUAL(found.size(), 1);
+    }
+
+    // Nothing is left behind in the block database
+    CBlockTreeDB db(1 << 20, false, false);
+    std::vector<CAddressIndexDbEntry> found;
+    BOOST_CHECK(db.ReadAddressIndex(addr, type, found));
+    BOOST_CHECK(found.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -212,6 +212,203 @@ BOOST_AUTO_TEST_CASE(RemoveWithoutBranchId) {
     BOOST_CHECK_EQUAL(pool.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(RemoveExpiredAndWithAnchor) {
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    entry.nFee = 10000LL;
+    entry.hadNoDependencies = true;
+    uint256 sproutAnchor = GetRandHash();
+    uint256 saplingAnchor = GetRandHash();
+
+    // Transactions expiring at heights 0 (never), 10, 20 and 30, every
+    // other one spending from the anchors
+    for (auto i = 0; i < 4; i++) {
+        CMutableTransaction tx = CMutableTransaction();
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[0].nValue = i * COIN;
+        tx.nExpiryHeight = i * 10;
+        if (i % 2 == 0) {
+            tx.vJoinSplit.resize(1);
+            tx.vJoinSplit[0].anchor = sproutAnchor;
+        } else {
+            tx.vShieldedSpend.resize(1);
+            tx.vShieldedSpend[0].anchor = saplingAnchor;
+        }
+        pool.addUnchecked(tx.GetHash(), entry.FromTx(tx));
+    }
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+
+    // Expiry is strictly after the expiry height
+    pool.removeExpired(20);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    pool.removeExpired(21);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+
+    // Unknown anchors remove nothing
+    pool.removeWithAnchor(GetRandHash(), SAPLING);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    pool.removeWithAnchor(saplingAnchor, SAPLING);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    pool.removeWithAnchor(saplingAnchor, SPROUT);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+
+    // The transaction that never expires is only removed with its anchor
+    pool.removeExpired(1000000);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    pool.removeWithAnchor(sproutAnchor, SPROUT);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAddressIndex) {
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    uint160 addressHash = uint160(ParseHex("0102030405060708090a0b0c0d0e0f1011121314"));
+    CScript scriptPubKey = CScript() << OP_DUP << OP_HASH160 << ToByteVector(addressHash) << OP_EQUALVERIFY << OP_CHECKSIG;
+    std::vector<std::pair<uint160, int>> addresses = {std::make_pair(addressHash, (int)CScript::P2PKH)};
+    size_t nUsage = pool.DynamicMemoryUsage();
+
+    // Two outputs of the same transaction to an address spill its entries to the heap
+    std::vector<CMutableTransaction> txs(2);
+    for (auto i = 0; i < 2; i++) {
+        txs[i].vout.resize(i + 1);
+        for (auto& out : txs[i].vout) {
+            out.scriptPubKey = scriptPubKey;
+            out.nValue = (i + 1) * COIN;
+        }
+        CTxMemPoolEntry poolEntry = entry.FromTx(txs[i]);
+        pool.addUnchecked(txs[i].GetHash(), poolEntry);
+        pool.addAddressIndex(poolEntry, view);
+    }
+    size_t nUsageAdded = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsageAdded > nUsage);
+
+    std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>> results;
+    pool.getAddressIndex(addresses, results);
+    BOOST_CHECK_EQUAL(results.size(), 3);
+    for (const auto& result : results) {
+        BOOST_CHECK(result.first.addressBytes == addressHash);
+        BOOST_CHECK_EQUAL(result.first.spending, 0);
+    }
+
+    std::list<CTransaction> removed;
+    pool.remove(txs[1], removed);
+    pool.removeAddressIndex(txs[1].GetHash());
+    results.clear();
+    pool.getAddressIndex(addresses, results);
+    BOOST_REQUIRE_EQUAL(results.size(), 1);
+    BOOST_CHECK(results[0].first.txhash == txs[0].GetHash());
+    BOOST_CHECK_EQUAL(results[0].second.amount, COIN);
+    BOOST_CHECK(pool.DynamicMemoryUsage() < nUsageAdded);
+
+    pool.remove(txs[0], removed);
+    pool.removeAddressIndex(txs[0].GetHash());
+    results.clear();
+    pool.getAddressIndex(addresses, results);
+    BOOST_CHECK(results.empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSnapshot) {
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    CMutableTransaction txParent;
+    txParent.vout.resize(2);
+    txParent.vout[0].nValue = txParent.vout[1].nValue = COIN;
+    CMutableTransaction txChild;
+    txChild.vin.resize(2);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vin[1].prevout = COutPoint(txParent.GetHash(), 1);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = COIN;
+
+    std::shared_ptr<const CMempoolSnapshot> empty = pool.GetSnapshot();
+    BOOST_CHECK(empty->vEntries.empty());
+    // Unchanged pools keep serving the published snapshot
+    BOOST_CHECK(pool.GetSnapshot() == empty);
+
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(1000LL).Height(10).FromTx(txParent));
+    pool.addUnchecked(txChild.GetHash(), entry.Fee(2000LL).FromTx(txChild));
+    pool.SetChainHeight(20);
+    // The changes of a small pool are copied when it is next read
+    std::shared_ptr<const CMempoolSnapshot> snapshot = pool.GetSnapshot();
+    BOOST_CHECK(snapshot != empty);
+    BOOST_CHECK(pool.GetSnapshot() == snapshot);
+    BOOST_CHECK(empty->vEntries.empty());
+    BOOST_CHECK_EQUAL(snapshot->nChainHeight, 20);
+    BOOST_CHECK_EQUAL(snapshot->nTotalTxSize, pool.GetTotalTxSize());
+    BOOST_CHECK_EQUAL(snapshot->nUsage, pool.DynamicMemoryUsage());
+    BOOST_REQUIRE_EQUAL(snapshot->vEntries.size(), 2);
+    for (const CMempoolSnapshotEntry& e : snapshot->vEntries) {
+        if (e.hash == txChild.GetHash()) {
+            BOOST_CHECK_EQUAL(e.nFee, 2000);
+            BOOST_REQUIRE_EQUAL(e.vDepends.size(), 1);
+            BOOST_CHECK(e.vDepends[0] == txParent.GetHash());
+        } else {
+            BOOST_CHECK(e.hash == txParent.GetHash());
+            BOOST_CHECK(e.vDepends.empty());
+            BOOST_CHECK(e.dCurrentPriority > e.dStartingPriority);
+        }
+    }
+
+    std::list<CTransaction> removed;
+    pool.remove(txChild, removed);
+    BOOST_CHECK_EQUAL(pool.GetSnapshot()->vEntries.size(), 1);
+    BOOST_CHECK_EQUAL(snapshot->vEntries.size(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolConflicts) {
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    uint256 sproutNf = GetRandHash();
+    uint256 saplingNf = GetRandHash();
+
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = COIN;
+    CMutableTransaction txShielded;
+    txShielded.nVersion = 4;
+    txShielded.fOverwintered = true;
+    txShielded.nVersionGroupId = SAPLING_VERSION_GROUP_ID;
+    txShielded.vJoinSplit.resize(1);
+    txShielded.vJoinSplit[0].nullifiers[0] = sproutNf;
+    txShielded.vShieldedSpend.resize(1);
+    txShielded.vShieldedSpend[0].nullifier = saplingNf;
+    pool.addUnchecked(txSpend.GetHash(), entry.FromTx(txSpend));
+    pool.addUnchecked(txShielded.GetHash(), entry.FromTx(txShielded));
+
+    // A transaction never conflicts with itself
+    BOOST_CHECK(!pool.HasConflicts(txSpend));
+    BOOST_CHECK(!pool.HasConflicts(txShielded));
+
+    CMutableTransaction txDoubleSpend;
+    txDoubleSpend.vin = txSpend.vin;
+    txDoubleSpend.vShieldedSpend.resize(1);
+    txDoubleSpend.vShieldedSpend[0].nullifier = saplingNf;
+    BOOST_CHECK(pool.HasConflicts(txDoubleSpend));
+    std::vector<uint256> vConflicts;
+    pool.GetConflicts(txDoubleSpend, vConflicts);
+    BOOST_REQUIRE_EQUAL(vConflicts.size(), 2);
+    BOOST_CHECK(vConflicts[0] == txSpend.GetHash());
+    BOOST_CHECK(vConflicts[1] == txShielded.GetHash());
+
+    CMutableTransaction txSproutDoubleSpend;
+    txSproutDoubleSpend.vJoinSplit.resize(1);
+    txSproutDoubleSpend.vJoinSplit[0].nullifiers[1] = sproutNf;
+    BOOST_CHECK(pool.HasConflicts(txSproutDoubleSpend));
+
+    std::list<CTransaction> removed;
+    pool.removeConflicts(txDoubleSpend, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK(!pool.HasConflicts(txSproutDoubleSpend));
+    BOOST_CHECK(!pool.nullifierExists(saplingNf, SAPLING));
+}
+
 // Test that nCheckFrequency is set correctly when calling setSanityCheck().
 // https://github.com/zcash/zcash/issues/3134
 BOOST_AUTO_TEST_CASE(SetSanityCheck) {
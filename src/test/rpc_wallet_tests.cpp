@@ -856,6 +856,74 @@ BOOST_AUTO_TEST_CASE(rpc_wallet_async_operations_parallel_cancel)
     BOOST_CHECK(ids.size()==0);
 }
 
+// Records the order in which operations are started
+std::vector<OperationPriority> gStartOrder;
+
+class PriorityOperation : public AsyncRPCOperation {
+public:
+    OperationPriority priority;
+    PriorityOperation(OperationPriority p) : priority(p) {}
+    virtual ~PriorityOperation() {}
+    virtual OperationPriority getPriority() const {
+        return priority;
+    }
+    virtual void main() {
+        set_state(OperationStatus::EXECUTING);
+        gStartOrder.push_back(priority);
+        set_state(OperationStatus::SUCCESS);
+    }
+};
+
+// Loops until it is cancelled
+class InterruptibleOperation : public AsyncRPCOperation {
+public:
+    virtual ~InterruptibleOperation() {}
+    virtual void main() {
+        set_state(OperationStatus::EXECUTING);
+        start_execution_clock();
+        try {
+            while (true) {
+                interruption_point();
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        } catch (const AsyncRPCOperationCancelled& e) {
+        }
+        stop_execution_clock();
+        set_state(unsuccessful_state());
+    }
+};
+
+BOOST_AUTO_TEST_CASE(rpc_wallet_async_operations_priority_and_cancel)
+{
+    gStartOrder.clear();
+
+    std::shared_ptr<AsyncRPCQueue> q = std::make_shared<AsyncRPCQueue>();
+    q->addOperation(std::shared_ptr<AsyncRPCOperation>(new PriorityOperation(OperationPriority::LOW)));
+    q->addOperation(std::shared_ptr<AsyncRPCOperation>(new PriorityOperation(OperationPriority::NORMAL)));
+    q->addOperation(std::shared_ptr<AsyncRPCOperation>(new PriorityOperation(OperationPriority::HIGH)));
+    q->addOperation(std::shared_ptr<AsyncRPCOperation>(new PriorityOperation(OperationPriority::LOW)));
+    q->addWorker();
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    BOOST_CHECK(q->getOperationCount() == 0);
+    std::vector<OperationPriority> expected = {
+        OperationPriority::HIGH, OperationPriority::NORMAL, OperationPriority::LOW, OperationPriority::LOW};
+    BOOST_CHECK(gStartOrder == expected);
+
+    // An executing operation stops at its next cancellation point
+    std::shared_ptr<AsyncRPCOperation> op(new InterruptibleOperation());
+    q->addOperation(op);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    BOOST_CHECK_EQUAL(op->isExecuting(), true);
+    op->cancel();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    BOOST_CHECK_EQUAL(op->isCancelled(), true);
+    UniValue status = op->getStatus();
+    BOOST_CHECK_EQUAL(find_value(status, "priority").get_str(), "normal");
+    BOOST_CHECK(find_value(status, "cpu_secs").isNum());
+    BOOST_CHECK(find_value(status, "proving_secs").isNum());
+    q->finishAndWait();
+}
+
 // This tests z_getoperationstatus, z_getoperationresult, z_listoperationids
 BOOST_AUTO_TEST_CASE(rpc_z_getoperations)
 {
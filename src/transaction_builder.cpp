@@ -10,6 +10,7 @@
 #include "script/sign.h"
 #include "utilmoneystr.h"
 
+#include <boost/thread.hpp>
 #include <boost/variant.hpp>
 #include <librustzcash.h>
 
@@ -64,6 +65,23 @@ TransactionBuilder::TransactionBuilder(
     mtx = CreateNewContextualCMutableTransaction(consensusParams, nHeight);
 }
 
+bool ProveJoinSplits(
+    ZCJoinSplit& params,
+    const uint256& joinSplitPubKey,
+    std::vector<JSDescription>& vJoinSplit,
+    const std::vector<ZCJSProofWitness>& vProofWitnesses)
+{
+    assert(vJoinSplit.size() == vProofWitnesses.size());
+
+    std::vector<char> vValid(vJoinSplit.size(), false);
+    ForEachIndexInParallel(vJoinSplit.size(), [&](size_t i) {
+        vJoinSplit[i].proof = params.prove(vProofWitnesses[i]);
+        auto verifier = libzcash::ProofVerifier::Strict();
+        vValid[i] = vJoinSplit[i].Verify(params, verifier, joinSplitPubKey);
+    }, MAX_SPROUT_PROVING_THREADS);
+    return std::find(vValid.begin(), vValid.end(), false) == vValid.end();
+}
+
 // This exception is thrown in certain scenarios when building JoinSplits fails.
 struct JSDescException : public std::exception
 {
@@ -261,88 +279,22 @@ TransactionBuilderResult TransactionBuilder::Build()
     // Sapling spends and outputs
     //
 
-    auto ctx = librustzcash_sapling_proving_ctx_init();
-
-    // Create Sapling SpendDescriptions
-    for (auto spend : spends) {
-        auto cm = spend.note.cm();
-        auto nf = spend.note.nullifier(
-            spend.expsk.full_viewing_key(), spend.witness.position());
-        if (!cm || !nf) {
-            librustzcash_sapling_proving_ctx_free(ctx);
-            return TransactionBuilderResult("Spend is invalid");
-        }
-
-        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-        ss << spend.witness.path();
-        std::vector<unsigned char> witness(ss.begin(), ss.end());
-
-        SpendDescription sdesc;
-        if (!librustzcash_sapling_spend_proof(
-                ctx,
-                spend.expsk.full_viewing_key().ak.begin(),
-                spend.expsk.nsk.begin(),
-                spend.note.d.data(),
-                spend.note.r.begin(),
-                spend.alpha.begin(),
-                spend.note.value(),
-                spend.anchor.begin(),
-                witness.data(),
-                sdesc.cv.begin(),
-                sdesc.rk.begin(),
-                sdesc.zkproof.data())) {
-            librustzcash_sapling_proving_ctx_free(ctx);
-            return TransactionBuilderResult("Spend proof failed");
-        }
-
-        sdesc.anchor = spend.anchor;
-        sdesc.nullifier = *nf;
-        mtx.vShieldedSpend.push_back(sdesc);
-    }
+    // The Sapling proofs are created in parallel with each other. When there
+    // are also Sprout JoinSplits to prove, they are created on their own
+    // thread in the meantime.
+    bool fSprout = !jsInputs.empty() || !jsOutputs.empty();
+    bool fSapling = !spends.empty() || !outputs.empty();
 
-    // Create Sapling OutputDescriptions
-    for (auto output : outputs) {
-        auto cm = output.note.cm();
-        if (!cm) {
-            librustzcash_sapling_proving_ctx_free(ctx);
-            return TransactionBuilderResult("Output is invalid");
-        }
-
-        libzcash::SaplingNotePlaintext notePlaintext(output.note, output.memo);
-
-        auto res = notePlaintext.encrypt(output.note.pk_d);
-        if (!res) {
-            librustzcash_sapling_proving_ctx_free(ctx);
-            return TransactionBuilderResult("Failed to encrypt note");
-        }
-        auto enc = res.get();
-        auto encryptor = enc.second;
-
-        OutputDescription odesc;
-        if (!librustzcash_sapling_output_proof(
-                ctx,
-                encryptor.get_esk().begin(),
-                output.note.d.data(),
-                output.note.pk_d.begin(),
-                output.note.r.begin(),
-                output.note.value(),
-                odesc.cv.begin(),
-                odesc.zkproof.begin())) {
-            librustzcash_sapling_proving_ctx_free(ctx);
-            return TransactionBuilderResult("Output proof failed");
-        }
-
-        odesc.cm = *cm;
-        odesc.ephemeralKey = encryptor.get_epk();
-        odesc.encCiphertext = enc.first;
+    auto ctx = librustzcash_sapling_proving_ctx_init();
 
-        libzcash::SaplingOutgoingPlaintext outPlaintext(output.note.pk_d, encryptor.get_esk());
-        odesc.outCiphertext = outPlaintext.encrypt(
-            output.ovk,
-            odesc.cv,
-            odesc.cm,
-            encryptor);
-        mtx.vShieldedOutput.push_back(odesc);
+    boost::optional<std::string> saplingError;
+    boost::thread saplingThread;
+    if (fSprout && fSapling) {
+        saplingThread = boost::thread([this, ctx, &saplingError] {
+            saplingError = CreateSaplingDescriptions(ctx);
+        });
+    } else {
+        saplingError = CreateSaplingDescriptions(ctx);
     }
 
     //
@@ -352,19 +304,37 @@ TransactionBuilderResult TransactionBuilder::Build()
     unsigned char joinSplitPrivKey[crypto_sign_SECRETKEYBYTES];
     crypto_sign_keypair(mtx.joinSplitPubKey.begin(), joinSplitPrivKey);
 
-    // Create Sprout JSDescriptions
-    if (!jsInputs.empty() || !jsOutputs.empty()) {
+    // Create Sprout JSDescriptions (saplingError belongs to saplingThread until it is joined)
+    boost::optional<std::string> sproutError;
+    if (fSprout && (saplingThread.joinable() || !saplingError)) {
         try {
             CreateJSDescriptions();
+            if (!ProveJoinSplits(*sproutParams, mtx.joinSplitPubKey, mtx.vJoinSplit, jsProofWitnesses)) {
+                throw JSDescException("error verifying joinsplit");
+            }
         } catch (JSDescException e) {
+            sproutError = std::string(e.what());
+        } catch (...) {
+            if (saplingThread.joinable()) {
+                saplingThread.join();
+            }
             librustzcash_sapling_proving_ctx_free(ctx);
-            return TransactionBuilderResult(e.what());
-        } catch (std::runtime_error e) {
-            librustzcash_sapling_proving_ctx_free(ctx);
-            throw e;
+            throw;
         }
     }
 
+    if (saplingThread.joinable()) {
+        saplingThread.join();
+    }
+    if (saplingError) {
+        librustzcash_sapling_proving_ctx_free(ctx);
+        return TransactionBuilderResult(saplingError.get());
+    }
+    if (sproutError) {
+        librustzcash_sapling_proving_ctx_free(ctx);
+        return TransactionBuilderResult(sproutError.get());
+    }
+
     //
     // Signatures
     //
@@ -435,8 +405,126 @@ TransactionBuilderResult TransactionBuilder::Build()
     return TransactionBuilderResult(CTransaction(mtx));
 }
 
+boost::optional<std::string> TransactionBuilder::CreateSaplingDescriptions(void* ctx)
+{
+    // The proofs are independent, so each one is created on its own proving
+    // context, in parallel. The contexts are merged into ctx afterwards, which
+    // then holds the value commitments and randomness of all of them for the
+    // binding signature.
+    size_t nSpends = spends.size();
+    size_t nProofs = nSpends + outputs.size();
+    size_t nSpendBase = mtx.vShieldedSpend.size();
+    size_t nOutputBase = mtx.vShieldedOutput.size();
+    mtx.vShieldedSpend.resize(nSpendBase + nSpends);
+    mtx.vShieldedOutput.resize(nOutputBase + outputs.size());
+
+    std::vector<void*> vCtx(nProofs);
+    std::vector<boost::optional<std::string>> vError(nProofs);
+    ForEachIndexInParallel(nProofs, [&](size_t i) {
+        vCtx[i] = librustzcash_sapling_proving_ctx_init();
+        if (i < nSpends) {
+            vError[i] = CreateSpendDescription(vCtx[i], spends[i], mtx.vShieldedSpend[nSpendBase + i]);
+        } else {
+            vError[i] = CreateOutputDescription(vCtx[i], outputs[i - nSpends], mtx.vShieldedOutput[nOutputBase + i - nSpends]);
+        }
+    }, MAX_SAPLING_PROVING_THREADS);
+
+    boost::optional<std::string> error;
+    for (size_t i = 0; i < nProofs; i++) {
+        if (vError[i] && !error) {
+            error = vError[i];
+        }
+        librustzcash_sapling_proving_ctx_merge(ctx, vCtx[i]);
+        librustzcash_sapling_proving_ctx_free(vCtx[i]);
+    }
+    return error;
+}
+
+boost::optional<std::string> TransactionBuilder::CreateSpendDescription(
+    void* ctx,
+    const SpendDescriptionInfo& spend,
+    SpendDescription& sdesc)
+{
+    auto cm = spend.note.cm();
+    auto nf = spend.note.nullifier(
+        spend.expsk.full_viewing_key(), spend.witness.position());
+    if (!cm || !nf) {
+        return std::string("Spend is invalid");
+    }
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << spend.witness.path();
+    std::vector<unsigned char> witness(ss.begin(), ss.end());
+
+    if (!librustzcash_sapling_spend_proof(
+            ctx,
+            spend.expsk.full_viewing_key().ak.begin(),
+            spend.expsk.nsk.begin(),
+            spend.note.d.data(),
+            spend.note.r.begin(),
+            spend.alpha.begin(),
+            spend.note.value(),
+            spend.anchor.begin(),
+            witness.data(),
+            sdesc.cv.begin(),
+            sdesc.rk.begin(),
+            sdesc.zkproof.data())) {
+        return std::string("Spend proof failed");
+    }
+
+    sdesc.anchor = spend.anchor;
+    sdesc.nullifier = *nf;
+    return boost::none;
+}
+
+boost::optional<std::string> TransactionBuilder::CreateOutputDescription(
+    void* ctx,
+    const OutputDescriptionInfo& output,
+    OutputDescription& odesc)
+{
+    auto cm = output.note.cm();
+    if (!cm) {
+        return std::string("Output is invalid");
+    }
+
+    libzcash::SaplingNotePlaintext notePlaintext(output.note, output.memo);
+
+    auto res = notePlaintext.encrypt(output.note.pk_d);
+    if (!res) {
+        return std::string("Failed to encrypt note");
+    }
+    auto enc = res.get();
+    auto encryptor = enc.second;
+
+    if (!librustzcash_sapling_output_proof(
+            ctx,
+            encryptor.get_esk().begin(),
+            output.note.d.data(),
+            output.note.pk_d.begin(),
+            output.note.r.begin(),
+            output.note.value(),
+            odesc.cv.begin(),
+            odesc.zkproof.begin())) {
+        return std::string("Output proof failed");
+    }
+
+    odesc.cm = *cm;
+    odesc.ephemeralKey = encryptor.get_epk();
+    odesc.encCiphertext = enc.first;
+
+    libzcash::SaplingOutgoingPlaintext outPlaintext(output.note.pk_d, encryptor.get_esk());
+    odesc.outCiphertext = outPlaintext.encrypt(
+        output.ovk,
+        odesc.cv,
+        odesc.cm,
+        encryptor);
+    return boost::none;
+}
+
 void TransactionBuilder::CreateJSDescriptions()
 {
+    jsProofWitnesses.clear();
+
     // Copy jsInputs and jsOutputs to more flexible containers
     std::deque<libzcash::JSInput> jsInputsDeque;
     for (auto jsInput : jsInputs) {
@@ -694,8 +782,11 @@ void TransactionBuilder::CreateJSDescription(
 
     uint256 esk; // payment disclosure - secret
 
-    // Generate the proof, this can take over a minute.
+    // The proof is created by ProveJoinSplits() once the whole chain of
+    // JoinSplits is known, so this only computes the notes and commitments
+    // the next JoinSplit in the chain needs.
     assert(mtx.fOverwintered && (mtx.nVersion >= SAPLING_TX_VERSION));
+    ZCJSProofWitness proofWitness;
     JSDescription jsdesc = JSDescription::Randomized(
             *sproutParams,
             mtx.joinSplitPubKey,
@@ -706,17 +797,13 @@ void TransactionBuilder::CreateJSDescription(
             outputMap,
             vpub_old,
             vpub_new,
-            true, //!this->testmode,
-            &esk); // parameter expects pointer to esk, so pass in address
-
-    {
-        auto verifier = libzcash::ProofVerifier::Strict();
-        if (!jsdesc.Verify(*sproutParams, verifier, mtx.joinSplitPubKey)) {
-            throw std::runtime_error("error verifying joinsplit");
-        }
-    }
+            false,
+            &esk, // parameter expects pointer to esk, so pass in address
+            GetRandInt,
+            &proofWitness);
 
     mtx.vJoinSplit.push_back(jsdesc);
+    jsProofWitnesses.push_back(proofWitness);
 
     // TODO: Sprout payment disclosure
 }
@@ -20,6 +20,33 @@
 
 #include <boost/optional.hpp>
 
+/**
+ * Maximum number of Sprout proofs to create at the same time. Each proof
+ * loads its own copy of the Sprout proving parameters, so this bounds the
+ * memory used while proving rather than the use of the cores.
+ */
+static const int MAX_SPROUT_PROVING_THREADS = 4;
+
+/**
+ * Maximum number of Sapling proofs to create at the same time. The Sapling
+ * proving parameters are shared, so this only keeps a transaction with many
+ * spends from taking every core.
+ */
+static const int MAX_SAPLING_PROVING_THREADS = 8;
+
+/**
+ * Create the proofs of JoinSplits that were built with computeProof = false,
+ * from the proof witnesses that were returned alongside them, and verify
+ * them. The proofs don't depend on each other (even within a chain of
+ * JoinSplits, which only needs the commitments of the previous one), so they
+ * are created in parallel. Returns false if any of them doesn't verify.
+ */
+bool ProveJoinSplits(
+    ZCJoinSplit& params,
+    const uint256& joinSplitPubKey,
+    std::vector<JSDescription>& vJoinSplit,
+    const std::vector<ZCJSProofWitness>& vProofWitnesses);
+
 struct SpendDescriptionInfo {
     libzcash::SaplingExpandedSpendingKey expsk;
     libzcash::SaplingNote note;
@@ -85,6 +112,8 @@ private:
     std::vector<libzcash::JSInput> jsInputs;
     std::vector<libzcash::JSOutput> jsOutputs;
     std::vector<TransparentInputInfo> tIns;
+    // Proof witnesses of mtx.vJoinSplit, whose proofs are created once they have all been chained
+    std::vector<ZCJSProofWitness> jsProofWitnesses;
 
     boost::optional<std::pair<uint256, libzcash::SaplingPaymentAddress>> saplingChangeAddr;
     boost::optional<libzcash::SproutPaymentAddress> sproutChangeAddr;
@@ -144,6 +173,21 @@ public:
     TransactionBuilderResult Build();
 
 private:
+    // Returns an error message if a Sapling description could not be created.
+    // Only touches the Sapling parts of mtx, so it can run alongside
+    // CreateJSDescriptions().
+    boost::optional<std::string> CreateSaplingDescriptions(void* ctx);
+
+    // Create one description on its own proving context; thread-safe.
+    static boost::optional<std::string> CreateSpendDescription(
+        void* ctx,
+        const SpendDescriptionInfo& spend,
+        SpendDescription& sdesc);
+    static boost::optional<std::string> CreateOutputDescription(
+        void* ctx,
+        const OutputDescriptionInfo& output,
+        OutputDescription& odesc);
+
     void CreateJSDescriptions();
 
     void CreateJSDescription(
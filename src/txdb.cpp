@@ -13,6 +13,10 @@
 
 #include <stdint.h>
 
+#include <algorithm>
+#include <memory>
+#include <queue>
+
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -34,10 +38,12 @@ static const char DB_BEST_SAPLING_ANCHOR = 'z';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_INDEX_BUILDER = 'I';
 
 // insightexplorer
 static const char DB_ADDRESSINDEX = 'd';
 static const char DB_ADDRESSUNSPENTINDEX = 'u';
+static const char DB_ADDRESSBALANCEINDEX = 'e';
 static const char DB_SPENTINDEX = 'p';
 static const char DB_TIMESTAMPINDEX = 'T';
 static const char DB_BLOCKHASHINDEX = 'h';
@@ -199,7 +205,14 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, size_t nInsightCacheSize) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+    if (nInsightCacheSize > 0) {
+        // The address and unspent indexes take the bulk of the writes and lookups
+        paddressdb.reset(new CDBWrapper(GetDataDir() / "blocks" / "addressindex", nInsightCacheSize * 3 / 8, fMemory, fWipe));
+        punspentdb.reset(new CDBWrapper(GetDataDir() / "blocks" / "unspentindex", nInsightCacheSize * 3 / 8, fMemory, fWipe));
+        pspentdb.reset(new CDBWrapper(GetDataDir() / "blocks" / "spentindex", nInsightCacheSize / 8, fMemory, fWipe));
+        ptimestampdb.reset(new CDBWrapper(GetDataDir() / "blocks" / "timestampindex", nInsightCacheSize / 8, fMemory, fWipe));
+    }
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -268,7 +281,19 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     return true;
 }
 
+bool CBlockTreeDB::SyncInsightIndexes() {
+    for (CDBWrapper* pdb : {paddressdb.get(), punspentdb.get(), pspentdb.get(), ptimestampdb.get()}) {
+        if (pdb && !pdb->Sync())
+            return false;
+    }
+    return true;
+}
+
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
+    // The insight indexes used to share the log of this database, so they
+    // were made durable together with the block index; keep it that way.
+    if (!SyncInsightIndexes())
+        return false;
     CDBBatch batch(*this);
     for (std::vector<std::pair<int, const CBlockFileInfo*> >::const_iterator it=fileInfo.begin(); it != fileInfo.end(); it++) {
         batch.Write(make_pair(DB_BLOCK_FILES, it->first), *it->second);
@@ -303,7 +328,7 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
 // https://github.com/bitpay/bitcoin/commit/017f548ea6d89423ef568117447e61dd5707ec42#diff-81e4f16a1b5d5b7ca25351a63d07cb80R183
 bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<CAddressUnspentDbEntry> &vect)
 {
-    CDBBatch batch(*this);
+    CDBBatch batch(UnspentDB());
     for (std::vector<CAddressUnspentDbEntry>::const_iterator it=vect.begin(); it!=vect.end(); it++) {
         if (it->second.IsNull()) {
             batch.Erase(make_pair(DB_ADDRESSUNSPENTINDEX, it->first));
@@ -311,12 +336,12 @@ bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<CAddressUnspentDb
             batch.Write(make_pair(DB_ADDRESSUNSPENTINDEX, it->first), it->second);
         }
     }
-    return WriteBatch(batch);
+    return UnspentDB().WriteBatch(batch);
 }
 
 bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type, std::vector<CAddressUnspentDbEntry> &unspentOutputs)
 {
-    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    boost::scoped_ptr<CDBIterator> pcursor(UnspentDB().NewIterator());
 
     pcursor->Seek(make_pair(DB_ADDRESSUNSPENTINDEX, CAddressIndexIteratorKey(type, addressHash)));
 
@@ -334,18 +359,173 @@ bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type, std::v
     return true;
 }
 
+bool CBlockTreeDB::ForEachAddressUnspent(
+        const std::vector<std::pair<uint160, int>>& addresses,
+        const CAddressUnspentKey* pAfter,
+        boost::function<bool(const CAddressUnspentKey&, const CAddressUnspentValue&)> visit)
+{
+    // Walk the addresses in the order their entries are stored in, so that a
+    // cursor (the last key returned) identifies where to resume.
+    std::vector<std::pair<int, uint160>> vAddresses;
+    for (const std::pair<uint160, int>& address : addresses)
+        vAddresses.push_back(std::make_pair(address.second, address.first));
+    std::sort(vAddresses.begin(), vAddresses.end());
+    vAddresses.erase(std::unique(vAddresses.begin(), vAddresses.end()), vAddresses.end());
+
+    boost::scoped_ptr<CDBIterator> pcursor(UnspentDB().NewIterator());
+    for (const std::pair<int, uint160>& address : vAddresses) {
+        const int type = address.first;
+        const uint160& addressHash = address.second;
+        if (pAfter && std::make_pair((int)pAfter->type, pAfter->hashBytes) > address)
+            continue;
+
+        if (pAfter && pAfter->type == type && pAfter->hashBytes == addressHash) {
+            pcursor->Seek(make_pair(DB_ADDRESSUNSPENTINDEX, *pAfter));
+        } else {
+            pcursor->Seek(make_pair(DB_ADDRESSUNSPENTINDEX, CAddressIndexIteratorKey(type, addressHash)));
+        }
+
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            std::pair<char,CAddressUnspentKey> key;
+            if (!(pcursor->GetKey(key) && key.first == DB_ADDRESSUNSPENTINDEX &&
+                  key.second.type == type && key.second.hashBytes == addressHash))
+                break;
+            if (pAfter && key.second.type == pAfter->type && key.second.hashBytes == pAfter->hashBytes &&
+                key.second.txhash == pAfter->txhash && key.second.index == pAfter->index) {
+                pcursor->Next();
+                continue;
+            }
+            CAddressUnspentValue nValue;
+            if (!pcursor->GetValue(nValue))
+                return error("failed to get address unspent value");
+            if (!visit(key.second, nValue))
+                return true;
+            pcursor->Next();
+        }
+    }
+    return true;
+}
+
+/**
+ * Add (nSign = 1) or subtract (nSign = -1) the address index entries in vect,
+ * which are those of one block, to the balance records of their addresses.
+ * The entries of a block are written and erased in a single batch, so if the
+ * first one is already in (respectively, already gone from) the address index
+ * the block was already counted, and nothing is done. This way reconnecting a
+ * block after an unclean shutdown doesn't count it twice, at the cost of one
+ * lookup per block.
+ */
+static void BatchUpdateAddressBalances(const CDBWrapper& db, CDBBatch& batch,
+                                       const std::vector<CAddressIndexDbEntry> &vect, int nSign)
+{
+    if (vect.empty() || db.Exists(make_pair(DB_ADDRESSINDEX, vect[0].first)) == (nSign > 0))
+        return;
+
+    std::map<CAddressIndexIteratorKey, CAddressBalanceValue> mapDeltas;
+    std::set<std::pair<CAddressIndexIteratorKey, uint256>> setTxs;
+    for (const CAddressIndexDbEntry& entry : vect) {
+        CAddressIndexIteratorKey key(entry.first.type, entry.first.hashBytes);
+        CAddressBalanceValue& delta = mapDeltas[key];
+        delta.balance += entry.second;
+        if (!entry.first.spending)
+            delta.received += entry.second;
+        if (setTxs.insert(make_pair(key, entry.first.txhash)).second)
+            delta.txCount++;
+    }
+    for (const auto& it : mapDeltas) {
+        CAddressBalanceValue value;
+        db.Read(make_pair(DB_ADDRESSBALANCEINDEX, it.first), value);
+        value.balance += nSign * it.second.balance;
+        value.received += nSign * it.second.received;
+        value.txCount += nSign * it.second.txCount;
+        if (value.IsNull()) {
+            batch.Erase(make_pair(DB_ADDRESSBALANCEINDEX, it.first));
+        } else {
+            batch.Write(make_pair(DB_ADDRESSBALANCEINDEX, it.first), value);
+        }
+    }
+}
+
 bool CBlockTreeDB::WriteAddressIndex(const std::vector<CAddressIndexDbEntry> &vect) {
-    CDBBatch batch(*this);
+    CDBBatch batch(AddressDB());
+    BatchUpdateAddressBalances(AddressDB(), batch, vect, 1);
     for (std::vector<CAddressIndexDbEntry>::const_iterator it=vect.begin(); it!=vect.end(); it++)
         batch.Write(make_pair(DB_ADDRESSINDEX, it->first), it->second);
-    return WriteBatch(batch);
+    return AddressDB().WriteBatch(batch);
 }
 
 bool CBlockTreeDB::EraseAddressIndex(const std::vector<CAddressIndexDbEntry> &vect) {
-    CDBBatch batch(*this);
+    CDBBatch batch(AddressDB());
+    BatchUpdateAddressBalances(AddressDB(), batch, vect, -1);
     for (std::vector<CAddressIndexDbEntry>::const_iterator it=vect.begin(); it!=vect.end(); it++)
         batch.Erase(make_pair(DB_ADDRESSINDEX, it->first));
-    return WriteBatch(batch);
+    return AddressDB().WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadAddressBalance(uint160 addressHash, int type, CAddressBalanceValue &value)
+{
+    value.SetNull();
+    if (!AddressDB().Exists(make_pair(DB_ADDRESSBALANCEINDEX, CAddressIndexIteratorKey(type, addressHash))))
+        return true;
+    return AddressDB().Read(make_pair(DB_ADDRESSBALANCEINDEX, CAddressIndexIteratorKey(type, addressHash)), value);
+}
+
+bool CBlockTreeDB::BuildAddressBalanceIndex()
+{
+    // The address index is sorted by address and then by height and
+    // transaction, so each address (and each of its transactions) is one run
+    // of entries.
+    boost::scoped_ptr<CDBIterator> pcursor(AddressDB().NewIterator());
+    pcursor->Seek(DB_ADDRESSINDEX);
+
+    std::unique_ptr<CDBBatch> pbatch(new CDBBatch(AddressDB()));
+    size_t nBatched = 0;
+    int64_t nAddresses = 0;
+    bool fCurrent = false;
+    CAddressIndexIteratorKey current;
+    CAddressBalanceValue value;
+    uint256 lastTx;
+    while (true) {
+        boost::this_thread::interruption_point();
+        std::pair<char,CAddressIndexKey> key;
+        bool fValid = pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_ADDRESSINDEX;
+        if (fCurrent && (!fValid || key.second.type != current.type || key.second.hashBytes != current.hashBytes)) {
+            if (!value.IsNull())
+                pbatch->Write(make_pair(DB_ADDRESSBALANCEINDEX, current), value);
+            nAddresses++;
+            if (++nBatched >= 10000) {
+                if (!AddressDB().WriteBatch(*pbatch))
+                    return error("failed to write address balance index");
+                pbatch.reset(new CDBBatch(AddressDB()));
+                nBatched = 0;
+            }
+            fCurrent = false;
+        }
+        if (!fValid)
+            break;
+        if (!fCurrent) {
+            fCurrent = true;
+            current = CAddressIndexIteratorKey(key.second.type, key.second.hashBytes);
+            value.SetNull();
+            lastTx.SetNull();
+        }
+        CAmount nValue;
+        if (!pcursor->GetValue(nValue))
+            return error("failed to get address index value");
+        value.balance += nValue;
+        if (!key.second.spending)
+            value.received += nValue;
+        if (key.second.txhash != lastTx) {
+            value.txCount++;
+            lastTx = key.second.txhash;
+        }
+        pcursor->Next();
+    }
+    if (!AddressDB().WriteBatch(*pbatch))
+        return error("failed to write address balance index");
+    LogPrintf("Built address balance index for %d addresses\n", nAddresses);
+    return true;
 }
 
 bool CBlockTreeDB::ReadAddressIndex(
@@ -353,7 +533,7 @@ bool CBlockTreeDB::ReadAddressIndex(
         std::vector<CAddressIndexDbEntry> &addressIndex,
         int start, int end)
 {
-    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    boost::scoped_ptr<CDBIterator> pcursor(AddressDB().NewIterator());
 
     if (start > 0 && end > 0) {
         pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(type, addressHash, start)));
@@ -377,12 +557,123 @@ bool CBlockTreeDB::ReadAddressIndex(
     return true;
 }
 
+namespace {
+
+/** One address's entries in the address index, read lazily in key order. */
+struct CAddressIndexStream
+{
+    boost::scoped_ptr<CDBIterator> pcursor;
+    CAddressIndexKey key;
+    CAmount nValue;
+};
+
+/** Orders streams so that the priority queue yields the smallest current key. */
+struct CAddressIndexStreamCompare
+{
+    const std::vector<std::unique_ptr<CAddressIndexStream>>& streams;
+    explicit CAddressIndexStreamCompare(const std::vector<std::unique_ptr<CAddressIndexStream>>& streamsIn) : streams(streamsIn) {}
+    bool operator()(size_t a, size_t b) const {
+        return CAddressIndexKeyCompareByHeight()(streams[b]->key, streams[a]->key);
+    }
+};
+
+}
+
+/**
+ * Move the stream to its next entry that comes after pAfter (if given) and is
+ * still within the address and height range. Returns false when the stream is
+ * exhausted; fError is set if an entry could not be read.
+ */
+static bool AdvanceAddressIndexStream(CAddressIndexStream& stream, int type, const uint160& addressHash,
+                                      int end, const CAddressIndexKey* pAfter, bool& fError)
+{
+    while (stream.pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char,CAddressIndexKey> key;
+        if (!(stream.pcursor->GetKey(key) && key.first == DB_ADDRESSINDEX &&
+              key.second.type == type && key.second.hashBytes == addressHash))
+            return false;
+        if (end > 0 && key.second.blockHeight > end)
+            return false;
+        if (pAfter && !CAddressIndexKeyCompareByHeight()(*pAfter, key.second)) {
+            stream.pcursor->Next();
+            continue;
+        }
+        if (!stream.pcursor->GetValue(stream.nValue)) {
+            fError = true;
+            return false;
+        }
+        stream.key = key.second;
+        stream.pcursor->Next();
+        return true;
+    }
+    return false;
+}
+
+bool CBlockTreeDB::ForEachAddressIndex(
+        const std::vector<std::pair<uint160, int>>& addresses, int start, int end,
+        const CAddressIndexKey* pAfter,
+        boost::function<bool(const CAddressIndexKey&, CAmount)> visit)
+{
+    std::vector<std::pair<int, uint160>> vAddresses;
+    for (const std::pair<uint160, int>& address : addresses)
+        vAddresses.push_back(std::make_pair(address.second, address.first));
+    std::sort(vAddresses.begin(), vAddresses.end());
+    vAddresses.erase(std::unique(vAddresses.begin(), vAddresses.end()), vAddresses.end());
+
+    // As in ReadAddressIndex, the height range only applies when both ends are given.
+    if (start <= 0 || end <= 0)
+        start = end = 0;
+
+    std::vector<std::unique_ptr<CAddressIndexStream>> streams;
+    CAddressIndexStreamCompare comp(streams);
+    std::priority_queue<size_t, std::vector<size_t>, CAddressIndexStreamCompare> queue(comp);
+    bool fError = false;
+    for (const std::pair<int, uint160>& address : vAddresses) {
+        const int type = address.first;
+        const uint160& addressHash = address.second;
+        streams.emplace_back(new CAddressIndexStream());
+        CAddressIndexStream& stream = *streams.back();
+        stream.pcursor.reset(AddressDB().NewIterator());
+        if (pAfter && pAfter->blockHeight >= start) {
+            CAddressIndexKey seekKey(*pAfter);
+            seekKey.type = type;
+            seekKey.hashBytes = addressHash;
+            stream.pcursor->Seek(make_pair(DB_ADDRESSINDEX, seekKey));
+        } else if (start > 0) {
+            stream.pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(type, addressHash, start)));
+        } else {
+            stream.pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorKey(type, addressHash)));
+        }
+        if (AdvanceAddressIndexStream(stream, type, addressHash, end, pAfter, fError))
+            queue.push(streams.size() - 1);
+        if (fError)
+            break;
+    }
+
+    while (!fError && !queue.empty()) {
+        size_t i = queue.top();
+        queue.pop();
+        CAddressIndexStream& stream = *streams[i];
+        if (!visit(stream.key, stream.nValue))
+            break;
+        int type = stream.key.type;
+        uint160 addressHash = stream.key.hashBytes;
+        if (AdvanceAddressIndexStream(stream, type, addressHash, end, NULL, fError))
+            queue.push(i);
+    }
+
+    if (fError)
+        return error("failed to get address index value");
+    return true;
+}
+
 bool CBlockTreeDB::ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value) {
-    return Read(make_pair(DB_SPENTINDEX, key), value);
+    return SpentDB().Read(make_pair(DB_SPENTINDEX, key), value);
 }
 
 bool CBlockTreeDB::UpdateSpentIndex(const std::vector<CSpentIndexDbEntry> &vect) {
-    CDBBatch batch(*this);
+    CDBBatch batch(SpentDB());
     for (std::vector<CSpentIndexDbEntry>::const_iterator it=vect.begin(); it!=vect.end(); it++) {
         if (it->second.IsNull()) {
             batch.Erase(make_pair(DB_SPENTINDEX, it->first));
@@ -390,19 +681,19 @@ bool CBlockTreeDB::UpdateSpentIndex(const std::vector<CSpentIndexDbEntry> &vect)
             batch.Write(make_pair(DB_SPENTINDEX, it->first), it->second);
         }
     }
-    return WriteBatch(batch);
+    return SpentDB().WriteBatch(batch);
 }
 
 bool CBlockTreeDB::WriteTimestampIndex(const CTimestampIndexKey &timestampIndex) {
-    CDBBatch batch(*this);
+    CDBBatch batch(TimestampDB());
     batch.Write(make_pair(DB_TIMESTAMPINDEX, timestampIndex), 0);
-    return WriteBatch(batch);
+    return TimestampDB().WriteBatch(batch);
 }
 
 bool CBlockTreeDB::ReadTimestampIndex(unsigned int high, unsigned int low,
     const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes)
 {
-    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    boost::scoped_ptr<CDBIterator> pcursor(TimestampDB().NewIterator());
 
     pcursor->Seek(make_pair(DB_TIMESTAMPINDEX, CTimestampIndexIteratorKey(low)));
 
@@ -428,15 +719,15 @@ bool CBlockTreeDB::ReadTimestampIndex(unsigned int high, unsigned int low,
 bool CBlockTreeDB::WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex,
     const CTimestampBlockIndexValue &logicalts)
 {
-    CDBBatch batch(*this);
+    CDBBatch batch(TimestampDB());
     batch.Write(make_pair(DB_BLOCKHASHINDEX, blockhashIndex), logicalts);
-    return WriteBatch(batch);
+    return TimestampDB().WriteBatch(batch);
 }
 
 bool CBlockTreeDB::ReadTimestampBlockIndex(const uint256 &hash, unsigned int &ltimestamp)
 {
     CTimestampBlockIndexValue(lts);
-    if (!Read(std::make_pair(DB_BLOCKHASHINDEX, hash), lts))
+    if (!TimestampDB().Read(std::make_pair(DB_BLOCKHASHINDEX, hash), lts))
         return false;
 
     ltimestamp = lts.ltimestamp;
@@ -444,6 +735,62 @@ bool CBlockTreeDB::ReadTimestampBlockIndex(const uint256 &hash, unsigned int &lt
 }
 // END insightexplorer
 
+/**
+ * Move the entries with the given prefix from one database to another, in
+ * batches. Each batch is synced to the new database before it is erased from
+ * the old one, so an interrupted move, even by a crash, can be run again.
+ */
+template <typename K, typename V>
+static bool MoveIndexEntries(CDBWrapper& from, CDBWrapper& to, char prefix)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(from.NewIterator());
+    pcursor->Seek(prefix);
+
+    std::unique_ptr<CDBBatch> pbatchWrite(new CDBBatch(to));
+    std::unique_ptr<CDBBatch> pbatchErase(new CDBBatch(from));
+    size_t nBatched = 0;
+    int64_t nMoved = 0;
+    while (true) {
+        boost::this_thread::interruption_point();
+        std::pair<char,K> key;
+        bool fValid = pcursor->Valid() && pcursor->GetKey(key) && key.first == prefix;
+        if (nBatched > 0 && (!fValid || nBatched >= 10000)) {
+            if (!to.WriteBatch(*pbatchWrite, true) || !from.WriteBatch(*pbatchErase))
+                return error("%s: failed to move index entries", __func__);
+            pbatchWrite.reset(new CDBBatch(to));
+            pbatchErase.reset(new CDBBatch(from));
+            nBatched = 0;
+            if (fValid && nMoved % 1000000 == 0)
+                LogPrintf("Moved %d '%c' index entries to their own database so far\n", nMoved, prefix);
+        }
+        if (!fValid)
+            break;
+        V value;
+        if (!pcursor->GetValue(value))
+            return error("%s: failed to read index value", __func__);
+        pbatchWrite->Write(key, value);
+        pbatchErase->Erase(key);
+        nBatched++;
+        nMoved++;
+        pcursor->Next();
+    }
+    if (nMoved > 0)
+        LogPrintf("Moved %d '%c' index entries to their own database\n", nMoved, prefix);
+    return true;
+}
+
+bool CBlockTreeDB::MoveInsightIndexes()
+{
+    if (!paddressdb)
+        return true;
+    return MoveIndexEntries<CAddressIndexKey, CAmount>(*this, *paddressdb, DB_ADDRESSINDEX) &&
+           MoveIndexEntries<CAddressIndexIteratorKey, CAddressBalanceValue>(*this, *paddressdb, DB_ADDRESSBALANCEINDEX) &&
+           MoveIndexEntries<CAddressUnspentKey, CAddressUnspentValue>(*this, *punspentdb, DB_ADDRESSUNSPENTINDEX) &&
+           MoveIndexEntries<CSpentIndexKey, CSpentIndexValue>(*this, *pspentdb, DB_SPENTINDEX) &&
+           MoveIndexEntries<CTimestampIndexKey, int>(*this, *ptimestampdb, DB_TIMESTAMPINDEX) &&
+           MoveIndexEntries<CTimestampBlockIndexKey, CTimestampBlockIndexValue>(*this, *ptimestampdb, DB_BLOCKHASHINDEX);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
 }
@@ -456,6 +803,18 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+bool CBlockTreeDB::WriteIndexBuilderBest(const std::string &name, const uint256 &hashBlock) {
+    return Write(std::make_pair(DB_INDEX_BUILDER, name), hashBlock);
+}
+
+bool CBlockTreeDB::ReadIndexBuilderBest(const std::string &name, uint256 &hashBlock) {
+    return Read(std::make_pair(DB_INDEX_BUILDER, name), hashBlock);
+}
+
+bool CBlockTreeDB::EraseIndexBuilderBest(const std::string &name) {
+    return Erase(std::make_pair(DB_INDEX_BUILDER, name));
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
 {
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
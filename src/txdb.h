@@ -11,6 +11,7 @@
 #include "chain.h"
 
 #include <map>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
@@ -25,6 +26,7 @@ struct CAddressUnspentValue;
 struct CAddressIndexKey;
 struct CAddressIndexIteratorKey;
 struct CAddressIndexIteratorHeightKey;
+struct CAddressBalanceValue;
 struct CSpentIndexKey;
 struct CSpentIndexValue;
 struct CTimestampIndexKey;
@@ -98,15 +100,37 @@ public:
     bool GetStats(CCoinsStats &stats) const;
 };
 
-/** Access to the block database (blocks/index/) */
+/**
+ * Access to the block database (blocks/index/)
+ *
+ * Given a cache budget for them, the insight explorer indexes are kept in
+ * databases of their own (blocks/addressindex/, blocks/unspentindex/,
+ * blocks/spentindex/ and blocks/timestampindex/), so that their write and
+ * compaction traffic doesn't hold up block index flushes. Otherwise they
+ * live in the block database. Either way ConnectBlock and DisconnectBlock
+ * still write them synchronously (see ConnectBlock).
+ */
 class CBlockTreeDB : public CDBWrapper
 {
 public:
-    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, size_t nInsightCacheSize = 0);
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
+
+    // insightexplorer
+    std::unique_ptr<CDBWrapper> paddressdb;   //!< address index and balances
+    std::unique_ptr<CDBWrapper> punspentdb;   //!< address unspent index
+    std::unique_ptr<CDBWrapper> pspentdb;     //!< spent index
+    std::unique_ptr<CDBWrapper> ptimestampdb; //!< timestamp and block hash indexes
+
+    CDBWrapper& AddressDB() { return paddressdb ? *paddressdb : *this; }
+    CDBWrapper& UnspentDB() { return punspentdb ? *punspentdb : *this; }
+    CDBWrapper& SpentDB() { return pspentdb ? *pspentdb : *this; }
+    CDBWrapper& TimestampDB() { return ptimestampdb ? *ptimestampdb : *this; }
 public:
+    //! Make the writes to the separate insight explorer databases durable
+    bool SyncInsightIndexes();
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
     bool EraseBatchSync(const std::vector<const CBlockIndex*>& blockinfo);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
@@ -122,6 +146,24 @@ public:
     bool WriteAddressIndex(const std::vector<CAddressIndexDbEntry> &vect);
     bool EraseAddressIndex(const std::vector<CAddressIndexDbEntry> &vect);
     bool ReadAddressIndex(uint160 addressHash, int type, std::vector<CAddressIndexDbEntry> &addressIndex, int start = 0, int end = 0);
+    bool ReadAddressBalance(uint160 addressHash, int type, CAddressBalanceValue &value);
+    /**
+     * Call visit for the address index entries of the given addresses between
+     * heights start and end (0 for no bound), merged in CAddressIndexKeyCompareByHeight
+     * order and starting after pAfter if given, until visit returns false.
+     */
+    bool ForEachAddressIndex(const std::vector<std::pair<uint160, int>>& addresses, int start, int end,
+                             const CAddressIndexKey* pAfter,
+                             boost::function<bool(const CAddressIndexKey&, CAmount)> visit);
+    /**
+     * Call visit for the unspent outputs of the given addresses, one address
+     * after another in index order and starting after pAfter if given, until
+     * visit returns false.
+     */
+    bool ForEachAddressUnspent(const std::vector<std::pair<uint160, int>>& addresses,
+                               const CAddressUnspentKey* pAfter,
+                               boost::function<bool(const CAddressUnspentKey&, const CAddressUnspentValue&)> visit);
+    bool BuildAddressBalanceIndex();
     bool ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
     bool UpdateSpentIndex(const std::vector<CSpentIndexDbEntry> &vect);
     bool WriteTimestampIndex(const CTimestampIndexKey &timestampIndex);
@@ -130,10 +172,16 @@ public:
     bool WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex,
             const CTimestampBlockIndexValue &logicalts);
     bool ReadTimestampBlockIndex(const uint256 &hash, unsigned int &logicalTS);
+    //! Move insight explorer index entries written by earlier versions out of the block database
+    bool MoveInsightIndexes();
     // END insightexplorer
 
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    //! The last block a background index builder (see indexbuilder.h) has indexed
+    bool WriteIndexBuilderBest(const std::string &name, const uint256 &hashBlock);
+    bool ReadIndexBuilderBest(const std::string &name, uint256 &hashBlock);
+    bool EraseIndexBuilderBest(const std::string &name);
     bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
 };
 
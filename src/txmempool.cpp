@@ -21,7 +21,7 @@ using namespace std;
 
 CTxMemPoolEntry::CTxMemPoolEntry():
     nFee(0), nTxSize(0), nModSize(0), nUsageSize(0), nTime(0), dPriority(0.0),
-    hadNoDependencies(false), spendsCoinbase(false)
+    hadNoDependencies(false), spendsCoinbase(false), lockTimeDependent(false)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
@@ -38,6 +38,16 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
     nModSize = tx.CalculateModifiedSize(nTxSize);
     nUsageSize = RecursiveDynamicUsage(tx);
     feeRate = CFeeRate(nFee, nTxSize);
+
+    lockTimeDependent = false;
+    if (tx.nLockTime != 0) {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (!txin.IsFinal()) {
+                lockTimeDependent = true;
+                break;
+            }
+        }
+    }
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -55,7 +65,7 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
 }
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) :
-    nTransactionsUpdated(0)
+    nTransactionsUpdated(0), nSnapshotEpoch(0)
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
@@ -63,6 +73,7 @@ CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) :
     nCheckFrequency = 0;
 
     minerPolicyEstimator = new CBlockPolicyEstimator(_minRelayFee);
+    snapshot = std::make_shared<CMempoolSnapshot>();
 }
 
 CTxMemPool::~CTxMemPool()
@@ -76,12 +87,10 @@ void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
 {
     LOCK(cs);
 
-    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hashTx, 0));
-
-    // iterate over all COutPoints in mapNextTx whose hash equals the provided hashTx
-    while (it != mapNextTx.end() && it->first.hash == hashTx) {
-        coins.Spend(it->first.n); // and remove those outputs from coins
-        it++;
+    // remove the outputs spent by transactions in mapNextTx from coins
+    for (unsigned int n = 0; n < coins.vout.size(); n++) {
+        if (mapNextTx.count(COutPoint(hashTx, n)))
+            coins.Spend(n);
     }
 }
 
@@ -97,6 +106,59 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
+void CTxMemPool::SetChainHeight(int nHeight)
+{
+    LOCK(cs);
+    nChainHeight = nHeight;
+    nSnapshotEpoch++;
+}
+
+std::shared_ptr<const CMempoolSnapshot> CTxMemPool::GetSnapshot()
+{
+    if (std::atomic_load(&snapshot)->nEpoch != nSnapshotEpoch.load())
+        UpdateSnapshot();
+    return std::atomic_load(&snapshot);
+}
+
+void CTxMemPool::UpdateSnapshot(bool fForce)
+{
+    LOCK(cs);
+    std::shared_ptr<const CMempoolSnapshot> current = std::atomic_load(&snapshot);
+    if (current->nEpoch == nSnapshotEpoch.load())
+        return;
+    int64_t nNow = GetTimeMillis();
+    if (!fForce && mapTx.size() > MEMPOOL_SNAPSHOT_EAGER_TXS && nNow - nLastSnapshotTime < MEMPOOL_SNAPSHOT_INTERVAL)
+        return;
+
+    std::shared_ptr<CMempoolSnapshot> next = std::make_shared<CMempoolSnapshot>();
+    next->nEpoch = nSnapshotEpoch.load();
+    next->nChainHeight = nChainHeight;
+    next->nTotalTxSize = totalTxSize;
+    next->nUsage = DynamicMemoryUsage();
+    next->vEntries.reserve(mapTx.size());
+    for (const CTxMemPoolEntry& e : mapTx) {
+        const CTransaction& tx = e.GetTx();
+        CMempoolSnapshotEntry entry;
+        entry.hash = tx.GetHash();
+        entry.nTxSize = e.GetTxSize();
+        entry.nFee = e.GetFee();
+        entry.nTime = e.GetTime();
+        entry.nHeight = e.GetHeight();
+        entry.dStartingPriority = e.GetPriority(e.GetHeight());
+        entry.dCurrentPriority = e.GetPriority(nChainHeight);
+        for (const CTxIn& txin : tx.vin) {
+            if (mapTx.count(txin.prevout.hash) &&
+                std::find(entry.vDepends.begin(), entry.vDepends.end(), txin.prevout.hash) == entry.vDepends.end())
+                entry.vDepends.push_back(txin.prevout.hash);
+        }
+        next->vEntries.push_back(std::move(entry));
+    }
+    next->mapAddress = mapAddress;
+
+    std::atomic_store(&snapshot, std::shared_ptr<const CMempoolSnapshot>(next));
+    nLastSnapshotTime = nNow;
+}
+
 
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate)
 {
@@ -115,11 +177,14 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
         BOOST_FOREACH(const uint256 &nf, joinsplit.nullifiers) {
             mapSproutNullifiers[nf] = &tx;
         }
+        mapSproutAnchors[joinsplit.anchor].insert(hash);
     }
     for (const SpendDescription &spendDescription : tx.vShieldedSpend) {
         mapSaplingNullifiers[spendDescription.nullifier] = &tx;
+        mapSaplingAnchors[spendDescription.anchor].insert(hash);
     }
     nTransactionsUpdated++;
+    nSnapshotEpoch++;
     totalTxSize += entry.GetTxSize();
     cachedInnerUsage += entry.DynamicMemoryUsage();
     minerPolicyEstimator->processTransaction(entry, fCurrentEstimate);
@@ -127,11 +192,26 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     return true;
 }
 
+void CTxMemPool::addAddressEntry(const CMempoolAddressKey& key, const CMempoolAddressEntry& entry,
+                                 std::vector<CMempoolAddressKey>& inserted)
+{
+    AssertLockHeld(cs);
+    CMempoolAddressBucket& bucket = mapAddress[key];
+    cachedIndexUsage -= memusage::DynamicUsage(bucket);
+    CMempoolAddressTxEntries& txEntries = bucket[entry.txhash];
+    cachedIndexUsage -= memusage::DynamicUsage(txEntries);
+    // The first entry of the transaction for this address records the key
+    if (txEntries.empty())
+        inserted.push_back(key);
+    txEntries.push_back(entry);
+    cachedIndexUsage += memusage::DynamicUsage(bucket) + memusage::DynamicUsage(txEntries);
+}
+
 void CTxMemPool::addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view)
 {
     LOCK(cs);
     const CTransaction& tx = entry.GetTx();
-    std::vector<CMempoolAddressDeltaKey> inserted;
+    std::vector<CMempoolAddressKey> inserted;
 
     uint256 txhash = tx.GetHash();
     for (unsigned int j = 0; j < tx.vin.size(); j++) {
@@ -140,10 +220,9 @@ void CTxMemPool::addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewC
         CScript::ScriptType type = prevout.scriptPubKey.GetType();
         if (type == CScript::UNKNOWN)
             continue;
-        CMempoolAddressDeltaKey key(type, prevout.scriptPubKey.AddressHash(), txhash, j, 1);
+        CMempoolAddressKey key(prevout.scriptPubKey.AddressHash(), type);
         CMempoolAddressDelta delta(entry.GetTime(), prevout.nValue * -1, input.prevout.hash, input.prevout.n);
-        mapAddress.insert(make_pair(key, delta));
-        inserted.push_back(key);
+        addAddressEntry(key, CMempoolAddressEntry(txhash, j, 1, delta), inserted);
     }
 
     for (unsigned int j = 0; j < tx.vout.size(); j++) {
@@ -151,40 +230,74 @@ void CTxMemPool::addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewC
         CScript::ScriptType type = out.scriptPubKey.GetType();
         if (type == CScript::UNKNOWN)
             continue;
-        CMempoolAddressDeltaKey key(type, out.scriptPubKey.AddressHash(), txhash, j, 0);
-        mapAddress.insert(make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
-        inserted.push_back(key);
+        CMempoolAddressKey key(out.scriptPubKey.AddressHash(), type);
+        addAddressEntry(key, CMempoolAddressEntry(txhash, j, 0, CMempoolAddressDelta(entry.GetTime(), out.nValue)), inserted);
     }
 
+    cachedIndexUsage += memusage::DynamicUsage(inserted);
     mapAddressInserted.insert(make_pair(txhash, inserted));
+    nSnapshotEpoch++;
 }
 
-// START insightexplorer
-void CTxMemPool::getAddressIndex(
+static void LookupAddressIndex(
+    const CMempoolAddressMap& mapAddress,
     const std::vector<std::pair<uint160, int>>& addresses,
     std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>>& results)
 {
-    LOCK(cs);
     for (const auto& it : addresses) {
-        auto ait = mapAddress.lower_bound(CMempoolAddressDeltaKey(it.second, it.first));
-        while (ait != mapAddress.end() && (*ait).first.addressBytes == it.first && (*ait).first.type == it.second) {
-            results.push_back(*ait);
-            ait++;
+        auto ait = mapAddress.find(it);
+        if (ait == mapAddress.end())
+            continue;
+        for (const auto& txEntries : ait->second) {
+            for (const CMempoolAddressEntry& entry : txEntries.second) {
+                results.push_back(std::make_pair(
+                    CMempoolAddressDeltaKey(it.second, it.first, entry.txhash, entry.index, entry.spending),
+                    entry.delta));
+            }
         }
     }
 }
 
+void CMempoolSnapshot::getAddressIndex(
+    const std::vector<std::pair<uint160, int>>& addresses,
+    std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>>& results) const
+{
+    LookupAddressIndex(mapAddress, addresses, results);
+}
+
+// START insightexplorer
+void CTxMemPool::getAddressIndex(
+    const std::vector<std::pair<uint160, int>>& addresses,
+    std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>>& results)
+{
+    LOCK(cs);
+    LookupAddressIndex(mapAddress, addresses, results);
+}
+
 void CTxMemPool::removeAddressIndex(const uint256& txhash)
 {
     LOCK(cs);
     auto it = mapAddressInserted.find(txhash);
 
     if (it != mapAddressInserted.end()) {
-        std::vector<CMempoolAddressDeltaKey> keys = it->second;
-        for (const auto& mit : keys) {
-            mapAddress.erase(mit);
+        for (const CMempoolAddressKey& key : it->second) {
+            auto ait = mapAddress.find(key);
+            if (ait == mapAddress.end())
+                continue;
+            CMempoolAddressBucket& bucket = ait->second;
+            auto bit = bucket.find(txhash);
+            if (bit == bucket.end())
+                continue;
+            cachedIndexUsage -= memusage::DynamicUsage(bucket) + memusage::DynamicUsage(bit->second);
+            bucket.erase(bit);
+            if (bucket.empty())
+                mapAddress.erase(ait);
+            else
+                cachedIndexUsage += memusage::DynamicUsage(bucket);
         }
+        cachedIndexUsage -= memusage::DynamicUsage(it->second);
         mapAddressInserted.erase(it);
+        nSnapshotEpoch++;
     }
 }
 
@@ -205,13 +318,14 @@ void CTxMemPool::addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCac
         mapSpent.insert(make_pair(key, value));
         inserted.push_back(key);
     }
+    cachedIndexUsage += memusage::DynamicUsage(inserted);
     mapSpentInserted.insert(make_pair(txhash, inserted));
 }
 
 bool CTxMemPool::getSpentIndex(const CSpentIndexKey &key, CSpentIndexValue &value)
 {
     LOCK(cs);
-    std::map<CSpentIndexKey, CSpentIndexValue, CSpentIndexKeyCompare>::iterator it = mapSpent.find(key);
+    auto it = mapSpent.find(key);
     if (it != mapSpent.end()) {
         value = it->second;
         return true;
@@ -225,15 +339,25 @@ void CTxMemPool::removeSpentIndex(const uint256 txhash)
     auto it = mapSpentInserted.find(txhash);
 
     if (it != mapSpentInserted.end()) {
-        std::vector<CSpentIndexKey> keys = (*it).second;
-        for (std::vector<CSpentIndexKey>::iterator mit = keys.begin(); mit != keys.end(); mit++) {
-            mapSpent.erase(*mit);
+        for (const CSpentIndexKey& key : it->second) {
+            mapSpent.erase(key);
         }
+        cachedIndexUsage -= memusage::DynamicUsage(it->second);
         mapSpentInserted.erase(it);
     }
 }
 // END insightexplorer
 
+static void EraseAnchorSpend(std::map<uint256, std::set<uint256>>& mapAnchors, const uint256& anchor, const uint256& hash)
+{
+    std::map<uint256, std::set<uint256>>::iterator it = mapAnchors.find(anchor);
+    if (it != mapAnchors.end()) {
+        it->second.erase(hash);
+        if (it->second.empty())
+            mapAnchors.erase(it);
+    }
+}
+
 void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& removed, bool fRecursive)
 {
     // Remove transaction from memory pool
@@ -247,7 +371,7 @@ void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& rem
             // happen during chain re-orgs if origTx isn't re-accepted into
             // the mempool for any reason.
             for (unsigned int i = 0; i < origTx.vout.size(); i++) {
-                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
+                auto it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
                 if (it == mapNextTx.end())
                     continue;
                 txToRemove.push_back(it->second.ptx->GetHash());
@@ -262,7 +386,7 @@ void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& rem
             const CTransaction& tx = mapTx.find(hash)->GetTx();
             if (fRecursive) {
                 for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+                    auto it = mapNextTx.find(COutPoint(hash, i));
                     if (it == mapNextTx.end())
                         continue;
                     txToRemove.push_back(it->second.ptx->GetHash());
@@ -275,15 +399,18 @@ void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& rem
                 BOOST_FOREACH(const uint256& nf, joinsplit.nullifiers) {
                     mapSproutNullifiers.erase(nf);
                 }
+                EraseAnchorSpend(mapSproutAnchors, joinsplit.anchor, hash);
             }
             for (const SpendDescription &spendDescription : tx.vShieldedSpend) {
                 mapSaplingNullifiers.erase(spendDescription.nullifier);
+                EraseAnchorSpend(mapSaplingAnchors, spendDescription.anchor, hash);
             }
             removed.push_back(tx);
             totalTxSize -= mapTx.find(hash)->GetTxSize();
             cachedInnerUsage -= mapTx.find(hash)->DynamicMemoryUsage();
             mapTx.erase(hash);
             nTransactionsUpdated++;
+            nSnapshotEpoch++;
             minerPolicyEstimator->removeTx(hash);
 
             // insightexplorer
@@ -300,10 +427,13 @@ void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& rem
 
 void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight, int flags)
 {
-    // Remove transactions spending a coinbase which are now immature and no-longer-final transactions
+    // Remove transactions spending a coinbase which are now immature and no-longer-final transactions.
+    // Only entries that spend a coinbase or are time-locked can be affected.
     LOCK(cs);
     list<CTransaction> transactionsToRemove;
-    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    typedef indexed_transaction_set::index<reorg_sensitive>::type reorg_index;
+    std::pair<reorg_index::const_iterator, reorg_index::const_iterator> range = mapTx.get<reorg_sensitive>().equal_range(true);
+    for (reorg_index::const_iterator it = range.first; it != range.second; it++) {
         const CTransaction& tx = it->GetTx();
         if (!CheckFinalTx(tx, flags)) {
             transactionsToRemove.push_back(tx);
@@ -335,31 +465,24 @@ void CTxMemPool::removeWithAnchor(const uint256 &invalidRoot, ShieldedType type)
     // from that root -- almost as though they were spending coinbases
     // which are no longer valid to spend due to coinbase maturity.
     LOCK(cs);
-    list<CTransaction> transactionsToRemove;
-
-    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
-        const CTransaction& tx = it->GetTx();
-        switch (type) {
-            case SPROUT:
-                BOOST_FOREACH(const JSDescription& joinsplit, tx.vJoinSplit) {
-                    if (joinsplit.anchor == invalidRoot) {
-                        transactionsToRemove.push_back(tx);
-                        break;
-                    }
-                }
-            break;
-            case SAPLING:
-                BOOST_FOREACH(const SpendDescription& spendDescription, tx.vShieldedSpend) {
-                    if (spendDescription.anchor == invalidRoot) {
-                        transactionsToRemove.push_back(tx);
-                        break;
-                    }
-                }
+    const std::map<uint256, std::set<uint256>>* mapAnchors;
+    switch (type) {
+        case SPROUT:
+            mapAnchors = &mapSproutAnchors;
             break;
-            default:
-                throw runtime_error("Unknown shielded type");
+        case SAPLING:
+            mapAnchors = &mapSaplingAnchors;
             break;
-        }
+        default:
+            throw runtime_error("Unknown shielded type");
+    }
+
+    std::map<uint256, std::set<uint256>>::const_iterator itAnchor = mapAnchors->find(invalidRoot);
+    if (itAnchor == mapAnchors->end())
+        return;
+    list<CTransaction> transactionsToRemove;
+    BOOST_FOREACH(const uint256& hash, itAnchor->second) {
+        transactionsToRemove.push_back(mapTx.find(hash)->GetTx());
     }
 
     BOOST_FOREACH(const CTransaction& tx, transactionsToRemove) {
@@ -368,41 +491,66 @@ void CTxMemPool::removeWithAnchor(const uint256 &invalidRoot, ShieldedType type)
     }
 }
 
-void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed)
+bool CTxMemPool::findConflicts(const CTransaction& tx, std::vector<uint256>* pvConflicts) const
 {
-    // Remove transactions which depend on inputs of tx, recursively
-    list<CTransaction> result;
-    LOCK(cs);
-    BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
-        if (it != mapNextTx.end()) {
-            const CTransaction &txConflict = *it->second.ptx;
-            if (txConflict != tx)
-            {
-                remove(txConflict, removed, true);
-            }
+    AssertLockHeld(cs);
+    const uint256& hash = tx.GetHash();
+    bool fConflict = false;
+    auto found = [&](const CTransaction* ptxConflict) {
+        if (ptxConflict->GetHash() == hash)
+            return false;
+        fConflict = true;
+        if (!pvConflicts)
+            return true;
+        pvConflicts->push_back(ptxConflict->GetHash());
+        return false;
+    };
+
+    for (const CTxIn& txin : tx.vin) {
+        auto it = mapNextTx.find(txin.prevout);
+        if (it != mapNextTx.end() && found(it->second.ptx))
+            return true;
+    }
+    for (const JSDescription& joinsplit : tx.vJoinSplit) {
+        for (const uint256& nf : joinsplit.nullifiers) {
+            auto it = mapSproutNullifiers.find(nf);
+            if (it != mapSproutNullifiers.end() && found(it->second))
+                return true;
         }
     }
-
-    BOOST_FOREACH(const JSDescription &joinsplit, tx.vJoinSplit) {
-        BOOST_FOREACH(const uint256 &nf, joinsplit.nullifiers) {
-            std::map<uint256, const CTransaction*>::iterator it = mapSproutNullifiers.find(nf);
-            if (it != mapSproutNullifiers.end()) {
-                const CTransaction &txConflict = *it->second;
-                if (txConflict != tx) {
-                    remove(txConflict, removed, true);
-                }
-            }
-        }
+    for (const SpendDescription& spendDescription : tx.vShieldedSpend) {
+        auto it = mapSaplingNullifiers.find(spendDescription.nullifier);
+        if (it != mapSaplingNullifiers.end() && found(it->second))
+            return true;
     }
-    for (const SpendDescription &spendDescription : tx.vShieldedSpend) {
-        std::map<uint256, const CTransaction*>::iterator it = mapSaplingNullifiers.find(spendDescription.nullifier);
-        if (it != mapSaplingNullifiers.end()) {
-            const CTransaction &txConflict = *it->second;
-            if (txConflict != tx) {
-                remove(txConflict, removed, true);
-            }
-        }
+    return fConflict;
+}
+
+bool CTxMemPool::HasConflicts(const CTransaction& tx) const
+{
+    LOCK(cs);
+    return findConflicts(tx, NULL);
+}
+
+void CTxMemPool::GetConflicts(const CTransaction& tx, std::vector<uint256>& vConflicts) const
+{
+    LOCK(cs);
+    findConflicts(tx, &vConflicts);
+}
+
+void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed)
+{
+    // Remove transactions which depend on inputs of tx, recursively
+    LOCK(cs);
+    std::vector<uint256> vConflicts;
+    findConflicts(tx, &vConflicts);
+    for (const uint256& hash : vConflicts) {
+        // An earlier conflict may already have removed this one as a descendant
+        indexed_transaction_set::const_iterator it = mapTx.find(hash);
+        if (it == mapTx.end())
+            continue;
+        const CTransaction txConflict = it->GetTx();
+        remove(txConflict, removed, true);
     }
 }
 
@@ -411,7 +559,11 @@ void CTxMemPool::removeExpired(unsigned int nBlockHeight)
     // Remove expired txs from the mempool
     LOCK(cs);
     list<CTransaction> transactionsToRemove;
-    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++)
+    // Entries with an expiry height of 0 never expire
+    typedef indexed_transaction_set::index<expiry_height>::type expiry_index;
+    const expiry_index& index = mapTx.get<expiry_height>();
+    for (expiry_index::const_iterator it = index.upper_bound(0);
+         it != index.end() && it->GetTx().nExpiryHeight < nBlockHeight; it++)
     {
         const CTransaction& tx = it->GetTx();
         if (IsExpiredTx(tx, nBlockHeight)) {
@@ -479,9 +631,19 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapSproutNullifiers.clear();
+    mapSaplingNullifiers.clear();
+    mapSproutAnchors.clear();
+    mapSaplingAnchors.clear();
+    mapAddress.clear();
+    mapAddressInserted.clear();
+    mapSpent.clear();
+    mapSpentInserted.clear();
+    cachedIndexUsage = 0;
     totalTxSize = 0;
     cachedInnerUsage = 0;
     ++nTransactionsUpdated;
+    ++nSnapshotEpoch;
 }
 
 void CTxMemPool::check(const CCoinsViewCache *pcoins) const
@@ -520,7 +682,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 assert(coins && coins->IsAvailable(txin.prevout.n));
             }
             // Check whether its inputs are marked in mapNextTx.
-            std::map<COutPoint, CInPoint>::const_iterator it3 = mapNextTx.find(txin.prevout);
+            auto it3 = mapNextTx.find(txin.prevout);
             assert(it3 != mapNextTx.end());
             assert(it3->second.ptx == &tx);
             assert(it3->second.n == i);
@@ -582,7 +744,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             stepsSinceLastRemove = 0;
         }
     }
-    for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
+    for (auto it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
         indexed_transaction_set::const_iterator it2 = mapTx.find(hash);
         const CTransaction& tx = it2->GetTx();
@@ -594,6 +756,8 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     checkNullifiers(SPROUT);
     checkNullifiers(SAPLING);
+    checkAnchors(SPROUT);
+    checkAnchors(SAPLING);
 
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
@@ -601,7 +765,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
 void CTxMemPool::checkNullifiers(ShieldedType type) const
 {
-    const std::map<uint256, const CTransaction*>* mapToUse;
+    const CMempoolNullifierMap* mapToUse;
     switch (type) {
         case SPROUT:
             mapToUse = &mapSproutNullifiers;
@@ -621,6 +785,27 @@ void CTxMemPool::checkNullifiers(ShieldedType type) const
     }
 }
 
+void CTxMemPool::checkAnchors(ShieldedType type) const
+{
+    const std::map<uint256, std::set<uint256>>* mapToUse;
+    switch (type) {
+        case SPROUT:
+            mapToUse = &mapSproutAnchors;
+            break;
+        case SAPLING:
+            mapToUse = &mapSaplingAnchors;
+            break;
+        default:
+            throw runtime_error("Unknown shielded type");
+    }
+    for (const auto& entry : *mapToUse) {
+        assert(!entry.second.empty());
+        for (const uint256& hash : entry.second) {
+            assert(mapTx.count(hash));
+        }
+    }
+}
+
 void CTxMemPool::queryHashes(vector<uint256>& vtxid)
 {
     vtxid.clear();
@@ -802,8 +987,11 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) const {
 
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
-    // Estimate the overhead of mapTx to be 6 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 6 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + cachedInnerUsage;
+    // Estimate the overhead of mapTx to be 12 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + cachedInnerUsage +
+        memusage::DynamicUsage(mapSproutNullifiers) + memusage::DynamicUsage(mapSaplingNullifiers) +
+        memusage::DynamicUsage(mapAddress) + memusage::DynamicUsage(mapAddressInserted) +
+        memusage::DynamicUsage(mapSpent) + memusage::DynamicUsage(mapSpentInserted) + cachedIndexUsage;
 }
 
 void CTxMemPool::SetMempoolCostLimit(int64_t totalCostLimit, int64_t evictionMemorySeconds) {
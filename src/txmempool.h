@@ -6,16 +6,23 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <atomic>
 #include <list>
+#include <memory>
+#include <set>
+#include <vector>
 
 #include "amount.h"
 #include "coins.h"
 #include "mempool_limit.h"
+#include "prevector.h"
 #include "primitives/transaction.h"
 #include "sync.h"
 #include "addressindex.h"
 #include "spentindex.h"
 
+#include <boost/unordered_map.hpp>
+
 #undef foreach
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
@@ -36,6 +43,10 @@ inline bool AllowFree(double dPriority)
 
 /** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
+/** Mempools with up to this many transactions are copied to a new snapshot whenever a changed pool is read */
+static const unsigned int MEMPOOL_SNAPSHOT_EAGER_TXS = 1000;
+/** Larger ones are copied at most this often, and at least once a second (in milliseconds) */
+static const int64_t MEMPOOL_SNAPSHOT_INTERVAL = 1000;
 
 /**
  * CTxMemPool stores these:
@@ -54,6 +65,7 @@ private:
     unsigned int nHeight;      //!< Chain height when entering the mempool
     bool hadNoDependencies;    //!< Not dependent on any other txs when it entered the mempool
     bool spendsCoinbase;       //!< keep track of transactions that spend a coinbase
+    bool lockTimeDependent;    //!< nLockTime is set and not overridden by final sequence numbers
     uint32_t nBranchId;        //!< Branch ID this transaction is known to commit to, cached for efficiency
 
 public:
@@ -74,6 +86,9 @@ public:
     size_t DynamicMemoryUsage() const { return nUsageSize; }
 
     bool GetSpendsCoinbase() const { return spendsCoinbase; }
+    bool IsLockTimeDependent() const { return lockTimeDependent; }
+    /** Whether the entry can become invalid when blocks are disconnected */
+    bool IsReorgSensitive() const { return spendsCoinbase || lockTimeDependent; }
     uint32_t GetValidatedBranchId() const { return nBranchId; }
 };
 
@@ -87,6 +102,30 @@ struct mempoolentry_txid
     }
 };
 
+// extracts a TxMemPoolEntry's expiry height, 0 if it never expires
+struct mempoolentry_expiry
+{
+    typedef uint32_t result_type;
+    result_type operator() (const CTxMemPoolEntry &entry) const
+    {
+        return entry.GetTx().nExpiryHeight;
+    }
+};
+
+// extracts whether a TxMemPoolEntry must be rechecked by removeForReorg
+struct mempoolentry_reorg_sensitive
+{
+    typedef bool result_type;
+    result_type operator() (const CTxMemPoolEntry &entry) const
+    {
+        return entry.IsReorgSensitive();
+    }
+};
+
+// index tags
+struct expiry_height {};
+struct reorg_sensitive {};
+
 class CompareTxMemPoolEntryByFee
 {
 public:
@@ -100,6 +139,93 @@ public:
 
 class CBlockPolicyEstimator;
 
+// insightexplorer
+/** An address in the mempool address index: its hash and script type */
+typedef std::pair<uint160, int> CMempoolAddressKey;
+/** The entries of one transaction paying to or spending from an address, usually only one */
+typedef prevector<1, CMempoolAddressEntry> CMempoolAddressTxEntries;
+
+/**
+ * Hashes the txids within a single address's bucket. Buckets are created for
+ * every new address, so this avoids drawing a random salt for each of them.
+ */
+struct CMempoolAddressTxidHasher
+{
+    size_t operator()(const uint256& hash) const { return hash.GetCheapHash(); }
+};
+
+/**
+ * The mempool entries of an address, by transaction, so that removing a
+ * transaction doesn't scan the address's other entries
+ */
+typedef boost::unordered_map<uint256, CMempoolAddressTxEntries, CMempoolAddressTxidHasher> CMempoolAddressBucket;
+
+class CMempoolAddressKeyHasher
+{
+private:
+    CCoinsKeyHasher hasher;
+
+public:
+    size_t operator()(const CMempoolAddressKey& key) const {
+        uint256 padded;
+        memcpy(padded.begin(), key.first.begin(), key.first.size());
+        return hasher(padded) ^ key.second;
+    }
+};
+
+class CSpentIndexKeyHasher
+{
+private:
+    CCoinsKeyHasher hasher;
+
+public:
+    size_t operator()(const CSpentIndexKey& key) const {
+        return hasher(key.txid) ^ key.outputIndex;
+    }
+};
+
+typedef boost::unordered_map<CMempoolAddressKey, CMempoolAddressBucket, CMempoolAddressKeyHasher> CMempoolAddressMap;
+
+/** The mempool transaction spending each Sprout or Sapling nullifier */
+typedef boost::unordered_map<uint256, const CTransaction*, CCoinsKeyHasher> CMempoolNullifierMap;
+
+/** What the RPC and REST interfaces report about a mempool entry */
+struct CMempoolSnapshotEntry
+{
+    uint256 hash;
+    size_t nTxSize;
+    CAmount nFee;
+    int64_t nTime;
+    unsigned int nHeight;
+    double dStartingPriority;
+    double dCurrentPriority;
+    std::vector<uint256> vDepends; //!< In-mempool parents
+};
+
+/**
+ * An immutable copy of the parts of the mempool served to RPC and REST
+ * clients. Writers only bump an epoch when they update the pool, and the copy
+ * is made by the scheduler or by a reader (see CTxMemPool::GetSnapshot), never
+ * on the validation thread. Readers take a reference to the current snapshot
+ * and keep using it until they drop it, without holding cs_main or
+ * CTxMemPool::cs while they do.
+ */
+class CMempoolSnapshot
+{
+public:
+    uint64_t nEpoch;
+    int nChainHeight;
+    uint64_t nTotalTxSize;
+    size_t nUsage;
+    std::vector<CMempoolSnapshotEntry> vEntries; //!< Sorted by txid
+    CMempoolAddressMap mapAddress;               //!< insightexplorer
+
+    CMempoolSnapshot() : nEpoch(0), nChainHeight(0), nTotalTxSize(0), nUsage(0) {}
+
+    void getAddressIndex(const std::vector<std::pair<uint160, int>>& addresses,
+                         std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>>& results) const;
+};
+
 /** An inpoint - a combination of a transaction and an index n into its vin */
 class CInPoint
 {
@@ -138,12 +264,24 @@ private:
     uint64_t nRecentlyAddedSequence = 0;
     uint64_t nNotifiedSequence = 0;
 
-    std::map<uint256, const CTransaction*> mapSproutNullifiers;
-    std::map<uint256, const CTransaction*> mapSaplingNullifiers;
+    CMempoolNullifierMap mapSproutNullifiers;
+    CMempoolNullifierMap mapSaplingNullifiers;
+    //! Hashes of the transactions spending from each Sprout and Sapling anchor, for removeWithAnchor
+    std::map<uint256, std::set<uint256>> mapSproutAnchors;
+    std::map<uint256, std::set<uint256>> mapSaplingAnchors;
+    //! Bumped under cs by every change visible through GetSnapshot()
+    std::atomic<uint64_t> nSnapshotEpoch;
+    //! Height of the active chain, for the current priority reported in snapshots
+    int nChainHeight = 0;
+    std::shared_ptr<const CMempoolSnapshot> snapshot;
+    int64_t nLastSnapshotTime = 0;
+
     RecentlyEvictedList* recentlyEvicted = new RecentlyEvictedList(DEFAULT_MEMPOOL_EVICTION_MEMORY_MINUTES * 60);
     WeightedTxTree* weightedTxTree = new WeightedTxTree(DEFAULT_MEMPOOL_TOTAL_COST_LIMIT);
 
     void checkNullifiers(ShieldedType type) const;
+    void checkAnchors(ShieldedType type) const;
+    bool findConflicts(const CTransaction& tx, std::vector<uint256>* pvConflicts) const;
     
 public:
     typedef boost::multi_index_container<
@@ -155,6 +293,16 @@ public:
             boost::multi_index::ordered_non_unique<
                 boost::multi_index::identity<CTxMemPoolEntry>,
                 CompareTxMemPoolEntryByFee
+            >,
+            // sorted by expiry height, for removeExpired
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<expiry_height>,
+                mempoolentry_expiry
+            >,
+            // split by whether a reorg can invalidate the entry, for removeForReorg
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<reorg_sensitive>,
+                mempoolentry_reorg_sensitive
             >
         >
     > indexed_transaction_set;
@@ -164,13 +312,18 @@ public:
 
 private:
     // insightexplorer
-    std::map<CMempoolAddressDeltaKey, CMempoolAddressDelta, CMempoolAddressDeltaKeyCompare> mapAddress;
-    std::map<uint256, std::vector<CMempoolAddressDeltaKey> > mapAddressInserted;
-    std::map<CSpentIndexKey, CSpentIndexValue, CSpentIndexKeyCompare> mapSpent;
-    std::map<uint256, std::vector<CSpentIndexKey>> mapSpentInserted;
+    CMempoolAddressMap mapAddress;
+    boost::unordered_map<uint256, std::vector<CMempoolAddressKey>, CCoinsKeyHasher> mapAddressInserted;
+    boost::unordered_map<CSpentIndexKey, CSpentIndexValue, CSpentIndexKeyHasher> mapSpent;
+    boost::unordered_map<uint256, std::vector<CSpentIndexKey>, CCoinsKeyHasher> mapSpentInserted;
+    //! Heap usage of the buckets and vectors held by the maps above
+    uint64_t cachedIndexUsage = 0;
+
+    void addAddressEntry(const CMempoolAddressKey& key, const CMempoolAddressEntry& entry,
+                         std::vector<CMempoolAddressKey>& inserted);
 
 public:
-    std::map<COutPoint, CInPoint> mapNextTx;
+    boost::unordered_map<COutPoint, CInPoint, COutPointHasher> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
     CTxMemPool(const CFeeRate& _minRelayFee);
@@ -211,6 +364,25 @@ public:
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
+    /** Record the height of a new active chain tip */
+    void SetChainHeight(int nHeight);
+
+    /**
+     * Return a snapshot of the pool. If the pool changed since the last one
+     * was published, a new one is copied first (under cs) when the pool is
+     * small or MEMPOOL_SNAPSHOT_INTERVAL has passed. Otherwise the snapshot
+     * trails the pool until the scheduler publishes the changes: on a pool
+     * larger than MEMPOOL_SNAPSHOT_EAGER_TXS, a transaction accepted by
+     * sendrawtransaction can be missing from getrawmempool for up to a second.
+     */
+    std::shared_ptr<const CMempoolSnapshot> GetSnapshot();
+    /**
+     * Publish a snapshot of the pool if it changed since the last one. To
+     * bound the cost of copying a large pool, this is skipped unless fForce
+     * is set or the pool is small or MEMPOOL_SNAPSHOT_INTERVAL has passed.
+     * Takes cs only, so callers shouldn't hold cs_main.
+     */
+    void UpdateSnapshot(bool fForce = false);
     /**
      * Check that none of this transactions inputs are in the mempool, and thus
      * the tx is not dependent on other mempool transactions to be included in a block.
@@ -224,6 +396,14 @@ public:
 
     bool nullifierExists(const uint256& nullifier, ShieldedType type) const;
 
+    /**
+     * Whether any input or Sprout/Sapling nullifier of tx is already spent by
+     * a transaction in the pool, checked in a single pass under cs.
+     */
+    bool HasConflicts(const CTransaction& tx) const;
+    /** Hashes of the pool transactions, other than tx itself, that tx conflicts with */
+    void GetConflicts(const CTransaction& tx, std::vector<uint256>& vConflicts) const;
+
     void NotifyRecentlyAdded();
     bool IsFullyNotified();
 
@@ -696,6 +696,17 @@ void FileCommit(FILE *fileout)
 #endif
 }
 
+void DirectoryCommit(const boost::filesystem::path& dirname)
+{
+#ifndef WIN32
+    FILE* file = fopen(dirname.string().c_str(), "r");
+    if (file) {
+        fsync(fileno(file));
+        fclose(file);
+    }
+#endif
+}
+
 bool TruncateFile(FILE *file, unsigned int length) {
 #if defined(WIN32)
     return _chsize(_fileno(file), length) == 0;
@@ -930,3 +941,25 @@ int GetNumCores()
     return boost::thread::physical_concurrency();
 }
 
+void ForEachIndexInParallel(size_t nCount, const std::function<void(size_t)>& f, int nMaxThreads)
+{
+    std::atomic<size_t> nNext(0);
+    auto worker = [&]() {
+        size_t i;
+        while ((i = nNext++) < nCount) {
+            f(i);
+        }
+    };
+
+    int nThreads = std::min<size_t>(GetNumCores(), nCount);
+    if (nMaxThreads > 0) {
+        nThreads = std::min(nThreads, nMaxThreads);
+    }
+    boost::thread_group threadGroup;
+    for (int i = 1; i < nThreads; i++) {
+        threadGroup.create_thread(worker);
+    }
+    worker();
+    threadGroup.join_all();
+}
+
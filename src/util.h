@@ -20,6 +20,7 @@
 
 #include <atomic>
 #include <exception>
+#include <functional>
 #include <map>
 #include <stdint.h>
 #include <string>
@@ -117,6 +118,8 @@ const boost::filesystem::path &ZC_GetParamsDir();
 void PrintExceptionContinue(const std::exception *pex, const char* pszThread);
 void ParseParameters(int argc, const char*const argv[]);
 void FileCommit(FILE *fileout);
+/** Make the creation, renaming or removal of files in a directory durable. */
+void DirectoryCommit(const boost::filesystem::path& dirname);
 bool TruncateFile(FILE *file, unsigned int length);
 int RaiseFileDescriptorLimit(int nMinFD);
 void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length);
@@ -228,6 +231,9 @@ std::string HelpMessageOpt(const std::string& option, const std::string& message
  */
 int GetNumCores();
 
+/** Call f(i) for every i in [0, nCount), on all cores (or at most nMaxThreads of them, if set). */
+void ForEachIndexInParallel(size_t nCount, const std::function<void(size_t)>& f, int nMaxThreads = 0);
+
 void SetThreadPriority(int nPriority);
 void RenameThread(const char* name);
 
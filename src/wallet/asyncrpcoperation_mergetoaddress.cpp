@@ -170,7 +170,7 @@ void AsyncRPCOperation_mergetoaddress::main()
     if (success) {
         set_state(OperationStatus::SUCCESS);
     } else {
-        set_state(OperationStatus::FAILED);
+        set_state(unsuccessful_state());
     }
 
     std::string s = strprintf("%s: z_mergetoaddress finished (status=%s", getId(), getStateAsString());
@@ -318,10 +318,7 @@ bool AsyncRPCOperation_mergetoaddress::main_impl()
         // Fetch Sapling anchor and witnesses
         uint256 anchor;
         std::vector<boost::optional<SaplingWitness>> witnesses;
-        {
-            LOCK2(cs_main, pwalletMain->cs_wallet);
-            pwalletMain->GetSaplingNoteWitnesses(saplingOPs, witnesses, anchor);
-        }
+        pwalletMain->GetSaplingNoteWitnesses(saplingOPs, witnesses, anchor);
 
         // Add Sapling spends
         for (size_t i = 0; i < saplingNotes.size(); i++) {
@@ -357,7 +354,11 @@ bool AsyncRPCOperation_mergetoaddress::main_impl()
         }
 
         // Build the transaction
-        tx_ = builder_.Build().GetTxOrThrow();
+        interruption_point();
+        {
+            ProvingTimer provingTimer(*this);
+            tx_ = builder_.Build().GetTxOrThrow();
+        }
 
         UniValue sendResult = SendTransaction(tx_, boost::none, testmode);
         set_result(sendResult);
@@ -417,6 +418,7 @@ bool AsyncRPCOperation_mergetoaddress::main_impl()
         info.vjsout.push_back(jso);
 
         UniValue obj = perform_joinsplit(info);
+        prove_joinsplits(obj);
         auto txAndResult = SignSendRawTransaction(obj, boost::none, testmode);
         tx_ = txAndResult.first;
         set_result(txAndResult.second);
@@ -436,15 +438,31 @@ bool AsyncRPCOperation_mergetoaddress::main_impl()
     // When spending notes, take a snapshot of note witnesses and anchors as the treestate will
     // change upon arrival of new blocks which contain joinsplit transactions.  This is likely
     // to happen as creating a chained joinsplit transaction can take longer than the block interval.
+    // The witnesses of all the notes are fetched at once, so that they share an anchor and any
+    // that aren't cached are built in a single pass over the blocks, and the blocks that mined
+    // the notes are looked up at the same time so the locks aren't taken again for each note.
     {
+        std::vector<JSOutPoint> vOutPoints;
+        for (const auto& t : sproutNoteInputs_) {
+            vOutPoints.push_back(std::get<0>(t));
+        }
+        uint256 inputAnchor;
+        std::vector<boost::optional<SproutWitness>> vInputWitnesses;
+
+        pwalletMain->GetSproutNoteWitnesses(vOutPoints, vInputWitnesses, inputAnchor);
         LOCK2(cs_main, pwalletMain->cs_wallet);
-        for (auto t : sproutNoteInputs_) {
-            JSOutPoint jso = std::get<0>(t);
-            std::vector<JSOutPoint> vOutPoints = {jso};
-            uint256 inputAnchor;
-            std::vector<boost::optional<SproutWitness>> vInputWitnesses;
-            pwalletMain->GetSproutNoteWitnesses(vOutPoints, vInputWitnesses, inputAnchor);
-            jsopWitnessAnchorMap[jso.ToString()] = MergeToAddressWitnessAnchorData{vInputWitnesses[0], inputAnchor};
+        for (size_t i = 0; i < vOutPoints.size(); i++) {
+            const CWalletTx& wtx = pwalletMain->mapWallet[vOutPoints[i].hash];
+            MergeToAddressWitnessAnchorData wad;
+            wad.witness = vInputWitnesses[i];
+            wad.anchor = inputAnchor;
+            wad.blockHash = wtx.hashBlock;
+            BlockMap::const_iterator mi = mapBlockIndex.find(wtx.hashBlock);
+            if (mi != mapBlockIndex.end()) {
+                wad.height = mi->second->nHeight;
+            }
+            wad.depth = wtx.GetDepthInMainChain();
+            jsopWitnessAnchorMap[vOutPoints[i].ToString()] = wad;
         }
     }
 
@@ -612,17 +630,9 @@ bool AsyncRPCOperation_mergetoaddress::main_impl()
 
             jsInputValue += noteFunds;
 
-            int wtxHeight = -1;
-            int wtxDepth = -1;
-            {
-                LOCK2(cs_main, pwalletMain->cs_wallet);
-                const CWalletTx& wtx = pwalletMain->mapWallet[jso.hash];
-                // Zero confirmation notes belong to transactions which have not yet been mined
-                if (mapBlockIndex.find(wtx.hashBlock) == mapBlockIndex.end()) {
-                    throw JSONRPCError(RPC_WALLET_ERROR, strprintf("mapBlockIndex does not contain block hash %s", wtx.hashBlock.ToString()));
-                }
-                wtxHeight = mapBlockIndex[wtx.hashBlock]->nHeight;
-                wtxDepth = wtx.GetDepthInMainChain();
+            // Zero confirmation notes belong to transactions which have not yet been mined
+            if (wad.height < 0) {
+                throw JSONRPCError(RPC_WALLET_ERROR, strprintf("mapBlockIndex does not contain block hash %s", wad.blockHash.ToString()));
             }
             LogPrint("zrpcunsafe", "%s: spending note (txid=%s, vJoinSplit=%d, jsoutindex=%d, amount=%s, height=%d, confirmations=%d)\n",
                      getId(),
@@ -630,8 +640,8 @@ bool AsyncRPCOperation_mergetoaddress::main_impl()
                      jso.js,
                      int(jso.n), // uint8_t
                      FormatMoney(noteFunds),
-                     wtxHeight,
-                     wtxDepth);
+                     wad.height,
+                     wad.depth);
         }
 
         // Add history of previous commitments to witness
@@ -718,6 +728,8 @@ bool AsyncRPCOperation_mergetoaddress::main_impl()
     assert(zInputsDeque.size() == 0);
     assert(vpubNewProcessed);
 
+    prove_joinsplits(obj);
+
     auto txAndResult = SignSendRawTransaction(obj, boost::none, testmode);
     tx_ = txAndResult.first;
     set_result(txAndResult.second);
@@ -725,6 +737,41 @@ bool AsyncRPCOperation_mergetoaddress::main_impl()
 }
 
 
+void AsyncRPCOperation_mergetoaddress::prove_joinsplits(UniValue& obj)
+{
+    if (this->testmode) {
+        return;
+    }
+    interruption_point();
+
+    CMutableTransaction mtx(tx_);
+    {
+        ProvingTimer provingTimer(*this);
+        if (!ProveJoinSplits(*pzcashParams, joinSplitPubKey_, mtx.vJoinSplit, jsProofWitnesses_)) {
+            throw std::runtime_error("error verifying joinsplit");
+        }
+    }
+
+    // The signature covers the proofs, so sign again
+    CScript scriptCode;
+    CTransaction signTx(mtx);
+    uint256 dataToBeSigned = SignatureHash(scriptCode, signTx, NOT_AN_INPUT, SIGHASH_ALL, 0, consensusBranchId_);
+    if (!(crypto_sign_detached(&mtx.joinSplitSig[0], NULL,
+                               dataToBeSigned.begin(), 32,
+                               joinSplitPrivKey_) == 0)) {
+        throw std::runtime_error("crypto_sign_detached failed");
+    }
+    if (!(crypto_sign_verify_detached(&mtx.joinSplitSig[0],
+                                      dataToBeSigned.begin(), 32,
+                                      mtx.joinSplitPubKey.begin()) == 0)) {
+        throw std::runtime_error("crypto_sign_verify_detached failed");
+    }
+
+    tx_ = CTransaction(mtx);
+    obj.pushKV("rawtxn", EncodeHexTx(tx_));
+}
+
+
 UniValue AsyncRPCOperation_mergetoaddress::perform_joinsplit(MergeToAddressJSInfo& info)
 {
     std::vector<boost::optional<SproutWitness>> witnesses;
@@ -741,10 +788,7 @@ UniValue AsyncRPCOperation_mergetoaddress::perform_joinsplit(MergeToAddressJSInf
 {
     std::vector<boost::optional<SproutWitness>> witnesses;
     uint256 anchor;
-    {
-        LOCK(cs_main);
-        pwalletMain->GetSproutNoteWitnesses(outPoints, witnesses, anchor);
-    }
+    pwalletMain->GetSproutNoteWitnesses(outPoints, witnesses, anchor);
     return perform_joinsplit(info, witnesses, anchor);
 }
 
@@ -753,6 +797,8 @@ UniValue AsyncRPCOperation_mergetoaddress::perform_joinsplit(
     std::vector<boost::optional<SproutWitness>> witnesses,
     uint256 anchor)
 {
+    interruption_point();
+
     if (anchor.IsNull()) {
         throw std::runtime_error("anchor is null");
     }
@@ -794,7 +840,6 @@ UniValue AsyncRPCOperation_mergetoaddress::perform_joinsplit(
              FormatMoney(info.vjsin[0].note.value()), FormatMoney(info.vjsin[1].note.value()),
              FormatMoney(info.vjsout[0].value), FormatMoney(info.vjsout[1].value));
 
-    // Generate the proof, this can take over a minute.
     std::array<libzcash::JSInput, ZC_NUM_JS_INPUTS> inputs{info.vjsin[0], info.vjsin[1]};
     std::array<libzcash::JSOutput, ZC_NUM_JS_OUTPUTS> outputs{info.vjsout[0], info.vjsout[1]};
     std::array<size_t, ZC_NUM_JS_INPUTS> inputMap;
@@ -802,7 +847,12 @@ UniValue AsyncRPCOperation_mergetoaddress::perform_joinsplit(
 
     uint256 esk; // payment disclosure - secret
 
+    // Only the notes and commitments are computed here, which is all the next JoinSplit in
+    // a chain needs. The proofs, which can take over a minute each, are created together
+    // by prove_joinsplits(). In test mode no proofs are generated, so this JoinSplit is
+    // verified (and rejected) straight away.
     assert(mtx.fOverwintered && (mtx.nVersion >= SAPLING_TX_VERSION));
+    ZCJSProofWitness proofWitness;
     JSDescription jsdesc = JSDescription::Randomized(
         *pzcashParams,
         joinSplitPubKey_,
@@ -813,13 +863,17 @@ UniValue AsyncRPCOperation_mergetoaddress::perform_joinsplit(
         outputMap,
         info.vpub_old,
         info.vpub_new,
-        !this->testmode,
-        &esk); // parameter expects pointer to esk, so pass in address
-    {
+        false,
+        &esk, // parameter expects pointer to esk, so pass in address
+        GetRandInt,
+        &proofWitness);
+    if (this->testmode) {
         auto verifier = libzcash::ProofVerifier::Strict();
         if (!(jsdesc.Verify(*pzcashParams, verifier, joinSplitPubKey_))) {
             throw std::runtime_error("error verifying joinsplit");
         }
+    } else {
+        jsProofWitnesses_.push_back(proofWitness);
     }
 
     mtx.vJoinSplit.push_back(jsdesc);
@@ -46,10 +46,14 @@ struct MergeToAddressJSInfo {
     CAmount vpub_new = 0;
 };
 
-// A struct to help us track the witness and anchor for a given JSOutPoint
+// A struct to help us track the witness and anchor for a given JSOutPoint,
+// along with the block that mined it as of when the witness was taken
 struct MergeToAddressWitnessAnchorData {
     boost::optional<SproutWitness> witness;
     uint256 anchor;
+    uint256 blockHash;
+    int height = -1; // -1 if the block is not in mapBlockIndex
+    int depth = -1;
 };
 
 class AsyncRPCOperation_mergetoaddress : public AsyncRPCOperation
@@ -74,6 +78,10 @@ public:
 
     virtual void main();
 
+    virtual OperationPriority getPriority() const {
+        return OperationPriority::LOW;
+    }
+
     virtual UniValue getStatus() const;
 
     bool testmode = false; // Set to true to disable sending txs and generating proofs
@@ -108,6 +116,10 @@ private:
     TransactionBuilder builder_;
     CTransaction tx_;
 
+    // Proof witnesses of the JoinSplits in tx_, whose proofs are created by
+    // prove_joinsplits() once all of them have been chained together
+    std::vector<ZCJSProofWitness> jsProofWitnesses_;
+
     std::array<unsigned char, ZC_MEMO_SIZE> get_memo_from_hex_string(std::string s);
     bool main_impl();
 
@@ -123,6 +135,10 @@ private:
         std::vector<boost::optional<SproutWitness>> witnesses,
         uint256 anchor);
 
+    // Create the proofs of the JoinSplits added by perform_joinsplit, and
+    // sign the transaction again. Updates the raw transaction in obj.
+    void prove_joinsplits(UniValue& obj);
+
     void lock_utxos();
 
     void unlock_utxos();
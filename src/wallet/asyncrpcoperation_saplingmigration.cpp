@@ -49,12 +49,14 @@ void AsyncRPCOperation_saplingmigration::main() {
         set_error_message("unknown error");
     }
 
+    unlock_notes();
+
     stop_execution_clock();
 
     if (success) {
         set_state(OperationStatus::SUCCESS);
     } else {
-        set_state(OperationStatus::FAILED);
+        set_state(unsuccessful_state());
     }
 
     std::string s = strprintf("%s: Sprout->Sapling transactions created. (status=%s", getId(), getStateAsString());
@@ -85,6 +87,12 @@ bool AsyncRPCOperation_saplingmigration::main_impl() {
         // an anchor at height N-10 for each Sprout JoinSplit description
         // Consider, should notes be sorted?
         pwalletMain->GetFilteredNotes(sproutEntries, saplingEntries, "", 11);
+        // Lock the notes while the transactions are created, so that operations
+        // running at the same time don't spend them as well
+        for (const SproutNoteEntry& sproutEntry : sproutEntries) {
+            pwalletMain->LockNote(sproutEntry.jsop);
+            lockedNotes_.push_back(sproutEntry.jsop);
+        }
     }
     CAmount availableFunds = 0;
     for (const SproutNoteEntry& sproutEntry : sproutEntries) {
@@ -146,10 +154,13 @@ bool AsyncRPCOperation_saplingmigration::main_impl() {
         // the value of the Sapling output will be 0.0001 ZEC less.
         builder.SetFee(FEE);
         builder.AddSaplingOutput(ovkForShieldingFromTaddr(seed), migrationDestAddress, amountToSend - FEE);
+        interruption_point();
+        ProvingTimer provingTimer(*this);
         CTransaction tx = builder.Build().GetTxOrThrow();
-        if (isCancelled()) {
+        provingTimer.stop();
+        if (isCancelRequested()) {
             LogPrint("zrpcunsafe", "%s: Canceled. Stopping.\n", getId());
-            break;
+            interruption_point();
         }
         pwalletMain->AddPendingSaplingMigrationTx(tx);
         LogPrint("zrpcunsafe", "%s: Added pending migration transaction with txid=%s\n", getId(), tx.GetHash().ToString());
@@ -163,6 +174,14 @@ bool AsyncRPCOperation_saplingmigration::main_impl() {
     return true;
 }
 
+void AsyncRPCOperation_saplingmigration::unlock_notes() {
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    for (const JSOutPoint& jsop : lockedNotes_) {
+        pwalletMain->UnlockNote(jsop);
+    }
+    lockedNotes_.clear();
+}
+
 void AsyncRPCOperation_saplingmigration::setMigrationResult(int numTxCreated, const CAmount& amountMigrated, const std::vector<std::string>& migrationTxIds) {
     UniValue res(UniValue::VOBJ);
     res.push_back(Pair("num_tx_created", numTxCreated));
@@ -227,10 +246,6 @@ libzcash::SaplingPaymentAddress AsyncRPCOperation_saplingmigration::getMigration
     return toAddress;
 }
 
-void AsyncRPCOperation_saplingmigration::cancel() {
-    set_state(OperationStatus::CANCELLED);
-}
-
 UniValue AsyncRPCOperation_saplingmigration::getStatus() const {
     UniValue v = AsyncRPCOperation::getStatus();
     UniValue obj = v.get_obj();
@@ -1,6 +1,7 @@
 #include "amount.h"
 #include "asyncrpcoperation.h"
 #include "univalue.h"
+#include "wallet/wallet.h"
 #include "zcash/Address.hpp"
 #include "zcash/zip32.h"
 
@@ -20,15 +21,21 @@ public:
 
     virtual void main();
 
-    virtual void cancel();
+    virtual OperationPriority getPriority() const {
+        return OperationPriority::LOW;
+    }
 
     virtual UniValue getStatus() const;
 
 private:
     int targetHeight_;
+    // Sprout notes locked by this operation, unlocked when it finishes
+    std::vector<JSOutPoint> lockedNotes_;
 
     bool main_impl();
 
+    void unlock_notes();
+
     void setMigrationResult(int numTxCreated, const CAmount& amountMigrated, const std::vector<std::string>& migrationTxIds);
 
     CAmount chooseAmount(const CAmount& availableFunds);
@@ -161,12 +161,15 @@ void AsyncRPCOperation_sendmany::main() {
     GenerateBitcoins(GetBoolArg("-gen", false), GetArg("-genproclimit", 1), Params());
 #endif
 
+    unlock_utxos();
+    unlock_notes();
+
     stop_execution_clock();
 
     if (success) {
         set_state(OperationStatus::SUCCESS);
     } else {
-        set_state(OperationStatus::FAILED);
+        set_state(unsuccessful_state());
     }
 
     std::string s = strprintf("%s: z_sendmany finished (status=%s", getId(), getStateAsString());
@@ -196,7 +199,8 @@ void AsyncRPCOperation_sendmany::main() {
 // Notes:
 // 1. #1159 Currently there is no limit set on the number of joinsplits, so size of tx could be invalid.
 // 2. #1360 Note selection is not optimal
-// 3. #1277 Spendable notes are not locked, so an operation running in parallel could also try to use them
+// 3. #1277 The utxos and notes to spend are locked until the operation finishes, so that an operation
+//    running in parallel doesn't try to use them as well
 bool AsyncRPCOperation_sendmany::main_impl() {
 
     assert(isfromtaddr_ != isfromzaddr_);
@@ -206,6 +210,19 @@ bool AsyncRPCOperation_sendmany::main_impl() {
     bool isPureTaddrOnlyTx = (isfromtaddr_ && z_outputs_.size() == 0);
     CAmount minersFee = fee_;
 
+    CAmount t_outputs_total = 0;
+    for (SendManyRecipient & t : t_outputs_) {
+        t_outputs_total += std::get<1>(t);
+    }
+
+    CAmount z_outputs_total = 0;
+    for (SendManyRecipient & t : z_outputs_) {
+        z_outputs_total += std::get<1>(t);
+    }
+
+    CAmount sendAmount = z_outputs_total + t_outputs_total;
+    CAmount targetAmount = sendAmount + minersFee;
+
     // When spending coinbase utxos, you can only specify a single zaddr as the change must go somewhere
     // and if there are multiple zaddrs, we don't know where to send it.
     if (isfromtaddr_) {
@@ -226,7 +243,7 @@ bool AsyncRPCOperation_sendmany::main_impl() {
         }        
     }
     
-    if (isfromzaddr_ && !find_unspent_notes()) {
+    if (isfromzaddr_ && !find_unspent_notes(targetAmount)) {
         throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Insufficient funds, no unspent notes found for zaddr from address.");
     }
 
@@ -246,19 +263,6 @@ bool AsyncRPCOperation_sendmany::main_impl() {
         z_inputs_total += t.note.value();
     }
 
-    CAmount t_outputs_total = 0;
-    for (SendManyRecipient & t : t_outputs_) {
-        t_outputs_total += std::get<1>(t);
-    }
-
-    CAmount z_outputs_total = 0;
-    for (SendManyRecipient & t : z_outputs_) {
-        z_outputs_total += std::get<1>(t);
-    }
-
-    CAmount sendAmount = z_outputs_total + t_outputs_total;
-    CAmount targetAmount = sendAmount + minersFee;
-
     assert(!isfromtaddr_ || z_inputs_total == 0);
     assert(!isfromzaddr_ || t_inputs_total == 0);
 
@@ -312,6 +316,12 @@ bool AsyncRPCOperation_sendmany::main_impl() {
 
         t_inputs_ = selectedTInputs;
         t_inputs_total = selectedUTXOAmount;
+        {
+            // Release the utxos that won't be spent
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            unlock_utxos();
+            lock_utxos();
+        }
 
         // Check mempooltxinputlimit to avoid creating a transaction which the local mempool rejects
         size_t limit = (size_t)GetArg("-mempooltxinputlimit", 0);
@@ -404,33 +414,12 @@ bool AsyncRPCOperation_sendmany::main_impl() {
             builder_.SendChangeTo(changeAddr);
         }
 
-        // Select Sapling notes
-        std::vector<SaplingOutPoint> ops;
-        std::vector<SaplingNote> notes;
-        CAmount sum = 0;
-        for (auto t : z_sapling_inputs_) {
-            ops.push_back(t.op);
-            notes.push_back(t.note);
-            sum += t.note.value();
-            if (sum >= targetAmount) {
-                break;
-            }
-        }
-
-        // Fetch Sapling anchor and witnesses
-        uint256 anchor;
-        std::vector<boost::optional<SaplingWitness>> witnesses;
-        {
-            LOCK2(cs_main, pwalletMain->cs_wallet);
-            pwalletMain->GetSaplingNoteWitnesses(ops, witnesses, anchor);
-        }
-
-        // Add Sapling spends
-        for (size_t i = 0; i < notes.size(); i++) {
-            if (!witnesses[i]) {
+        // Add Sapling spends for the notes selected by find_unspent_notes()
+        for (size_t i = 0; i < z_sapling_witnesses_.size(); i++) {
+            if (!z_sapling_witnesses_[i]) {
                 throw JSONRPCError(RPC_WALLET_ERROR, "Missing witness for Sapling note");
             }
-            builder_.AddSaplingSpend(expsk, notes[i], anchor, witnesses[i].get());
+            builder_.AddSaplingSpend(expsk, z_sapling_inputs_[i].note, z_sapling_anchor_, z_sapling_witnesses_[i].get());
         }
 
         // Add Sapling outputs
@@ -458,7 +447,11 @@ bool AsyncRPCOperation_sendmany::main_impl() {
         }
 
         // Build the transaction
-        tx_ = builder_.Build().GetTxOrThrow();
+        interruption_point();
+        {
+            ProvingTimer provingTimer(*this);
+            tx_ = builder_.Build().GetTxOrThrow();
+        }
 
         UniValue sendResult = SendTransaction(tx_, keyChange, testmode);
         set_result(sendResult);
@@ -533,21 +526,6 @@ bool AsyncRPCOperation_sendmany::main_impl() {
         zOutputsDeque.push_back(o);
     }
 
-    // When spending notes, take a snapshot of note witnesses and anchors as the treestate will
-    // change upon arrival of new blocks which contain joinsplit transactions.  This is likely
-    // to happen as creating a chained joinsplit transaction can take longer than the block interval.
-    if (z_sprout_inputs_.size() > 0) {
-        LOCK2(cs_main, pwalletMain->cs_wallet);
-        for (auto t : z_sprout_inputs_) {
-            JSOutPoint jso = std::get<0>(t);
-            std::vector<JSOutPoint> vOutPoints = { jso };
-            uint256 inputAnchor;
-            std::vector<boost::optional<SproutWitness>> vInputWitnesses;
-            pwalletMain->GetSproutNoteWitnesses(vOutPoints, vInputWitnesses, inputAnchor);
-            jsopWitnessAnchorMap[ jso.ToString() ] = WitnessAnchorData{ vInputWitnesses[0], inputAnchor };
-        }
-    }
-
 
     /**
      * SCENARIO #2
@@ -610,6 +588,7 @@ bool AsyncRPCOperation_sendmany::main_impl() {
             }
             obj = perform_joinsplit(info);
         }
+        prove_joinsplits(obj);
 
         auto txAndResult = SignSendRawTransaction(obj, keyChange, testmode);
         tx_ = txAndResult.first;
@@ -755,18 +734,10 @@ bool AsyncRPCOperation_sendmany::main_impl() {
             vInputNotes.push_back(note);
             
             jsInputValue += noteFunds;
-            
-            int wtxHeight = -1;
-            int wtxDepth = -1;
-            {
-                LOCK2(cs_main, pwalletMain->cs_wallet);
-                const CWalletTx& wtx = pwalletMain->mapWallet[jso.hash];
-                // Zero-confirmation notes belong to transactions which have not yet been mined
-                if (mapBlockIndex.find(wtx.hashBlock) == mapBlockIndex.end()) {
-                    throw JSONRPCError(RPC_WALLET_ERROR, strprintf("mapBlockIndex does not contain block hash %s", wtx.hashBlock.ToString()));
-                }
-                wtxHeight = mapBlockIndex[wtx.hashBlock]->nHeight;
-                wtxDepth = wtx.GetDepthInMainChain();
+
+            // Zero-confirmation notes belong to transactions which have not yet been mined
+            if (wad.height < 0) {
+                throw JSONRPCError(RPC_WALLET_ERROR, strprintf("mapBlockIndex does not contain block hash %s", wad.blockHash.ToString()));
             }
             LogPrint("zrpcunsafe", "%s: spending note (txid=%s, vJoinSplit=%d, jsoutindex=%d, amount=%s, height=%d, confirmations=%d)\n",
                     getId(),
@@ -774,8 +745,8 @@ bool AsyncRPCOperation_sendmany::main_impl() {
                     jso.js,
                     int(jso.n), // uint8_t
                     FormatMoney(noteFunds),
-                    wtxHeight,
-                    wtxDepth
+                    wad.height,
+                    wad.depth
                     );
         }
                     
@@ -891,6 +862,8 @@ bool AsyncRPCOperation_sendmany::main_impl() {
     assert(zOutputsDeque.size() == 0);
     assert(vpubNewProcessed);
 
+    prove_joinsplits(obj);
+
     auto txAndResult = SignSendRawTransaction(obj, boost::none, testmode);
     tx_ = txAndResult.first;
     set_result(txAndResult.second);
@@ -943,17 +916,25 @@ bool AsyncRPCOperation_sendmany::find_utxos(bool fAcceptCoinbase=false) {
         return ( std::get<2>(i) < std::get<2>(j));
     });
 
+    // Lock all of them until main_impl() has chosen the ones to spend, so
+    // that operations running at the same time don't find them as well
+    lock_utxos();
+
     return t_inputs_.size() > 0;
 }
 
 
-bool AsyncRPCOperation_sendmany::find_unspent_notes() {
+bool AsyncRPCOperation_sendmany::find_unspent_notes(CAmount targetAmount) {
     std::vector<SproutNoteEntry> sproutEntries;
     std::vector<SaplingNoteEntry> saplingEntries;
+    std::vector<JSOutPoint> sproutOPs;
+    std::vector<SaplingOutPoint> saplingOPs;
+
     {
-        LOCK2(cs_main, pwalletMain->cs_wallet);
-        pwalletMain->GetFilteredNotes(sproutEntries, saplingEntries, fromaddress_, mindepth_);
-    }
+    // Select the notes to spend and lock them in one go, so that operations
+    // running at the same time don't select them as well.
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    pwalletMain->GetFilteredNotes(sproutEntries, saplingEntries, fromaddress_, mindepth_);
 
     // If using the TransactionBuilder, we only want Sapling notes.
     // If not using it, we only want Sprout notes.
@@ -1002,6 +983,56 @@ bool AsyncRPCOperation_sendmany::find_unspent_notes() {
             return i.note.value() > j.note.value();
         });
 
+    // Notes are spent biggest first until the target amount is reached
+    CAmount sum = 0;
+    for (const SendManyInputJSOP& t : z_sprout_inputs_) {
+        sproutOPs.push_back(std::get<0>(t));
+        sum += std::get<2>(t);
+        if (sum >= targetAmount) {
+            break;
+        }
+    }
+    sum = 0;
+    for (const SaplingNoteEntry& t : z_sapling_inputs_) {
+        saplingOPs.push_back(t.op);
+        sum += t.note.value();
+        if (sum >= targetAmount) {
+            break;
+        }
+    }
+    lock_notes(sproutOPs, saplingOPs);
+    }
+
+    // The witnesses of the notes to spend are fetched at once, so that they
+    // share an anchor and any that aren't cached are built in a single pass
+    // over the blocks. The snapshot is kept while the proofs are created, as
+    // the treestate changes with new blocks and creating a chained joinsplit
+    // transaction can take longer than the block interval.
+    if (!sproutOPs.empty()) {
+        std::vector<boost::optional<SproutWitness>> witnesses;
+        uint256 anchor;
+        pwalletMain->GetSproutNoteWitnesses(sproutOPs, witnesses, anchor);
+
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        for (size_t i = 0; i < sproutOPs.size(); i++) {
+            const CWalletTx& wtx = pwalletMain->mapWallet[sproutOPs[i].hash];
+            WitnessAnchorData wad;
+            wad.witness = witnesses[i];
+            wad.anchor = anchor;
+            wad.blockHash = wtx.hashBlock;
+            BlockMap::const_iterator mi = mapBlockIndex.find(wtx.hashBlock);
+            if (mi != mapBlockIndex.end()) {
+                wad.height = mi->second->nHeight;
+            }
+            wad.depth = wtx.GetDepthInMainChain();
+            jsopWitnessAnchorMap[sproutOPs[i].ToString()] = wad;
+        }
+    }
+
+    if (!saplingOPs.empty()) {
+        pwalletMain->GetSaplingNoteWitnesses(saplingOPs, z_sapling_witnesses_, z_sapling_anchor_);
+    }
+
     return true;
 }
 
@@ -1019,10 +1050,7 @@ UniValue AsyncRPCOperation_sendmany::perform_joinsplit(AsyncJoinSplitInfo & info
 UniValue AsyncRPCOperation_sendmany::perform_joinsplit(AsyncJoinSplitInfo & info, std::vector<JSOutPoint> & outPoints) {
     std::vector<boost::optional < SproutWitness>> witnesses;
     uint256 anchor;
-    {
-        LOCK(cs_main);
-        pwalletMain->GetSproutNoteWitnesses(outPoints, witnesses, anchor);
-    }
+    pwalletMain->GetSproutNoteWitnesses(outPoints, witnesses, anchor);
     return perform_joinsplit(info, witnesses, anchor);
 }
 
@@ -1031,6 +1059,8 @@ UniValue AsyncRPCOperation_sendmany::perform_joinsplit(
         std::vector<boost::optional < SproutWitness>> witnesses,
         uint256 anchor)
 {
+    interruption_point();
+
     if (anchor.IsNull()) {
         throw std::runtime_error("anchor is null");
     }
@@ -1069,7 +1099,6 @@ UniValue AsyncRPCOperation_sendmany::perform_joinsplit(
             FormatMoney(info.vjsout[0].value), FormatMoney(info.vjsout[1].value)
             );
 
-    // Generate the proof, this can take over a minute.
     std::array<libzcash::JSInput, ZC_NUM_JS_INPUTS> inputs
             {info.vjsin[0], info.vjsin[1]};
     std::array<libzcash::JSOutput, ZC_NUM_JS_OUTPUTS> outputs
@@ -1079,7 +1108,12 @@ UniValue AsyncRPCOperation_sendmany::perform_joinsplit(
 
     uint256 esk; // payment disclosure - secret
 
+    // Only the notes and commitments are computed here, which is all the next JoinSplit in
+    // a chain needs. The proofs, which can take over a minute each, are created together
+    // by prove_joinsplits(). In test mode no proofs are generated, so this JoinSplit is
+    // verified (and rejected) straight away.
     assert(mtx.fOverwintered && (mtx.nVersion >= SAPLING_TX_VERSION));
+    ZCJSProofWitness proofWitness;
     JSDescription jsdesc = JSDescription::Randomized(
             *pzcashParams,
             joinSplitPubKey_,
@@ -1090,13 +1124,17 @@ UniValue AsyncRPCOperation_sendmany::perform_joinsplit(
             outputMap,
             info.vpub_old,
             info.vpub_new,
-            !this->testmode,
-            &esk); // parameter expects pointer to esk, so pass in address
-    {
+            false,
+            &esk, // parameter expects pointer to esk, so pass in address
+            GetRandInt,
+            &proofWitness);
+    if (this->testmode) {
         auto verifier = libzcash::ProofVerifier::Strict();
         if (!(jsdesc.Verify(*pzcashParams, verifier, joinSplitPubKey_))) {
             throw std::runtime_error("error verifying joinsplit");
         }
+    } else {
+        jsProofWitnesses_.push_back(proofWitness);
     }
 
     mtx.vJoinSplit.push_back(jsdesc);
@@ -1190,6 +1228,43 @@ UniValue AsyncRPCOperation_sendmany::perform_joinsplit(
     return obj;
 }
 
+void AsyncRPCOperation_sendmany::prove_joinsplits(UniValue& obj) {
+    if (this->testmode) {
+        return;
+    }
+    interruption_point();
+
+    CMutableTransaction mtx(tx_);
+    {
+        ProvingTimer provingTimer(*this);
+        if (!ProveJoinSplits(*pzcashParams, joinSplitPubKey_, mtx.vJoinSplit, jsProofWitnesses_)) {
+            throw std::runtime_error("error verifying joinsplit");
+        }
+    }
+
+    // The signature covers the proofs, so sign again
+    CScript scriptCode;
+    CTransaction signTx(mtx);
+    uint256 dataToBeSigned = SignatureHash(scriptCode, signTx, NOT_AN_INPUT, SIGHASH_ALL, 0, consensusBranchId_);
+    if (!(crypto_sign_detached(&mtx.joinSplitSig[0], NULL,
+            dataToBeSigned.begin(), 32,
+            joinSplitPrivKey_
+            ) == 0))
+    {
+        throw std::runtime_error("crypto_sign_detached failed");
+    }
+    if (!(crypto_sign_verify_detached(&mtx.joinSplitSig[0],
+            dataToBeSigned.begin(), 32,
+            mtx.joinSplitPubKey.begin()
+            ) == 0))
+    {
+        throw std::runtime_error("crypto_sign_verify_detached failed");
+    }
+
+    tx_ = CTransaction(mtx);
+    obj.pushKV("rawtxn", EncodeHexTx(tx_));
+}
+
 void AsyncRPCOperation_sendmany::add_taddr_outputs_to_tx() {
 
     CMutableTransaction rawTx(tx_);
@@ -1269,3 +1344,56 @@ UniValue AsyncRPCOperation_sendmany::getStatus() const {
     return obj;
 }
 
+
+/**
+ * Lock input utxos
+ */
+void AsyncRPCOperation_sendmany::lock_utxos() {
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    for (const SendManyInputUTXO& utxo : t_inputs_) {
+        COutPoint outpt(std::get<0>(utxo), std::get<1>(utxo));
+        pwalletMain->LockCoin(outpt);
+        locked_utxos_.push_back(outpt);
+    }
+}
+
+/**
+ * Unlock input utxos
+ */
+void AsyncRPCOperation_sendmany::unlock_utxos() {
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    for (COutPoint& outpt : locked_utxos_) {
+        pwalletMain->UnlockCoin(outpt);
+    }
+    locked_utxos_.clear();
+}
+
+/**
+ * Lock input notes
+ */
+void AsyncRPCOperation_sendmany::lock_notes(const std::vector<JSOutPoint>& sproutOPs, const std::vector<SaplingOutPoint>& saplingOPs) {
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    for (const JSOutPoint& jsop : sproutOPs) {
+        pwalletMain->LockNote(jsop);
+        locked_sprout_notes_.push_back(jsop);
+    }
+    for (const SaplingOutPoint& op : saplingOPs) {
+        pwalletMain->LockNote(op);
+        locked_sapling_notes_.push_back(op);
+    }
+}
+
+/**
+ * Unlock input notes
+ */
+void AsyncRPCOperation_sendmany::unlock_notes() {
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    for (const JSOutPoint& jsop : locked_sprout_notes_) {
+        pwalletMain->UnlockNote(jsop);
+    }
+    for (const SaplingOutPoint& op : locked_sapling_notes_) {
+        pwalletMain->UnlockNote(op);
+    }
+    locked_sprout_notes_.clear();
+    locked_sapling_notes_.clear();
+}
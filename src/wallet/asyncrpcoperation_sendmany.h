@@ -44,10 +44,14 @@ struct AsyncJoinSplitInfo
     CAmount vpub_new = 0;
 };
 
-// A struct to help us track the witness and anchor for a given JSOutPoint
+// A struct to help us track the witness and anchor for a given JSOutPoint,
+// along with the block that mined it as of when the witness was taken
 struct WitnessAnchorData {
 	boost::optional<SproutWitness> witness;
 	uint256 anchor;
+	uint256 blockHash;
+	int height = -1; // -1 if the block is not in mapBlockIndex
+	int depth = -1;
 };
 
 class AsyncRPCOperation_sendmany : public AsyncRPCOperation {
@@ -71,6 +75,10 @@ public:
     
     virtual void main();
 
+    virtual OperationPriority getPriority() const {
+        return OperationPriority::HIGH;
+    }
+
     virtual UniValue getStatus() const;
 
     bool testmode = false;  // Set to true to disable sending txs and generating proofs
@@ -105,12 +113,21 @@ private:
     std::vector<SendManyInputJSOP> z_sprout_inputs_;
     std::vector<SaplingNoteEntry> z_sapling_inputs_;
 
+    // Witnesses (and their anchor) of the Sapling notes to spend, which are
+    // the first z_sapling_witnesses_.size() entries of z_sapling_inputs_
+    std::vector<boost::optional<SaplingWitness>> z_sapling_witnesses_;
+    uint256 z_sapling_anchor_;
+
+    // Proof witnesses of the JoinSplits in tx_, whose proofs are created by
+    // prove_joinsplits() once all of them have been chained together
+    std::vector<ZCJSProofWitness> jsProofWitnesses_;
+
     TransactionBuilder builder_;
     CTransaction tx_;
 
     void add_taddr_change_output_to_tx(CReserveKey& keyChange, CAmount amount);
     void add_taddr_outputs_to_tx();
-    bool find_unspent_notes();
+    bool find_unspent_notes(CAmount targetAmount);
     bool find_utxos(bool fAcceptCoinbase);
     std::array<unsigned char, ZC_MEMO_SIZE> get_memo_from_hex_string(std::string s);
     bool main_impl();
@@ -127,6 +144,24 @@ private:
         std::vector<boost::optional < SproutWitness>> witnesses,
         uint256 anchor);
 
+    // Create the proofs of the JoinSplits added by perform_joinsplit, and
+    // sign the transaction again. Updates the raw transaction in obj.
+    void prove_joinsplits(UniValue& obj);
+
+    // The utxos and notes locked by this operation, which are unlocked when
+    // it finishes
+    std::vector<COutPoint> locked_utxos_;
+    std::vector<JSOutPoint> locked_sprout_notes_;
+    std::vector<SaplingOutPoint> locked_sapling_notes_;
+
+    void lock_utxos();
+
+    void unlock_utxos();
+
+    void lock_notes(const std::vector<JSOutPoint>& sproutOPs, const std::vector<SaplingOutPoint>& saplingOPs);
+
+    void unlock_notes();
+
     // payment disclosure!
     std::vector<PaymentDisclosureKeyInfo> paymentDisclosureData_;
 };
@@ -157,8 +192,8 @@ public:
         delegate->add_taddr_outputs_to_tx();
     }
     
-    bool find_unspent_notes() {
-        return delegate->find_unspent_notes();
+    bool find_unspent_notes(CAmount targetAmount) {
+        return delegate->find_unspent_notes(targetAmount);
     }
 
     bool find_utxos(bool fAcceptCoinbase) {
@@ -142,7 +142,7 @@ void AsyncRPCOperation_shieldcoinbase::main() {
     if (success) {
         set_state(OperationStatus::SUCCESS);
     } else {
-        set_state(OperationStatus::FAILED);
+        set_state(unsuccessful_state());
     }
 
     std::string s = strprintf("%s: z_shieldcoinbase finished (status=%s", getId(), getStateAsString());
@@ -258,7 +258,11 @@ bool ShieldToAddress::operator()(const libzcash::SaplingPaymentAddress &zaddr) c
     m_op->builder_.SendChangeTo(zaddr, ovk);
 
     // Build the transaction
-    m_op->tx_ = m_op->builder_.Build().GetTxOrThrow();
+    m_op->interruption_point();
+    {
+        AsyncRPCOperation_shieldcoinbase::ProvingTimer provingTimer(*m_op);
+        m_op->tx_ = m_op->builder_.Build().GetTxOrThrow();
+    }
 
     UniValue sendResult = SendTransaction(m_op->tx_, boost::none, m_op->testmode);
     m_op->set_result(sendResult);
@@ -272,6 +276,8 @@ bool ShieldToAddress::operator()(const libzcash::InvalidEncoding& no) const {
 
 
 UniValue AsyncRPCOperation_shieldcoinbase::perform_joinsplit(ShieldCoinbaseJSInfo & info) {
+    interruption_point();
+
     uint32_t consensusBranchId;
     uint256 anchor;
     {
@@ -319,6 +325,7 @@ UniValue AsyncRPCOperation_shieldcoinbase::perform_joinsplit(ShieldCoinbaseJSInf
     uint256 esk; // payment disclosure - secret
 
     assert(mtx.fOverwintered && (mtx.nVersion >= SAPLING_TX_VERSION));
+    ProvingTimer provingTimer(*this);
     JSDescription jsdesc = JSDescription::Randomized(
             *pzcashParams,
             joinSplitPubKey_,
@@ -331,6 +338,7 @@ UniValue AsyncRPCOperation_shieldcoinbase::perform_joinsplit(ShieldCoinbaseJSInf
             info.vpub_new,
             !this->testmode,
             &esk); // parameter expects pointer to esk, so pass in address
+    provingTimer.stop();
     {
         auto verifier = libzcash::ProofVerifier::Strict();
         if (!(jsdesc.Verify(*pzcashParams, verifier, joinSplitPubKey_))) {
@@ -59,6 +59,10 @@ public:
 
     virtual void main();
 
+    virtual OperationPriority getPriority() const {
+        return OperationPriority::LOW;
+    }
+
     virtual UniValue getStatus() const;
 
     bool testmode = false;  // Set to true to disable sending txs and generating proofs
@@ -488,7 +488,7 @@ bool CCryptoKeyStore::AddCryptedSproutSpendingKey(
             return false;
 
         mapCryptedSproutSpendingKeys[address] = vchCryptedSecret;
-        mapNoteDecryptors.insert(std::make_pair(address, ZCNoteDecryption(rk)));
+        AddNoteDecryptor(address, rk);
     }
     return true;
 }
@@ -548,6 +548,18 @@ bool CCryptoKeyStore::GetSaplingSpendingKey(const libzcash::SaplingFullViewingKe
     return false;
 }
 
+bool CCryptoKeyStore::RemoveSaplingSpendingKey(const libzcash::SaplingExtendedSpendingKey &sk)
+{
+    {
+        LOCK(cs_SpendingKeyStore);
+        if (!IsCrypted())
+            return CBasicKeyStore::RemoveSaplingSpendingKey(sk);
+
+        mapCryptedSaplingSpendingKeys.erase(sk.ToXFVK());
+    }
+    return true;
+}
+
 bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn)
 {
     {
@@ -262,6 +262,7 @@ public:
         return false;
     }
     bool GetSaplingSpendingKey(const libzcash::SaplingFullViewingKey &fvk, libzcash::SaplingExtendedSpendingKey &skOut) const;
+    bool RemoveSaplingSpendingKey(const libzcash::SaplingExtendedSpendingKey &sk);
 
 
     /**
@@ -153,6 +153,16 @@ CDBEnv::VerifyResult CDBEnv::Verify(const std::string& strFile, bool (*recoverFu
     LOCK(cs_db);
     assert(mapFileUseCount.count(strFile) == 0);
 
+    if (IsLogFile(strFile)) {
+        // Replaying the log checks every batch. A corrupt log is left alone,
+        // to be restored from a backup or salvaged with -salvagewallet.
+        CWalletLog log;
+        if (log.Open(boost::filesystem::path(strPath) / strFile, false))
+            return VERIFY_OK;
+        LogPrintf("CDBEnv::Verify: Can't read the wallet log %s; restore it from a backup, or run with -salvagewallet to recover its keys\n", strFile);
+        return RECOVER_FAIL;
+    }
+
     Db db(dbenv, 0);
     int result = db.verify(strFile.c_str(), NULL, NULL, 0);
     if (result == 0)
@@ -170,6 +180,9 @@ bool CDBEnv::Salvage(const std::string& strFile, bool fAggressive, std::vector<C
     LOCK(cs_db);
     assert(mapFileUseCount.count(strFile) == 0);
 
+    if (IsLogFile(strFile))
+        return CWalletLog::Salvage(boost::filesystem::path(strPath) / strFile, vResult);
+
     u_int32_t flags = DB_SALVAGE;
     if (fAggressive)
         flags |= DB_AGGRESSIVE;
@@ -218,13 +231,37 @@ bool CDBEnv::Salvage(const std::string& strFile, bool fAggressive, std::vector<C
 void CDBEnv::CheckpointLSN(const std::string& strFile)
 {
     dbenv->txn_checkpoint(0, 0, 0);
-    if (fMockDb)
+    if (fMockDb || IsLogFile(strFile))
         return;
     dbenv->lsn_reset(strFile.c_str(), 0);
 }
 
+bool CDBEnv::IsLogFile(const std::string& strFile)
+{
+    if (fMockDb)
+        return false;
+    return CWalletLog::IsLogFile(boost::filesystem::path(strPath) / strFile);
+}
 
-CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), activeTxn(NULL)
+bool CDBEnv::FlushLog(const std::string& strFile)
+{
+    LOCK(cs_db);
+    std::map<std::string, CWalletLog*>::iterator mi = mapLogs.find(strFile);
+    if (mi == mapLogs.end())
+        return false;
+    if (mapFileUseCount.count(strFile) == 0 || mapFileUseCount[strFile] == 0)
+        mi->second->MaybeCompact();
+    mi->second->Flush();
+    return true;
+}
+
+
+WalletFormat GetWalletFormat()
+{
+    return GetArg("-walletformat", "bdb") == "log" ? WALLET_FORMAT_LOG : WALLET_FORMAT_BDB;
+}
+
+CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), plog(NULL), activeTxn(NULL)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -244,6 +281,38 @@ CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnClose
 
         strFile = strFilename;
         ++bitdb.mapFileUseCount[strFile];
+
+        // The backend of an existing file is recognised from its contents,
+        // that of a new file comes from -walletformat
+        std::map<std::string, CWalletLog*>::iterator mi = bitdb.mapLogs.find(strFile);
+        if (mi != bitdb.mapLogs.end()) {
+            plog = mi->second;
+            return;
+        }
+        boost::filesystem::path pathFile = GetDataDir() / strFile;
+        std::map<std::string, Db*>::iterator mdi = bitdb.mapDb.find(strFile);
+        bool fDbOpen = mdi != bitdb.mapDb.end() && mdi->second != NULL;
+        if (!fDbOpen && !bitdb.IsMock() &&
+            (bitdb.IsLogFile(strFile) ||
+             (fCreate && GetWalletFormat() == WALLET_FORMAT_LOG && !boost::filesystem::exists(pathFile)))) {
+            plog = new CWalletLog();
+            if (!plog->Open(pathFile, fCreate)) {
+                delete plog;
+                plog = NULL;
+                --bitdb.mapFileUseCount[strFile];
+                throw runtime_error(strprintf("CDB: Can't open wallet log %s", strFile));
+            }
+            bitdb.mapLogs[strFile] = plog;
+
+            if (fCreate && !Exists(string("version"))) {
+                bool fTmp = fReadOnly;
+                fReadOnly = false;
+                WriteVersion(CLIENT_VERSION);
+                fReadOnly = fTmp;
+            }
+            return;
+        }
+
         pdb = bitdb.mapDb[strFile];
         if (pdb == NULL) {
             pdb = new Db(bitdb.dbenv, 0);
@@ -285,9 +354,15 @@ CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnClose
 
 void CDB::Flush()
 {
-    if (activeTxn)
+    if (activeTxn || activeLogTxn)
         return;
 
+    if (plog) {
+        // Appended records only need to reach the disk
+        plog->Flush();
+        return;
+    }
+
     // Flush database activity from memory pool to disk log
     unsigned int nMinutes = 0;
     if (fReadOnly)
@@ -298,15 +373,17 @@ void CDB::Flush()
 
 void CDB::Close()
 {
-    if (!pdb)
+    if (!pdb && !plog)
         return;
     if (activeTxn)
         activeTxn->abort();
     activeTxn = NULL;
-    pdb = NULL;
+    activeLogTxn = boost::none;
 
     if (fFlushOnClose)
         Flush();
+    pdb = NULL;
+    plog = NULL;
 
     {
         LOCK(bitdb.cs_db);
@@ -314,10 +391,81 @@ void CDB::Close()
     }
 }
 
+bool CDB::LogRead(const CDataStream& ssKey, CDataStream& ssValue)
+{
+    CWalletLog::Bytes key(ssKey.begin(), ssKey.end());
+    if (activeLogTxn) {
+        // Reads see the writes of the active transaction
+        for (CWalletLog::Batch::const_reverse_iterator it = activeLogTxn->rbegin(); it != activeLogTxn->rend(); ++it) {
+            if (it->first == key) {
+                if (!it->second)
+                    return false;
+                ssValue.write((const char*)it->second->data(), it->second->size());
+                return true;
+            }
+        }
+    }
+    CWalletLog::Bytes value;
+    if (!plog->Read(key, value))
+        return false;
+    ssValue.write((const char*)value.data(), value.size());
+    memset(value.data(), 0, value.size());
+    return true;
+}
+
+bool CDB::LogWrite(const CDataStream& ssKey, const CDataStream* pssValue)
+{
+    CWalletLog::Update update;
+    update.first.assign(ssKey.begin(), ssKey.end());
+    if (pssValue)
+        update.second = CWalletLog::Bytes(pssValue->begin(), pssValue->end());
+    if (activeLogTxn) {
+        activeLogTxn->push_back(update);
+        return true;
+    }
+    return plog->Write(CWalletLog::Batch(1, update));
+}
+
+int CDB::LogReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+{
+    // Cursors see the committed records only
+    CWalletLog::Bytes key, value;
+    bool fFound;
+    if (fFlags == DB_SET_RANGE)
+        fFound = plog->Seek(CWalletLog::Bytes(ssKey.begin(), ssKey.end()), true, key, value);
+    else if (fFlags != DB_NEXT)
+        return EINVAL;
+    else if (pcursor->fStarted)
+        fFound = plog->Seek(pcursor->vchLastKey, false, key, value);
+    else
+        fFound = plog->First(key, value);
+    if (!fFound)
+        return DB_NOTFOUND;
+
+    pcursor->fStarted = true;
+    pcursor->vchLastKey = key;
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write((const char*)key.data(), key.size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    ssValue.write((const char*)value.data(), value.size());
+    memset(value.data(), 0, value.size());
+    return 0;
+}
+
 void CDBEnv::CloseDb(const string& strFile)
 {
     {
         LOCK(cs_db);
+        std::map<std::string, CWalletLog*>::iterator mi = mapLogs.find(strFile);
+        if (mi != mapLogs.end()) {
+            CWalletLog* plog = mi->second;
+            plog->MaybeCompact();
+            plog->Close();
+            delete plog;
+            mapLogs.erase(mi);
+        }
         if (mapDb[strFile] != NULL) {
             // Close the database handle
             Db* pdb = mapDb[strFile];
@@ -348,6 +496,22 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                 bitdb.CheckpointLSN(strFile);
                 bitdb.mapFileUseCount.erase(strFile);
 
+                if (bitdb.IsLogFile(strFile)) {
+                    // Compacting a log drops everything but the live records
+                    LogPrintf("CDB::Rewrite: Compacting %s...\n", strFile);
+                    CWalletLog log;
+                    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+                    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+                    ssKey << string("version");
+                    ssValue << CLIENT_VERSION;
+                    CWalletLog::Batch batch(1, std::make_pair(CWalletLog::Bytes(ssKey.begin(), ssKey.end()),
+                                                              CWalletLog::Bytes(ssValue.begin(), ssValue.end())));
+                    bool fSuccess = log.Open(GetDataDir() / strFile, false) && log.Compact(pszSkip) && log.Write(batch);
+                    if (!fSuccess)
+                        LogPrintf("CDB::Rewrite: Failed to compact wallet log %s\n", strFile);
+                    return fSuccess;
+                }
+
                 bool fSuccess = true;
                 LogPrintf("CDB::Rewrite: Rewriting %s...\n", strFile);
                 string strFileRes = strFile + ".rewrite";
@@ -366,7 +530,7 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess) {
                             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
@@ -420,6 +584,92 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
     return false;
 }
 
+bool CDB::Convert(const string& strFile, WalletFormat format)
+{
+    LOCK(bitdb.cs_db);
+    if (bitdb.IsMock() || (bitdb.mapFileUseCount.count(strFile) && bitdb.mapFileUseCount[strFile] != 0))
+        return false;
+    bool fLog = bitdb.IsLogFile(strFile);
+    if (fLog == (format == WALLET_FORMAT_LOG))
+        return true;
+
+    LogPrintf("CDB::Convert: Converting %s to a %s\n", strFile, fLog ? "Berkeley database" : "wallet log");
+    int64_t nStart = GetTimeMillis();
+
+    // Read all records
+    std::vector<CDBEnv::KeyValPair> vRecords;
+    {
+        CDB db(strFile, "r");
+        CDBCursor* pcursor = db.GetCursor();
+        if (!pcursor)
+            return false;
+        while (true) {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
+            if (ret == DB_NOTFOUND)
+                break;
+            if (ret != 0) {
+                pcursor->close();
+                return error("CDB::Convert: Can't read %s", strFile);
+            }
+            vRecords.push_back(make_pair(CWalletLog::Bytes(ssKey.begin(), ssKey.end()),
+                                         CWalletLog::Bytes(ssValue.begin(), ssValue.end())));
+        }
+        pcursor->close();
+    }
+    bitdb.CloseDb(strFile);
+    bitdb.CheckpointLSN(strFile);
+    bitdb.mapFileUseCount.erase(strFile);
+
+    // Write them to a new file in the other format
+    string strFileRes = strFile + ".convert";
+    boost::filesystem::path pathFile = GetDataDir() / strFile;
+    boost::filesystem::path pathFileRes = GetDataDir() / strFileRes;
+    boost::filesystem::remove(pathFileRes);
+    if (format == WALLET_FORMAT_LOG) {
+        CWalletLog log;
+        CWalletLog::Batch batch;
+        for (const CDBEnv::KeyValPair& record : vRecords)
+            batch.push_back(make_pair(record.first, record.second));
+        if (!log.Open(pathFileRes, true) || !log.Write(batch) || !log.Flush())
+            return error("CDB::Convert: Can't write %s", strFileRes);
+    } else {
+        Db* pdbCopy = new Db(bitdb.dbenv, 0);
+        int ret = pdbCopy->open(NULL, strFileRes.c_str(), "main", DB_BTREE, DB_CREATE, 0);
+        bool fSuccess = (ret == 0);
+        for (CDBEnv::KeyValPair& record : vRecords) {
+            if (!fSuccess)
+                break;
+            Dbt datKey(record.first.data(), record.first.size());
+            Dbt datValue(record.second.data(), record.second.size());
+            fSuccess = (pdbCopy->put(NULL, &datKey, &datValue, DB_NOOVERWRITE) == 0);
+        }
+        if (ret == 0 && pdbCopy->close(0))
+            fSuccess = false;
+        delete pdbCopy;
+        if (!fSuccess)
+            return error("CDB::Convert: Can't write %s", strFileRes);
+        bitdb.CheckpointLSN(strFileRes);
+    }
+    for (CDBEnv::KeyValPair& record : vRecords) {
+        memset(record.first.data(), 0, record.first.size());
+        memset(record.second.data(), 0, record.second.size());
+    }
+
+    // Keep the original as a backup and put the new file in its place
+    boost::filesystem::path pathBackup = GetDataDir() / strprintf("%s.%d.bak", strFile, GetTime());
+    try {
+        boost::filesystem::rename(pathFile, pathBackup);
+        boost::filesystem::rename(pathFileRes, pathFile);
+    } catch (const boost::filesystem::filesystem_error& e) {
+        return error("CDB::Convert: Can't replace %s: %s", strFile, e.what());
+    }
+    LogPrintf("CDB::Convert: Converted %u records in %dms, original saved as %s\n",
+              vRecords.size(), GetTimeMillis() - nStart, pathBackup.string());
+    return true;
+}
+
 
 void CDBEnv::Flush(bool fShutdown)
 {
@@ -441,13 +691,23 @@ void CDBEnv::Flush(bool fShutdown)
                 LogPrint("db", "CDBEnv::Flush: %s checkpoint\n", strFile);
                 dbenv->txn_checkpoint(0, 0, 0);
                 LogPrint("db", "CDBEnv::Flush: %s detach\n", strFile);
-                if (!fMockDb)
+                if (!fMockDb && !IsLogFile(strFile))
                     dbenv->lsn_reset(strFile.c_str(), 0);
                 LogPrint("db", "CDBEnv::Flush: %s closed\n", strFile);
                 mapFileUseCount.erase(mi++);
             } else
                 mi++;
         }
+        if (fShutdown) {
+            // Idle wallet logs are kept open (see FlushLog) without a use count
+            std::vector<std::string> vLogs;
+            for (const std::pair<std::string, CWalletLog*>& item : mapLogs) {
+                if (mapFileUseCount.count(item.first) == 0)
+                    vLogs.push_back(item.first);
+            }
+            for (const std::string& strLog : vLogs)
+                CloseDb(strLog);
+        }
         LogPrint("db", "CDBEnv::Flush: Flush(%s)%s took %15dms\n", fShutdown ? "true" : "false", fDbEnvInit ? "" : " database not started", GetTimeMillis() - nStart);
         if (fShutdown) {
             char** listp;
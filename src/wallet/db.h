@@ -11,6 +11,7 @@
 #include "streams.h"
 #include "sync.h"
 #include "version.h"
+#include "wallet/walletlog.h"
 
 #include <map>
 #include <string>
@@ -38,6 +39,7 @@ public:
     DbEnv *dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    std::map<std::string, CWalletLog*> mapLogs;  //!< files using the log backend instead
 
     CDBEnv();
     ~CDBEnv();
@@ -58,7 +60,8 @@ public:
     VerifyResult Verify(const std::string& strFile, bool (*recoverFunc)(CDBEnv& dbenv, const std::string& strFile));
     /**
      * Salvage data from a file that Verify says is bad.
-     * fAggressive sets the DB_AGGRESSIVE flag (see berkeley DB->verify() method documentation).
+     * fAggressive sets the DB_AGGRESSIVE flag (see berkeley DB->verify() method documentation);
+     * a wallet log is always salvaged aggressively, skipping corrupt batches.
      * Appends binary key/value pairs to vResult, returns true if successful.
      * NOTE: reads the entire database into memory, so cannot be used
      * for huge databases.
@@ -72,6 +75,14 @@ public:
     void CheckpointLSN(const std::string& strFile);
 
     void CloseDb(const std::string& strFile);
+    /** Whether strFile (in the data directory) uses the log backend */
+    bool IsLogFile(const std::string& strFile);
+    /**
+     * Sync (and compact, if worthwhile) strFile if it is an open wallet log,
+     * which, unlike a Berkeley database, stays open and self-contained.
+     * Returns false if it isn't one.
+     */
+    bool FlushLog(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
     DbTxn* TxnBegin(int flags = DB_TXN_WRITE_NOSYNC)
@@ -86,14 +97,48 @@ public:
 
 extern CDBEnv bitdb;
 
+/** Storage backend of a wallet file, chosen with -walletformat when it is created */
+enum WalletFormat
+{
+    WALLET_FORMAT_BDB,
+    WALLET_FORMAT_LOG
+};
+
+/** Backend for new wallet files, as selected with -walletformat */
+WalletFormat GetWalletFormat();
+
+/**
+ * Cursor over the records of a CDB, for either backend. A log cursor
+ * remembers the last key it returned, so it stays valid across writes.
+ */
+class CDBCursor
+{
+public:
+    Dbc* pcursor;
+    bool fStarted;
+    CWalletLog::Bytes vchLastKey;
+
+    explicit CDBCursor(Dbc* pcursorIn) : pcursor(pcursorIn), fStarted(false) { }
+
+    /** Like Dbc::close(), this frees the cursor. */
+    void close()
+    {
+        if (pcursor)
+            pcursor->close();
+        delete this;
+    }
+};
+
 
 /** RAII class that provides access to a Berkeley database */
 class CDB
 {
 protected:
     Db* pdb;
+    CWalletLog* plog;
     std::string strFile;
     DbTxn* activeTxn;
+    boost::optional<CWalletLog::Batch> activeLogTxn;
     bool fReadOnly;
     bool fFlushOnClose;
 
@@ -108,17 +153,34 @@ private:
     CDB(const CDB&);
     void operator=(const CDB&);
 
+    bool LogRead(const CDataStream& ssKey, CDataStream& ssValue);
+    bool LogWrite(const CDataStream& ssKey, const CDataStream* pssValue);
+    int LogReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags);
+
 protected:
     template <typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (plog) {
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            bool fFound = LogRead(ssKey, ssValue);
+            memset(&ssKey[0], 0, ssKey.size());
+            if (!fFound)
+                return false;
+            try {
+                ssValue >> value;
+            } catch (const std::exception&) {
+                return false;
+            }
+            return true;
+        }
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
@@ -146,7 +208,7 @@ protected:
     template <typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite = true)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
@@ -155,12 +217,20 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+
+        if (plog) {
+            CDataStream ssExisting(SER_DISK, CLIENT_VERSION);
+            bool fSuccess = (fOverwrite || !LogRead(ssKey, ssExisting)) && LogWrite(ssKey, &ssValue);
+            memset(&ssKey[0], 0, ssKey.size());
+            memset(&ssValue[0], 0, ssValue.size());
+            return fSuccess;
+        }
+        Dbt datKey(&ssKey[0], ssKey.size());
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
@@ -175,7 +245,7 @@ protected:
     template <typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
@@ -184,6 +254,11 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (plog) {
+            bool fSuccess = LogWrite(ssKey, NULL);
+            memset(&ssKey[0], 0, ssKey.size());
+            return fSuccess;
+        }
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
@@ -197,13 +272,17 @@ protected:
     template <typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (plog) {
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            return LogRead(ssKey, ssValue);
+        }
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
@@ -214,19 +293,25 @@ protected:
         return (ret == 0);
     }
 
-    Dbc* GetCursor()
+    CDBCursor* GetCursor()
     {
+        if (plog)
+            return new CDBCursor(NULL);
         if (!pdb)
             return NULL;
         Dbc* pcursor = NULL;
         int ret = pdb->cursor(NULL, &pcursor, 0);
         if (ret != 0)
             return NULL;
-        return pcursor;
+        return new CDBCursor(pcursor);
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags = DB_NEXT)
+    int ReadAtCursor(CDBCursor* pcursorIn, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags = DB_NEXT)
     {
+        if (!pcursorIn->pcursor)
+            return LogReadAtCursor(pcursorIn, ssKey, ssValue, fFlags);
+        Dbc* pcursor = pcursorIn->pcursor;
+
         // Read at cursor
         Dbt datKey;
         if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE) {
@@ -265,6 +350,12 @@ protected:
 public:
     bool TxnBegin()
     {
+        if (plog) {
+            if (activeLogTxn)
+                return false;
+            activeLogTxn = CWalletLog::Batch();
+            return true;
+        }
         if (!pdb || activeTxn)
             return false;
         DbTxn* ptxn = bitdb.TxnBegin();
@@ -276,6 +367,13 @@ public:
 
     bool TxnCommit()
     {
+        if (plog) {
+            if (!activeLogTxn)
+                return false;
+            bool fSuccess = plog->Write(*activeLogTxn);
+            activeLogTxn = boost::none;
+            return fSuccess;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->commit(0);
@@ -285,6 +383,12 @@ public:
 
     bool TxnAbort()
     {
+        if (plog) {
+            if (!activeLogTxn)
+                return false;
+            activeLogTxn = boost::none;
+            return true;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->abort();
@@ -304,6 +408,12 @@ public:
     }
 
     bool static Rewrite(const std::string& strFile, const char* pszSkip = NULL);
+    /**
+     * Copy all records of strFile to a new file using the given backend and
+     * replace strFile with it. The original is kept as strFile.{timestamp}.bak.
+     * strFile must not be open.
+     */
+    bool static Convert(const std::string& strFile, WalletFormat format);
 };
 
 #endif // BITCOIN_WALLET_DB_H
@@ -1,11 +1,18 @@
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <sodium.h>
 
+#include "arith_uint256.h"
 #include "base58.h"
 #include "chainparams.h"
+#include "crypto/equihash.h"
 #include "key_io.h"
 #include "main.h"
+#include "pow.h"
 #include "primitives/block.h"
 #include "random.h"
 #include "transaction_builder.h"
@@ -544,6 +551,40 @@ TEST(WalletTests, FindMySaplingNotes) {
     RegtestDeactivateSapling();
 }
 
+TEST(WalletTests, FindMySaplingNotesWithKeySnapshot) {
+    auto consensusParams = RegtestActivateSapling();
+
+    TestWallet wallet;
+
+    auto sk = GetTestMasterSaplingSpendingKey();
+    auto expsk = sk.expsk;
+    auto fvk = expsk.full_viewing_key();
+    auto ivk = fvk.in_viewing_key();
+    auto pa = sk.DefaultAddress();
+
+    auto testNote = GetTestSaplingNote(pa, 50000);
+
+    auto builder = TransactionBuilder(consensusParams, 1);
+    builder.AddSaplingSpend(expsk, testNote.note, testNote.tree.root(), testNote.tree.witness());
+    builder.AddSaplingOutput(fvk.ovk, pa, 25000, {});
+    auto tx = builder.Build().GetTxOrThrow();
+
+    // Nothing is found without keys, whatever the wallet contains
+    ASSERT_TRUE(wallet.AddSaplingZKey(sk, pa));
+    std::vector<libzcash::SaplingIncomingViewingKey> ivks;
+    EXPECT_EQ(0, wallet.FindMySaplingNotes(tx, ivks).first.size());
+
+    // The snapshot variant reports the address even if the wallet knows it
+    ivks.push_back(ivk);
+    auto result = wallet.FindMySaplingNotes(tx, ivks);
+    EXPECT_EQ(2, result.first.size());
+    EXPECT_EQ(1, result.second.count(pa));
+    EXPECT_EQ(0, wallet.FindMySaplingNotes(tx).second.size());
+
+    // Revert to default
+    RegtestDeactivateSapling();
+}
+
 TEST(WalletTests, FindMySproutNotes) {
     CWallet wallet;
 
@@ -1518,6 +1559,191 @@ TEST(WalletTests, ClearNoteWitnessCache) {
     EXPECT_EQ(0, wallet.nWitnessCacheSize);
 }
 
+TEST(WalletTests, NotePositionsWithoutWitnessCache) {
+    TestWallet wallet;
+    SproutMerkleTree sproutTree;
+    SaplingMerkleTree saplingTree;
+    fCacheNoteWitnesses = false;
+
+    auto sk = libzcash::SproutSpendingKey::random();
+    wallet.AddSproutSpendingKey(sk);
+
+    CBlock block1;
+    CBlockIndex index1(block1);
+    index1.nHeight = 1;
+    auto outpts = CreateValidBlock(wallet, sk, index1, block1, sproutTree, saplingTree);
+    auto hash = outpts.first.hash;
+
+    // Only the note's own position is recorded
+    EXPECT_EQ(1, wallet.mapWallet[hash].mapSproutNoteData[outpts.first].witnesses.size());
+    EXPECT_EQ(1, wallet.mapWallet[hash].mapSproutNoteData[outpts.first].witnessHeight);
+    EXPECT_EQ(1, wallet.mapWallet[hash].mapSaplingNoteData[outpts.second].witnesses.size());
+    EXPECT_EQ(0, wallet.nWitnessCacheSize);
+
+    // Connecting another block doesn't touch it
+    CBlock block2;
+    CBlockIndex index2(block2);
+    index2.nHeight = 2;
+    auto outpts2 = CreateValidBlock(wallet, sk, index2, block2, sproutTree, saplingTree);
+    EXPECT_EQ(1, wallet.mapWallet[hash].mapSproutNoteData[outpts.first].witnesses.size());
+    EXPECT_EQ(1, wallet.mapWallet[hash].mapSproutNoteData[outpts.first].witnessHeight);
+
+    // Disconnecting the second block forgets the position of its notes only
+    wallet.DecrementNoteWitnesses(&index2);
+    auto hash2 = outpts2.first.hash;
+    EXPECT_TRUE(wallet.mapWallet[hash2].mapSproutNoteData[outpts2.first].witnesses.empty());
+    EXPECT_EQ(-1, wallet.mapWallet[hash2].mapSaplingNoteData[outpts2.second].witnessHeight);
+    EXPECT_EQ(1, wallet.mapWallet[hash].mapSproutNoteData[outpts.first].witnesses.size());
+    EXPECT_EQ(1, wallet.mapWallet[hash].mapSaplingNoteData[outpts.second].witnesses.size());
+
+    fCacheNoteWitnesses = DEFAULT_CACHE_NOTE_WITNESSES;
+}
+
+#ifdef ENABLE_MINING
+// Witnesses are built from blocks on disk, which need a valid header
+class WitnessAnchorsCoinsView : public CCoinsView {
+public:
+    std::map<uint256, SproutMerkleTree> sproutTrees;
+    std::map<uint256, SaplingMerkleTree> saplingTrees;
+
+    bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const {
+        auto it = sproutTrees.find(rt);
+        if (it == sproutTrees.end())
+            return false;
+        tree = it->second;
+        return true;
+    }
+
+    bool GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const {
+        auto it = saplingTrees.find(rt);
+        if (it == saplingTrees.end())
+            return false;
+        tree = it->second;
+        return true;
+    }
+};
+
+static void SolveBlock(CBlock& block)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    block.nBits = UintToArith256(params.powLimit).GetCompact();
+
+    crypto_generichash_blake2b_state eh_state;
+    EhInitialiseState(params.nEquihashN, params.nEquihashK, eh_state);
+    CEquihashInput I{block};
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << I;
+    crypto_generichash_blake2b_update(&eh_state, (unsigned char*)&ss[0], ss.size());
+
+    while (true) {
+        block.nNonce = ArithToUint256(UintToArith256(block.nNonce) + 1);
+        crypto_generichash_blake2b_state curr_state = eh_state;
+        crypto_generichash_blake2b_update(&curr_state, block.nNonce.begin(), block.nNonce.size());
+        std::function<bool(std::vector<unsigned char>)> validBlock =
+                [&block, &params](std::vector<unsigned char> soln) {
+            block.nSolution = soln;
+            return CheckProofOfWork(block.GetHash(), block.nBits, params);
+        };
+        if (EhBasicSolveUncancellable(params.nEquihashN, params.nEquihashK, curr_state, validBlock))
+            return;
+    }
+}
+
+template<typename Witness>
+static void ExpectSameWitness(const Witness& expected, const boost::optional<Witness>& witness)
+{
+    ASSERT_TRUE((bool) witness);
+    EXPECT_EQ(expected.root(), witness->root());
+    EXPECT_EQ(expected.position(), witness->position());
+    EXPECT_EQ(expected.path().authentication_path, witness->path().authentication_path);
+    EXPECT_EQ(expected.path().index, witness->path().index);
+}
+
+TEST(WalletTests, BuildWitnessesMatchesCachedWitnesses) {
+    SelectParams(CBaseChainParams::REGTEST);
+
+    TestWallet wallet;
+    auto sk = libzcash::SproutSpendingKey::random();
+    wallet.AddSproutSpendingKey(sk);
+
+    WitnessAnchorsCoinsView view;
+    CCoinsViewCache coins(&view);
+    CCoinsViewCache* pcoinsTipOld = pcoinsTip;
+    pcoinsTip = &coins;
+
+    // Connect a few blocks, caching witnesses as usual, and write them to
+    // disk with the tree states before each of them in the coins view
+    const size_t numBlocks = 4;
+    std::vector<CBlock> blocks(numBlocks);
+    std::vector<CBlockIndex> indices(numBlocks);
+    std::vector<std::pair<JSOutPoint, SaplingOutPoint>> outpts;
+    SproutMerkleTree sproutTree;
+    SaplingMerkleTree saplingTree;
+    for (size_t i = 0; i < numBlocks; i++) {
+        CBlockIndex& index = indices[i];
+        index.nHeight = i;
+        index.pprev = i > 0 ? &indices[i - 1] : NULL;
+        index.hashSproutAnchor = sproutTree.root();
+        view.sproutTrees[sproutTree.root()] = sproutTree;
+        view.saplingTrees[saplingTree.root()] = saplingTree;
+        outpts.push_back(CreateValidBlock(wallet, sk, index, blocks[i], sproutTree, saplingTree));
+        index.hashFinalSproutRoot = sproutTree.root();
+        index.hashFinalSaplingRoot = saplingTree.root();
+
+        blocks[i].hashPrevBlock = i > 0 ? indices[i - 1].GetBlockHash() : uint256();
+        blocks[i].hashMerkleRoot = blocks[i].BuildMerkleTree();
+        SolveBlock(blocks[i]);
+        BlockMap::iterator mi = mapBlockIndex.insert(std::make_pair(blocks[i].GetHash(), &index)).first;
+        index.phashBlock = &mi->first;
+        CDiskBlockPos pos(1000 + i, 0);
+        ASSERT_TRUE(WriteBlockToDisk(blocks[i], pos, Params().MessageStart()));
+        index.nFile = pos.nFile;
+        index.nDataPos = pos.nPos;
+        index.nStatus |= BLOCK_HAVE_DATA;
+    }
+    chainActive.SetTip(&indices.back());
+
+    std::vector<std::pair<uint256, uint256>> sproutNotes;
+    std::vector<std::pair<uint256, uint256>> saplingNotes;
+    for (size_t i = 0; i < numBlocks; i++) {
+        const CTransaction& tx = blocks[i].vtx[0];
+        const JSOutPoint& jsop = outpts[i].first;
+        sproutNotes.push_back(std::make_pair(indices[i].GetBlockHash(), tx.vJoinSplit[jsop.js].commitments[jsop.n]));
+        saplingNotes.push_back(std::make_pair(indices[i].GetBlockHash(), tx.vShieldedOutput[outpts[i].second.n].cm));
+    }
+
+    // Witnesses built at the tip from the blocks on disk are the cached ones
+    std::vector<boost::optional<SproutWitness>> sproutWitnesses;
+    std::vector<boost::optional<SaplingWitness>> saplingWitnesses;
+    ASSERT_TRUE(BuildSproutWitnesses(sproutNotes, chainActive.Tip(), sproutWitnesses));
+    ASSERT_TRUE(BuildSaplingWitnesses(saplingNotes, chainActive.Tip(), saplingWitnesses));
+    for (size_t i = 0; i < numBlocks; i++) {
+        const CWalletTx& wtx = wallet.mapWallet[outpts[i].first.hash];
+        ExpectSameWitness(wtx.mapSproutNoteData.at(outpts[i].first).witnesses.front(), sproutWitnesses[i]);
+        ExpectSameWitness(wtx.mapSaplingNoteData.at(outpts[i].second).witnesses.front(), saplingWitnesses[i]);
+    }
+
+    // At an earlier anchor, notes mined after it aren't witnessed
+    ASSERT_TRUE(BuildSproutWitnesses(sproutNotes, &indices[1], sproutWitnesses));
+    ASSERT_TRUE(BuildSaplingWitnesses(saplingNotes, &indices[1], saplingWitnesses));
+    for (size_t i = 0; i < numBlocks; i++) {
+        EXPECT_EQ(i <= 1, (bool) sproutWitnesses[i]);
+        EXPECT_EQ(i <= 1, (bool) saplingWitnesses[i]);
+    }
+    EXPECT_EQ(indices[1].hashFinalSproutRoot, sproutWitnesses[0]->root());
+    EXPECT_EQ(indices[1].hashFinalSaplingRoot, saplingWitnesses[1]->root());
+
+    // Tear down
+    chainActive.SetTip(NULL);
+    for (size_t i = 0; i < numBlocks; i++) {
+        uint256 hash = indices[i].GetBlockHash();
+        boost::filesystem::remove(GetBlockPosFilename(indices[i].GetBlockPos(), "blk"));
+        mapBlockIndex.erase(hash);
+    }
+    pcoinsTip = pcoinsTipOld;
+}
+#endif // ENABLE_MINING
+
 TEST(WalletTests, WriteWitnessCache) {
     TestWallet wallet;
     MockWalletDB walletdb;
@@ -1719,6 +1945,130 @@ TEST(WalletTests, UpdateSproutNullifierNoteMap) {
     EXPECT_EQ(1, wallet.mapSproutNullifiersToNotes[nullifier].n);
 }
 
+TEST(WalletTests, UpdateNullifierNoteMapMatchesSerialDerivation) {
+    TestWallet wallet;
+
+    std::vector<libzcash::SproutSpendingKey> keys;
+    for (int i = 0; i < 2; i++) {
+        keys.push_back(libzcash::SproutSpendingKey::random());
+        wallet.AddSproutSpendingKey(keys.back());
+    }
+    auto otherSk = libzcash::SproutSpendingKey::random();
+
+    // Notes without nullifiers, as if they were found while the wallet was
+    // locked, and the nullifiers derived one note at a time
+    std::map<uint256, JSOutPoint> expected;
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 6; i++) {
+        const auto& sk = keys[i % keys.size()];
+        auto wtx = GetValidSproutReceive(sk, 10, true);
+        mapSproutNoteData_t noteData;
+        for (uint8_t n = 0; n < ZC_NUM_JS_OUTPUTS; n++) {
+            JSOutPoint jsoutpt {wtx.GetHash(), 0, n};
+            noteData[jsoutpt] = SproutNoteData {sk.address()};
+            expected[GetSproutNote(sk, wtx, 0, n).nullifier(sk)] = jsoutpt;
+        }
+        wtx.SetSproutNoteData(noteData);
+        wallet.AddToWallet(wtx, true, NULL);
+        vHashes.push_back(wtx.GetHash());
+    }
+
+    // A note of an address without a spending key in the wallet keeps no nullifier
+    auto otherWtx = GetValidSproutReceive(otherSk, 10, true);
+    mapSproutNoteData_t otherNoteData;
+    JSOutPoint otherJsoutpt {otherWtx.GetHash(), 0, 1};
+    otherNoteData[otherJsoutpt] = SproutNoteData {otherSk.address()};
+    otherWtx.SetSproutNoteData(otherNoteData);
+    wallet.AddToWallet(otherWtx, true, NULL);
+
+    EXPECT_TRUE(wallet.UpdateNullifierNoteMap());
+
+    EXPECT_EQ(expected, wallet.mapSproutNullifiersToNotes);
+    for (const uint256& hash : vHashes) {
+        for (const auto& item : wallet.mapWallet[hash].mapSproutNoteData) {
+            ASSERT_TRUE(item.second.nullifier);
+            EXPECT_EQ(1, expected.count(*item.second.nullifier));
+            EXPECT_EQ(item.first, expected[*item.second.nullifier]);
+        }
+    }
+    EXPECT_FALSE(wallet.mapWallet[otherWtx.GetHash()].mapSproutNoteData[otherJsoutpt].nullifier);
+
+    // Running it again doesn't change anything
+    EXPECT_TRUE(wallet.UpdateNullifierNoteMap());
+    EXPECT_EQ(expected, wallet.mapSproutNullifiersToNotes);
+}
+
+TEST(WalletTests, UpdateSaplingNullifierNoteMapForBlockMatchesSerialDerivation) {
+    auto consensusParams = RegtestActivateSapling();
+
+    TestWallet wallet;
+    LOCK2(cs_main, wallet.cs_wallet);
+
+    auto sk = GetTestMasterSaplingSpendingKey();
+    auto expsk = sk.expsk;
+    auto fvk = expsk.full_viewing_key();
+    auto ivk = fvk.in_viewing_key();
+    auto pa = sk.DefaultAddress();
+    ASSERT_TRUE(wallet.AddSaplingZKey(sk, pa));
+
+    // Two transactions with a payment and change to us each, in one block
+    CBlock block;
+    for (int i = 0; i < 2; i++) {
+        auto testNote = GetTestSaplingNote(pa, 50000);
+        auto builder = TransactionBuilder(consensusParams, 1);
+        builder.AddSaplingSpend(expsk, testNote.note, testNote.tree.root(), testNote.tree.witness());
+        builder.AddSaplingOutput(fvk.ovk, pa, 25000, {});
+        block.vtx.push_back(builder.Build().GetTxOrThrow());
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    auto blockHash = block.GetHash();
+    CBlockIndex fakeIndex {block};
+    mapBlockIndex.insert(std::make_pair(blockHash, &fakeIndex));
+    chainActive.SetTip(&fakeIndex);
+
+    for (const CTransaction& tx : block.vtx) {
+        CWalletTx wtx {&wallet, tx};
+        wtx.SetMerkleBranch(block);
+        auto saplingNoteData = wallet.FindMySaplingNotes(wtx).first;
+        ASSERT_EQ(2, saplingNoteData.size());
+        wtx.SetSaplingNoteData(saplingNoteData);
+        wallet.AddToWallet(wtx, true, NULL);
+    }
+
+    SproutMerkleTree sproutTree;
+    SaplingMerkleTree saplingTree;
+    wallet.IncrementNoteWitnesses(&fakeIndex, &block, sproutTree, saplingTree);
+    wallet.UpdateSaplingNullifierNoteMapForBlock(&block);
+
+    // Derive each nullifier on its own from the note and its position
+    std::map<uint256, SaplingOutPoint> expected;
+    for (const CTransaction& tx : block.vtx) {
+        const CWalletTx& wtx = wallet.mapWallet[tx.GetHash()];
+        for (const auto& item : wtx.mapSaplingNoteData) {
+            const OutputDescription& output = tx.vShieldedOutput[item.first.n];
+            auto pt = libzcash::SaplingNotePlaintext::decrypt(output.encCiphertext, ivk, output.ephemeralKey, output.cm);
+            ASSERT_TRUE(pt);
+            auto note = pt.get().note(ivk);
+            ASSERT_TRUE(note);
+            ASSERT_EQ(1, item.second.witnesses.size());
+            auto nf = note.get().nullifier(fvk, item.second.witnesses.front().position());
+            ASSERT_TRUE(nf);
+            ASSERT_TRUE(item.second.nullifier);
+            EXPECT_EQ(nf.get(), item.second.nullifier.get());
+            expected[nf.get()] = item.first;
+        }
+    }
+    EXPECT_EQ(4, expected.size());
+    EXPECT_EQ(expected, wallet.mapSaplingNullifiersToNotes);
+
+    // Tear down
+    chainActive.SetTip(NULL);
+    mapBlockIndex.erase(blockHash);
+
+    // Revert to default
+    RegtestDeactivateSapling();
+}
+
 TEST(WalletTests, UpdatedSproutNoteData) {
     TestWallet wallet;
 
@@ -2082,3 +2432,304 @@ TEST(WalletTests, SaplingNoteLocking) {
     EXPECT_FALSE(wallet.IsLockedNote(sop1));
     EXPECT_FALSE(wallet.IsLockedNote(sop2));
 }
+
+TEST(WalletTests, BalanceLedgerMinDepth) {
+    CBalanceLedger ledger;
+    ledger.Add(BALANCE_HEIGHT_UNTRUSTED, 1);
+    ledger.Add(BALANCE_HEIGHT_TRUSTED, 10);
+    ledger.Add(100, 100);
+    ledger.Add(105, 1000);
+    ledger.Add(110, 10000);
+
+    EXPECT_EQ(11111, ledger.Get(110, 0));
+    EXPECT_EQ(11110, ledger.GetTrusted());
+    EXPECT_EQ(11100, ledger.Get(110, 1));
+    EXPECT_EQ(1100, ledger.Get(110, 2));
+    EXPECT_EQ(1100, ledger.Get(110, 6));
+    EXPECT_EQ(100, ledger.Get(110, 7));
+    EXPECT_EQ(0, ledger.Get(110, 12));
+
+    // Removing value drops empty buckets
+    ledger.Add(BALANCE_HEIGHT_UNTRUSTED, -1);
+    ledger.Add(BALANCE_HEIGHT_TRUSTED, -10);
+    ledger.Add(100, -100);
+    ledger.Add(105, -1000);
+    ledger.Add(110, -10000);
+    EXPECT_TRUE(ledger.IsEmpty());
+    EXPECT_EQ(0, ledger.Get(110, 0));
+}
+
+TEST(WalletTests, WalletBalancesUpdateAndRemove) {
+    CWalletBalances balances;
+    CTxDestination taddr = CKeyID(uint160(ParseHex("0102030405060708090a0b0c0d0e0f1011121314")));
+    libzcash::PaymentAddress zaddr = libzcash::SproutPaymentAddress(uint256(), uint256());
+
+    CBalanceContribution transparent;
+    transparent.pool = BALANCE_POOL_TRANSPARENT;
+    transparent.taddr = taddr;
+    transparent.n = 0;
+    transparent.nValue = 5;
+    transparent.fSpendable = true;
+    transparent.fLocked = false;
+
+    CBalanceContribution watchonly = transparent;
+    watchonly.n = 1;
+    watchonly.nValue = 7;
+    watchonly.fSpendable = false;
+
+    CBalanceContribution sprout;
+    sprout.pool = BALANCE_POOL_SPROUT;
+    sprout.zaddr = zaddr;
+    sprout.nValue = 3;
+    sprout.fSpendable = true;
+    sprout.fLocked = false;
+
+    CWalletTxBalance txBalance;
+    txBalance.nHeight = 10;
+    txBalance.fSpends = true;
+    txBalance.vContributions = {transparent, watchonly, sprout};
+
+    uint256 txid = GetRandHash();
+    EXPECT_FALSE(static_cast<bool>(balances.Update(txid, txBalance)));
+    EXPECT_EQ(1, balances.Size());
+    EXPECT_EQ(5, balances.GetPoolBalance(BALANCE_POOL_TRANSPARENT, 10, 1, false));
+    EXPECT_EQ(12, balances.GetPoolBalance(BALANCE_POOL_TRANSPARENT, 10, 1, true));
+    EXPECT_EQ(0, balances.GetPoolBalance(BALANCE_POOL_TRANSPARENT, 10, 2, true));
+    EXPECT_EQ(12, balances.GetAddressBalance(taddr, 10, 1, true));
+    EXPECT_EQ(3, balances.GetAddressBalance(zaddr, 11, 2, false));
+    EXPECT_EQ(0, balances.GetPoolBalance(BALANCE_POOL_SAPLING, 10, 1, true));
+    EXPECT_EQ(5, balances.GetTrustedTransparentBalance(true));
+    EXPECT_EQ(7, balances.GetTrustedTransparentBalance(false));
+
+    // Transparent outputs are in the coin index, ordered by value
+    EXPECT_EQ(2, balances.CoinCount());
+    ASSERT_EQ(1, balances.GetCoins().count(10));
+    const std::set<CIndexedCoin>& coins = balances.GetCoins().at(10);
+    ASSERT_EQ(2, coins.size());
+    EXPECT_EQ(COutPoint(txid, 0), coins.begin()->outpoint);
+    EXPECT_TRUE(coins.begin()->fSpendable);
+    EXPECT_EQ(COutPoint(txid, 1), coins.rbegin()->outpoint);
+    EXPECT_FALSE(coins.rbegin()->fSpendable);
+
+    // Locking the transparent output keeps it in GetBalance() only
+    txBalance.vContributions[0].fLocked = true;
+    EXPECT_TRUE(static_cast<bool>(balances.Update(txid, txBalance)));
+    EXPECT_EQ(1, balances.Size());
+    EXPECT_EQ(0, balances.GetPoolBalance(BALANCE_POOL_TRANSPARENT, 10, 1, false));
+    EXPECT_EQ(7, balances.GetAddressBalance(taddr, 10, 1, true));
+    EXPECT_EQ(5, balances.GetTrustedTransparentBalance(true));
+    EXPECT_EQ(2, balances.CoinCount());
+    EXPECT_TRUE(balances.GetCoins().at(10).begin()->fLocked);
+
+    auto prev = balances.Remove(txid);
+    EXPECT_TRUE(static_cast<bool>(prev));
+    EXPECT_EQ(3, prev->vContributions.size());
+    EXPECT_EQ(0, balances.Size());
+    EXPECT_EQ(0, balances.GetAddressBalance(taddr, 10, 0, true));
+    EXPECT_EQ(0, balances.GetAddressBalance(zaddr, 10, 0, true));
+    EXPECT_EQ(0, balances.GetTrustedTransparentBalance(true));
+    EXPECT_EQ(0, balances.CoinCount());
+    EXPECT_TRUE(balances.GetCoins().empty());
+    EXPECT_FALSE(static_cast<bool>(balances.Remove(txid)));
+}
+
+TEST(WalletTests, KeyBirthHeightIsOnlyLowered) {
+    TestWallet wallet;
+    LOCK(wallet.cs_wallet);
+
+    auto sk = libzcash::SproutSpendingKey::random();
+    auto addr = sk.address();
+
+    auto addResult = boost::apply_visitor(AddSpendingKeyToWallet(&wallet, Params().GetConsensus(), 100), libzcash::SpendingKey(sk));
+    EXPECT_EQ(KeyAdded, addResult);
+    EXPECT_EQ(100, wallet.mapSproutZKeyMetadata[addr].nBirthHeight);
+
+    // Re-importing with a later birth height keeps the earlier one
+    addResult = boost::apply_visitor(AddSpendingKeyToWallet(&wallet, Params().GetConsensus(), 200), libzcash::SpendingKey(sk));
+    EXPECT_EQ(KeyAlreadyExists, addResult);
+    EXPECT_EQ(100, wallet.mapSproutZKeyMetadata[addr].nBirthHeight);
+
+    // An earlier birth height replaces it
+    addResult = boost::apply_visitor(AddSpendingKeyToWallet(&wallet, Params().GetConsensus(), 50), libzcash::SpendingKey(sk));
+    EXPECT_EQ(KeyAlreadyExists, addResult);
+    EXPECT_EQ(50, wallet.mapSproutZKeyMetadata[addr].nBirthHeight);
+
+    // Importing without a birth height doesn't forget it
+    addResult = boost::apply_visitor(AddSpendingKeyToWallet(&wallet, Params().GetConsensus()), libzcash::SpendingKey(sk));
+    EXPECT_EQ(KeyAlreadyExists, addResult);
+    EXPECT_EQ(50, wallet.mapSproutZKeyMetadata[addr].nBirthHeight);
+
+    // A key whose metadata was written before birth heights were recorded
+    auto sk2 = libzcash::SproutSpendingKey::random();
+    auto addr2 = sk2.address();
+    CKeyMetadata oldMeta(1000);
+    oldMeta.nVersion = CKeyMetadata::VERSION_WITH_HDDATA;
+    CDataStream ssOld(SER_DISK, CLIENT_VERSION);
+    ssOld << oldMeta;
+    CKeyMetadata loadedMeta;
+    ssOld >> loadedMeta;
+    EXPECT_EQ(-1, loadedMeta.nBirthHeight);
+    ASSERT_TRUE(wallet.LoadZKey(sk2));
+    ASSERT_TRUE(wallet.LoadZKeyMetadata(addr2, loadedMeta));
+
+    // gets a birth height that is written back with it
+    addResult = boost::apply_visitor(AddSpendingKeyToWallet(&wallet, Params().GetConsensus(), 80), libzcash::SpendingKey(sk2));
+    EXPECT_EQ(KeyAlreadyExists, addResult);
+    CDataStream ssNew(SER_DISK, CLIENT_VERSION);
+    ssNew << wallet.mapSproutZKeyMetadata[addr2];
+    CKeyMetadata savedMeta;
+    ssNew >> savedMeta;
+    EXPECT_EQ(CKeyMetadata::VERSION_WITH_BIRTHHEIGHT, savedMeta.nVersion);
+    EXPECT_EQ(80, savedMeta.nBirthHeight);
+    EXPECT_EQ(1000, savedMeta.nCreateTime);
+}
+
+TEST(WalletTests, OrderedTxItemsAndTxHashesSince) {
+    TestWallet wallet;
+    LOCK2(cs_main, wallet.cs_wallet);
+
+    CMutableTransaction mtx1;
+    mtx1.nLockTime = 1;
+    CWalletTx wtx1(&wallet, mtx1);
+    wtx1.nOrderPos = 1;
+    CMutableTransaction mtx2;
+    mtx2.nLockTime = 2;
+    CWalletTx wtx2(&wallet, mtx2);
+    wtx2.nOrderPos = 0;
+
+    // Loaded transactions are ordered by nOrderPos, not by insertion
+    wallet.AddToWallet(wtx1, true, NULL);
+    wallet.AddToWallet(wtx2, true, NULL);
+    const CWallet::TxItems& txOrdered = wallet.OrderedTxItems();
+    ASSERT_EQ(2, txOrdered.size());
+    EXPECT_EQ(wtx2.GetHash(), txOrdered.begin()->second.first->GetHash());
+    EXPECT_EQ(wtx1.GetHash(), txOrdered.rbegin()->second.first->GetHash());
+
+    // Unmined transactions are always listed since any block
+    std::vector<uint256> vHashes;
+    wallet.GetTxHashesSince(100, vHashes);
+    ASSERT_EQ(2, vHashes.size());
+    EXPECT_TRUE(std::is_sorted(vHashes.begin(), vHashes.end()));
+
+    // Erased transactions are dropped from both indexes
+    wallet.mapWallet.erase(wtx1.GetHash());
+    wallet.MarkTxIndexesStale();
+    EXPECT_EQ(1, wallet.OrderedTxItems().size());
+    wallet.GetTxHashesSince(100, vHashes);
+    ASSERT_EQ(1, vHashes.size());
+    EXPECT_EQ(wtx2.GetHash(), vHashes[0]);
+}
+
+TEST(WalletTests, IsMineAndIsFromMeFilters) {
+    TestWallet wallet;
+    LOCK2(cs_main, wallet.cs_wallet);
+
+    CKey ours, theirs;
+    ours.MakeNewKey(true);
+    theirs.MakeNewKey(true);
+    ASSERT_TRUE(wallet.AddKeyPubKey(ours, ours.GetPubKey()));
+    CScript scriptOurs = GetScriptForDestination(ours.GetPubKey().GetID());
+    CScript scriptTheirs = GetScriptForDestination(theirs.GetPubKey().GetID());
+
+    CMutableTransaction mtx;
+    mtx.vout.resize(2);
+    mtx.vout[0].nValue = 5;
+    mtx.vout[0].scriptPubKey = scriptOurs;
+    mtx.vout[1].nValue = 7;
+    mtx.vout[1].scriptPubKey = scriptTheirs;
+    CWalletTx wtx(&wallet, mtx);
+    EXPECT_EQ(ISMINE_SPENDABLE, wallet.IsMine(wtx.vout[0]));
+    EXPECT_EQ(ISMINE_NO, wallet.IsMine(wtx.vout[1]));
+    wallet.AddToWallet(wtx, true, NULL);
+
+    CMutableTransaction spendOurs;
+    spendOurs.vin.resize(1);
+    spendOurs.vin[0].prevout = COutPoint(wtx.GetHash(), 0);
+    CMutableTransaction spendTheirs;
+    spendTheirs.vin.resize(1);
+    spendTheirs.vin[0].prevout = COutPoint(wtx.GetHash(), 1);
+    EXPECT_TRUE(wallet.IsFromMe(spendOurs));
+    EXPECT_EQ(5, wallet.GetDebit(spendOurs, ISMINE_ALL));
+    EXPECT_FALSE(wallet.IsFromMe(spendTheirs));
+    EXPECT_EQ(ISMINE_NO, wallet.IsMine(spendTheirs.vin[0]));
+
+    // Watching a script makes outputs already in the wallet ours
+    ASSERT_TRUE(wallet.AddWatchOnly(scriptTheirs));
+    EXPECT_EQ(ISMINE_WATCH_ONLY, wallet.IsMine(wtx.vout[1]));
+    EXPECT_EQ(ISMINE_WATCH_ONLY, wallet.IsMine(spendTheirs.vin[0]));
+    EXPECT_TRUE(wallet.IsFromMe(spendTheirs));
+    EXPECT_EQ(0, wallet.GetDebit(spendTheirs, ISMINE_SPENDABLE));
+    EXPECT_EQ(7, wallet.GetDebit(spendTheirs, ISMINE_WATCH_ONLY));
+}
+
+TEST(WalletTests, LoadWalletChecksTxRecordsInBatches) {
+    std::string strWalletFile = "wallet-loadbatches.dat";
+    bool fFirstRun;
+    {
+        CWallet wallet(strWalletFile);
+        ASSERT_EQ(DB_LOAD_OK, wallet.LoadWallet(fFirstRun));
+    }
+
+    auto sk = libzcash::SproutSpendingKey::random();
+    auto sproutAddr = sk.address();
+    auto ivk = GetTestMasterSaplingSpendingKey().expsk.full_viewing_key().in_viewing_key();
+
+    // More transactions than fit in one batch, each spending the previous
+    // one, with cached nullifiers for the nullifier maps to be built from
+    std::vector<CWalletTx> vWtx;
+    uint256 prevHash = GetRandHash();
+    for (size_t i = 0; i < WALLET_LOAD_TX_BATCH_SIZE + 5; i++) {
+        CMutableTransaction mtx;
+        mtx.fOverwintered = true;
+        mtx.nVersionGroupId = SAPLING_VERSION_GROUP_ID;
+        mtx.nVersion = SAPLING_TX_VERSION;
+        mtx.vin.resize(1);
+        mtx.vin[0].prevout = COutPoint(prevHash, 0);
+        mtx.vout.resize(1);
+        mtx.vout[0].nValue = 1000;
+        CWalletTx wtx(NULL, mtx);
+        wtx.nOrderPos = i;
+        wtx.mapSproutNoteData[JSOutPoint(wtx.GetHash(), 0, 0)] = SproutNoteData(sproutAddr, GetRandHash());
+        wtx.mapSaplingNoteData[SaplingOutPoint(wtx.GetHash(), 0)] = SaplingNoteData(ivk, GetRandHash());
+        vWtx.push_back(wtx);
+        prevHash = wtx.GetHash();
+    }
+
+    {
+        CWalletDB db(strWalletFile);
+        CKeyMetadata meta(GetTime());
+        ASSERT_TRUE(db.WriteZKey(sproutAddr, sk, meta));
+        for (const CWalletTx& wtx : vWtx) {
+            ASSERT_TRUE(db.WriteTx(wtx.GetHash(), wtx));
+        }
+        // A record whose transaction doesn't match its key is skipped
+        ASSERT_TRUE(db.WriteTx(GetRandHash(), vWtx[0]));
+    }
+
+    // The same transactions, added one by one
+    CWallet expected;
+    for (const CWalletTx& wtx : vWtx) {
+        expected.AddToWallet(wtx, true, NULL);
+    }
+
+    CWallet wallet(strWalletFile);
+    EXPECT_EQ(DB_NONCRITICAL_ERROR, wallet.LoadWallet(fFirstRun));
+    mapArgs.erase("-rescan");
+
+    LOCK2(cs_main, wallet.cs_wallet);
+    ASSERT_EQ(vWtx.size(), wallet.mapWallet.size());
+    for (size_t i = 0; i < vWtx.size(); i++) {
+        const CWalletTx& wtx = wallet.mapWallet.at(vWtx[i].GetHash());
+        EXPECT_EQ(vWtx[i].nOrderPos, wtx.nOrderPos);
+        EXPECT_EQ(vWtx[i].mapSproutNoteData, wtx.mapSproutNoteData);
+        EXPECT_EQ(vWtx[i].mapSaplingNoteData, wtx.mapSaplingNoteData);
+        EXPECT_EQ(i + 1 < vWtx.size(), wallet.IsSpent(vWtx[i].GetHash(), 0));
+    }
+    EXPECT_EQ(expected.mapSproutNullifiersToNotes, wallet.mapSproutNullifiersToNotes);
+    EXPECT_EQ(expected.mapSaplingNullifiersToNotes, wallet.mapSaplingNullifiersToNotes);
+
+    // The note decryptor of a loaded Sprout key is created when it is first used
+    ZCNoteDecryption dec;
+    ASSERT_TRUE(wallet.GetNoteDecryptor(sproutAddr, dec));
+    EXPECT_EQ(ZCNoteDecryption(sk.receiving_key()), dec);
+}
@@ -110,6 +110,62 @@ TEST(wallet_zkeys_tests, StoreAndLoadSaplingZkeys) {
  * LoadZKey()
  * LoadZKeyMetadata()
  */
+TEST(wallet_zkeys_tests, GenerateSaplingZKeysInBulk) {
+    SelectParams(CBaseChainParams::MAIN);
+
+    CWallet wallet;
+    LOCK(wallet.cs_wallet);
+    EXPECT_ANY_THROW(wallet.GenerateNewSaplingZKeys(3));
+
+    CKeyingMaterial rawSeed(32, 0);
+    HDSeed seed(rawSeed);
+    wallet.LoadHDSeed(seed);
+
+    // Bulk generation continues the key path used by GenerateNewSaplingZKey
+    auto first = wallet.GenerateNewSaplingZKey();
+    auto addrs = wallet.GenerateNewSaplingZKeys(3);
+    ASSERT_EQ(3, addrs.size());
+    EXPECT_EQ(4, wallet.GetHDChain().saplingAccountCounter);
+    auto m_32h_cth = libzcash::SaplingExtendedSpendingKey::Master(seed)
+        .Derive(32 | ZIP32_HARDENED_KEY_LIMIT)
+        .Derive(Params().BIP44CoinType() | ZIP32_HARDENED_KEY_LIMIT);
+    for (size_t i = 0; i < addrs.size(); i++) {
+        EXPECT_EQ(m_32h_cth.Derive((i + 1) | ZIP32_HARDENED_KEY_LIMIT).DefaultAddress(), addrs[i]);
+        libzcash::SaplingExtendedSpendingKey xsk;
+        EXPECT_TRUE(wallet.GetSaplingExtendedSpendingKey(addrs[i], xsk));
+    }
+
+    // Diversified addresses share the key of the address they come from
+    auto diversified = wallet.GenerateSaplingDiversifiedAddresses(first, 5);
+    ASSERT_EQ(5, diversified.size());
+    auto ivk = m_32h_cth.Derive(0 | ZIP32_HARDENED_KEY_LIMIT).expsk.full_viewing_key().in_viewing_key();
+    std::set<libzcash::SaplingPaymentAddress> seen = {first};
+    for (const auto& addr : diversified) {
+        EXPECT_TRUE(seen.insert(addr).second);
+        libzcash::SaplingIncomingViewingKey ivkOut;
+        EXPECT_TRUE(wallet.GetSaplingIncomingViewingKey(addr, ivkOut));
+        EXPECT_EQ(ivk, ivkOut);
+    }
+
+    // ... and don't repeat themselves
+    auto more = wallet.GenerateSaplingDiversifiedAddresses(first, 5);
+    for (const auto& addr : more) {
+        EXPECT_TRUE(seen.insert(addr).second);
+    }
+
+    // There are still only four keys to trial-decrypt with
+    std::set<libzcash::SaplingPaymentAddress> allAddrs;
+    wallet.GetSaplingPaymentAddresses(allAddrs);
+    EXPECT_EQ(14, allAddrs.size());
+    std::set<libzcash::SaplingIncomingViewingKey> ivks;
+    for (const auto& addr : allAddrs) {
+        libzcash::SaplingIncomingViewingKey ivkOut;
+        EXPECT_TRUE(wallet.GetSaplingIncomingViewingKey(addr, ivkOut));
+        ivks.insert(ivkOut);
+    }
+    EXPECT_EQ(4, ivks.size());
+}
+
 TEST(wallet_zkeys_tests, store_and_load_zkeys) {
     SelectParams(CBaseChainParams::MAIN);
 
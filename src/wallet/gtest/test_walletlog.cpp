@@ -0,0 +1,212 @@
+#include <gtest/gtest.h>
+
+#include "chainparams.h"
+#include "util.h"
+#include "wallet/wallet.h"
+#include "wallet/walletdb.h"
+#include "wallet/walletlog.h"
+
+#include <boost/filesystem.hpp>
+
+static CWalletLog::Bytes B(const std::string& str)
+{
+    return CWalletLog::Bytes(str.begin(), str.end());
+}
+
+static CWalletLog::Update Put(const std::string& key, const std::string& value)
+{
+    return std::make_pair(B(key), boost::optional<CWalletLog::Bytes>(B(value)));
+}
+
+static CWalletLog::Update Del(const std::string& key)
+{
+    return std::make_pair(B(key), boost::optional<CWalletLog::Bytes>());
+}
+
+TEST(WalletLog, WriteReadReopen) {
+    boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    CWalletLog::Bytes value;
+
+    {
+        CWalletLog log;
+        EXPECT_FALSE(log.Open(pathTemp, false));
+        ASSERT_TRUE(log.Open(pathTemp, true));
+        EXPECT_TRUE(CWalletLog::IsLogFile(pathTemp));
+
+        EXPECT_TRUE(log.Write({Put("b", "1"), Put("a", "2")}));
+        EXPECT_TRUE(log.Write({Put("b", "3"), Del("a"), Put("c", "")}));
+        EXPECT_TRUE(log.Read(B("b"), value));
+        EXPECT_EQ(B("3"), value);
+        EXPECT_FALSE(log.Exists(B("a")));
+        EXPECT_TRUE(log.Exists(B("c")));
+    }
+
+    // A torn batch at the end is dropped when the log is reopened
+    FILE* file = fopen(pathTemp.string().c_str(), "ab");
+    ASSERT_TRUE(file != NULL);
+    fwrite("\x10\x00\x00\x00garbage", 1, 11, file);
+    fclose(file);
+
+    CWalletLog log;
+    ASSERT_TRUE(log.Open(pathTemp, false));
+    EXPECT_EQ(2, log.Size());
+    EXPECT_TRUE(log.Read(B("b"), value));
+    EXPECT_EQ(B("3"), value);
+    EXPECT_TRUE(log.Read(B("c"), value));
+    EXPECT_TRUE(value.empty());
+
+    // New batches follow the last complete one
+    EXPECT_TRUE(log.Write({Put("a", "4")}));
+    log.Close();
+    ASSERT_TRUE(log.Open(pathTemp, false));
+    EXPECT_TRUE(log.Read(B("a"), value));
+    EXPECT_EQ(B("4"), value);
+
+    log.Close();
+    boost::filesystem::remove(pathTemp);
+}
+
+TEST(WalletLog, CompactAndSeek) {
+    boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    CWalletLog log;
+    ASSERT_TRUE(log.Open(pathTemp, true));
+
+    for (int i = 0; i < 100; i++) {
+        EXPECT_TRUE(log.Write({Put("key", strprintf("%d", i)), Put("skip" + std::to_string(i % 2), "x")}));
+    }
+    uintmax_t nSize = boost::filesystem::file_size(pathTemp);
+
+    EXPECT_TRUE(log.Compact("skip"));
+    EXPECT_LT(boost::filesystem::file_size(pathTemp), nSize);
+    EXPECT_EQ(1, log.Size());
+
+    CWalletLog::Bytes key, value;
+    EXPECT_TRUE(log.Write({Put("a", "1"), Put("c", "2")}));
+    ASSERT_TRUE(log.First(key, value));
+    EXPECT_EQ(B("a"), key);
+    ASSERT_TRUE(log.Seek(key, false, key, value));
+    EXPECT_EQ(B("c"), key);
+    ASSERT_TRUE(log.Seek(B("d"), true, key, value));
+    EXPECT_EQ(B("key"), key);
+    EXPECT_EQ(B("99"), value);
+    EXPECT_FALSE(log.Seek(key, false, key, value));
+
+    log.Close();
+    boost::filesystem::remove(pathTemp);
+}
+
+static std::vector<char> ReadFile(const boost::filesystem::path& path)
+{
+    std::vector<char> vch(boost::filesystem::file_size(path));
+    FILE* file = fopen(path.string().c_str(), "rb");
+    EXPECT_TRUE(file != NULL);
+    if (file) {
+        EXPECT_EQ(vch.size(), fread(vch.data(), 1, vch.size(), file));
+        fclose(file);
+    }
+    return vch;
+}
+
+TEST(WalletLog, CorruptHeaderIsNotTorn) {
+    boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    uintmax_t nSecond;
+    {
+        CWalletLog log;
+        ASSERT_TRUE(log.Open(pathTemp, true));
+        EXPECT_TRUE(log.Write({Put("a", "1")}));
+        nSecond = boost::filesystem::file_size(pathTemp);
+        EXPECT_TRUE(log.Write({Put("b", "2")}));
+        EXPECT_TRUE(log.Write({Put("c", "3")}));
+    }
+
+    // A bit flip in the size of a batch before the end makes it look longer
+    // than the rest of the file; the header checksum tells it from a torn write
+    std::vector<char> vchLog = ReadFile(pathTemp);
+    vchLog[nSecond + 1] ^= 1;
+    FILE* file = fopen(pathTemp.string().c_str(), "wb");
+    ASSERT_TRUE(file != NULL);
+    fwrite(vchLog.data(), 1, vchLog.size(), file);
+    fclose(file);
+
+    CWalletLog log;
+    EXPECT_FALSE(log.Open(pathTemp, false));
+    EXPECT_EQ(vchLog, ReadFile(pathTemp));
+
+    // Salvaging skips the bad batch and keeps the ones after it
+    std::vector<std::pair<CWalletLog::Bytes, CWalletLog::Bytes>> vRecords;
+    EXPECT_FALSE(CWalletLog::Salvage(pathTemp, vRecords));
+    ASSERT_EQ(2, vRecords.size());
+    EXPECT_EQ(B("a"), vRecords[0].first);
+    EXPECT_EQ(B("c"), vRecords[1].first);
+    EXPECT_EQ(B("3"), vRecords[1].second);
+
+    boost::filesystem::remove(pathTemp);
+}
+
+TEST(WalletLog, TornTailAndCorruptionThroughCWalletDB) {
+    SelectParams(CBaseChainParams::TESTNET);
+
+    boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+    mapArgs["-walletformat"] = "log";
+    const std::string strFile = "wallet-log.dat";
+    boost::filesystem::path pathFile = GetDataDir() / strFile;
+
+    auto sk = libzcash::SproutSpendingKey::random();
+    auto addr = sk.address();
+    {
+        CWalletDB db(strFile, "cr+");
+        ASSERT_TRUE(db.WriteZKey(addr, sk, CKeyMetadata(GetTime())));
+        ASSERT_TRUE(db.WriteAccount("a", CAccount()));
+    }
+    bitdb.Flush(false);
+    ASSERT_TRUE(bitdb.IsLogFile(strFile));
+    uintmax_t nSize = boost::filesystem::file_size(pathFile);
+
+    // A torn write at the end is dropped, and the wallet opens
+    FILE* file = fopen(pathFile.string().c_str(), "ab");
+    ASSERT_TRUE(file != NULL);
+    fwrite("\x40\x00\x00\x00torn", 1, 8, file);
+    fclose(file);
+    EXPECT_EQ(CDBEnv::VERIFY_OK, bitdb.Verify(strFile, CWalletDB::Recover));
+    EXPECT_EQ(nSize, boost::filesystem::file_size(pathFile));
+    {
+        CWalletDB db(strFile);
+        CAccount account;
+        EXPECT_TRUE(db.ReadAccount("a", account));
+        EXPECT_TRUE(db.WriteAccount("b", CAccount()));
+    }
+    bitdb.Flush(false);
+
+    // A corrupt batch with others after it is not mistaken for a torn write:
+    // the wallet doesn't open, and the file is left as it is
+    std::vector<char> vchWallet = ReadFile(pathFile);
+    vchWallet[nSize - 1] ^= 1;
+    file = fopen(pathFile.string().c_str(), "wb");
+    ASSERT_TRUE(file != NULL);
+    fwrite(vchWallet.data(), 1, vchWallet.size(), file);
+    fclose(file);
+    EXPECT_EQ(CDBEnv::RECOVER_FAIL, bitdb.Verify(strFile, CWalletDB::Recover));
+    EXPECT_EQ(vchWallet, ReadFile(pathFile));
+
+    // -salvagewallet keeps the keys, and moves the corrupt log aside
+    EXPECT_TRUE(CWalletDB::Recover(bitdb, strFile, true));
+    EXPECT_EQ(CDBEnv::VERIFY_OK, bitdb.Verify(strFile, CWalletDB::Recover));
+    {
+        CWallet wallet(strFile);
+        bool fFirstRun;
+        ASSERT_EQ(DB_LOAD_OK, wallet.LoadWallet(fFirstRun));
+        EXPECT_TRUE(wallet.HaveSproutSpendingKey(addr));
+    }
+    bitdb.Flush(false);
+    EXPECT_TRUE(bitdb.IsLogFile(strFile));
+    bool fBackup = false;
+    for (boost::filesystem::directory_iterator it(GetDataDir()); it != boost::filesystem::directory_iterator(); ++it) {
+        if (it->path().filename().string().find(".bak") != std::string::npos)
+            fBackup = vchWallet == ReadFile(it->path());
+    }
+    EXPECT_TRUE(fBackup);
+
+    mapArgs.erase("-walletformat");
+}
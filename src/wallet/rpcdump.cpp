@@ -18,6 +18,7 @@
 #include <stdint.h>
 
 #include <boost/algorithm/string.hpp>
+#include <boost/assign/list_of.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
 #include <univalue.h>
@@ -99,48 +100,57 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
             + HelpExampleRpc("importprivkey", "\"mykey\", \"testing\", false")
         );
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CKeyID vchAddress;
+    CBlockIndex* pindexRescan = NULL;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
 
-    EnsureWalletIsUnlocked();
+        EnsureWalletIsUnlocked();
 
-    string strSecret = params[0].get_str();
-    string strLabel = "";
-    if (params.size() > 1)
-        strLabel = params[1].get_str();
+        string strSecret = params[0].get_str();
+        string strLabel = "";
+        if (params.size() > 1)
+            strLabel = params[1].get_str();
 
-    // Whether to perform rescan after import
-    bool fRescan = true;
-    if (params.size() > 2)
-        fRescan = params[2].get_bool();
+        // Whether to perform rescan after import
+        bool fRescan = true;
+        if (params.size() > 2)
+            fRescan = params[2].get_bool();
 
-    CKey key = DecodeSecret(strSecret);
-    if (!key.IsValid()) throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid private key encoding");
+        CKey key = DecodeSecret(strSecret);
+        if (!key.IsValid()) throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid private key encoding");
 
-    CPubKey pubkey = key.GetPubKey();
-    assert(key.VerifyPubKey(pubkey));
-    CKeyID vchAddress = pubkey.GetID();
-    {
-        pwalletMain->MarkDirty();
-        pwalletMain->SetAddressBook(vchAddress, strLabel, "receive");
+        CPubKey pubkey = key.GetPubKey();
+        assert(key.VerifyPubKey(pubkey));
+        vchAddress = pubkey.GetID();
+        {
+            pwalletMain->MarkDirty();
+            pwalletMain->SetAddressBook(vchAddress, strLabel, "receive");
 
-        // Don't throw error in case a key is already there
-        if (pwalletMain->HaveKey(vchAddress)) {
-            return EncodeDestination(vchAddress);
-        }
+            // Don't throw error in case a key is already there
+            if (pwalletMain->HaveKey(vchAddress)) {
+                return EncodeDestination(vchAddress);
+            }
 
-        pwalletMain->mapKeyMetadata[vchAddress].nCreateTime = 1;
+            pwalletMain->mapKeyMetadata[vchAddress].nCreateTime = 1;
 
-        if (!pwalletMain->AddKeyPubKey(key, pubkey))
-            throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
+            if (!pwalletMain->AddKeyPubKey(key, pubkey))
+                throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
 
-        // whenever a key is imported, we need to scan the whole chain
-        pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
+            // whenever a key is imported, we need to scan the whole chain
+            pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
 
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+            if (fRescan) {
+                pindexRescan = chainActive.Genesis();
+            }
         }
     }
 
+    // Rescan without holding cs_main so that the node keeps processing blocks
+    if (pindexRescan) {
+        pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+    }
+
     return EncodeDestination(vchAddress);
 }
 
@@ -167,53 +177,61 @@ UniValue importaddress(const UniValue& params, bool fHelp)
             + HelpExampleRpc("importaddress", "\"myaddress\", \"testing\", false")
         );
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CBlockIndex* pindexRescan = NULL;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
 
-    CScript script;
+        CScript script;
 
-    CTxDestination dest = DecodeDestination(params[0].get_str());
-    if (IsValidDestination(dest)) {
-        script = GetScriptForDestination(dest);
-    } else if (IsHex(params[0].get_str())) {
-        std::vector<unsigned char> data(ParseHex(params[0].get_str()));
-        script = CScript(data.begin(), data.end());
-    } else {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Zcash address or script");
-    }
+        CTxDestination dest = DecodeDestination(params[0].get_str());
+        if (IsValidDestination(dest)) {
+            script = GetScriptForDestination(dest);
+        } else if (IsHex(params[0].get_str())) {
+            std::vector<unsigned char> data(ParseHex(params[0].get_str()));
+            script = CScript(data.begin(), data.end());
+        } else {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Zcash address or script");
+        }
 
-    string strLabel = "";
-    if (params.size() > 1)
-        strLabel = params[1].get_str();
+        string strLabel = "";
+        if (params.size() > 1)
+            strLabel = params[1].get_str();
 
-    // Whether to perform rescan after import
-    bool fRescan = true;
-    if (params.size() > 2)
-        fRescan = params[2].get_bool();
+        // Whether to perform rescan after import
+        bool fRescan = true;
+        if (params.size() > 2)
+            fRescan = params[2].get_bool();
 
-    {
-        if (::IsMine(*pwalletMain, script) == ISMINE_SPENDABLE)
-            throw JSONRPCError(RPC_WALLET_ERROR, "The wallet already contains the private key for this address or script");
+        {
+            if (::IsMine(*pwalletMain, script) == ISMINE_SPENDABLE)
+                throw JSONRPCError(RPC_WALLET_ERROR, "The wallet already contains the private key for this address or script");
 
-        // add to address book or update label
-        if (IsValidDestination(dest))
-            pwalletMain->SetAddressBook(dest, strLabel, "receive");
+            // add to address book or update label
+            if (IsValidDestination(dest))
+                pwalletMain->SetAddressBook(dest, strLabel, "receive");
 
-        // Don't throw error in case an address is already there
-        if (pwalletMain->HaveWatchOnly(script))
-            return NullUniValue;
+            // Don't throw error in case an address is already there
+            if (pwalletMain->HaveWatchOnly(script))
+                return NullUniValue;
 
-        pwalletMain->MarkDirty();
+            pwalletMain->MarkDirty();
 
-        if (!pwalletMain->AddWatchOnly(script))
-            throw JSONRPCError(RPC_WALLET_ERROR, "Error adding address to wallet");
+            if (!pwalletMain->AddWatchOnly(script))
+                throw JSONRPCError(RPC_WALLET_ERROR, "Error adding address to wallet");
 
-        if (fRescan)
-        {
-            pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
-            pwalletMain->ReacceptWalletTransactions();
+            if (fRescan)
+            {
+                pindexRescan = chainActive.Genesis();
+            }
         }
     }
 
+    // Rescan without holding cs_main so that the node keeps processing blocks
+    if (pindexRescan) {
+        pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+        pwalletMain->ReacceptWalletTransactions();
+    }
+
     return NullUniValue;
 }
 
@@ -265,104 +283,107 @@ UniValue importwallet(const UniValue& params, bool fHelp)
 
 UniValue importwallet_impl(const UniValue& params, bool fHelp, bool fImportZKeys)
 {
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    bool fGood = true;
+    CBlockIndex *pindex = NULL;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
 
-    EnsureWalletIsUnlocked();
+        EnsureWalletIsUnlocked();
 
-    ifstream file;
-    file.open(params[0].get_str().c_str(), std::ios::in | std::ios::ate);
-    if (!file.is_open())
-        throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open wallet dump file");
+        ifstream file;
+        file.open(params[0].get_str().c_str(), std::ios::in | std::ios::ate);
+        if (!file.is_open())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open wallet dump file");
 
-    int64_t nTimeBegin = chainActive.Tip()->GetBlockTime();
+        int64_t nTimeBegin = chainActive.Tip()->GetBlockTime();
 
-    bool fGood = true;
+        int64_t nFilesize = std::max((int64_t)1, (int64_t)file.tellg());
+        file.seekg(0, file.beg);
 
-    int64_t nFilesize = std::max((int64_t)1, (int64_t)file.tellg());
-    file.seekg(0, file.beg);
-
-    pwalletMain->ShowProgress(_("Importing..."), 0); // show progress dialog in GUI
-    while (file.good()) {
-        pwalletMain->ShowProgress("", std::max(1, std::min(99, (int)(((double)file.tellg() / (double)nFilesize) * 100))));
-        std::string line;
-        std::getline(file, line);
-        if (line.empty() || line[0] == '#')
-            continue;
-
-        std::vector<std::string> vstr;
-        boost::split(vstr, line, boost::is_any_of(" "));
-        if (vstr.size() < 2)
-            continue;
-
-        // Let's see if the address is a valid Zcash spending key
-        if (fImportZKeys) {
-            auto spendingkey = DecodeSpendingKey(vstr[0]);
-            int64_t nTime = DecodeDumpTime(vstr[1]);
-            // Only include hdKeypath and seedFpStr if we have both
-            boost::optional<std::string> hdKeypath = (vstr.size() > 3) ? boost::optional<std::string>(vstr[2]) : boost::none;
-            boost::optional<std::string> seedFpStr = (vstr.size() > 3) ? boost::optional<std::string>(vstr[3]) : boost::none;
-            if (IsValidSpendingKey(spendingkey)) {
-                auto addResult = boost::apply_visitor(
-                    AddSpendingKeyToWallet(pwalletMain, Params().GetConsensus(), nTime, hdKeypath, seedFpStr, true), spendingkey);
-                if (addResult == KeyAlreadyExists){
-                    LogPrint("zrpc", "Skipping import of zaddr (key already present)\n");
-                } else if (addResult == KeyNotAdded) {
-                    // Something went wrong
-                    fGood = false;
-                }
+        pwalletMain->ShowProgress(_("Importing..."), 0); // show progress dialog in GUI
+        while (file.good()) {
+            pwalletMain->ShowProgress("", std::max(1, std::min(99, (int)(((double)file.tellg() / (double)nFilesize) * 100))));
+            std::string line;
+            std::getline(file, line);
+            if (line.empty() || line[0] == '#')
                 continue;
-            } else {
-                LogPrint("zrpc", "Importing detected an error: invalid spending key. Trying as a transparent key...\n");
-                // Not a valid spending key, so carry on and see if it's a Zcash style t-address.
+
+            std::vector<std::string> vstr;
+            boost::split(vstr, line, boost::is_any_of(" "));
+            if (vstr.size() < 2)
+                continue;
+
+            // Let's see if the address is a valid Zcash spending key
+            if (fImportZKeys) {
+                auto spendingkey = DecodeSpendingKey(vstr[0]);
+                int64_t nTime = DecodeDumpTime(vstr[1]);
+                // Only include hdKeypath and seedFpStr if we have both
+                boost::optional<std::string> hdKeypath = (vstr.size() > 3) ? boost::optional<std::string>(vstr[2]) : boost::none;
+                boost::optional<std::string> seedFpStr = (vstr.size() > 3) ? boost::optional<std::string>(vstr[3]) : boost::none;
+                if (IsValidSpendingKey(spendingkey)) {
+                    auto addResult = boost::apply_visitor(
+                        AddSpendingKeyToWallet(pwalletMain, Params().GetConsensus(), nTime, hdKeypath, seedFpStr, true), spendingkey);
+                    if (addResult == KeyAlreadyExists){
+                        LogPrint("zrpc", "Skipping import of zaddr (key already present)\n");
+                    } else if (addResult == KeyNotAdded) {
+                        // Something went wrong
+                        fGood = false;
+                    }
+                    continue;
+                } else {
+                    LogPrint("zrpc", "Importing detected an error: invalid spending key. Trying as a transparent key...\n");
+                    // Not a valid spending key, so carry on and see if it's a Zcash style t-address.
+                }
             }
-        }
 
-        CKey key = DecodeSecret(vstr[0]);
-        if (!key.IsValid())
-            continue;
-        CPubKey pubkey = key.GetPubKey();
-        assert(key.VerifyPubKey(pubkey));
-        CKeyID keyid = pubkey.GetID();
-        if (pwalletMain->HaveKey(keyid)) {
-            LogPrintf("Skipping import of %s (key already present)\n", EncodeDestination(keyid));
-            continue;
-        }
-        int64_t nTime = DecodeDumpTime(vstr[1]);
-        std::string strLabel;
-        bool fLabel = true;
-        for (unsigned int nStr = 2; nStr < vstr.size(); nStr++) {
-            if (boost::algorithm::starts_with(vstr[nStr], "#"))
-                break;
-            if (vstr[nStr] == "change=1")
-                fLabel = false;
-            if (vstr[nStr] == "reserve=1")
-                fLabel = false;
-            if (boost::algorithm::starts_with(vstr[nStr], "label=")) {
-                strLabel = DecodeDumpString(vstr[nStr].substr(6));
-                fLabel = true;
+            CKey key = DecodeSecret(vstr[0]);
+            if (!key.IsValid())
+                continue;
+            CPubKey pubkey = key.GetPubKey();
+            assert(key.VerifyPubKey(pubkey));
+            CKeyID keyid = pubkey.GetID();
+            if (pwalletMain->HaveKey(keyid)) {
+                LogPrintf("Skipping import of %s (key already present)\n", EncodeDestination(keyid));
+                continue;
             }
+            int64_t nTime = DecodeDumpTime(vstr[1]);
+            std::string strLabel;
+            bool fLabel = true;
+            for (unsigned int nStr = 2; nStr < vstr.size(); nStr++) {
+                if (boost::algorithm::starts_with(vstr[nStr], "#"))
+                    break;
+                if (vstr[nStr] == "change=1")
+                    fLabel = false;
+                if (vstr[nStr] == "reserve=1")
+                    fLabel = false;
+                if (boost::algorithm::starts_with(vstr[nStr], "label=")) {
+                    strLabel = DecodeDumpString(vstr[nStr].substr(6));
+                    fLabel = true;
+                }
+            }
+            LogPrintf("Importing %s...\n", EncodeDestination(keyid));
+            if (!pwalletMain->AddKeyPubKey(key, pubkey)) {
+                fGood = false;
+                continue;
+            }
+            pwalletMain->mapKeyMetadata[keyid].nCreateTime = nTime;
+            if (fLabel)
+                pwalletMain->SetAddressBook(keyid, strLabel, "receive");
+            nTimeBegin = std::min(nTimeBegin, nTime);
         }
-        LogPrintf("Importing %s...\n", EncodeDestination(keyid));
-        if (!pwalletMain->AddKeyPubKey(key, pubkey)) {
-            fGood = false;
-            continue;
-        }
-        pwalletMain->mapKeyMetadata[keyid].nCreateTime = nTime;
-        if (fLabel)
-            pwalletMain->SetAddressBook(keyid, strLabel, "receive");
-        nTimeBegin = std::min(nTimeBegin, nTime);
-    }
-    file.close();
-    pwalletMain->ShowProgress("", 100); // hide progress dialog in GUI
+        file.close();
+        pwalletMain->ShowProgress("", 100); // hide progress dialog in GUI
 
-    CBlockIndex *pindex = chainActive.Tip();
-    while (pindex && pindex->pprev && pindex->GetBlockTime() > nTimeBegin - 7200)
-        pindex = pindex->pprev;
+        pindex = chainActive.Tip();
+        while (pindex && pindex->pprev && pindex->GetBlockTime() > nTimeBegin - 7200)
+            pindex = pindex->pprev;
 
-    if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
-        pwalletMain->nTimeFirstKey = nTimeBegin;
+        if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
+            pwalletMain->nTimeFirstKey = nTimeBegin;
+    }
 
-    LogPrintf("Rescanning last %i blocks\n", chainActive.Height() - pindex->nHeight + 1);
+    // Rescan without holding cs_main so that the node keeps processing blocks
+    LogPrintf("Rescanning from height %i\n", pindex->nHeight);
     pwalletMain->ScanForWalletTransactions(pindex);
     pwalletMain->MarkDirty();
 
@@ -599,68 +620,248 @@ UniValue z_importkey(const UniValue& params, bool fHelp)
             + HelpExampleRpc("z_importkey", "\"mykey\", \"no\"")
         );
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CBlockIndex* pindexRescan = NULL;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        EnsureWalletIsUnlocked();
+
+        // Whether to perform rescan after import
+        bool fRescan = true;
+        bool fIgnoreExistingKey = true;
+        if (params.size() > 1) {
+            auto rescan = params[1].get_str();
+            if (rescan.compare("whenkeyisnew") != 0) {
+                fIgnoreExistingKey = false;
+                if (rescan.compare("yes") == 0) {
+                    fRescan = true;
+                } else if (rescan.compare("no") == 0) {
+                    fRescan = false;
+                } else {
+                    // Handle older API
+                    UniValue jVal;
+                    if (!jVal.read(std::string("[")+rescan+std::string("]")) ||
+                        !jVal.isArray() || jVal.size()!=1 || !jVal[0].isBool()) {
+                        throw JSONRPCError(
+                            RPC_INVALID_PARAMETER,
+                            "rescan must be \"yes\", \"no\" or \"whenkeyisnew\"");
+                    }
+                    fRescan = jVal[0].getBool();
+                }
+            }
+        }
 
-    EnsureWalletIsUnlocked();
+        // Height to rescan from
+        int nRescanHeight = 0;
+        if (params.size() > 2)
+            nRescanHeight = params[2].get_int();
+        if (nRescanHeight < 0 || nRescanHeight > chainActive.Height()) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
+        }
 
-    // Whether to perform rescan after import
-    bool fRescan = true;
-    bool fIgnoreExistingKey = true;
-    if (params.size() > 1) {
-        auto rescan = params[1].get_str();
-        if (rescan.compare("whenkeyisnew") != 0) {
-            fIgnoreExistingKey = false;
-            if (rescan.compare("yes") == 0) {
-                fRescan = true;
-            } else if (rescan.compare("no") == 0) {
-                fRescan = false;
-            } else {
-                // Handle older API
-                UniValue jVal;
-                if (!jVal.read(std::string("[")+rescan+std::string("]")) ||
-                    !jVal.isArray() || jVal.size()!=1 || !jVal[0].isBool()) {
+        string strSecret = params[0].get_str();
+        auto spendingkey = DecodeSpendingKey(strSecret);
+        if (!IsValidSpendingKey(spendingkey)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid spending key");
+        }
+
+        // An explicit start height doubles as the key's birth height, so
+        // later rescans don't trial-decrypt earlier blocks with it
+        int nBirthHeight = params.size() > 2 ? nRescanHeight : -1;
+
+        // Sapling support
+        auto addResult = boost::apply_visitor(AddSpendingKeyToWallet(pwalletMain, Params().GetConsensus(), nBirthHeight), spendingkey);
+        if (addResult == KeyAlreadyExists && fIgnoreExistingKey) {
+            return NullUniValue;
+        }
+        pwalletMain->MarkDirty();
+        if (addResult == KeyNotAdded) {
+            throw JSONRPCError(RPC_WALLET_ERROR, "Error adding spending key to wallet");
+        }
+    
+        // whenever a key is imported, we need to scan the whole chain
+        pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
+    
+        // We want to scan for transactions and notes
+        if (fRescan) {
+            pindexRescan = chainActive[nRescanHeight];
+        }
+    }
+
+    // Rescan without holding cs_main so that the node keeps processing blocks
+    if (pindexRescan) {
+        pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+    }
+
+    return NullUniValue;
+}
+
+UniValue z_importkeys(const UniValue& params, bool fHelp)
+{
+    if (!EnsureWalletIsAvailable(fHelp))
+        return NullUniValue;
+
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "z_importkeys [{\"key\":\"key\",\"birthheight\":n},...] ( rescan )\n"
+            "\nAdds several private keys (as returned by dumpprivkey or z_exportkey) to your wallet,\n"
+            "then rescans the chain once, starting at the lowest birth height of the imported keys.\n"
+            "A key's birth height is remembered, and later rescans skip earlier blocks for that key.\n"
+            "\nArguments:\n"
+            "1. \"keys\"               (array, required) The keys to import\n"
+            "    [\n"
+            "      {\n"
+            "        \"key\":\"key\"       (string, required) A transparent private key or a zkey\n"
+            "        \"birthheight\":n   (numeric, optional) Height of the first block that can involve the key;\n"
+            "                                   if omitted the whole chain is scanned for it\n"
+            "      }\n"
+            "      ,...\n"
+            "    ]\n"
+            "2. rescan               (string, optional, default=\"whenkeyisnew\") Rescan the wallet for transactions - can be \"yes\", \"no\" or \"whenkeyisnew\"\n"
+            "\nResult:\n"
+            "[\"address\",...]        (array) The address of each imported key, in the order given\n"
+            "\nNote: This call can take minutes to complete if rescan is true.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("z_importkeys", "\"[{\\\"key\\\":\\\"mykey\\\",\\\"birthheight\\\":30000},{\\\"key\\\":\\\"myotherkey\\\"}]\"") +
+            "\nAs a JSON-RPC call\n"
+            + HelpExampleRpc("z_importkeys", "[{\"key\":\"mykey\",\"birthheight\":30000}], \"yes\"")
+        );
+
+    UniValue ret(UniValue::VARR);
+    CBlockIndex* pindexRescan = NULL;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        EnsureWalletIsUnlocked();
+
+        // Whether to perform rescan after import
+        bool fRescan = true;
+        bool fIgnoreExistingKey = true;
+        if (params.size() > 1) {
+            auto rescan = params[1].get_str();
+            if (rescan.compare("whenkeyisnew") != 0) {
+                fIgnoreExistingKey = false;
+                if (rescan.compare("yes") == 0) {
+                    fRescan = true;
+                } else if (rescan.compare("no") == 0) {
+                    fRescan = false;
+                } else {
                     throw JSONRPCError(
                         RPC_INVALID_PARAMETER,
                         "rescan must be \"yes\", \"no\" or \"whenkeyisnew\"");
                 }
-                fRescan = jVal[0].getBool();
             }
         }
-    }
 
-    // Height to rescan from
-    int nRescanHeight = 0;
-    if (params.size() > 2)
-        nRescanHeight = params[2].get_int();
-    if (nRescanHeight < 0 || nRescanHeight > chainActive.Height()) {
-        throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
-    }
+        UniValue keys = params[0].get_array();
+        if (keys.empty()) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, keys array is empty.");
+        }
 
-    string strSecret = params[0].get_str();
-    auto spendingkey = DecodeSpendingKey(strSecret);
-    if (!IsValidSpendingKey(spendingkey)) {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid spending key");
-    }
+        // Decode and check every entry before adding any, so that a bad entry
+        // can't leave the wallet with part of the batch imported
+        struct KeyToImport {
+            CKey key;
+            libzcash::SpendingKey spendingkey;
+            int nBirthHeight;
+        };
+        std::vector<KeyToImport> vKeys;
+        vKeys.reserve(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            const UniValue& o = keys[i].get_obj();
+            RPCTypeCheckObj(o, boost::assign::map_list_of("key", UniValue::VSTR));
+
+            KeyToImport entry;
+            entry.nBirthHeight = -1;
+            const UniValue& birthheight = find_value(o, "birthheight");
+            if (!birthheight.isNull()) {
+                entry.nBirthHeight = birthheight.get_int();
+                if (entry.nBirthHeight < 0 || entry.nBirthHeight > chainActive.Height()) {
+                    throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Block height out of range for key %d", i));
+                }
+            }
 
-    // Sapling support
-    auto addResult = boost::apply_visitor(AddSpendingKeyToWallet(pwalletMain, Params().GetConsensus()), spendingkey);
-    if (addResult == KeyAlreadyExists && fIgnoreExistingKey) {
-        return NullUniValue;
-    }
-    pwalletMain->MarkDirty();
-    if (addResult == KeyNotAdded) {
-        throw JSONRPCError(RPC_WALLET_ERROR, "Error adding spending key to wallet");
+            string strSecret = find_value(o, "key").get_str();
+            entry.key = DecodeSecret(strSecret);
+            if (!entry.key.IsValid()) {
+                entry.spendingkey = DecodeSpendingKey(strSecret);
+                if (!IsValidSpendingKey(entry.spendingkey)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, strprintf("Invalid private key or spending key %d", i));
+                }
+            }
+            vKeys.push_back(entry);
+        }
+
+        // Lowest birth height of the keys that need a rescan, -1 if none do
+        int nRescanHeight = -1;
+        bool fAnyAdded = false;
+        // Keys added before a wallet error still need to be picked up by the wallet
+        auto failImport = [&fAnyAdded](const std::string& strError) {
+            if (fAnyAdded) {
+                pwalletMain->MarkDirty();
+                pwalletMain->nTimeFirstKey = 1;
+            }
+            return JSONRPCError(RPC_WALLET_ERROR, strError);
+        };
+        for (const KeyToImport& entry : vKeys) {
+            int nBirthHeight = entry.nBirthHeight;
+            bool fAdded;
+            if (entry.key.IsValid()) {
+                const CKey& key = entry.key;
+                CPubKey pubkey = key.GetPubKey();
+                assert(key.VerifyPubKey(pubkey));
+                CKeyID vchAddress = pubkey.GetID();
+                fAdded = !pwalletMain->HaveKey(vchAddress);
+                if (fAdded) {
+                    pwalletMain->mapKeyMetadata[vchAddress].nCreateTime = 1;
+                    pwalletMain->mapKeyMetadata[vchAddress].nBirthHeight = nBirthHeight;
+                    if (!pwalletMain->AddKeyPubKey(key, pubkey))
+                        throw failImport("Error adding key to wallet");
+                    pwalletMain->SetAddressBook(vchAddress, "", "receive");
+                } else {
+                    pwalletMain->SetKeyBirthHeight(pubkey, nBirthHeight);
+                }
+                ret.push_back(EncodeDestination(vchAddress));
+            } else {
+                const libzcash::SpendingKey& spendingkey = entry.spendingkey;
+                auto addResult = boost::apply_visitor(AddSpendingKeyToWallet(pwalletMain, Params().GetConsensus(), nBirthHeight), spendingkey);
+                if (addResult == KeyNotAdded) {
+                    throw failImport("Error adding spending key to wallet");
+                }
+                fAdded = addResult == KeyAdded;
+                if (auto sk = boost::get<libzcash::SproutSpendingKey>(&spendingkey)) {
+                    ret.push_back(EncodePaymentAddress(sk->address()));
+                } else {
+                    ret.push_back(EncodePaymentAddress(boost::get<libzcash::SaplingExtendedSpendingKey>(spendingkey).DefaultAddress()));
+                }
+            }
+
+            fAnyAdded |= fAdded;
+            if (fAdded || !fIgnoreExistingKey) {
+                int nKeyHeight = std::max(nBirthHeight, 0);
+                if (nRescanHeight < 0 || nKeyHeight < nRescanHeight)
+                    nRescanHeight = nKeyHeight;
+            }
+        }
+
+        if (fAnyAdded) {
+            pwalletMain->MarkDirty();
+            // whenever a key is imported, we need to scan the whole chain
+            pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
+        }
+
+        // One rescan covers every key; keys are skipped below their own birth height
+        if (fRescan && nRescanHeight >= 0) {
+            pindexRescan = chainActive[nRescanHeight];
+        }
     }
-    
-    // whenever a key is imported, we need to scan the whole chain
-    pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
-    
-    // We want to scan for transactions and notes
-    if (fRescan) {
-        pwalletMain->ScanForWalletTransactions(chainActive[nRescanHeight], true);
+
+    // Rescan without holding cs_main so that the node keeps processing blocks
+    if (pindexRescan) {
+        pwalletMain->ScanForWalletTransactions(pindexRescan, true);
     }
 
-    return NullUniValue;
+    return ret;
 }
 
 UniValue z_importviewingkey(const UniValue& params, bool fHelp)
@@ -690,72 +891,80 @@ UniValue z_importviewingkey(const UniValue& params, bool fHelp)
             + HelpExampleRpc("z_importviewingkey", "\"vkey\", \"no\"")
         );
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
-
-    EnsureWalletIsUnlocked();
-
-    // Whether to perform rescan after import
-    bool fRescan = true;
-    bool fIgnoreExistingKey = true;
-    if (params.size() > 1) {
-        auto rescan = params[1].get_str();
-        if (rescan.compare("whenkeyisnew") != 0) {
-            fIgnoreExistingKey = false;
-            if (rescan.compare("no") == 0) {
-                fRescan = false;
-            } else if (rescan.compare("yes") != 0) {
-                throw JSONRPCError(
-                    RPC_INVALID_PARAMETER,
-                    "rescan must be \"yes\", \"no\" or \"whenkeyisnew\"");
+    CBlockIndex* pindexRescan = NULL;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        EnsureWalletIsUnlocked();
+
+        // Whether to perform rescan after import
+        bool fRescan = true;
+        bool fIgnoreExistingKey = true;
+        if (params.size() > 1) {
+            auto rescan = params[1].get_str();
+            if (rescan.compare("whenkeyisnew") != 0) {
+                fIgnoreExistingKey = false;
+                if (rescan.compare("no") == 0) {
+                    fRescan = false;
+                } else if (rescan.compare("yes") != 0) {
+                    throw JSONRPCError(
+                        RPC_INVALID_PARAMETER,
+                        "rescan must be \"yes\", \"no\" or \"whenkeyisnew\"");
+                }
             }
         }
-    }
-
-    // Height to rescan from
-    int nRescanHeight = 0;
-    if (params.size() > 2) {
-        nRescanHeight = params[2].get_int();
-    }
-    if (nRescanHeight < 0 || nRescanHeight > chainActive.Height()) {
-        throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
-    }
 
-    string strVKey = params[0].get_str();
-    auto viewingkey = DecodeViewingKey(strVKey);
-    if (!IsValidViewingKey(viewingkey)) {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid viewing key");
-    }
-    // TODO: Add Sapling support. For now, return an error to the user.
-    if (boost::get<libzcash::SproutViewingKey>(&viewingkey) == nullptr) {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Currently, only Sprout viewing keys are supported");
-    }
-    auto vkey = boost::get<libzcash::SproutViewingKey>(viewingkey);
-    auto addr = vkey.address();
+        // Height to rescan from
+        int nRescanHeight = 0;
+        if (params.size() > 2) {
+            nRescanHeight = params[2].get_int();
+        }
+        if (nRescanHeight < 0 || nRescanHeight > chainActive.Height()) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
+        }
 
-    {
-        if (pwalletMain->HaveSproutSpendingKey(addr)) {
-            throw JSONRPCError(RPC_WALLET_ERROR, "The wallet already contains the private key for this viewing key");
+        string strVKey = params[0].get_str();
+        auto viewingkey = DecodeViewingKey(strVKey);
+        if (!IsValidViewingKey(viewingkey)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid viewing key");
         }
+        // TODO: Add Sapling support. For now, return an error to the user.
+        if (boost::get<libzcash::SproutViewingKey>(&viewingkey) == nullptr) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Currently, only Sprout viewing keys are supported");
+        }
+        auto vkey = boost::get<libzcash::SproutViewingKey>(viewingkey);
+        auto addr = vkey.address();
 
-        // Don't throw error in case a viewing key is already there
-        if (pwalletMain->HaveSproutViewingKey(addr)) {
-            if (fIgnoreExistingKey) {
-                return NullUniValue;
+        {
+            if (pwalletMain->HaveSproutSpendingKey(addr)) {
+                throw JSONRPCError(RPC_WALLET_ERROR, "The wallet already contains the private key for this viewing key");
             }
-        } else {
-            pwalletMain->MarkDirty();
 
-            if (!pwalletMain->AddSproutViewingKey(vkey)) {
-                throw JSONRPCError(RPC_WALLET_ERROR, "Error adding viewing key to wallet");
+            // Don't throw error in case a viewing key is already there
+            if (pwalletMain->HaveSproutViewingKey(addr)) {
+                if (fIgnoreExistingKey) {
+                    return NullUniValue;
+                }
+            } else {
+                pwalletMain->MarkDirty();
+
+                if (!pwalletMain->AddSproutViewingKey(vkey)) {
+                    throw JSONRPCError(RPC_WALLET_ERROR, "Error adding viewing key to wallet");
+                }
             }
-        }
 
-        // We want to scan for transactions and notes
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(chainActive[nRescanHeight], true);
+            // We want to scan for transactions and notes
+            if (fRescan) {
+                pindexRescan = chainActive[nRescanHeight];
+            }
         }
     }
 
+    // Rescan without holding cs_main so that the node keeps processing blocks
+    if (pindexRescan) {
+        pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+    }
+
     return NullUniValue;
 }
 
@@ -854,33 +854,26 @@ UniValue movecmd(const UniValue& params, bool fHelp)
     if (params.size() > 4)
         strComment = params[4].get_str();
 
-    CWalletDB walletdb(pwalletMain->strWalletFile);
-    if (!walletdb.TxnBegin())
-        throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
-
     int64_t nNow = GetAdjustedTime();
 
     // Debit
     CAccountingEntry debit;
-    debit.nOrderPos = pwalletMain->IncOrderPosNext(&walletdb);
     debit.strAccount = strFrom;
     debit.nCreditDebit = -nAmount;
     debit.nTime = nNow;
     debit.strOtherAccount = strTo;
     debit.strComment = strComment;
-    walletdb.WriteAccountingEntry(debit);
 
     // Credit
     CAccountingEntry credit;
-    credit.nOrderPos = pwalletMain->IncOrderPosNext(&walletdb);
     credit.strAccount = strTo;
     credit.nCreditDebit = nAmount;
     credit.nTime = nNow;
     credit.strOtherAccount = strFrom;
     credit.strComment = strComment;
-    walletdb.WriteAccountingEntry(credit);
 
-    if (!walletdb.TxnCommit())
+    std::vector<CAccountingEntry> entries = {debit, credit};
+    if (!pwalletMain->AddAccountingEntries(entries))
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
     return true;
@@ -1497,11 +1490,10 @@ UniValue listtransactions(const UniValue& params, bool fHelp)
 
     UniValue ret(UniValue::VARR);
 
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
+    const CWallet::TxItems& txOrdered = pwalletMain->OrderedTxItems();
 
     // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
     {
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
@@ -1691,12 +1683,18 @@ UniValue listsinceblock(const UniValue& params, bool fHelp)
 
     UniValue transactions(UniValue::VARR);
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    if (depth == -1)
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions, filter);
+        for (map<uint256, CWalletTx>::const_iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+            ListTransactions((*it).second, "*", 0, true, transactions, filter);
+    }
+    else
+    {
+        // Only the transactions mined after pindex, or not mined in the active chain at all
+        std::vector<uint256> vHashes;
+        pwalletMain->GetTxHashesSince(pindex->nHeight, vHashes);
+        BOOST_FOREACH(const uint256& hash, vHashes)
+            ListTransactions(pwalletMain->mapWallet.at(hash), "*", 0, true, transactions, filter);
     }
 
     CBlockIndex *pblockLast = chainActive[chainActive.Height() + 1 - target_confirms];
@@ -3188,6 +3186,63 @@ UniValue z_getnewaddress(const UniValue& params, bool fHelp)
     }
 }
 
+#define Z_GETNEWADDRESSES_MAX 10000
+
+UniValue z_getnewaddresses(const UniValue& params, bool fHelp)
+{
+    if (!EnsureWalletIsAvailable(fHelp))
+        return NullUniValue;
+
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "z_getnewaddresses count ( \"zaddr\" )\n"
+            "\nReturns a number of new Sapling addresses for receiving payments.\n"
+            "\nWithout a zaddr, every address gets a new spending key, as with z_getnewaddress.\n"
+            "With a zaddr, the addresses are new diversified addresses that share its spending key,\n"
+            "which keeps the cost of scanning for incoming notes the same however many addresses are used.\n"
+            "\nArguments:\n"
+            "1. count          (numeric, required) The number of addresses to generate (at most " + std::to_string(Z_GETNEWADDRESSES_MAX) + ").\n"
+            "2. \"zaddr\"        (string, optional) A Sapling address of this wallet to diversify.\n"
+            "\nResult:\n"
+            "[                 (json array of string)\n"
+            "  \"zaddr\"       (string) a new shielded address\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("z_getnewaddresses", "100")
+            + HelpExampleCli("z_getnewaddresses", "100 \"ztestsapling1...\"")
+            + HelpExampleRpc("z_getnewaddresses", "100")
+        );
+
+    int nCount = params[0].get_int();
+    if (nCount < 1 || nCount > Z_GETNEWADDRESSES_MAX)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Invalid count, must be between 1 and %d", Z_GETNEWADDRESSES_MAX));
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    EnsureWalletIsUnlocked();
+
+    std::vector<libzcash::SaplingPaymentAddress> vAddresses;
+    if (params.size() > 1) {
+        auto zaddr = DecodePaymentAddress(params[1].get_str());
+        if (!IsValidPaymentAddress(zaddr) || boost::get<libzcash::SaplingPaymentAddress>(&zaddr) == nullptr)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Sapling address");
+        auto addr = boost::get<libzcash::SaplingPaymentAddress>(zaddr);
+        libzcash::SaplingExtendedSpendingKey xsk;
+        if (!pwalletMain->GetSaplingExtendedSpendingKey(addr, xsk))
+            throw JSONRPCError(RPC_WALLET_ERROR, "Wallet does not hold the spending key for this address");
+        vAddresses = pwalletMain->GenerateSaplingDiversifiedAddresses(addr, nCount);
+    } else {
+        vAddresses = pwalletMain->GenerateNewSaplingZKeys(nCount);
+    }
+
+    UniValue ret(UniValue::VARR);
+    for (const libzcash::SaplingPaymentAddress& addr : vAddresses) {
+        ret.push_back(EncodePaymentAddress(addr));
+    }
+    return ret;
+}
+
 
 UniValue z_listaddresses(const UniValue& params, bool fHelp)
 {
@@ -3246,61 +3301,25 @@ UniValue z_listaddresses(const UniValue& params, bool fHelp)
 }
 
 CAmount getBalanceTaddr(std::string transparentAddress, int minDepth=1, bool ignoreUnspendable=true) {
-    std::set<CTxDestination> destinations;
-    vector<COutput> vecOutputs;
-    CAmount balance = 0;
-
     if (transparentAddress.length() > 0) {
         CTxDestination taddr = DecodeDestination(transparentAddress);
         if (!IsValidDestination(taddr)) {
             throw std::runtime_error("invalid transparent address");
         }
-        destinations.insert(taddr);
+        return pwalletMain->GetAddressBalance(taddr, minDepth, !ignoreUnspendable);
     }
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
-
-    pwalletMain->AvailableCoins(vecOutputs, false, NULL, true);
-
-    BOOST_FOREACH(const COutput& out, vecOutputs) {
-        if (out.nDepth < minDepth) {
-            continue;
-        }
-
-        if (ignoreUnspendable && !out.fSpendable) {
-            continue;
-        }
-
-        if (destinations.size()) {
-            CTxDestination address;
-            if (!ExtractDestination(out.tx->vout[out.i].scriptPubKey, address)) {
-                continue;
-            }
-
-            if (!destinations.count(address)) {
-                continue;
-            }
-        }
-
-        CAmount nValue = out.tx->vout[out.i].nValue;
-        balance += nValue;
-    }
-    return balance;
+    return pwalletMain->GetPoolBalance(BALANCE_POOL_TRANSPARENT, minDepth, !ignoreUnspendable);
 }
 
 CAmount getBalanceZaddr(std::string address, int minDepth = 1, bool ignoreUnspendable=true) {
-    CAmount balance = 0;
-    std::vector<SproutNoteEntry> sproutEntries;
-    std::vector<SaplingNoteEntry> saplingEntries;
-    LOCK2(cs_main, pwalletMain->cs_wallet);
-    pwalletMain->GetFilteredNotes(sproutEntries, saplingEntries, address, minDepth, true, ignoreUnspendable);
-    for (auto & entry : sproutEntries) {
-        balance += CAmount(entry.note.value());
+    if (address.length() > 0) {
+        libzcash::PaymentAddress zaddr = DecodePaymentAddress(address);
+        return pwalletMain->GetAddressBalance(zaddr, minDepth, !ignoreUnspendable);
     }
-    for (auto & entry : saplingEntries) {
-        balance += CAmount(entry.note.value());
-    }
-    return balance;
+
+    return pwalletMain->GetPoolBalance(BALANCE_POOL_SPROUT, minDepth, !ignoreUnspendable) +
+           pwalletMain->GetPoolBalance(BALANCE_POOL_SAPLING, minDepth, !ignoreUnspendable);
 }
 
 
@@ -3538,6 +3557,36 @@ UniValue z_getoperationresult(const UniValue& params, bool fHelp)
     return z_getoperationstatus_IMPL(params, true);
 }
 
+UniValue z_canceloperation(const UniValue& params, bool fHelp)
+{
+    if (!EnsureWalletIsAvailable(fHelp))
+        return NullUniValue;
+
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "z_canceloperation \"operationid\"\n"
+            "\nCancel an operation. A queued operation is cancelled right away; an executing one stops"
+            "\nat its next cancellation point (for example before creating the next proof), after which"
+            "\nits status becomes \"cancelled\"."
+            + HelpRequiringPassphrase() + "\n"
+            "\nArguments:\n"
+            "1. \"operationid\"         (string, required) The id of the operation to cancel.\n"
+            "\nResult:\n"
+            "true|false               (boolean) Whether the operation was queued or executing, and so will be cancelled\n"
+            "\nExamples:\n"
+            + HelpExampleCli("z_canceloperation", "\"operationid\"")
+            + HelpExampleRpc("z_canceloperation", "\"operationid\"")
+        );
+
+    std::shared_ptr<AsyncRPCOperation> operation = getAsyncRPCQueue()->getOperationForId(params[0].get_str());
+    if (!operation) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "No operation exists for that id.");
+    }
+    bool fCancellable = operation->isReady() || operation->isExecuting();
+    operation->cancel();
+    return fCancellable;
+}
+
 UniValue z_getoperationstatus(const UniValue& params, bool fHelp)
 {
    if (!EnsureWalletIsAvailable(fHelp))
@@ -4735,6 +4784,7 @@ extern UniValue dumpwallet(const UniValue& params, bool fHelp);
 extern UniValue importwallet(const UniValue& params, bool fHelp);
 extern UniValue z_exportkey(const UniValue& params, bool fHelp);
 extern UniValue z_importkey(const UniValue& params, bool fHelp);
+extern UniValue z_importkeys(const UniValue& params, bool fHelp);
 extern UniValue z_exportviewingkey(const UniValue& params, bool fHelp);
 extern UniValue z_importviewingkey(const UniValue& params, bool fHelp);
 extern UniValue z_exportwallet(const UniValue& params, bool fHelp);
@@ -4804,10 +4854,13 @@ static const CRPCCommand commands[] =
     { "wallet",             "z_getoperationstatus",     &z_getoperationstatus,     true  },
     { "wallet",             "z_getoperationresult",     &z_getoperationresult,     true  },
     { "wallet",             "z_listoperationids",       &z_listoperationids,       true  },
+    { "wallet",             "z_canceloperation",        &z_canceloperation,        true  },
     { "wallet",             "z_getnewaddress",          &z_getnewaddress,          true  },
+    { "wallet",             "z_getnewaddresses",        &z_getnewaddresses,        true  },
     { "wallet",             "z_listaddresses",          &z_listaddresses,          true  },
     { "wallet",             "z_exportkey",              &z_exportkey,              true  },
     { "wallet",             "z_importkey",              &z_importkey,              true  },
+    { "wallet",             "z_importkeys",             &z_importkeys,             true  },
     { "wallet",             "z_exportviewingkey",       &z_exportviewingkey,       true  },
     { "wallet",             "z_importviewingkey",       &z_importviewingkey,       true  },
     { "wallet",             "z_exportwallet",           &z_exportwallet,           true  },
@@ -307,4 +307,24 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(coin_selection_exact_match)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    empty_wallet();
+    for (int i = 0; i < 1000; i++)
+        add_coin(2 * CENT);
+    add_coin(1 * CENT);
+
+    // an odd amount can only be made exactly with the single 1 cent coin
+    BOOST_CHECK( wallet.SelectCoinsMinConf(1001 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 1001 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 501U);
+
+    empty_wallet();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -28,6 +28,7 @@
 #include "zcash/zip32.h"
 
 #include <assert.h>
+#include <atomic>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
@@ -44,6 +45,7 @@ CAmount maxTxFee = DEFAULT_TRANSACTION_MAXFEE;
 unsigned int nTxConfirmTarget = DEFAULT_TX_CONFIRM_TARGET;
 bool bSpendZeroConfChange = true;
 bool fSendFreeTransactions = false;
+bool fCacheNoteWitnesses = DEFAULT_CACHE_NOTE_WITNESSES;
 bool fPayAtLeastCustomFee = true;
 
 /**
@@ -155,6 +157,214 @@ SaplingPaymentAddress CWallet::GenerateNewSaplingZKey()
     return addr;
 }
 
+static libzcash::diversifier_index_t DiversifierIndex(uint64_t n)
+{
+    libzcash::diversifier_index_t j;
+    for (size_t k = 0; k < sizeof(n); k++) {
+        j.begin()[k] = (n >> (8 * k)) & 0xff;
+    }
+    return j;
+}
+
+static uint64_t DiversifierIndexToUint64(const libzcash::diversifier_index_t& j)
+{
+    uint64_t n = 0;
+    for (size_t k = 0; k < sizeof(n); k++) {
+        n |= uint64_t(j.begin()[k]) << (8 * k);
+    }
+    for (size_t k = sizeof(n); k < j.size(); k++) {
+        if (j.begin()[k] != 0) {
+            throw std::runtime_error("DiversifierIndexToUint64(): diversifier index out of range");
+        }
+    }
+    return n;
+}
+
+void CWallet::BeginKeyBatch()
+{
+    AssertLockHeld(cs_wallet);
+    if (!fFileBacked) {
+        return;
+    }
+    assert(!pwalletdbEncryption);
+    pwalletdbEncryption = new CWalletDB(strWalletFile);
+    if (!pwalletdbEncryption->TxnBegin()) {
+        delete pwalletdbEncryption;
+        pwalletdbEncryption = NULL;
+        throw std::runtime_error("CWallet::BeginKeyBatch(): Can't begin a wallet database transaction");
+    }
+}
+
+void CWallet::EndKeyBatch(bool fCommit)
+{
+    AssertLockHeld(cs_wallet);
+    if (!pwalletdbEncryption) {
+        return;
+    }
+    bool fSuccess = fCommit ? pwalletdbEncryption->TxnCommit() : pwalletdbEncryption->TxnAbort();
+    delete pwalletdbEncryption;
+    pwalletdbEncryption = NULL;
+    if (fCommit && !fSuccess) {
+        throw std::runtime_error("CWallet::EndKeyBatch(): Can't commit the wallet database transaction");
+    }
+}
+
+std::vector<SaplingPaymentAddress> CWallet::GenerateNewSaplingZKeys(size_t nCount)
+{
+    AssertLockHeld(cs_wallet); // mapSaplingZKeyMetadata
+
+    int64_t nCreationTime = GetTime();
+    HDSeed seed;
+    if (!GetHDSeed(seed))
+        throw std::runtime_error("CWallet::GenerateNewSaplingZKeys(): HD seed not found");
+
+    auto m = libzcash::SaplingExtendedSpendingKey::Master(seed);
+    uint32_t bip44CoinType = Params().BIP44CoinType();
+    auto m_32h_cth = m.Derive(32 | ZIP32_HARDENED_KEY_LIMIT).Derive(bip44CoinType | ZIP32_HARDENED_KEY_LIMIT);
+
+    // What to undo in memory if the batch isn't saved
+    struct AddedKey {
+        libzcash::SaplingExtendedSpendingKey xsk;
+        SaplingPaymentAddress addr;
+        bool fHadViewingKey;
+        boost::optional<CKeyMetadata> metadataBefore;
+    };
+    std::vector<AddedKey> vAdded;
+    uint32_t nCounterBefore = hdChain.saplingAccountCounter;
+
+    std::vector<SaplingPaymentAddress> vAddresses;
+    BeginKeyBatch();
+    try {
+        while (vAddresses.size() < nCount) {
+            // Derive the account keys, and search for their default
+            // diversifiers, in parallel
+            size_t nNeeded = nCount - vAddresses.size();
+            uint32_t nFirst = hdChain.saplingAccountCounter;
+            std::vector<std::pair<libzcash::SaplingExtendedSpendingKey, SaplingPaymentAddress>> vKeys(nNeeded);
+            ForEachIndexInParallel(nNeeded, [&](size_t i) {
+                auto xsk = m_32h_cth.Derive((nFirst + i) | ZIP32_HARDENED_KEY_LIMIT);
+                vKeys[i] = std::make_pair(xsk, xsk.DefaultAddress());
+            });
+
+            for (size_t i = 0; i < vKeys.size(); i++) {
+                const libzcash::SaplingExtendedSpendingKey& xsk = vKeys[i].first;
+                hdChain.saplingAccountCounter++;
+                // Skip keys already known to the wallet
+                auto fvk = xsk.expsk.full_viewing_key();
+                if (HaveSaplingSpendingKey(fvk)) {
+                    continue;
+                }
+
+                auto ivk = fvk.in_viewing_key();
+                AddedKey added {xsk, vKeys[i].second, HaveSaplingFullViewingKey(ivk), boost::none};
+                auto mi = mapSaplingZKeyMetadata.find(ivk);
+                if (mi != mapSaplingZKeyMetadata.end()) {
+                    added.metadataBefore = mi->second;
+                }
+                vAdded.push_back(added);
+
+                CKeyMetadata metadata(nCreationTime);
+                metadata.hdKeypath = "m/32'/" + std::to_string(bip44CoinType) + "'/" + std::to_string(nFirst + i) + "'";
+                metadata.seedFp = hdChain.seedFp;
+                mapSaplingZKeyMetadata[ivk] = metadata;
+                if (!AddSaplingZKey(xsk, vKeys[i].second)) {
+                    throw std::runtime_error("CWallet::GenerateNewSaplingZKeys(): AddSaplingZKey failed");
+                }
+                vAddresses.push_back(vKeys[i].second);
+            }
+        }
+
+        if (pwalletdbEncryption && !pwalletdbEncryption->WriteHDChain(hdChain))
+            throw std::runtime_error("CWallet::GenerateNewSaplingZKeys(): Writing HD chain model failed");
+        EndKeyBatch(true);
+    } catch (...) {
+        EndKeyBatch(false);
+        // The database has none of the new keys, so forget them, and reuse
+        // their account indices next time
+        for (auto it = vAdded.rbegin(); it != vAdded.rend(); ++it) {
+            auto fvk = it->xsk.expsk.full_viewing_key();
+            RemoveSaplingSpendingKey(it->xsk);
+            if (!it->fHadViewingKey) {
+                RemoveSaplingFullViewingKey(fvk);
+                RemoveSaplingIncomingViewingKey(it->addr);
+            }
+            if (it->metadataBefore) {
+                mapSaplingZKeyMetadata[fvk.in_viewing_key()] = *it->metadataBefore;
+            } else {
+                mapSaplingZKeyMetadata.erase(fvk.in_viewing_key());
+            }
+        }
+        hdChain.saplingAccountCounter = nCounterBefore;
+        throw;
+    }
+    return vAddresses;
+}
+
+std::vector<SaplingPaymentAddress> CWallet::GenerateSaplingDiversifiedAddresses(
+    const SaplingPaymentAddress& addr, size_t nCount)
+{
+    AssertLockHeld(cs_wallet); // mapSaplingZKeyMetadata
+
+    libzcash::SaplingExtendedSpendingKey xsk;
+    if (!GetSaplingExtendedSpendingKey(addr, xsk))
+        throw std::runtime_error("CWallet::GenerateSaplingDiversifiedAddresses(): Spending key not found");
+    auto xfvk = xsk.ToXFVK();
+    auto ivk = xfvk.fvk.in_viewing_key();
+    CKeyMetadata& metadata = mapSaplingZKeyMetadata[ivk];
+    CKeyMetadata metadataBefore = metadata;
+    uint64_t nNext = DiversifierIndexToUint64(metadata.nextDiversifierIndex);
+
+    std::vector<SaplingPaymentAddress> vAddresses;
+    BeginKeyBatch();
+    try {
+        while (vAddresses.size() < nCount) {
+            // About half of all diversifier indices give a valid address, so
+            // check a bit more than twice as many as we still need in parallel
+            size_t nNeeded = nCount - vAddresses.size();
+            size_t nCandidates = 2 * nNeeded + 16;
+            std::vector<boost::optional<SaplingPaymentAddress>> vCandidates(nCandidates);
+            ForEachIndexInParallel(nCandidates, [&](size_t i) {
+                auto j = DiversifierIndex(nNext + i);
+                auto result = xfvk.Address(j);
+                if (result && result->first == j) {
+                    vCandidates[i] = result->second;
+                }
+            });
+
+            size_t nChecked = 0;
+            for (; nChecked < nCandidates && vAddresses.size() < nCount; nChecked++) {
+                const boost::optional<SaplingPaymentAddress>& candidate = vCandidates[nChecked];
+                // Skip the default address and any other address handed out before
+                if (!candidate || HaveSaplingIncomingViewingKey(*candidate)) {
+                    continue;
+                }
+                vAddresses.push_back(*candidate);
+                if (!AddSaplingIncomingViewingKey(ivk, *candidate)) {
+                    throw std::runtime_error("CWallet::GenerateSaplingDiversifiedAddresses(): AddSaplingIncomingViewingKey failed");
+                }
+            }
+            nNext += nChecked;
+        }
+
+        metadata.nextDiversifierIndex = DiversifierIndex(nNext);
+        if (metadata.nVersion < CKeyMetadata::VERSION_WITH_DIVERSIFIER)
+            metadata.nVersion = CKeyMetadata::VERSION_WITH_DIVERSIFIER;
+        if (pwalletdbEncryption && !pwalletdbEncryption->WriteSaplingZKeyMetadata(ivk, metadata))
+            throw std::runtime_error("CWallet::GenerateSaplingDiversifiedAddresses(): Writing key metadata failed");
+        EndKeyBatch(true);
+    } catch (...) {
+        EndKeyBatch(false);
+        // The database has none of the new addresses, so forget them, and
+        // hand out their diversifiers next time
+        for (const SaplingPaymentAddress& added : vAddresses) {
+            RemoveSaplingIncomingViewingKey(added);
+        }
+        metadata = metadataBefore;
+        throw;
+    }
+    return vAddresses;
+}
+
 // Add spending key to keystore 
 bool CWallet::AddSaplingZKey(
     const libzcash::SaplingExtendedSpendingKey &sk,
@@ -172,6 +382,9 @@ bool CWallet::AddSaplingZKey(
 
     if (!IsCrypted()) {
         auto ivk = sk.expsk.full_viewing_key().in_viewing_key();
+        if (pwalletdbEncryption) {
+            return pwalletdbEncryption->WriteSaplingZKey(ivk, sk, mapSaplingZKeyMetadata[ivk]);
+        }
         return CWalletDB(strWalletFile).WriteSaplingZKey(ivk, sk, mapSaplingZKeyMetadata[ivk]);
     }
     
@@ -193,6 +406,11 @@ bool CWallet::AddSaplingIncomingViewingKey(
         return true;
     }
 
+    if (pwalletdbEncryption) {
+        // Diversified addresses are written in batches (and for encrypted
+        // wallets too, as they are not found again until they receive notes)
+        return pwalletdbEncryption->WriteSaplingPaymentAddress(addr, ivk);
+    }
     if (!IsCrypted()) {
         return CWalletDB(strWalletFile).WriteSaplingPaymentAddress(addr, ivk);
     }
@@ -246,8 +464,12 @@ CPubKey CWallet::GenerateNewKey()
     if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
         nTimeFirstKey = nCreationTime;
 
+    // A key that was just generated can't own any outputs in the wallet, so
+    // it doesn't make the IsMine pre-filter rebuild setMyOutPoints
+    bool fMyOutPointsWereStale = fMyOutPointsStale;
     if (!AddKeyPubKey(secret, pubkey))
         throw std::runtime_error("CWallet::GenerateNewKey(): AddKey failed");
+    fMyOutPointsStale = fMyOutPointsWereStale;
     return pubkey;
 }
 
@@ -256,6 +478,7 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     AssertLockHeld(cs_wallet); // mapKeyMetadata
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
         return false;
+    AddToScriptFilter(pubkey.GetID());
 
     // check if we need to remove from watch-only
     CScript script;
@@ -279,6 +502,7 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
 
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    AddToScriptFilter(vchPubKey.GetID());
     if (!fFileBacked)
         return true;
     {
@@ -362,9 +586,65 @@ bool CWallet::LoadZKeyMetadata(const SproutPaymentAddress &addr, const CKeyMetad
     return true;
 }
 
+// Returns true if the birth height in meta changed
+static bool LowerBirthHeight(CKeyMetadata& meta, int nBirthHeight)
+{
+    if (nBirthHeight < 0 || (meta.nBirthHeight >= 0 && meta.nBirthHeight <= nBirthHeight))
+        return false;
+    meta.nBirthHeight = nBirthHeight;
+    // Metadata loaded from an older wallet wouldn't serialize the new field
+    if (meta.nVersion < CKeyMetadata::VERSION_WITH_BIRTHHEIGHT)
+        meta.nVersion = CKeyMetadata::VERSION_WITH_BIRTHHEIGHT;
+    return true;
+}
+
+bool CWallet::SetKeyBirthHeight(const CPubKey &pubkey, int nBirthHeight)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
+    CKeyMetadata& meta = mapKeyMetadata[pubkey.GetID()];
+    if (!LowerBirthHeight(meta, nBirthHeight))
+        return true;
+    if (!fFileBacked)
+        return true;
+    return CWalletDB(strWalletFile).WriteKeyMetadata(pubkey, meta);
+}
+
+bool CWallet::SetKeyBirthHeight(const SproutPaymentAddress &addr, int nBirthHeight)
+{
+    AssertLockHeld(cs_wallet); // mapSproutZKeyMetadata
+    CKeyMetadata& meta = mapSproutZKeyMetadata[addr];
+    if (!LowerBirthHeight(meta, nBirthHeight))
+        return true;
+    if (!fFileBacked)
+        return true;
+    return CWalletDB(strWalletFile).WriteZKeyMetadata(addr, meta);
+}
+
+bool CWallet::SetKeyBirthHeight(const SaplingIncomingViewingKey &ivk, int nBirthHeight)
+{
+    AssertLockHeld(cs_wallet); // mapSaplingZKeyMetadata
+    CKeyMetadata& meta = mapSaplingZKeyMetadata[ivk];
+    if (!LowerBirthHeight(meta, nBirthHeight))
+        return true;
+    if (!fFileBacked)
+        return true;
+    return CWalletDB(strWalletFile).WriteSaplingZKeyMetadata(ivk, meta);
+}
+
+bool CWallet::LoadKey(const CKey& key, const CPubKey &pubkey)
+{
+    if (!CCryptoKeyStore::AddKeyPubKey(key, pubkey))
+        return false;
+    AddToScriptFilter(pubkey.GetID());
+    return true;
+}
+
 bool CWallet::LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
-    return CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret);
+    if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
+        return false;
+    AddToScriptFilter(vchPubKey.GetID());
+    return true;
 }
 
 bool CWallet::LoadCryptedZKey(const libzcash::SproutPaymentAddress &addr, const libzcash::ReceivingKey &rk, const std::vector<unsigned char> &vchCryptedSecret)
@@ -439,6 +719,7 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    AddToScriptFilter(CScriptID(redeemScript));
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -457,14 +738,19 @@ bool CWallet::LoadCScript(const CScript& redeemScript)
         return true;
     }
 
-    return CCryptoKeyStore::AddCScript(redeemScript);
+    if (!CCryptoKeyStore::AddCScript(redeemScript))
+        return false;
+    AddToScriptFilter(CScriptID(redeemScript));
+    return true;
 }
 
 bool CWallet::AddWatchOnly(const CScript &dest)
 {
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    AddToScriptFilter(dest);
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
+    fBalancesStale = true;
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
         return true;
@@ -476,6 +762,7 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
     AssertLockHeld(cs_wallet);
     if (!CCryptoKeyStore::RemoveWatchOnly(dest))
         return false;
+    fBalancesStale = true;
     if (!HaveWatchOnly())
         NotifyWatchonlyChanged(false);
     if (fFileBacked)
@@ -487,7 +774,69 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
 
 bool CWallet::LoadWatchOnly(const CScript &dest)
 {
-    return CCryptoKeyStore::AddWatchOnly(dest);
+    if (!CCryptoKeyStore::AddWatchOnly(dest))
+        return false;
+    AddToScriptFilter(dest);
+    return true;
+}
+
+/** The key or script hash a P2PKH or P2SH script pays to, as indexed by the IsMine pre-filter */
+static bool GetScriptFilterHash(const CScript& scriptPubKey, uint160& hashRet)
+{
+    if (scriptPubKey.IsPayToPublicKeyHash()) {
+        memcpy(hashRet.begin(), &scriptPubKey[3], 20);
+        return true;
+    }
+    if (scriptPubKey.IsPayToScriptHash()) {
+        memcpy(hashRet.begin(), &scriptPubKey[2], 20);
+        return true;
+    }
+    return false;
+}
+
+void CWallet::AddToScriptFilter(const uint160& hash)
+{
+    {
+        LOCK(cs_myScripts);
+        if (!setMyScriptHashes.insert(hash).second)
+            return;
+    }
+    // Outputs already in the wallet may have become ours
+    LOCK(cs_wallet);
+    fMyOutPointsStale = true;
+}
+
+void CWallet::AddToScriptFilter(const CScript& scriptPubKey)
+{
+    // Other watch-only scripts are never filtered out by IsMine
+    uint160 hash;
+    if (GetScriptFilterHash(scriptPubKey, hash))
+        AddToScriptFilter(hash);
+}
+
+void CWallet::IndexMyOutPoints(const CWalletTx& wtx) const
+{
+    AssertLockHeld(cs_wallet); // setMyOutPoints
+    if (fMyOutPointsStale)
+        return;
+
+    const uint256& hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        if (IsMine(wtx.vout[i]) != ISMINE_NO)
+            setMyOutPoints.insert(COutPoint(hash, i));
+    }
+}
+
+bool CWallet::IsMyOutPoint(const COutPoint& outpoint) const
+{
+    AssertLockHeld(cs_wallet); // mapWallet, setMyOutPoints
+    if (fMyOutPointsStale) {
+        setMyOutPoints.clear();
+        fMyOutPointsStale = false;
+        for (const std::pair<const uint256, CWalletTx>& item : mapWallet)
+            IndexMyOutPoints(item.second);
+    }
+    return setMyOutPoints.count(outpoint) > 0;
 }
 
 bool CWallet::Unlock(const SecureString& strWalletPassphrase)
@@ -577,6 +926,18 @@ void CWallet::ChainTip(const CBlockIndex *pindex,
                        SaplingMerkleTree saplingTree, 
                        bool added)
 {
+    {
+        LOCK(cs_wallet);
+        if (fRescanInProgress) {
+            // Blocks the rescan has not reached yet are applied by the
+            // rescan itself once it gets there.
+            if (added ? pindex->pprev != pindexRescanTip : pindex != pindexRescanTip) {
+                return;
+            }
+            pindexRescanTip = added ? pindex : pindex->pprev;
+        }
+    }
+
     if (added) {
         ChainTipAdded(pindex, pblock, sproutTree, saplingTree);
         // Prevent migration transactions from being created when node is syncing after launch,
@@ -638,6 +999,13 @@ void CWallet::AddPendingSaplingMigrationTx(const CTransaction& tx) {
 
 void CWallet::SetBestChain(const CBlockLocator& loc)
 {
+    {
+        LOCK(cs_wallet);
+        // The witness caches only match the chain tip once the rescan is done
+        if (fRescanInProgress) {
+            return;
+        }
+    }
     CWalletDB walletdb(strWalletFile);
     SetBestChainINTERNAL(walletdb, loc);
 }
@@ -843,6 +1211,13 @@ bool CWallet::Verify(const string& walletFile, string& warningString, string& er
         }
     }
 
+    std::string strFormat = GetArg("-walletformat", "bdb");
+    if (strFormat != "bdb" && strFormat != "log")
+    {
+        errorString += strprintf(_("Unknown wallet format '%s'"), strFormat);
+        return true;
+    }
+
     if (GetBoolArg("-salvagewallet", false))
     {
         // Recover readable keypairs:
@@ -862,6 +1237,12 @@ bool CWallet::Verify(const string& walletFile, string& warningString, string& er
         }
         if (r == CDBEnv::RECOVER_FAIL)
             errorString += _("wallet.dat corrupt, salvage failed");
+
+        if (r != CDBEnv::RECOVER_FAIL && GetBoolArg("-convertwallet", false) &&
+            !CDB::Convert(walletFile, GetWalletFormat()))
+        {
+            errorString += strprintf(_("Error converting %s to the %s format"), walletFile, strFormat);
+        }
     }
 
     return true;
@@ -1021,6 +1402,58 @@ void CWallet::ClearNoteWitnessCache()
     nWitnessCacheSize = 0;
 }
 
+template<typename NoteDataMap>
+static void TrimNoteWitnesses(NoteDataMap& noteDataMap, const CBlockIndex* pindex)
+{
+    for (auto& item : noteDataMap) {
+        auto* nd = &(item.second);
+        if (nd->witnesses.empty()) {
+            continue;
+        }
+        if (!pindex) {
+            nd->witnesses.clear();
+            nd->witnessHeight = -1;
+            continue;
+        }
+        // Every witness of a note records its position
+        auto witness = nd->witnesses.back();
+        nd->witnesses.clear();
+        nd->witnesses.push_front(witness);
+        nd->witnessHeight = pindex->nHeight;
+    }
+}
+
+void CWallet::TrimNoteWitnessCache()
+{
+    LOCK2(cs_main, cs_wallet);
+    for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
+        const CBlockIndex* pindex = NULL;
+        BlockMap::const_iterator mi = mapBlockIndex.find(wtxItem.second.hashBlock);
+        if (mi != mapBlockIndex.end() && chainActive.Contains(mi->second)) {
+            pindex = mi->second;
+        }
+        ::TrimNoteWitnesses(wtxItem.second.mapSproutNoteData, pindex);
+        ::TrimNoteWitnesses(wtxItem.second.mapSaplingNoteData, pindex);
+    }
+    nWitnessCacheSize = 0;
+}
+
+bool CWallet::HasNoteWitnesses() const
+{
+    LOCK(cs_wallet);
+    for (const std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
+        for (const mapSproutNoteData_t::value_type& item : wtxItem.second.mapSproutNoteData) {
+            if (!item.second.witnesses.empty())
+                return true;
+        }
+        for (const mapSaplingNoteData_t::value_type& item : wtxItem.second.mapSaplingNoteData) {
+            if (!item.second.witnesses.empty())
+                return true;
+        }
+    }
+    return false;
+}
+
 template<typename NoteDataMap>
 void CopyPreviousWitnesses(NoteDataMap& noteDataMap, int indexHeight, int64_t nWitnessCacheSize)
 {
@@ -1107,12 +1540,75 @@ void UpdateWitnessHeights(NoteDataMap& noteDataMap, int indexHeight, int64_t nWi
     }
 }
 
+template<typename OutPoint, typename NoteData, typename Witness>
+void RecordNotePositionIfMine(std::map<OutPoint, NoteData>& noteDataMap, int indexHeight, const OutPoint& key, const Witness& witness)
+{
+    auto it = noteDataMap.find(key);
+    if (it != noteDataMap.end() && it->second.witnessHeight < indexHeight) {
+        it->second.witnesses.clear();
+        it->second.witnesses.push_front(witness);
+        it->second.witnessHeight = indexHeight;
+    }
+}
+
+template<typename NoteDataMap>
+void ForgetNotePositions(NoteDataMap& noteDataMap, int indexHeight)
+{
+    for (auto& item : noteDataMap) {
+        if (item.second.witnessHeight == indexHeight) {
+            item.second.witnesses.clear();
+            item.second.witnessHeight = -1;
+        }
+    }
+}
+
+void CWallet::RecordNotePositions(const CBlockIndex* pindex,
+                                  const CBlock* pblockIn,
+                                  SproutMerkleTree& sproutTree,
+                                  SaplingMerkleTree& saplingTree)
+{
+    AssertLockHeld(cs_wallet);
+    const CBlock* pblock {pblockIn};
+    CBlock block;
+    if (!pblock) {
+        ReadBlockFromDisk(block, pindex, Params().GetConsensus());
+        pblock = &block;
+    }
+
+    for (const CTransaction& tx : pblock->vtx) {
+        auto hash = tx.GetHash();
+        auto it = mapWallet.find(hash);
+        for (size_t i = 0; i < tx.vJoinSplit.size(); i++) {
+            const JSDescription& jsdesc = tx.vJoinSplit[i];
+            for (uint8_t j = 0; j < jsdesc.commitments.size(); j++) {
+                sproutTree.append(jsdesc.commitments[j]);
+                if (it != mapWallet.end()) {
+                    JSOutPoint jsoutpt {hash, i, j};
+                    ::RecordNotePositionIfMine(it->second.mapSproutNoteData, pindex->nHeight, jsoutpt, sproutTree.witness());
+                }
+            }
+        }
+        for (uint32_t i = 0; i < tx.vShieldedOutput.size(); i++) {
+            saplingTree.append(tx.vShieldedOutput[i].cm);
+            if (it != mapWallet.end()) {
+                SaplingOutPoint outPoint {hash, i};
+                ::RecordNotePositionIfMine(it->second.mapSaplingNoteData, pindex->nHeight, outPoint, saplingTree.witness());
+            }
+        }
+    }
+}
+
 void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
                                      const CBlock* pblockIn,
                                      SproutMerkleTree& sproutTree,
                                      SaplingMerkleTree& saplingTree)
 {
     LOCK(cs_wallet);
+    if (!fCacheNoteWitnesses) {
+        RecordNotePositions(pindex, pblockIn, sproutTree, saplingTree);
+        return;
+    }
+
     for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
        ::CopyPreviousWitnesses(wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize);
        ::CopyPreviousWitnesses(wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize);
@@ -1223,6 +1719,15 @@ void DecrementNoteWitnesses(NoteDataMap& noteDataMap, int indexHeight, int64_t n
 void CWallet::DecrementNoteWitnesses(const CBlockIndex* pindex)
 {
     LOCK(cs_wallet);
+    if (!fCacheNoteWitnesses) {
+        // Forget the positions of the notes in the block being removed
+        for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
+            ::ForgetNotePositions(wtxItem.second.mapSproutNoteData, pindex->nHeight);
+            ::ForgetNotePositions(wtxItem.second.mapSaplingNoteData, pindex->nHeight);
+        }
+        return;
+    }
+
     for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
         ::DecrementNoteWitnesses(wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize);
         ::DecrementNoteWitnesses(wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize);
@@ -1339,29 +1844,131 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+void CWallet::RebuildTxIndexes()
 {
+    AssertLockHeld(cs_main); // IndexTxHeight
     AssertLockHeld(cs_wallet); // mapWallet
-    CWalletDB walletdb(strWalletFile);
 
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
+    wtxOrdered.clear();
+    mapTxHashesByHeight.clear();
+    laccentries.clear();
+    fTxIndexesStale = false;
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
     for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
         CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        wtxOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        wtx->nIndexedHeight = WALLET_TX_NOT_INDEXED;
+        IndexTxHeight(*wtx);
     }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+    if (fFileBacked)
+        CWalletDB(strWalletFile).ListAccountCreditDebit("*", laccentries);
+    BOOST_FOREACH(CAccountingEntry& entry, laccentries)
     {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+        wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+    }
+}
+
+void CWallet::IndexTxHeight(CWalletTx& wtx)
+{
+    AssertLockHeld(cs_main); // chainActive, mapBlockIndex
+    AssertLockHeld(cs_wallet); // mapTxHashesByHeight
+    if (fTxIndexesStale)
+        return;
+
+    int nHeight = -1;
+    if (!wtx.hashBlock.IsNull()) {
+        BlockMap::const_iterator mi = mapBlockIndex.find(wtx.hashBlock);
+        if (mi != mapBlockIndex.end() && chainActive.Contains(mi->second))
+            nHeight = mi->second->nHeight;
+    }
+    if (nHeight == wtx.nIndexedHeight)
+        return;
+
+    const uint256& hash = wtx.GetHash();
+    if (wtx.nIndexedHeight != WALLET_TX_NOT_INDEXED) {
+        auto it = mapTxHashesByHeight.find(wtx.nIndexedHeight);
+        if (it != mapTxHashesByHeight.end()) {
+            it->second.erase(hash);
+            if (it->second.empty())
+                mapTxHashesByHeight.erase(it);
+        }
+    }
+    mapTxHashesByHeight[nHeight].insert(hash);
+    wtx.nIndexedHeight = nHeight;
+}
+
+void CWallet::UnindexTx(CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet); // wtxOrdered, mapTxHashesByHeight
+    if (fTxIndexesStale)
+        return;
+
+    auto range = wtxOrdered.equal_range(wtx.nOrderPos);
+    for (TxItems::iterator it = range.first; it != range.second; ++it) {
+        if (it->second.first == &wtx) {
+            wtxOrdered.erase(it);
+            break;
+        }
+    }
+    auto it = mapTxHashesByHeight.find(wtx.nIndexedHeight);
+    if (it != mapTxHashesByHeight.end()) {
+        it->second.erase(wtx.GetHash());
+        if (it->second.empty())
+            mapTxHashesByHeight.erase(it);
+    }
+    wtx.nIndexedHeight = WALLET_TX_NOT_INDEXED;
+}
+
+const CWallet::TxItems& CWallet::OrderedTxItems()
+{
+    AssertLockHeld(cs_main); // RebuildTxIndexes
+    AssertLockHeld(cs_wallet); // mapWallet
+    if (fTxIndexesStale)
+        RebuildTxIndexes();
+    return wtxOrdered;
+}
+
+void CWallet::GetTxHashesSince(int nHeight, std::vector<uint256>& vHashes)
+{
+    AssertLockHeld(cs_main); // chainActive
+    AssertLockHeld(cs_wallet); // mapWallet
+    if (fTxIndexesStale)
+        RebuildTxIndexes();
+
+    vHashes.clear();
+    auto it = mapTxHashesByHeight.find(-1);
+    if (it != mapTxHashesByHeight.end())
+        vHashes.insert(vHashes.end(), it->second.begin(), it->second.end());
+    for (it = mapTxHashesByHeight.upper_bound(std::max(nHeight, -1)); it != mapTxHashesByHeight.end(); ++it)
+        vHashes.insert(vHashes.end(), it->second.begin(), it->second.end());
+    std::sort(vHashes.begin(), vHashes.end());
+}
+
+bool CWallet::AddAccountingEntries(std::vector<CAccountingEntry>& entries)
+{
+    AssertLockHeld(cs_wallet); // nOrderPosNext, laccentries
+    CWalletDB walletdb(strWalletFile);
+    if (!walletdb.TxnBegin())
+        return false;
+    BOOST_FOREACH(CAccountingEntry& acentry, entries) {
+        acentry.nOrderPos = IncOrderPosNext(&walletdb);
+        if (!walletdb.WriteAccountingEntry(acentry)) {
+            walletdb.TxnAbort();
+            return false;
+        }
     }
+    if (!walletdb.TxnCommit())
+        return false;
 
-    return txOrdered;
+    if (!fTxIndexesStale) {
+        BOOST_FOREACH(const CAccountingEntry& acentry, entries) {
+            laccentries.push_back(acentry);
+            CAccountingEntry& entry = laccentries.back();
+            wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+        }
+    }
+    return true;
 }
 
 void CWallet::MarkDirty()
@@ -1370,44 +1977,118 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        fBalancesStale = true;
     }
 }
 
 /**
  * Ensure that every note in the wallet (for which we possess a spending key)
  * has a cached nullifier.
+ *
+ * The notes that are missing one are collected first, and their nullifiers
+ * are then computed on all cores without holding cs_wallet, so that unlocking
+ * a large wallet doesn't block other wallet calls while the notes are being
+ * decrypted. The updated transactions are written out in one batch, so the
+ * work isn't repeated the next time the wallet is loaded.
  */
 bool CWallet::UpdateNullifierNoteMap()
 {
+    struct CSproutNullifierTask {
+        uint256 hash;
+        JSOutPoint jsoutpt;
+        JSDescription jsdesc;
+        uint256 joinSplitPubKey;
+        libzcash::SproutPaymentAddress address;
+        boost::optional<uint256> nullifier;
+    };
+    std::vector<CSproutNullifierTask> vTasks;
+    std::map<libzcash::SproutPaymentAddress, std::pair<ZCNoteDecryption, libzcash::SproutSpendingKey>> mapKeys;
+
     {
         LOCK(cs_wallet);
 
         if (IsLocked())
             return false;
 
-        ZCNoteDecryption dec;
+        std::set<libzcash::SproutPaymentAddress> setMissingKeys;
         for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
             for (mapSproutNoteData_t::value_type& item : wtxItem.second.mapSproutNoteData) {
-                if (!item.second.nullifier) {
-                    if (GetNoteDecryptor(item.second.address, dec)) {
-                        auto i = item.first.js;
-                        auto hSig = wtxItem.second.vJoinSplit[i].h_sig(
-                            *pzcashParams, wtxItem.second.joinSplitPubKey);
-                        item.second.nullifier = GetSproutNoteNullifier(
-                            wtxItem.second.vJoinSplit[i],
-                            item.second.address,
-                            dec,
-                            hSig,
-                            item.first.n);
+                const libzcash::SproutPaymentAddress& address = item.second.address;
+                if (item.second.nullifier || setMissingKeys.count(address)) {
+                    continue;
+                }
+                if (!mapKeys.count(address)) {
+                    // Look each key up (and decrypt it) only once
+                    ZCNoteDecryption dec;
+                    libzcash::SproutSpendingKey key;
+                    if (!GetNoteDecryptor(address, dec) || !GetSproutSpendingKey(address, key)) {
+                        setMissingKeys.insert(address);
+                        continue;
                     }
+                    mapKeys.insert(std::make_pair(address, std::make_pair(dec, key)));
                 }
+                CSproutNullifierTask task;
+                task.hash = wtxItem.first;
+                task.jsoutpt = item.first;
+                task.jsdesc = wtxItem.second.vJoinSplit[item.first.js];
+                task.joinSplitPubKey = wtxItem.second.joinSplitPubKey;
+                task.address = address;
+                vTasks.push_back(task);
             }
 
             // TODO: Sapling.  This method is only called from RPC walletpassphrase, which is currently unsupported
             // as RPC encryptwallet is hidden behind two flags: -developerencryptwallet -experimentalfeatures
+        }
+    }
 
-            UpdateNullifierNoteMapWithTx(wtxItem.second);
+    ForEachIndexInParallel(vTasks.size(), [&](size_t i) {
+        CSproutNullifierTask& task = vTasks[i];
+        const auto& keys = mapKeys.at(task.address);
+        try {
+            auto hSig = task.jsdesc.h_sig(*pzcashParams, task.joinSplitPubKey);
+            auto note_pt = libzcash::SproutNotePlaintext::decrypt(
+                keys.first,
+                task.jsdesc.ciphertexts[task.jsoutpt.n],
+                task.jsdesc.ephemeralKey,
+                hSig,
+                (unsigned char) task.jsoutpt.n);
+            auto note = note_pt.note(task.address);
+            if (note.cm() == task.jsdesc.commitments[task.jsoutpt.n]) {
+                task.nullifier = note.nullifier(keys.second);
+            }
+        } catch (const std::exception& e) {
+            LogPrintf("UpdateNullifierNoteMap(): Could not decrypt note %s: %s\n", task.jsoutpt.ToString(), e.what());
         }
+    });
+
+    {
+        LOCK(cs_wallet);
+        std::set<uint256> setUpdated;
+        for (const CSproutNullifierTask& task : vTasks) {
+            if (!task.nullifier)
+                continue;
+            auto it = mapWallet.find(task.hash);
+            if (it == mapWallet.end() || !it->second.mapSproutNoteData.count(task.jsoutpt))
+                continue;
+            SproutNoteData& nd = it->second.mapSproutNoteData[task.jsoutpt];
+            if (nd.nullifier)
+                continue;
+            nd.nullifier = task.nullifier;
+            mapSproutNullifiersToNotes[*task.nullifier] = task.jsoutpt;
+            setUpdated.insert(task.hash);
+        }
+
+        if (fFileBacked && !setUpdated.empty()) {
+            CWalletDB walletdb(strWalletFile);
+            bool fTxn = walletdb.TxnBegin();
+            for (const uint256& hash : setUpdated) {
+                mapWallet[hash].WriteToDisk(&walletdb);
+            }
+            if (fTxn && !walletdb.TxnCommit()) {
+                LogPrintf("UpdateNullifierNoteMap(): Couldn't write the updated nullifiers\n");
+            }
+        }
+        fBalancesStale = true;
     }
     return true;
 }
@@ -1438,42 +2119,72 @@ void CWallet::UpdateNullifierNoteMapWithTx(const CWalletTx& wtx)
  * Update mapSaplingNullifiersToNotes, computing the nullifier from a cached witness if necessary.
  */
 void CWallet::UpdateSaplingNullifierNoteMapWithTx(CWalletTx& wtx) {
-    LOCK(cs_wallet);
+    UpdateSaplingNullifierNoteMap({&wtx});
+}
 
-    for (mapSaplingNoteData_t::value_type &item : wtx.mapSaplingNoteData) {
-        SaplingOutPoint op = item.first;
-        SaplingNoteData nd = item.second;
+/**
+ * Update mapSaplingNullifiersToNotes for the notes in these transactions.
+ * Nullifiers are only derived for notes that were witnessed since they were
+ * last updated, and those are derived together on all cores.
+ */
+void CWallet::UpdateSaplingNullifierNoteMap(const std::vector<CWalletTx*>& vWtx) {
+    LOCK(cs_wallet);
 
-        if (nd.witnesses.empty()) {
-            // If there are no witnesses, erase the nullifier and associated mapping.
-            if (item.second.nullifier) {
-                mapSaplingNullifiersToNotes.erase(item.second.nullifier.get());
+    struct CSaplingNullifierTask {
+        CWalletTx* pwtx;
+        SaplingOutPoint op;
+        uint64_t position;
+        uint256 nullifier;
+    };
+    std::vector<CSaplingNullifierTask> vTasks;
+
+    for (CWalletTx* pwtx : vWtx) {
+        MarkBalanceDirty(pwtx->GetHash());
+
+        for (mapSaplingNoteData_t::value_type &item : pwtx->mapSaplingNoteData) {
+            SaplingNoteData& nd = item.second;
+            if (nd.witnesses.empty()) {
+                // If there are no witnesses, erase the nullifier and associated mapping.
+                if (nd.nullifier) {
+                    mapSaplingNullifiersToNotes.erase(nd.nullifier.get());
+                }
+                nd.nullifier = boost::none;
+            } else if (nd.nullifier) {
+                // The position of a note only changes if its block is
+                // disconnected, which erases the nullifier above.
+                mapSaplingNullifiersToNotes[*nd.nullifier] = item.first;
+            } else {
+                vTasks.push_back({pwtx, item.first, nd.witnesses.front().position(), uint256()});
             }
-            item.second.nullifier = boost::none;
         }
-        else {
-            uint64_t position = nd.witnesses.front().position();
-            SaplingFullViewingKey fvk = mapSaplingFullViewingKeys.at(nd.ivk);
-            OutputDescription output = wtx.vShieldedOutput[op.n];
-            auto optPlaintext = SaplingNotePlaintext::decrypt(output.encCiphertext, nd.ivk, output.ephemeralKey, output.cm);
-            if (!optPlaintext) {
-                // An item in mapSaplingNoteData must have already been successfully decrypted,
-                // otherwise the item would not exist in the first place.
-                assert(false);
-            }
-            auto optNote = optPlaintext.get().note(nd.ivk);
-            if (!optNote) {
-                assert(false);
-            }
-            auto optNullifier = optNote.get().nullifier(fvk, position);
-            if (!optNullifier) {
-                // This should not happen.  If it does, maybe the position has been corrupted or miscalculated?
-                assert(false);
-            }
-            uint256 nullifier = optNullifier.get();
-            mapSaplingNullifiersToNotes[nullifier] = op;
-            item.second.nullifier = nullifier;
+    }
+
+    ForEachIndexInParallel(vTasks.size(), [&](size_t i) {
+        CSaplingNullifierTask& task = vTasks[i];
+        const SaplingNoteData& nd = task.pwtx->mapSaplingNoteData.at(task.op);
+        const SaplingFullViewingKey& fvk = mapSaplingFullViewingKeys.at(nd.ivk);
+        const OutputDescription& output = task.pwtx->vShieldedOutput[task.op.n];
+        auto optPlaintext = SaplingNotePlaintext::decrypt(output.encCiphertext, nd.ivk, output.ephemeralKey, output.cm);
+        if (!optPlaintext) {
+            // An item in mapSaplingNoteData must have already been successfully decrypted,
+            // otherwise the item would not exist in the first place.
+            assert(false);
         }
+        auto optNote = optPlaintext.get().note(nd.ivk);
+        if (!optNote) {
+            assert(false);
+        }
+        auto optNullifier = optNote.get().nullifier(fvk, task.position);
+        if (!optNullifier) {
+            // This should not happen.  If it does, maybe the position has been corrupted or miscalculated?
+            assert(false);
+        }
+        task.nullifier = optNullifier.get();
+    });
+
+    for (const CSaplingNullifierTask& task : vTasks) {
+        mapSaplingNullifiersToNotes[task.nullifier] = task.op;
+        task.pwtx->mapSaplingNoteData[task.op].nullifier = task.nullifier;
     }
 }
 
@@ -1484,13 +2195,14 @@ void CWallet::UpdateSaplingNullifierNoteMapWithTx(CWalletTx& wtx) {
 void CWallet::UpdateSaplingNullifierNoteMapForBlock(const CBlock *pblock) {
     LOCK(cs_wallet);
 
+    std::vector<CWalletTx*> vWtx;
     for (const CTransaction& tx : pblock->vtx) {
-        auto hash = tx.GetHash();
-        bool txIsOurs = mapWallet.count(hash);
-        if (txIsOurs) {
-            UpdateSaplingNullifierNoteMapWithTx(mapWallet[hash]);
+        auto it = mapWallet.find(tx.GetHash());
+        if (it != mapWallet.end()) {
+            vWtx.push_back(&it->second);
         }
     }
+    UpdateSaplingNullifierNoteMap(vWtx);
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb)
@@ -1501,6 +2213,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
     {
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
+        fTxIndexesStale = true;
+        fMyOutPointsStale = true;
         UpdateNullifierNoteMapWithTx(mapWallet[hash]);
         AddToSpends(hash);
     }
@@ -1517,6 +2231,13 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         {
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext(pwalletdb);
+            wtx.nIndexedHeight = WALLET_TX_NOT_INDEXED;
+            if (fTxIndexesStale)
+                RebuildTxIndexes(); // picks up wtx as well
+            else
+                wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+            IndexMyOutPoints(wtx);
+            const TxItems& txOrdered = wtxOrdered;
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (!wtxIn.hashBlock.IsNull())
@@ -1528,14 +2249,15 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64_t latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        for (TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
                                 continue;
                             CAccountingEntry *const pacentry = (*it).second.second;
+                            // Only the default account's entries have ever been considered here
+                            if (pacentry && !pacentry->strAccount.empty())
+                                continue;
                             int64_t nSmartTime;
                             if (pwtx)
                             {
@@ -1601,6 +2323,11 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        MarkBalanceDirty(hash);
+        MarkSpentBalancesDirty(wtx);
+
+        // The block may have changed, or been disconnected
+        IndexTxHeight(wtx);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -1668,16 +2395,31 @@ bool CWallet::UpdatedNoteData(const CWalletTx& wtxIn, CWalletTx& wtx)
  * the fly in CMerkleTx::GetDepthInMainChain().
  */
 bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate)
+{
+    AssertLockHeld(cs_wallet);
+    if (!fUpdate && mapWallet.count(tx.GetHash())) return false;
+    return AddToWalletIfInvolvingMe(tx, pblock, fUpdate, FindMySproutNotes(tx), FindMySaplingNotes(tx));
+}
+
+/**
+ * As above, with the results of trial decryption already computed (see
+ * FindMySproutNotes and FindMySaplingNotes).
+ */
+bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
+                                       const mapSproutNoteData_t& sproutNoteDataIn,
+                                       const std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>& saplingNoteDataAndAddressesToAdd)
 {
     {
         AssertLockHeld(cs_wallet);
         bool fExisted = mapWallet.count(tx.GetHash()) != 0;
         if (fExisted && !fUpdate) return false;
-        auto sproutNoteData = FindMySproutNotes(tx);
-        auto saplingNoteDataAndAddressesToAdd = FindMySaplingNotes(tx);
+        auto sproutNoteData = sproutNoteDataIn;
         auto saplingNoteData = saplingNoteDataAndAddressesToAdd.first;
         auto addressesToAdd = saplingNoteDataAndAddressesToAdd.second;
         for (const auto &addressToAdd : addressesToAdd) {
+            if (HaveSaplingIncomingViewingKey(addressToAdd.first)) {
+                continue;
+            }
             if (!AddSaplingIncomingViewingKey(addressToAdd.second, addressToAdd.first)) {
                 return false;
             }
@@ -1751,8 +2493,14 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        auto it = mapWallet.find(hash);
+        if (it != mapWallet.end()) {
+            MarkBalanceDirty(hash);
+            MarkSpentBalancesDirty(it->second);
+            UnindexTx(it->second);
+            mapWallet.erase(it);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return;
 }
@@ -1803,13 +2551,18 @@ boost::optional<uint256> CWallet::GetSproutNoteNullifier(const JSDescription &js
 mapSproutNoteData_t CWallet::FindMySproutNotes(const CTransaction &tx) const
 {
     LOCK(cs_SpendingKeyStore);
+    return FindMySproutNotes(tx, GetNoteDecryptors());
+}
+
+mapSproutNoteData_t CWallet::FindMySproutNotes(const CTransaction &tx, const NoteDecryptorMap& decryptors) const
+{
     uint256 hash = tx.GetHash();
 
     mapSproutNoteData_t noteData;
     for (size_t i = 0; i < tx.vJoinSplit.size(); i++) {
         auto hSig = tx.vJoinSplit[i].h_sig(*pzcashParams, tx.joinSplitPubKey);
         for (uint8_t j = 0; j < tx.vJoinSplit[i].ciphertexts.size(); j++) {
-            for (const NoteDecryptorMap::value_type& item : mapNoteDecryptors) {
+            for (const NoteDecryptorMap::value_type& item : decryptors) {
                 try {
                     auto address = item.first;
                     JSOutPoint jsoutpt {hash, i, j};
@@ -1850,7 +2603,34 @@ mapSproutNoteData_t CWallet::FindMySproutNotes(const CTransaction &tx) const
  */
 std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> CWallet::FindMySaplingNotes(const CTransaction &tx) const
 {
+    if (tx.vShieldedOutput.empty()) {
+        return std::make_pair(mapSaplingNoteData_t(), SaplingIncomingViewingKeyMap());
+    }
+
     LOCK(cs_SpendingKeyStore);
+    std::vector<SaplingIncomingViewingKey> ivks;
+    ivks.reserve(mapSaplingFullViewingKeys.size());
+    for (const auto& item : mapSaplingFullViewingKeys) {
+        ivks.push_back(item.first);
+    }
+    auto result = FindMySaplingNotes(tx, ivks);
+
+    // Only report the addresses we don't know about yet
+    auto& viewingKeysToAdd = result.second;
+    for (auto it = viewingKeysToAdd.begin(); it != viewingKeysToAdd.end(); ) {
+        if (mapSaplingIncomingViewingKeys.count(it->first)) {
+            it = viewingKeysToAdd.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return result;
+}
+
+std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> CWallet::FindMySaplingNotes(
+    const CTransaction &tx,
+    const std::vector<SaplingIncomingViewingKey>& ivks) const
+{
     uint256 hash = tx.GetHash();
 
     mapSaplingNoteData_t noteData;
@@ -1858,15 +2638,14 @@ std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> CWallet::FindMySap
 
     // Protocol Spec: 4.19 Block Chain Scanning (Sapling)
     for (uint32_t i = 0; i < tx.vShieldedOutput.size(); ++i) {
-        const OutputDescription output = tx.vShieldedOutput[i];
-        for (auto it = mapSaplingFullViewingKeys.begin(); it != mapSaplingFullViewingKeys.end(); ++it) {
-            SaplingIncomingViewingKey ivk = it->first;
+        const OutputDescription& output = tx.vShieldedOutput[i];
+        for (const SaplingIncomingViewingKey& ivk : ivks) {
             auto result = SaplingNotePlaintext::decrypt(output.encCiphertext, ivk, output.ephemeralKey, output.cm);
             if (!result) {
                 continue;
             }
             auto address = ivk.address(result.get().d);
-            if (address && mapSaplingIncomingViewingKeys.count(address.get()) == 0) {
+            if (address) {
                 viewingKeysToAdd[address.get()] = ivk;
             }
             // We don't cache the nullifier here as computing it requires knowledge of the note position
@@ -1910,22 +2689,68 @@ void CWallet::GetSproutNoteWitnesses(std::vector<JSOutPoint> notes,
                                      std::vector<boost::optional<SproutWitness>>& witnesses,
                                      uint256 &final_anchor)
 {
-    LOCK(cs_wallet);
-    witnesses.resize(notes.size());
+    std::vector<std::pair<uint256, uint256>> vNotes;
+    const CBlockIndex* pindexAnchor;
     boost::optional<uint256> rt;
-    int i = 0;
-    for (JSOutPoint note : notes) {
-        if (mapWallet.count(note.hash) &&
-                mapWallet[note.hash].mapSproutNoteData.count(note) &&
-                mapWallet[note.hash].mapSproutNoteData[note].witnesses.size() > 0) {
-            witnesses[i] = mapWallet[note.hash].mapSproutNoteData[note].witnesses.front();
-            if (!rt) {
-                rt = witnesses[i]->root();
-            } else {
-                assert(*rt == witnesses[i]->root());
+    {
+        LOCK2(cs_main, cs_wallet);
+        witnesses.resize(notes.size());
+        bool fMissing = false;
+        int i = 0;
+        for (JSOutPoint note : notes) {
+            if (fCacheNoteWitnesses &&
+                    mapWallet.count(note.hash) &&
+                    mapWallet[note.hash].mapSproutNoteData.count(note) &&
+                    mapWallet[note.hash].mapSproutNoteData[note].witnesses.size() > 0) {
+                witnesses[i] = mapWallet[note.hash].mapSproutNoteData[note].witnesses.front();
+                if (!rt) {
+                    rt = witnesses[i]->root();
+                } else {
+                    assert(*rt == witnesses[i]->root());
+                }
+            } else if (mapWallet.count(note.hash) &&
+                    mapWallet[note.hash].mapSproutNoteData.count(note) &&
+                    mapWallet[note.hash].GetDepthInMainChain() > 0) {
+                fMissing = true;
             }
+            i++;
         }
-        i++;
+        if (!fMissing) {
+            // All returned witnesses have the same anchor
+            if (rt) {
+                final_anchor = *rt;
+            }
+            return;
+        }
+
+        for (JSOutPoint note : notes) {
+            auto it = mapWallet.find(note.hash);
+            if (it == mapWallet.end() || !it->second.mapSproutNoteData.count(note)) {
+                vNotes.push_back(std::make_pair(uint256(), uint256()));
+                continue;
+            }
+            const CWalletTx& wtx = it->second;
+            vNotes.push_back(std::make_pair(wtx.hashBlock, wtx.vJoinSplit[note.js].commitments[note.n]));
+        }
+        pindexAnchor = chainActive.Tip();
+    }
+
+    // Witness mined notes without a cached witness from the blocks on disk,
+    // together with the others so that they all share the same anchor. This
+    // reads every block since the earliest note, so it is done without
+    // holding the locks (unless the caller does).
+    std::vector<boost::optional<SproutWitness>> vBuilt;
+    if (BuildSproutWitnesses(vNotes, pindexAnchor, vBuilt)) {
+        witnesses = vBuilt;
+        rt = boost::none;
+        for (const auto& witness : witnesses) {
+            if (witness) {
+                rt = witness->root();
+                break;
+            }
+        }
+    } else {
+        LogPrintf("GetSproutNoteWitnesses: Could not witness notes from the blocks on disk\n");
     }
     // All returned witnesses have the same anchor
     if (rt) {
@@ -1937,22 +2762,68 @@ void CWallet::GetSaplingNoteWitnesses(std::vector<SaplingOutPoint> notes,
                                       std::vector<boost::optional<SaplingWitness>>& witnesses,
                                       uint256 &final_anchor)
 {
-    LOCK(cs_wallet);
-    witnesses.resize(notes.size());
+    std::vector<std::pair<uint256, uint256>> vNotes;
+    const CBlockIndex* pindexAnchor;
     boost::optional<uint256> rt;
-    int i = 0;
-    for (SaplingOutPoint note : notes) {
-        if (mapWallet.count(note.hash) &&
-                mapWallet[note.hash].mapSaplingNoteData.count(note) &&
-                mapWallet[note.hash].mapSaplingNoteData[note].witnesses.size() > 0) {
-            witnesses[i] = mapWallet[note.hash].mapSaplingNoteData[note].witnesses.front();
-            if (!rt) {
-                rt = witnesses[i]->root();
-            } else {
-                assert(*rt == witnesses[i]->root());
+    {
+        LOCK2(cs_main, cs_wallet);
+        witnesses.resize(notes.size());
+        bool fMissing = false;
+        int i = 0;
+        for (SaplingOutPoint note : notes) {
+            if (fCacheNoteWitnesses &&
+                    mapWallet.count(note.hash) &&
+                    mapWallet[note.hash].mapSaplingNoteData.count(note) &&
+                    mapWallet[note.hash].mapSaplingNoteData[note].witnesses.size() > 0) {
+                witnesses[i] = mapWallet[note.hash].mapSaplingNoteData[note].witnesses.front();
+                if (!rt) {
+                    rt = witnesses[i]->root();
+                } else {
+                    assert(*rt == witnesses[i]->root());
+                }
+            } else if (mapWallet.count(note.hash) &&
+                    mapWallet[note.hash].mapSaplingNoteData.count(note) &&
+                    mapWallet[note.hash].GetDepthInMainChain() > 0) {
+                fMissing = true;
+            }
+            i++;
+        }
+        if (!fMissing) {
+            // All returned witnesses have the same anchor
+            if (rt) {
+                final_anchor = *rt;
+            }
+            return;
+        }
+
+        for (SaplingOutPoint note : notes) {
+            auto it = mapWallet.find(note.hash);
+            if (it == mapWallet.end() || !it->second.mapSaplingNoteData.count(note)) {
+                vNotes.push_back(std::make_pair(uint256(), uint256()));
+                continue;
+            }
+            const CWalletTx& wtx = it->second;
+            vNotes.push_back(std::make_pair(wtx.hashBlock, wtx.vShieldedOutput[note.n].cm));
+        }
+        pindexAnchor = chainActive.Tip();
+    }
+
+    // Witness mined notes without a cached witness from the blocks on disk,
+    // together with the others so that they all share the same anchor. This
+    // reads every block since the earliest note, so it is done without
+    // holding the locks (unless the caller does).
+    std::vector<boost::optional<SaplingWitness>> vBuilt;
+    if (BuildSaplingWitnesses(vNotes, pindexAnchor, vBuilt)) {
+        witnesses = vBuilt;
+        rt = boost::none;
+        for (const auto& witness : witnesses) {
+            if (witness) {
+                rt = witness->root();
+                break;
             }
         }
-        i++;
+    } else {
+        LogPrintf("GetSaplingNoteWitnesses: Could not witness notes from the blocks on disk\n");
     }
     // All returned witnesses have the same anchor
     if (rt) {
@@ -1964,6 +2835,8 @@ isminetype CWallet::IsMine(const CTxIn &txin) const
 {
     {
         LOCK(cs_wallet);
+        if (!IsMyOutPoint(txin.prevout))
+            return ISMINE_NO;
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txin.prevout.hash);
         if (mi != mapWallet.end())
         {
@@ -1979,6 +2852,8 @@ CAmount CWallet::GetDebit(const CTxIn &txin, const isminefilter& filter) const
 {
     {
         LOCK(cs_wallet);
+        if (!IsMyOutPoint(txin.prevout))
+            return 0;
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txin.prevout.hash);
         if (mi != mapWallet.end())
         {
@@ -1993,6 +2868,14 @@ CAmount CWallet::GetDebit(const CTxIn &txin, const isminefilter& filter) const
 
 isminetype CWallet::IsMine(const CTxOut& txout) const
 {
+    // Most outputs pay to a P2PKH or P2SH address of someone else, which
+    // a single probe of the filter rules out
+    uint160 hash;
+    if (GetScriptFilterHash(txout.scriptPubKey, hash)) {
+        LOCK(cs_myScripts);
+        if (!setMyScriptHashes.count(hash))
+            return ISMINE_NO;
+    }
     return ::IsMine(*this, txout.scriptPubKey);
 }
 
@@ -2459,28 +3342,195 @@ void CWallet::WitnessNoteCommitment(std::vector<uint256> commitments,
 
         uint256 current_anchor = tree.root();
 
-        // Consistency check: we should be able to find the current tree
-        // in our CCoins view.
-        SproutMerkleTree dummy_tree;
-        assert(pcoinsTip->GetSproutAnchorAt(current_anchor, dummy_tree));
+        // Consistency check: we should be able to find the current tree
+        // in our CCoins view.
+        SproutMerkleTree dummy_tree;
+        assert(pcoinsTip->GetSproutAnchorAt(current_anchor, dummy_tree));
+
+        pindex = chainActive.Next(pindex);
+    }
+
+    // TODO: #93; Select a root via some heuristic.
+    final_anchor = tree.root();
+
+    BOOST_FOREACH(boost::optional<SproutWitness>& wit, witnesses) {
+        if (wit) {
+            assert(final_anchor == wit->root());
+        }
+    }
+}
+
+/**
+ * Scan the block chain (starting in pindexStart) for transactions
+ * from or to us. If fUpdate is true, found transactions that already
+ * exist in the wallet will be updated.
+ */
+/** Blocks read from disk and trial-decrypted ahead of being applied by a rescan */
+struct CRescanBatch
+{
+    std::vector<CBlockIndex*> vIndex;
+    std::vector<CDiskBlockPos> vPos;
+    std::vector<CBlock> vBlocks;
+    std::vector<std::vector<mapSproutNoteData_t>> vSproutNoteData;
+    std::vector<std::vector<std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>>> vSaplingNoteData;
+
+    // Snapshot of the keys to trial-decrypt with
+    NoteDecryptorMap decryptors;
+    std::vector<libzcash::SaplingIncomingViewingKey> ivks;
+
+    void Clear()
+    {
+        vIndex.clear();
+        vPos.clear();
+        vBlocks.clear();
+        vSproutNoteData.clear();
+        vSaplingNoteData.clear();
+        decryptors.clear();
+        ivks.clear();
+    }
+};
+
+/**
+ * A rescan only releases cs_main between batches if every note in the wallet
+ * will be (re)witnessed by it, i.e. none was mined before pindexStart. Notes
+ * witnessed up to the current tip would otherwise have to be kept in step
+ * with blocks the rescan has not reached yet.
+ */
+bool CWallet::CanRescanWithoutLocks(const CBlockIndex* pindexStart) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    for (const std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
+        const CWalletTx& wtx = wtxItem.second;
+        if (wtx.mapSproutNoteData.empty() && wtx.mapSaplingNoteData.empty()) {
+            continue;
+        }
+        BlockMap::const_iterator mi = mapBlockIndex.find(wtx.hashBlock);
+        if (mi != mapBlockIndex.end() && mi->second && chainActive.Contains(mi->second) &&
+            mi->second->nHeight < pindexStart->nHeight) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Whether a key may be involved in transactions of blocks up to pindex,
+ * judging by its birth height or, failing that, its creation time (as
+ * adjusted for block time variability, see ScanForWalletTransactions).
+ */
+template<typename Key>
+static bool IsKeyBornBy(const std::map<Key, CKeyMetadata>& mapMetadata, const Key& key, const CBlockIndex* pindex)
+{
+    auto mi = mapMetadata.find(key);
+    if (mi == mapMetadata.end()) {
+        return true;
+    }
+    const CKeyMetadata& meta = mi->second;
+    if (meta.nBirthHeight >= 0) {
+        return pindex->nHeight >= meta.nBirthHeight;
+    }
+    // A creation time of 1 marks imported keys of unknown age
+    return meta.nCreateTime <= 1 || pindex->GetBlockTime() >= meta.nCreateTime - 7200;
+}
+
+/**
+ * Queue up to WALLET_RESCAN_BATCH_SIZE blocks of the active chain, starting
+ * at pindex, together with a snapshot of the keys to scan them with. Keys
+ * born after the last block of the batch are left out.
+ */
+void CWallet::CollectRescanBatch(CBlockIndex* pindex, CRescanBatch& batch) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet); // mapSproutZKeyMetadata, mapSaplingZKeyMetadata
 
+    batch.Clear();
+    while (pindex && batch.vIndex.size() < WALLET_RESCAN_BATCH_SIZE) {
+        batch.vIndex.push_back(pindex);
+        batch.vPos.push_back(pindex->GetBlockPos());
         pindex = chainActive.Next(pindex);
     }
+    if (batch.vIndex.empty()) {
+        return;
+    }
+    const CBlockIndex* pindexLast = batch.vIndex.back();
 
-    // TODO: #93; Select a root via some heuristic.
-    final_anchor = tree.root();
+    LOCK(cs_SpendingKeyStore);
+    for (const NoteDecryptorMap::value_type& item : GetNoteDecryptors()) {
+        if (IsKeyBornBy(mapSproutZKeyMetadata, item.first, pindexLast)) {
+            batch.decryptors.insert(item);
+        }
+    }
+    for (const auto& item : mapSaplingFullViewingKeys) {
+        if (IsKeyBornBy(mapSaplingZKeyMetadata, item.first, pindexLast)) {
+            batch.ivks.push_back(item.first);
+        }
+    }
+}
 
-    BOOST_FOREACH(boost::optional<SproutWitness>& wit, witnesses) {
-        if (wit) {
-            assert(final_anchor == wit->root());
+/**
+ * Read the blocks of a batch and trial-decrypt their shielded outputs on all
+ * cores. Takes no locks other than those FindMySproutNotes needs to compute
+ * the nullifiers of notes it finds.
+ */
+void CWallet::PrepareRescanBatch(CRescanBatch& batch) const
+{
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    size_t nBlocks = batch.vIndex.size();
+    batch.vBlocks.resize(nBlocks);
+    batch.vSproutNoteData.resize(nBlocks);
+    batch.vSaplingNoteData.resize(nBlocks);
+
+    // Only transactions with shielded outputs need to be trial-decrypted
+    std::vector<std::pair<size_t, size_t>> vShielded;
+    for (size_t i = 0; i < nBlocks; i++) {
+        CBlock& block = batch.vBlocks[i];
+        if (!ReadBlockFromDisk(block, batch.vPos[i], consensusParams) ||
+            block.GetHash() != batch.vIndex[i]->GetBlockHash()) {
+            LogPrintf("%s: failed to read block %s\n", __func__, batch.vIndex[i]->GetBlockHash().ToString());
+            block.SetNull();
+        }
+        batch.vSproutNoteData[i].resize(block.vtx.size());
+        batch.vSaplingNoteData[i].resize(block.vtx.size());
+        for (size_t j = 0; j < block.vtx.size(); j++) {
+            if (!block.vtx[j].vJoinSplit.empty() || !block.vtx[j].vShieldedOutput.empty()) {
+                vShielded.push_back(std::make_pair(i, j));
+            }
+        }
+    }
+
+    std::atomic<size_t> nNext(0);
+    auto worker = [&]() {
+        size_t n;
+        while ((n = nNext++) < vShielded.size()) {
+            size_t i = vShielded[n].first;
+            size_t j = vShielded[n].second;
+            const CTransaction& tx = batch.vBlocks[i].vtx[j];
+            batch.vSproutNoteData[i][j] = FindMySproutNotes(tx, batch.decryptors);
+            batch.vSaplingNoteData[i][j] = FindMySaplingNotes(tx, batch.ivks);
         }
+    };
+
+    int nThreads = std::min<int>(GetNumCores(), vShielded.size());
+    boost::thread_group threadGroup;
+    for (int i = 1; i < nThreads; i++) {
+        threadGroup.create_thread(worker);
     }
+    worker();
+    threadGroup.join_all();
 }
 
 /**
- * Scan the block chain (starting in pindexStart) for transactions
- * from or to us. If fUpdate is true, found transactions that already
- * exist in the wallet will be updated.
+ * Scan the active chain from pindexStart for transactions involving the
+ * wallet.
+ *
+ * This is a pipeline: while one batch of blocks is applied to the wallet
+ * (in height order, holding cs_main and cs_wallet), the next batch is read
+ * from disk and trial-decrypted in parallel without any locks. Unless notes
+ * mined before pindexStart are in the wallet, the locks are released between
+ * batches so that the node keeps processing blocks; the rescan then catches
+ * up with those blocks itself.
  */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
@@ -2488,9 +3538,18 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
     int64_t nNow = GetTime();
     const CChainParams& chainParams = Params();
 
+    // cs_walletRescan is taken before cs_main and cs_wallet, so that rescans
+    // can release those between batches
+    AssertLockNotHeld(cs_main);
+    AssertLockNotHeld(cs_wallet);
+    LOCK(cs_walletRescan);
+
     CBlockIndex* pindex = pindexStart;
 
     std::vector<uint256> myTxHashes;
+    double dProgressStart = 0.0, dProgressTip = 0.0;
+    bool fReleaseLocks = false;
+    CRescanBatch batch, nextBatch;
 
     {
         LOCK2(cs_main, cs_wallet);
@@ -2501,42 +3560,107 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
             pindex = chainActive.Next(pindex);
 
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
-        while (pindex)
+        dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
+
+        if (pindex && CanRescanWithoutLocks(pindex)) {
+            // Every note is witnessed again from the block it was mined in
+            ClearNoteWitnessCache();
+            fReleaseLocks = true;
+        }
+        fRescanInProgress = true;
+        pindexRescanTip = pindex ? pindex->pprev : NULL;
+        CollectRescanBatch(pindex, batch);
+    }
+
+    // Holding the locks across batches (they are recursive) keeps the chain
+    // from moving under a rescan that can't follow it.
+    boost::optional<CCriticalBlock> lockMain, lockWallet;
+    if (!fReleaseLocks) {
+        lockMain.emplace(cs_main, "cs_main", __FILE__, __LINE__);
+        lockWallet.emplace(cs_wallet, "cs_wallet", __FILE__, __LINE__);
+    }
+
+    PrepareRescanBatch(batch);
+    while (!batch.vIndex.empty())
+    {
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+            LOCK2(cs_main, cs_wallet);
+            CollectRescanBatch(chainActive.Next(batch.vIndex.back()), nextBatch);
+        }
+        boost::thread prefetch(&CWallet::PrepareRescanBatch, this, boost::ref(nextBatch));
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex, Params().GetConsensus());
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
-            {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate)) {
-                    myTxHashes.push_back(tx.GetHash());
-                    ret++;
+        bool fContinuous = true;
+        {
+            LOCK2(cs_main, cs_wallet);
+            for (size_t i = 0; i < batch.vIndex.size(); i++) {
+                pindex = batch.vIndex[i];
+                if (!chainActive.Contains(pindex) || (pindex->pprev != pindexRescanTip &&
+                        !(pindexRescanTip && pindexRescanTip->GetAncestor(pindex->nHeight) == pindex))) {
+                    // The chain was reorganized since this batch was queued
+                    fContinuous = false;
+                    break;
+                }
+                if (pindex->pprev != pindexRescanTip) {
+                    // Already applied by ChainTip
+                    continue;
                 }
-            }
 
-            SproutMerkleTree sproutTree;
-            SaplingMerkleTree saplingTree;
-            // This should never fail: we should always be able to get the tree
-            // state on the path to the tip of our chain
-            assert(pcoinsTip->GetSproutAnchorAt(pindex->hashSproutAnchor, sproutTree));
-            if (pindex->pprev) {
-                if (Params().GetConsensus().NetworkUpgradeActive(pindex->pprev->nHeight,  Consensus::UPGRADE_SAPLING)) {
-                    assert(pcoinsTip->GetSaplingAnchorAt(pindex->pprev->hashFinalSaplingRoot, saplingTree));
+                if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                    ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+
+                const CBlock& block = batch.vBlocks[i];
+                for (size_t j = 0; j < block.vtx.size(); j++) {
+                    const CTransaction& tx = block.vtx[j];
+                    if (AddToWalletIfInvolvingMe(tx, &block, fUpdate, batch.vSproutNoteData[i][j], batch.vSaplingNoteData[i][j])) {
+                        myTxHashes.push_back(tx.GetHash());
+                        ret++;
+                    }
                 }
-            }
-            // Increment note witness caches
-            ChainTipAdded(pindex, &block, sproutTree, saplingTree);
 
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
+                SproutMerkleTree sproutTree;
+                SaplingMerkleTree saplingTree;
+                // This should never fail: we should always be able to get the tree
+                // state on the path to the tip of our chain
+                assert(pcoinsTip->GetSproutAnchorAt(pindex->hashSproutAnchor, sproutTree));
+                if (pindex->pprev) {
+                    if (Params().GetConsensus().NetworkUpgradeActive(pindex->pprev->nHeight,  Consensus::UPGRADE_SAPLING)) {
+                        assert(pcoinsTip->GetSaplingAnchorAt(pindex->pprev->hashFinalSaplingRoot, saplingTree));
+                    }
+                }
+                // Increment note witness caches
+                ChainTipAdded(pindex, &block, sproutTree, saplingTree);
+                pindexRescanTip = pindex;
+
+                if (GetTime() >= nNow + 60) {
+                    nNow = GetTime();
+                    LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
+                }
             }
         }
+        prefetch.join();
+
+        if (!fContinuous || nextBatch.vIndex.empty()) {
+            // Carry on from the last block applied, which also picks up any
+            // blocks connected after the last batch was queued.
+            LOCK2(cs_main, cs_wallet);
+            CBlockIndex* pindexNext = pindexRescanTip ? chainActive.Next(pindexRescanTip) : chainActive.Genesis();
+            CollectRescanBatch(pindexNext, nextBatch);
+            if (nextBatch.vIndex.empty()) {
+                fRescanInProgress = false;
+                pindexRescanTip = NULL;
+            }
+        }
+        if (nextBatch.vBlocks.size() != nextBatch.vIndex.size()) {
+            PrepareRescanBatch(nextBatch);
+        }
+        std::swap(batch, nextBatch);
+    }
+
+    {
+        LOCK2(cs_main, cs_wallet);
+        fRescanInProgress = false;
+        pindexRescanTip = NULL;
 
         // After rescanning, persist Sapling note data that might have changed, e.g. nullifiers.
         // Do not flush the wallet here for performance reasons.
@@ -2560,31 +3684,94 @@ void CWallet::ReacceptWalletTransactions()
     // If transactions aren't being broadcasted, don't let them into local mempool either
     if (!fBroadcastTransactions)
         return;
-    LOCK2(cs_main, cs_wallet);
-    std::map<int64_t, CWalletTx*> mapSorted;
 
-    // Sort pending wallet transactions based on their initial wallet insertion order
-    BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+    std::vector<CTransaction> vTxs;
+    int nHeight;
+    InitialBlockDownloadCheck isInitBlockDownload;
     {
-        const uint256& wtxid = item.first;
-        CWalletTx& wtx = item.second;
-        assert(wtx.GetHash() == wtxid);
+        LOCK2(cs_main, cs_wallet);
+        std::map<int64_t, CWalletTx*> mapSorted;
+
+        // Sort pending wallet transactions based on their initial wallet insertion order
+        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        {
+            const uint256& wtxid = item.first;
+            CWalletTx& wtx = item.second;
+            assert(wtx.GetHash() == wtxid);
+
+            int nDepth = wtx.GetDepthInMainChain();
+
+            if (!wtx.IsCoinBase() && nDepth < 0) {
+                mapSorted.insert(std::make_pair(wtx.nOrderPos, &wtx));
+            }
+        }
 
-        int nDepth = wtx.GetDepthInMainChain();
+        BOOST_FOREACH(PAIRTYPE(const int64_t, CWalletTx*)& item, mapSorted) {
+            vTxs.push_back(*item.second);
+        }
+        nHeight = chainActive.Height() + 1;
+        isInitBlockDownload = FixedInitialBlockDownload(IsInitialBlockDownload(Params()));
+    }
+    if (vTxs.empty())
+        return;
 
-        if (!wtx.IsCoinBase() && nDepth < 0) {
-            mapSorted.insert(std::make_pair(wtx.nOrderPos, &wtx));
+    // Check the proofs and signatures of all the transactions in parallel, without
+    // holding any locks. This is most of the work of adding them to the mempool.
+    int64_t nStart = GetTimeMillis();
+    std::vector<char> vChecked(vTxs.size(), false);
+    std::atomic<size_t> nDone(0);
+    ForEachIndexInParallel(vTxs.size(), [&](size_t i) {
+        CValidationState state;
+        vChecked[i] = CheckTransactionProofs(vTxs[i], state, Params(), nHeight, isInitBlockDownload);
+        size_t n = ++nDone;
+        if (n % 100 == 0) {
+            LogPrintf("ReacceptWalletTransactions: Checked %u of %u transactions\n", n, vTxs.size());
+        }
+    });
+    LogPrintf("ReacceptWalletTransactions: Checked %u transactions in %dms\n", vTxs.size(), GetTimeMillis() - nStart);
+
+    // Add parents before their children, as a child is rejected while its parent is missing.
+    // Insertion order is usually right already, but not for transactions found by a rescan.
+    std::map<uint256, size_t> mapIndex;
+    for (size_t i = 0; i < vTxs.size(); i++) {
+        mapIndex[vTxs[i].GetHash()] = i;
+    }
+    std::vector<size_t> vOrder;
+    std::vector<char> vVisited(vTxs.size(), false);
+    std::function<void(size_t)> visit = [&](size_t i) {
+        if (vVisited[i])
+            return;
+        vVisited[i] = true;
+        for (const CTxIn& txin : vTxs[i].vin) {
+            auto it = mapIndex.find(txin.prevout.hash);
+            if (it != mapIndex.end()) {
+                visit(it->second);
+            }
         }
+        vOrder.push_back(i);
+    };
+    for (size_t i = 0; i < vTxs.size(); i++) {
+        visit(i);
     }
 
     // Try to add wallet transactions to memory pool
-    BOOST_FOREACH(PAIRTYPE(const int64_t, CWalletTx*)& item, mapSorted)
-    {
-        CWalletTx& wtx = *(item.second);
+    LOCK2(cs_main, cs_wallet);
+    // The checks are only valid for the height (and so consensus branch) they were made at
+    bool fSameHeight = chainActive.Height() + 1 == nHeight;
+    size_t nAccepted = 0;
+    for (size_t i : vOrder) {
+        if (fSameHeight && !vChecked[i]) {
+            LogPrint("mempool", "ReacceptWalletTransactions: %s has invalid proofs or signatures\n", vTxs[i].GetHash().ToString());
+            continue;
+        }
 
         LOCK(mempool.cs);
-        wtx.AcceptToMemoryPool(false);
+        CValidationState state;
+        if (::AcceptToMemoryPool(mempool, state, vTxs[i], false, NULL, true, fSameHeight)) {
+            nAccepted++;
+        }
     }
+    LogPrintf("ReacceptWalletTransactions: Added %u of %u transactions to the mempool in %dms\n", nAccepted, vTxs.size(), GetTimeMillis() - nStart);
 }
 
 bool CWalletTx::RelayWalletTransaction()
@@ -2860,18 +4047,9 @@ void CWallet::ResendWalletTransactions(int64_t nBestBlockTime)
 
 CAmount CWallet::GetBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return walletBalances.GetTrustedTransparentBalance(true);
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
@@ -2905,18 +4083,9 @@ CAmount CWallet::GetImmatureBalance() const
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return walletBalances.GetTrustedTransparentBalance(false);
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
@@ -2948,8 +4117,222 @@ CAmount CWallet::GetImmatureWatchOnlyBalance() const
     return nTotal;
 }
 
+CAmount CWallet::GetPoolBalance(BalancePool pool, int nMinDepth, bool fIncludeWatchonly) const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return walletBalances.GetPoolBalance(pool, chainActive.Height(), nMinDepth, fIncludeWatchonly);
+}
+
+CAmount CWallet::GetAddressBalance(const CTxDestination& dest, int nMinDepth, bool fIncludeWatchonly) const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return walletBalances.GetAddressBalance(dest, chainActive.Height(), nMinDepth, fIncludeWatchonly);
+}
+
+CAmount CWallet::GetAddressBalance(const libzcash::PaymentAddress& addr, int nMinDepth, bool fIncludeWatchonly) const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return walletBalances.GetAddressBalance(addr, chainActive.Height(), nMinDepth, fIncludeWatchonly);
+}
+
+/**
+ * Compute what a wallet transaction currently contributes to the running
+ * balances. fVolatileRet is set if the contribution can change without the
+ * transaction itself being updated, i.e. it has to be recomputed on every
+ * balance query.
+ */
+CWalletTxBalance CWallet::GetTxBalance(const CWalletTx& wtx, bool& fVolatileRet) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    CWalletTxBalance txBalance;
+    int nDepth = wtx.GetDepthInMainChain();
+    bool fImmature = wtx.GetBlocksToMaturity() > 0;
+    txBalance.fSpends = nDepth >= 0;
+    fVolatileRet = nDepth <= 0 || fImmature;
+    if (nDepth < 0 || fImmature || !CheckFinalTx(wtx)) {
+        return txBalance;
+    }
+    if (nDepth == 0) {
+        txBalance.nHeight = wtx.IsTrusted() ? BALANCE_HEIGHT_TRUSTED : BALANCE_HEIGHT_UNTRUSTED;
+    } else {
+        txBalance.nHeight = chainActive.Height() - nDepth + 1;
+    }
+
+    const uint256& hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        isminetype mine = IsMine(wtx.vout[i]);
+        if (mine == ISMINE_NO || IsSpent(hash, i)) {
+            continue;
+        }
+        CBalanceContribution c;
+        c.pool = BALANCE_POOL_TRANSPARENT;
+        if (!ExtractDestination(wtx.vout[i].scriptPubKey, c.taddr)) {
+            c.taddr = CNoDestination();
+        }
+        c.n = i;
+        c.nValue = wtx.vout[i].nValue;
+        c.fSpendable = (mine & ISMINE_SPENDABLE) != ISMINE_NO;
+        c.fLocked = IsLockedCoin(hash, i);
+        txBalance.vContributions.push_back(c);
+    }
+
+    for (const mapSproutNoteData_t::value_type& item : wtx.mapSproutNoteData) {
+        const JSOutPoint& jsop = item.first;
+        const SproutNoteData& nd = item.second;
+        if (nd.nullifier && IsSproutSpent(*nd.nullifier)) {
+            continue;
+        }
+
+        ZCNoteDecryption decryptor;
+        if (!GetNoteDecryptor(nd.address, decryptor)) {
+            LogPrintf("%s: Could not find note decryptor for payment address %s\n", __func__, EncodePaymentAddress(nd.address));
+            continue;
+        }
+        const JSDescription& jsdesc = wtx.vJoinSplit[jsop.js];
+        auto hSig = jsdesc.h_sig(*pzcashParams, wtx.joinSplitPubKey);
+        try {
+            SproutNotePlaintext plaintext = SproutNotePlaintext::decrypt(
+                    decryptor,
+                    jsdesc.ciphertexts[jsop.n],
+                    jsdesc.ephemeralKey,
+                    hSig,
+                    (unsigned char) jsop.n);
+
+            CBalanceContribution c;
+            c.pool = BALANCE_POOL_SPROUT;
+            c.zaddr = nd.address;
+            c.nValue = plaintext.note(nd.address).value();
+            c.fSpendable = HaveSproutSpendingKey(nd.address);
+            c.fLocked = IsLockedNote(jsop);
+            txBalance.vContributions.push_back(c);
+        } catch (const std::exception &exc) {
+            LogPrintf("%s: Could not decrypt note for payment address %s: %s\n", __func__, EncodePaymentAddress(nd.address), exc.what());
+        }
+    }
+
+    for (const mapSaplingNoteData_t::value_type& item : wtx.mapSaplingNoteData) {
+        const SaplingOutPoint& op = item.first;
+        const SaplingNoteData& nd = item.second;
+        if (nd.nullifier && IsSaplingSpent(*nd.nullifier)) {
+            continue;
+        }
+
+        const OutputDescription& output = wtx.vShieldedOutput[op.n];
+        auto maybe_pt = SaplingNotePlaintext::decrypt(output.encCiphertext, nd.ivk, output.ephemeralKey, output.cm);
+        assert(static_cast<bool>(maybe_pt));
+        auto notePt = maybe_pt.get();
+        auto maybe_pa = nd.ivk.address(notePt.d);
+        assert(static_cast<bool>(maybe_pa));
+        auto pa = maybe_pa.get();
+
+        libzcash::SaplingIncomingViewingKey ivk;
+        libzcash::SaplingFullViewingKey fvk;
+        CBalanceContribution c;
+        c.pool = BALANCE_POOL_SAPLING;
+        c.zaddr = pa;
+        c.nValue = notePt.value();
+        c.fSpendable = GetSaplingIncomingViewingKey(pa, ivk) &&
+                       GetSaplingFullViewingKey(ivk, fvk) &&
+                       HaveSaplingSpendingKey(fvk);
+        c.fLocked = IsLockedNote(op);
+        txBalance.vContributions.push_back(c);
+    }
+
+    return txBalance;
+}
+
+void CWallet::MarkBalanceDirty(const uint256& hash) const
+{
+    AssertLockHeld(cs_wallet);
+    setBalanceDirtyTxs.insert(hash);
+}
+
+/**
+ * Mark the wallet transactions whose outputs or notes are spent by tx, since
+ * whether they count as spent depends on tx.
+ */
+void CWallet::MarkSpentBalancesDirty(const CTransaction& tx) const
+{
+    AssertLockHeld(cs_wallet);
+    for (const CTxIn& txin : tx.vin) {
+        if (mapWallet.count(txin.prevout.hash)) {
+            MarkBalanceDirty(txin.prevout.hash);
+        }
+    }
+    for (const JSDescription& jsdesc : tx.vJoinSplit) {
+        for (const uint256& nullifier : jsdesc.nullifiers) {
+            auto it = mapSproutNullifiersToNotes.find(nullifier);
+            if (it != mapSproutNullifiersToNotes.end()) {
+                MarkBalanceDirty(it->second.hash);
+            }
+        }
+    }
+    for (const SpendDescription& spend : tx.vShieldedSpend) {
+        auto it = mapSaplingNullifiersToNotes.find(spend.nullifier);
+        if (it != mapSaplingNullifiersToNotes.end()) {
+            MarkBalanceDirty(it->second.hash);
+        }
+    }
+}
+
+/**
+ * Bring the running balances up to date with mapWallet and the current tip.
+ * Only dirty and volatile transactions are recomputed, unless the balances
+ * have been invalidated as a whole.
+ */
+void CWallet::UpdateBalances() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (fBalancesStale) {
+        walletBalances.Clear();
+        setBalanceVolatileTxs.clear();
+        setBalanceDirtyTxs.clear();
+        for (const std::pair<const uint256, CWalletTx>& item : mapWallet) {
+            setBalanceDirtyTxs.insert(setBalanceDirtyTxs.end(), item.first);
+        }
+        fBalancesStale = false;
+    }
+    setBalanceDirtyTxs.insert(setBalanceVolatileTxs.begin(), setBalanceVolatileTxs.end());
+
+    while (!setBalanceDirtyTxs.empty()) {
+        uint256 hash = *setBalanceDirtyTxs.begin();
+        setBalanceDirtyTxs.erase(setBalanceDirtyTxs.begin());
+
+        auto it = mapWallet.find(hash);
+        if (it == mapWallet.end()) {
+            walletBalances.Remove(hash);
+            setBalanceVolatileTxs.erase(hash);
+            continue;
+        }
+
+        bool fVolatile;
+        CWalletTxBalance txBalance = GetTxBalance(it->second, fVolatile);
+        boost::optional<CWalletTxBalance> prev = walletBalances.Update(hash, txBalance);
+        if (fVolatile) {
+            setBalanceVolatileTxs.insert(hash);
+        } else {
+            setBalanceVolatileTxs.erase(hash);
+        }
+        // A transaction that became (or stopped being) conflicted changes
+        // whether the outputs it spends count as spent.
+        if (prev && prev->fSpends != txBalance.fSpends) {
+            MarkSpentBalancesDirty(it->second);
+        }
+    }
+}
+
 /**
  * populate vCoins with vector of available COutputs.
+ *
+ * Reads the coin index kept with the wallet balances, which only holds final,
+ * mature, unspent outputs of transactions that are not conflicted.
  */
 void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, bool fIncludeZeroValue, bool fIncludeCoinBase) const
 {
@@ -2957,36 +4340,90 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+        UpdateBalances();
 
-            if (!CheckFinalTx(*pcoin))
+        const CWalletBalances::CoinIndex& coins = walletBalances.GetCoins();
+        vCoins.reserve(walletBalances.CoinCount());
+        int nTipHeight = chainActive.Height();
+        for (CWalletBalances::CoinIndex::const_iterator bucket = coins.begin(); bucket != coins.end(); ++bucket)
+        {
+            int nHeight = bucket->first;
+            if (fOnlyConfirmed && nHeight == BALANCE_HEIGHT_UNTRUSTED)
                 continue;
+            int nDepth = nHeight < 0 ? 0 : nTipHeight - nHeight + 1;
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
+            for (const CIndexedCoin& coin : bucket->second) {
+                if (coin.fLocked || (coin.nValue == 0 && !fIncludeZeroValue))
+                    continue;
+                if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected(coin.outpoint.hash, coin.outpoint.n))
+                    continue;
 
-            if (pcoin->IsCoinBase() && !fIncludeCoinBase)
-                continue;
+                map<uint256, CWalletTx>::const_iterator it = mapWallet.find(coin.outpoint.hash);
+                assert(it != mapWallet.end());
+                const CWalletTx* pcoin = &it->second;
+                if (pcoin->IsCoinBase() && !fIncludeCoinBase)
+                    continue;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+                vCoins.push_back(COutput(pcoin, coin.outpoint.n, nDepth, coin.fSpendable));
+            }
+        }
+    }
+}
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
-                continue;
+/**
+ * Depth-first search for a subset of vValue (sorted by descending value) that
+ * adds up to exactly nTargetValue, pruning branches that overshoot or can no
+ * longer reach it. Gives up after nMaxTries steps.
+ */
+static bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTargetValue,
+                           vector<char>& vfSelected, int nMaxTries = 100000)
+{
+    vector<char> vfCurrent;
+    CAmount nCurrent = 0;
+    CAmount nAvailable = 0;
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        nAvailable += vValue[i].first;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected((*it).first, i)))
-                        vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
+    for (int nTry = 0; nTry < nMaxTries; nTry++)
+    {
+        if (nCurrent == nTargetValue)
+        {
+            vfSelected = vfCurrent;
+            vfSelected.resize(vValue.size(), false);
+            return true;
+        }
+
+        if (nCurrent > nTargetValue || nCurrent + nAvailable < nTargetValue)
+        {
+            // Backtrack to the last coin that was included and leave it out instead
+            while (!vfCurrent.empty() && !vfCurrent.back())
+            {
+                vfCurrent.pop_back();
+                nAvailable += vValue[vfCurrent.size()].first;
+            }
+            if (vfCurrent.empty())
+                return false;
+            vfCurrent.back() = false;
+            nCurrent -= vValue[vfCurrent.size() - 1].first;
+        }
+        else
+        {
+            // Include the next coin, unless an equal coin was just left out,
+            // in which case including this one would only repeat that branch
+            size_t i = vfCurrent.size();
+            nAvailable -= vValue[i].first;
+            if (i > 0 && !vfCurrent.back() && vValue[i].first == vValue[i - 1].first)
+            {
+                vfCurrent.push_back(false);
+            }
+            else
+            {
+                vfCurrent.push_back(true);
+                nCurrent += vValue[i].first;
             }
         }
     }
+    return false;
 }
 
 static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
@@ -3101,14 +4538,29 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
     sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     CAmount nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+    // Look for an exact match first, which needs no change output at all
+    if (SelectCoinsBnB(vValue, nTargetValue, vfBest))
+    {
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+            {
+                setCoinsRet.insert(vValue[i].second);
+                nValueRet += vValue[i].first;
+            }
+        LogPrint("selectcoins", "SelectCoins() exact match of %d coins: total %s\n", setCoinsRet.size(), FormatMoney(nValueRet));
+        return true;
+    }
+
+    // Otherwise solve subset sum by stochastic approximation, bounding the
+    // total work for wallets with very many small coins
+    int nIterations = std::max(10, std::min(1000, (int) (COIN_SELECTION_MAX_WORK / vValue.size())));
+    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, nIterations);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, nIterations);
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -3140,8 +4592,13 @@ bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*
 {
     // Output parameter fOnlyCoinbaseCoinsRet is set to true when the only available coins are coinbase utxos.
     vector<COutput> vCoinsNoCoinbase, vCoinsWithCoinbase;
-    AvailableCoins(vCoinsNoCoinbase, true, coinControl, false, false);
     AvailableCoins(vCoinsWithCoinbase, true, coinControl, false, true);
+    vCoinsNoCoinbase.reserve(vCoinsWithCoinbase.size());
+    for (const COutput& out : vCoinsWithCoinbase) {
+        if (!out.tx->IsCoinBase()) {
+            vCoinsNoCoinbase.push_back(out);
+        }
+    }
     fOnlyCoinbaseCoinsRet = vCoinsNoCoinbase.size() == 0 && vCoinsWithCoinbase.size() > 0;
 
     // If coinbase utxos can only be sent to zaddrs, exclude any coinbase utxos from coin selection.
@@ -4151,17 +5608,22 @@ void CWallet::LockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.insert(output);
+    MarkBalanceDirty(output.hash);
 }
 
 void CWallet::UnlockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.erase(output);
+    MarkBalanceDirty(output.hash);
 }
 
 void CWallet::UnlockAllCoins()
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
+    for (const auto& output : setLockedCoins) {
+        MarkBalanceDirty(output.hash);
+    }
     setLockedCoins.clear();
 }
 
@@ -4190,17 +5652,22 @@ void CWallet::LockNote(const JSOutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedSproutNotes
     setLockedSproutNotes.insert(output);
+    MarkBalanceDirty(output.hash);
 }
 
 void CWallet::UnlockNote(const JSOutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedSproutNotes
     setLockedSproutNotes.erase(output);
+    MarkBalanceDirty(output.hash);
 }
 
 void CWallet::UnlockAllSproutNotes()
 {
     AssertLockHeld(cs_wallet); // setLockedSproutNotes
+    for (const auto& output : setLockedSproutNotes) {
+        MarkBalanceDirty(output.hash);
+    }
     setLockedSproutNotes.clear();
 }
 
@@ -4222,17 +5689,22 @@ void CWallet::LockNote(const SaplingOutPoint& output)
 {
     AssertLockHeld(cs_wallet);
     setLockedSaplingNotes.insert(output);
+    MarkBalanceDirty(output.hash);
 }
 
 void CWallet::UnlockNote(const SaplingOutPoint& output)
 {
     AssertLockHeld(cs_wallet);
     setLockedSaplingNotes.erase(output);
+    MarkBalanceDirty(output.hash);
 }
 
 void CWallet::UnlockAllSaplingNotes()
 {
     AssertLockHeld(cs_wallet);
+    for (const auto& output : setLockedSaplingNotes) {
+        MarkBalanceDirty(output.hash);
+    }
     setLockedSaplingNotes.clear();
 }
 
@@ -4700,11 +6172,16 @@ SpendingKeyAddResult AddSpendingKeyToWallet::operator()(const libzcash::SproutSp
         LogPrint("zrpc", "Importing zaddr %s...\n", EncodePaymentAddress(addr));
     }
     if (m_wallet->HaveSproutSpendingKey(addr)) {
+        m_wallet->SetKeyBirthHeight(addr, nBirthHeight);
         return KeyAlreadyExists;
-    } else if (m_wallet-> AddSproutZKey(sk)) {
-        m_wallet->mapSproutZKeyMetadata[addr].nCreateTime = nTime;
+    }
+    // Set the metadata first, so that it is written out with the key
+    m_wallet->mapSproutZKeyMetadata[addr].nCreateTime = nTime;
+    m_wallet->mapSproutZKeyMetadata[addr].nBirthHeight = nBirthHeight;
+    if (m_wallet-> AddSproutZKey(sk)) {
         return KeyAdded;
     } else {
+        m_wallet->mapSproutZKeyMetadata.erase(addr);
         return KeyNotAdded;
     }
 }
@@ -4719,12 +6196,10 @@ SpendingKeyAddResult AddSpendingKeyToWallet::operator()(const libzcash::SaplingE
         }
         // Don't throw error in case a key is already there
         if (m_wallet->HaveSaplingSpendingKey(fvk)) {
+            m_wallet->SetKeyBirthHeight(ivk, nBirthHeight);
             return KeyAlreadyExists;
         } else {
-            if (!m_wallet-> AddSaplingZKey(sk, addr)) {
-                return KeyNotAdded;
-            }
-
+            // Set the metadata first, so that it is written out with the key
             // Sapling addresses can't have been used in transactions prior to activation.
             if (params.vUpgrades[Consensus::UPGRADE_SAPLING].nActivationHeight == Consensus::NetworkUpgrade::ALWAYS_ACTIVE) {
                 m_wallet->mapSaplingZKeyMetadata[ivk].nCreateTime = nTime;
@@ -4732,6 +6207,7 @@ SpendingKeyAddResult AddSpendingKeyToWallet::operator()(const libzcash::SaplingE
                 // 154051200 seconds from epoch is Friday, 26 October 2018 00:00:00 GMT - definitely before Sapling activates
                 m_wallet->mapSaplingZKeyMetadata[ivk].nCreateTime = std::max((int64_t) 154051200, nTime);
             }
+            m_wallet->mapSaplingZKeyMetadata[ivk].nBirthHeight = nBirthHeight;
             if (hdKeypath) {
                 m_wallet->mapSaplingZKeyMetadata[ivk].hdKeypath = hdKeypath.get();
             }
@@ -4740,6 +6216,11 @@ SpendingKeyAddResult AddSpendingKeyToWallet::operator()(const libzcash::SaplingE
                 seedFp.SetHex(seedFpStr.get());
                 m_wallet->mapSaplingZKeyMetadata[ivk].seedFp = seedFp;
             }
+
+            if (!m_wallet-> AddSaplingZKey(sk, addr)) {
+                m_wallet->mapSaplingZKeyMetadata.erase(ivk);
+                return KeyNotAdded;
+            }
             return KeyAdded;
         }    
     }
@@ -9,6 +9,7 @@
 #include "amount.h"
 #include "asyncrpcoperation.h"
 #include "coins.h"
+#include "crypto/common.h"
 #include "key.h"
 #include "keystore.h"
 #include "main.h"
@@ -21,6 +22,7 @@
 #include "validationinterface.h"
 #include "wallet/crypter.h"
 #include "wallet/wallet_ismine.h"
+#include "wallet/walletbalances.h"
 #include "wallet/walletdb.h"
 #include "wallet/rpcwallet.h"
 #include "zcash/Address.hpp"
@@ -33,6 +35,7 @@
 #include <stdexcept>
 #include <stdint.h>
 #include <string>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -46,6 +49,7 @@ extern CAmount maxTxFee;
 extern unsigned int nTxConfirmTarget;
 extern bool bSpendZeroConfChange;
 extern bool fSendFreeTransactions;
+extern bool fCacheNoteWitnesses;
 extern bool fPayAtLeastCustomFee;
 
 //! -paytxfee default
@@ -64,6 +68,14 @@ static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
 //  Should be large enough that we can expect not to reorg beyond our cache
 //  unless there is some exceptional network disruption.
 static const unsigned int WITNESS_CACHE_SIZE = MAX_REORG_LENGTH + 1;
+//! Default for -witnesscache
+static const bool DEFAULT_CACHE_NOTE_WITNESSES = true;
+//! Number of blocks read, trial-decrypted and applied together during a rescan
+static const unsigned int WALLET_RESCAN_BATCH_SIZE = 100;
+//! Value of CWalletTx::nIndexedHeight for transactions that are not indexed by height
+static const int WALLET_TX_NOT_INDEXED = -2;
+//! Coins times iterations the stochastic coin selection fallback may visit
+static const size_t COIN_SELECTION_MAX_WORK = 10000000;
 
 //! Size of HD seed in bytes
 static const size_t HD_WALLET_SEED_LENGTH = 32;
@@ -75,6 +87,7 @@ class CReserveKey;
 class CScript;
 class CTxMemPool;
 class CWalletTx;
+struct CRescanBatch;
 
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
@@ -410,6 +423,7 @@ public:
     char fFromMe;
     std::string strFromAccount;
     int64_t nOrderPos; //!< position in ordered transaction list
+    int nIndexedHeight; //!< key of this transaction in CWallet::mapTxHashesByHeight
 
     // memory only
     mutable bool fDebitCached;
@@ -482,6 +496,7 @@ public:
         nImmatureWatchCreditCached = 0;
         nChangeCached = 0;
         nOrderPos = -1;
+        nIndexedHeight = WALLET_TX_NOT_INDEXED;
     }
 
     ADD_SERIALIZE_METHODS;
@@ -719,6 +734,14 @@ private:
 };
 
 
+/** Hasher for the key and script hashes in CWallet's IsMine pre-filter */
+struct CScriptHashHasher
+{
+    size_t operator()(const uint160& hash) const {
+        return ReadLE64(hash.begin());
+    }
+};
+
 /** 
  * A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
@@ -728,6 +751,7 @@ class CWallet : public CCryptoKeyStore, public CValidationInterface
 private:
     bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, bool& fOnlyCoinbaseCoinsRet, bool& fNeedCoinbaseCoinsRet, const CCoinControl *coinControl = NULL) const;
 
+    //! Open while the wallet is encrypted, or a batch of keys is added (see BeginKeyBatch)
     CWalletDB *pwalletdbEncryption;
 
     //! the current wallet version: clients below this version are not able to load the wallet
@@ -765,6 +789,39 @@ private:
     void AddToSaplingSpends(const uint256& nullifier, const uint256& wtxid);
     void AddToSpends(const uint256& wtxid);
 
+    //! Serializes rescans, which release cs_main and cs_wallet between batches
+    CCriticalSection cs_walletRescan;
+    /**
+     * Set while ScanForWalletTransactions applies blocks to the wallet with
+     * cs_main released. pindexRescanTip is the last block applied so far;
+     * ChainTip only handles blocks that extend or undo it and leaves the
+     * rest to the rescan.
+     */
+    bool fRescanInProgress;
+    const CBlockIndex* pindexRescanTip;
+
+    bool CanRescanWithoutLocks(const CBlockIndex* pindexStart) const;
+    void CollectRescanBatch(CBlockIndex* pindex, CRescanBatch& batch) const;
+    void PrepareRescanBatch(CRescanBatch& batch) const;
+
+    /**
+     * Running balances per pool and per address. Transactions in
+     * setBalanceDirtyTxs are re-evaluated on the next balance query.
+     * setBalanceVolatileTxs holds the transactions whose contribution can
+     * change without the wallet being told (unconfirmed, conflicted or
+     * immature ones); these are re-evaluated on every query.
+     * fBalancesStale forces a rebuild from mapWallet.
+     */
+    mutable CWalletBalances walletBalances;
+    mutable std::set<uint256> setBalanceDirtyTxs;
+    mutable std::set<uint256> setBalanceVolatileTxs;
+    mutable bool fBalancesStale;
+
+    CWalletTxBalance GetTxBalance(const CWalletTx& wtx, bool& fVolatileRet) const;
+    void MarkBalanceDirty(const uint256& hash) const;
+    void MarkSpentBalancesDirty(const CTransaction& tx) const;
+    void UpdateBalances() const;
+
 public:
     /*
      * Size of the incremental witness cache for the notes in our wallet.
@@ -775,6 +832,12 @@ public:
     bool fSaplingMigrationEnabled = false;
 
     void ClearNoteWitnessCache();
+    /**
+     * Keep a single witness per mined note, which records its position, and
+     * drop the rest of the cache. Used when running with -witnesscache=0.
+     */
+    void TrimNoteWitnessCache();
+    bool HasNoteWitnesses() const;
 
 protected:
     /**
@@ -788,6 +851,14 @@ protected:
      * pindex is the old tip being disconnected.
      */
     void DecrementNoteWitnesses(const CBlockIndex* pindex);
+    /**
+     * Record the position of our notes in the block at pindex, without
+     * updating any other witnesses (-witnesscache=0).
+     */
+    void RecordNotePositions(const CBlockIndex* pindex,
+                             const CBlock* pblock,
+                             SproutMerkleTree& sproutTree,
+                             SaplingMerkleTree& saplingTree);
 
     template <typename WalletDB>
     void SetBestChainINTERNAL(WalletDB& walletdb, const CBlockLocator& loc) {
@@ -901,6 +972,11 @@ public:
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
         nWitnessCacheSize = 0;
+        fBalancesStale = true;
+        fTxIndexesStale = true;
+        fMyOutPointsStale = true;
+        fRescanInProgress = false;
+        pindexRescanTip = NULL;
     }
 
     /**
@@ -1008,7 +1084,7 @@ public:
     //! Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
+    bool LoadKey(const CKey& key, const CPubKey &pubkey);
     //! Load metadata (used by LoadWallet)
     bool LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &metadata);
 
@@ -1042,6 +1118,15 @@ public:
 
     void GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const;
 
+    /**
+     * Record that a key cannot be involved in blocks below nBirthHeight, and
+     * save it to disk. A birth height that is already known is only ever
+     * lowered, so that rescans never skip blocks an earlier import covered.
+     */
+    bool SetKeyBirthHeight(const CPubKey &pubkey, int nBirthHeight);
+    bool SetKeyBirthHeight(const libzcash::SproutPaymentAddress &addr, int nBirthHeight);
+    bool SetKeyBirthHeight(const libzcash::SaplingIncomingViewingKey &ivk, int nBirthHeight);
+
     /**
       * Sprout ZKeys
       */
@@ -1072,6 +1157,22 @@ public:
       */
     //! Generates new Sapling key
     libzcash::SaplingPaymentAddress GenerateNewSaplingZKey();
+    /**
+     * Generates nCount new Sapling keys, deriving them in parallel and
+     * saving them in a single wallet database transaction, and returns their
+     * default addresses. If that fails, none of them are kept in memory either.
+     */
+    std::vector<libzcash::SaplingPaymentAddress> GenerateNewSaplingZKeys(size_t nCount);
+    /**
+     * Returns nCount new diversified addresses of the Sapling key of addr.
+     * Unlike new keys, these don't add to the cost of trial decryption.
+     */
+    std::vector<libzcash::SaplingPaymentAddress> GenerateSaplingDiversifiedAddresses(
+        const libzcash::SaplingPaymentAddress &addr, size_t nCount);
+    //! Write the keys added until EndKeyBatch() in a single database
+    //! transaction. Callers undo their changes in memory if it is aborted.
+    void BeginKeyBatch();
+    void EndKeyBatch(bool fCommit);
     //! Adds Sapling spending key to the store, and saves it to disk
     bool AddSaplingZKey(
         const libzcash::SaplingExtendedSpendingKey &key,
@@ -1105,21 +1206,79 @@ public:
     typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
     typedef std::multimap<int64_t, TxPair > TxItems;
 
+private:
+    /**
+     * Indexes of the wallet's activity, kept up to date as transactions and
+     * accounting entries are added so that listtransactions and
+     * listsinceblock don't have to walk the whole wallet. They are built from
+     * the positions and blocks stored with each record in the wallet
+     * database, and rebuilt after loading or reordering the wallet.
+     */
+    //! Wallet transactions and accounting entries (of all accounts) by nOrderPos
+    TxItems wtxOrdered;
+    //! Every accounting entry in the wallet database
+    std::list<CAccountingEntry> laccentries;
+    //! Hashes of wallet transactions by the height of their block, or -1 if not in the active chain
+    std::map<int, std::set<uint256>> mapTxHashesByHeight;
+    bool fTxIndexesStale;
+
+    void RebuildTxIndexes();
+    void IndexTxHeight(CWalletTx& wtx);
+    void UnindexTx(CWalletTx& wtx);
+
+    /**
+     * Pre-filters that let IsMine and IsFromMe reject most transactions
+     * without going through the keystore. setMyScriptHashes holds the
+     * hashes of our keys, redeem scripts and P2PKH/P2SH watch-only scripts,
+     * so a P2PKH or P2SH output whose hash is missing can't be ours.
+     * setMyOutPoints holds the wallet transaction outputs that are ours,
+     * spent or not so that conflicting spends are still found; it is rebuilt
+     * after keys or scripts are imported, which can make old outputs ours,
+     * but not after keys are generated (see GenerateNewKey).
+     */
+    mutable CCriticalSection cs_myScripts;
+    std::unordered_set<uint160, CScriptHashHasher> setMyScriptHashes;
+    mutable std::unordered_set<COutPoint, COutPointHasher> setMyOutPoints;
+    mutable bool fMyOutPointsStale;
+
+    void AddToScriptFilter(const uint160& hash);
+    void AddToScriptFilter(const CScript& scriptPubKey);
+    void IndexMyOutPoints(const CWalletTx& wtx) const;
+    bool IsMyOutPoint(const COutPoint& outpoint) const;
+
+public:
     /**
      * Get the wallet's activity log
-     * @return multimap of ordered transactions and accounting entries
-     * @warning Returned pointers are *only* valid within the scope of passed acentries
+     * @return multimap of ordered transactions and accounting entries of all accounts
+     * @warning Returned pointers are only valid while cs_wallet is held
+     */
+    const TxItems& OrderedTxItems();
+    //! Mark the activity indexes for rebuilding, e.g. after transactions were reordered
+    void MarkTxIndexesStale() { fTxIndexesStale = true; }
+    /**
+     * Get the wallet transactions that are not in the active chain or were
+     * mined above nHeight, in hash order.
      */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    void GetTxHashesSince(int nHeight, std::vector<uint256>& vHashes);
+    /**
+     * Give the accounting entries the next order positions and save them to
+     * disk in one database transaction. They are only added to the activity
+     * indexes once the transaction has been committed.
+     */
+    bool AddAccountingEntries(std::vector<CAccountingEntry>& entries);
 
     void MarkDirty();
     bool UpdateNullifierNoteMap();
     void UpdateNullifierNoteMapWithTx(const CWalletTx& wtx);
     void UpdateSaplingNullifierNoteMapWithTx(CWalletTx& wtx);
+    void UpdateSaplingNullifierNoteMap(const std::vector<CWalletTx*>& vWtx);
     void UpdateSaplingNullifierNoteMapForBlock(const CBlock* pblock);
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
+    bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
+                                  const mapSproutNoteData_t& sproutNoteData,
+                                  const std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>& saplingNoteDataAndAddressesToAdd);
     void EraseFromWallet(const uint256 &hash);
     void WitnessNoteCommitment(
          std::vector<uint256> commitments,
@@ -1135,6 +1294,11 @@ public:
     CAmount GetWatchOnlyBalance() const;
     CAmount GetUnconfirmedWatchOnlyBalance() const;
     CAmount GetImmatureWatchOnlyBalance() const;
+    /** Unspent, unlocked value in a pool with at least nMinDepth confirmations */
+    CAmount GetPoolBalance(BalancePool pool, int nMinDepth, bool fIncludeWatchonly) const;
+    /** Unspent, unlocked value received by an address with at least nMinDepth confirmations */
+    CAmount GetAddressBalance(const CTxDestination& dest, int nMinDepth, bool fIncludeWatchonly) const;
+    CAmount GetAddressBalance(const libzcash::PaymentAddress& addr, int nMinDepth, bool fIncludeWatchonly) const;
     bool FundTransaction(CMutableTransaction& tx, CAmount& nFeeRet, int& nChangePosRet, std::string& strFailReason);
     bool CreateTransaction(const std::vector<CRecipient>& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet, int& nChangePosRet,
                            std::string& strFailReason, const CCoinControl *coinControl = NULL, bool sign = true);
@@ -1165,6 +1329,15 @@ public:
         uint8_t n) const;
     mapSproutNoteData_t FindMySproutNotes(const CTransaction& tx) const;
     std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> FindMySaplingNotes(const CTransaction& tx) const;
+    /**
+     * Trial-decrypt against a snapshot of the wallet's keys, without holding
+     * cs_SpendingKeyStore, so that several threads can scan at once. The
+     * Sapling variant returns the addresses of all decrypted notes.
+     */
+    mapSproutNoteData_t FindMySproutNotes(const CTransaction& tx, const NoteDecryptorMap& decryptors) const;
+    std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> FindMySaplingNotes(
+        const CTransaction& tx,
+        const std::vector<libzcash::SaplingIncomingViewingKey>& ivks) const;
     bool IsSproutNullifierFromMe(const uint256& nullifier) const;
     bool IsSaplingNullifierFromMe(const uint256& nullifier) const;
 
@@ -1432,9 +1605,10 @@ private:
     boost::optional<std::string> hdKeypath; // currently sapling only
     boost::optional<std::string> seedFpStr; // currently sapling only
     bool log;
+    int nBirthHeight;
 public: 
-    AddSpendingKeyToWallet(CWallet *wallet, const Consensus::Params &params) :
-        m_wallet(wallet), params(params), nTime(1), hdKeypath(boost::none), seedFpStr(boost::none), log(false) {}
+    AddSpendingKeyToWallet(CWallet *wallet, const Consensus::Params &params, int _nBirthHeight = -1) :
+        m_wallet(wallet), params(params), nTime(1), hdKeypath(boost::none), seedFpStr(boost::none), log(false), nBirthHeight(_nBirthHeight) {}
     AddSpendingKeyToWallet(
         CWallet *wallet,
         const Consensus::Params &params,
@@ -1442,7 +1616,7 @@ public:
         boost::optional<std::string> _hdKeypath,
         boost::optional<std::string> _seedFp,
         bool _log
-    ) : m_wallet(wallet), params(params), nTime(_nTime), hdKeypath(_hdKeypath), seedFpStr(_seedFp), log(_log) {}
+    ) : m_wallet(wallet), params(params), nTime(_nTime), hdKeypath(_hdKeypath), seedFpStr(_seedFp), log(_log), nBirthHeight(-1) {}
 
 
     SpendingKeyAddResult operator()(const libzcash::SproutSpendingKey &sk) const;
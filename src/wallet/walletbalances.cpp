@@ -0,0 +1,160 @@
+// Copyright (c) 2019 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "wallet/walletbalances.h"
+
+void CBalanceLedger::Add(int nHeight, CAmount nValue)
+{
+    if (nValue == 0) {
+        return;
+    }
+    nTotal += nValue;
+    auto it = mapByHeight.insert(std::make_pair(nHeight, CAmount(0))).first;
+    it->second += nValue;
+    if (it->second == 0) {
+        mapByHeight.erase(it);
+    }
+}
+
+CAmount CBalanceLedger::Get(int nTipHeight, int nMinDepth) const
+{
+    if (nMinDepth <= 0) {
+        return nTotal;
+    }
+
+    // Unconfirmed value is filed under negative heights, which sort first;
+    // confirmed value that is not yet deep enough sits at the highest heights.
+    int nMaxHeight = nTipHeight - nMinDepth + 1;
+    CAmount nBalance = nTotal;
+    for (auto it = mapByHeight.begin(); it != mapByHeight.end() && it->first < 0; ++it) {
+        nBalance -= it->second;
+    }
+    for (auto it = mapByHeight.rbegin(); it != mapByHeight.rend() && it->first > nMaxHeight; ++it) {
+        if (it->first >= 0) {
+            nBalance -= it->second;
+        }
+    }
+    return nBalance;
+}
+
+CAmount CBalanceLedger::GetTrusted() const
+{
+    auto it = mapByHeight.find(BALANCE_HEIGHT_UNTRUSTED);
+    return nTotal - (it == mapByHeight.end() ? 0 : it->second);
+}
+
+void CWalletBalances::Apply(const uint256& txid, const CWalletTxBalance& txBalance, int nSign)
+{
+    for (const CBalanceContribution& c : txBalance.vContributions) {
+        CAmount nValue = nSign * c.nValue;
+
+        if (c.pool == BALANCE_POOL_TRANSPARENT) {
+            CIndexedCoin coin(c.nValue, COutPoint(txid, c.n), c.fSpendable, c.fLocked);
+            if (nSign > 0) {
+                if (mapCoins[txBalance.nHeight].insert(coin).second) {
+                    nCoins++;
+                }
+            } else {
+                auto it = mapCoins.find(txBalance.nHeight);
+                if (it != mapCoins.end()) {
+                    nCoins -= it->second.erase(coin);
+                    if (it->second.empty()) {
+                        mapCoins.erase(it);
+                    }
+                }
+            }
+        }
+
+        if (c.fLocked) {
+            // Locked coins only count towards CWallet::GetBalance()
+            if (c.pool == BALANCE_POOL_TRANSPARENT) {
+                lockedTransparent[c.fSpendable].Add(txBalance.nHeight, nValue);
+            }
+            continue;
+        }
+
+        pools[c.pool][c.fSpendable].Add(txBalance.nHeight, nValue);
+
+        if (c.pool == BALANCE_POOL_TRANSPARENT) {
+            if (!IsValidDestination(c.taddr)) {
+                continue;
+            }
+            auto it = mapTransparent.insert(std::make_pair(c.taddr, LedgerPair())).first;
+            it->second[c.fSpendable].Add(txBalance.nHeight, nValue);
+            if (it->second[0].IsEmpty() && it->second[1].IsEmpty()) {
+                mapTransparent.erase(it);
+            }
+        } else {
+            auto it = mapShielded.insert(std::make_pair(c.zaddr, LedgerPair())).first;
+            it->second[c.fSpendable].Add(txBalance.nHeight, nValue);
+            if (it->second[0].IsEmpty() && it->second[1].IsEmpty()) {
+                mapShielded.erase(it);
+            }
+        }
+    }
+}
+
+boost::optional<CWalletTxBalance> CWalletBalances::Update(const uint256& txid, const CWalletTxBalance& txBalance)
+{
+    boost::optional<CWalletTxBalance> prev = Remove(txid);
+    Apply(txid, txBalance, 1);
+    mapTxBalances[txid] = txBalance;
+    return prev;
+}
+
+boost::optional<CWalletTxBalance> CWalletBalances::Remove(const uint256& txid)
+{
+    auto it = mapTxBalances.find(txid);
+    if (it == mapTxBalances.end()) {
+        return boost::none;
+    }
+    CWalletTxBalance prev = it->second;
+    Apply(txid, prev, -1);
+    mapTxBalances.erase(it);
+    return prev;
+}
+
+void CWalletBalances::Clear()
+{
+    mapTxBalances.clear();
+    for (int i = 0; i < BALANCE_POOL_COUNT; i++) {
+        pools[i] = LedgerPair();
+    }
+    lockedTransparent = LedgerPair();
+    mapTransparent.clear();
+    mapShielded.clear();
+    mapCoins.clear();
+    nCoins = 0;
+}
+
+CAmount CWalletBalances::Get(const LedgerPair& ledgers, int nTipHeight, int nMinDepth, bool fIncludeWatchonly)
+{
+    CAmount nBalance = ledgers[true].Get(nTipHeight, nMinDepth);
+    if (fIncludeWatchonly) {
+        nBalance += ledgers[false].Get(nTipHeight, nMinDepth);
+    }
+    return nBalance;
+}
+
+CAmount CWalletBalances::GetPoolBalance(BalancePool pool, int nTipHeight, int nMinDepth, bool fIncludeWatchonly) const
+{
+    return Get(pools[pool], nTipHeight, nMinDepth, fIncludeWatchonly);
+}
+
+CAmount CWalletBalances::GetAddressBalance(const CTxDestination& dest, int nTipHeight, int nMinDepth, bool fIncludeWatchonly) const
+{
+    auto it = mapTransparent.find(dest);
+    return it == mapTransparent.end() ? 0 : Get(it->second, nTipHeight, nMinDepth, fIncludeWatchonly);
+}
+
+CAmount CWalletBalances::GetAddressBalance(const libzcash::PaymentAddress& addr, int nTipHeight, int nMinDepth, bool fIncludeWatchonly) const
+{
+    auto it = mapShielded.find(addr);
+    return it == mapShielded.end() ? 0 : Get(it->second, nTipHeight, nMinDepth, fIncludeWatchonly);
+}
+
+CAmount CWalletBalances::GetTrustedTransparentBalance(bool fSpendable) const
+{
+    return pools[BALANCE_POOL_TRANSPARENT][fSpendable].GetTrusted() + lockedTransparent[fSpendable].GetTrusted();
+}
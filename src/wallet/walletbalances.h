@@ -0,0 +1,157 @@
+// Copyright (c) 2019 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef BITCOIN_WALLET_WALLETBALANCES_H
+#define BITCOIN_WALLET_WALLETBALANCES_H
+
+#include "amount.h"
+#include "primitives/transaction.h"
+#include "pubkey.h"
+#include "script/standard.h"
+#include "uint256.h"
+#include "zcash/Address.hpp"
+
+#include <array>
+#include <map>
+#include <set>
+#include <tuple>
+#include <vector>
+
+#include <boost/optional.hpp>
+
+/** Ledger height used for wallet transactions in the mempool that CWalletTx::IsTrusted() accepts */
+static const int BALANCE_HEIGHT_TRUSTED = -1;
+/** Ledger height used for all other wallet transactions in the mempool */
+static const int BALANCE_HEIGHT_UNTRUSTED = -2;
+
+enum BalancePool
+{
+    BALANCE_POOL_TRANSPARENT = 0,
+    BALANCE_POOL_SPROUT,
+    BALANCE_POOL_SAPLING,
+    BALANCE_POOL_COUNT
+};
+
+/**
+ * A running total of unspent value, bucketed by the height at which it was
+ * mined so that minimum-depth queries only have to look at the few most
+ * recent heights.
+ */
+class CBalanceLedger
+{
+private:
+    CAmount nTotal;
+    std::map<int, CAmount> mapByHeight;
+
+public:
+    CBalanceLedger() : nTotal(0) { }
+
+    void Add(int nHeight, CAmount nValue);
+
+    /** Value with at least nMinDepth confirmations when the tip is at nTipHeight. */
+    CAmount Get(int nTipHeight, int nMinDepth) const;
+    /** Confirmed value plus trusted unconfirmed value (see CWalletTx::IsTrusted). */
+    CAmount GetTrusted() const;
+
+    bool IsEmpty() const { return mapByHeight.empty(); }
+};
+
+/** The share of a single unspent output or note in the wallet's balances. */
+struct CBalanceContribution
+{
+    BalancePool pool;
+    CTxDestination taddr;            //!< transparent outputs only
+    uint32_t n;                      //!< output index, transparent outputs only
+    libzcash::PaymentAddress zaddr;  //!< shielded notes only
+    CAmount nValue;
+    bool fSpendable;                 //!< false for watch-only outputs and viewing-key notes
+    bool fLocked;                    //!< locked with lockunspent or LockNote
+};
+
+/** Everything a wallet transaction currently contributes to the balances. */
+struct CWalletTxBalance
+{
+    int nHeight;
+    bool fSpends;                    //!< true if the transaction's spends are effective (depth >= 0)
+    std::vector<CBalanceContribution> vContributions;
+
+    CWalletTxBalance() : nHeight(BALANCE_HEIGHT_UNTRUSTED), fSpends(false) { }
+};
+
+/** An unspent transparent output as filed in the coin index of CWalletBalances. */
+struct CIndexedCoin
+{
+    CAmount nValue;
+    COutPoint outpoint;
+    bool fSpendable;
+    bool fLocked;
+
+    CIndexedCoin(CAmount nValueIn, const COutPoint& outpointIn, bool fSpendableIn, bool fLockedIn) :
+        nValue(nValueIn), outpoint(outpointIn), fSpendable(fSpendableIn), fLocked(fLockedIn) { }
+
+    // Ordered by value, so that the coins of a height bucket can be split at a target amount
+    friend bool operator<(const CIndexedCoin& a, const CIndexedCoin& b)
+    {
+        return std::tie(a.nValue, a.outpoint) < std::tie(b.nValue, b.outpoint);
+    }
+};
+
+/**
+ * Incrementally maintained balances of a wallet, per pool and per address.
+ *
+ * CWallet recomputes the contribution of a transaction whenever something
+ * that affects it changes (the transaction is added or updated, one of its
+ * outputs is spent, its depth changes) and replaces the previous one, so
+ * balance queries never have to walk mapWallet.
+ *
+ * The unspent transparent outputs themselves are kept in a coin index,
+ * bucketed by the height they were mined at and ordered by value within a
+ * bucket, which is what CWallet::AvailableCoins() and coin selection read.
+ */
+class CWalletBalances
+{
+public:
+    typedef std::map<int, std::set<CIndexedCoin>> CoinIndex; //!< keyed by height as in CBalanceLedger
+
+private:
+    typedef std::array<CBalanceLedger, 2> LedgerPair; //!< indexed by fSpendable
+
+    std::map<uint256, CWalletTxBalance> mapTxBalances;
+    LedgerPair pools[BALANCE_POOL_COUNT];
+    LedgerPair lockedTransparent;
+    std::map<CTxDestination, LedgerPair> mapTransparent;
+    std::map<libzcash::PaymentAddress, LedgerPair> mapShielded;
+    CoinIndex mapCoins;
+    size_t nCoins;
+
+    void Apply(const uint256& txid, const CWalletTxBalance& txBalance, int nSign);
+
+    static CAmount Get(const LedgerPair& ledgers, int nTipHeight, int nMinDepth, bool fIncludeWatchonly);
+
+public:
+    CWalletBalances() : nCoins(0) { }
+
+    /** Replace the contribution of a transaction. Returns the previous one, if any. */
+    boost::optional<CWalletTxBalance> Update(const uint256& txid, const CWalletTxBalance& txBalance);
+    /** Remove the contribution of a transaction. Returns the previous one, if any. */
+    boost::optional<CWalletTxBalance> Remove(const uint256& txid);
+    void Clear();
+
+    size_t Size() const { return mapTxBalances.size(); }
+
+    CAmount GetPoolBalance(BalancePool pool, int nTipHeight, int nMinDepth, bool fIncludeWatchonly) const;
+    CAmount GetAddressBalance(const CTxDestination& dest, int nTipHeight, int nMinDepth, bool fIncludeWatchonly) const;
+    CAmount GetAddressBalance(const libzcash::PaymentAddress& addr, int nTipHeight, int nMinDepth, bool fIncludeWatchonly) const;
+    /**
+     * Trusted transparent balance as defined by CWallet::GetBalance(), which
+     * (unlike the per-address balances) includes locked coins.
+     */
+    CAmount GetTrustedTransparentBalance(bool fSpendable) const;
+
+    /** Unspent transparent outputs (including watch-only and locked ones) by height. */
+    const CoinIndex& GetCoins() const { return mapCoins; }
+    size_t CoinCount() const { return nCoins; }
+};
+
+#endif // BITCOIN_WALLET_WALLETBALANCES_H
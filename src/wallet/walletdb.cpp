@@ -21,6 +21,8 @@
 #include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
+#include <atomic>
+
 using namespace std;
 
 static uint64_t nAccountingEntryNumber = 0;
@@ -147,6 +149,24 @@ bool CWalletDB::WriteCryptedSaplingZKey(
     return true;
 }
 
+bool CWalletDB::WriteKeyMetadata(const CPubKey& vchPubKey, const CKeyMetadata &keyMeta)
+{
+    nWalletDBUpdated++;
+    return Write(std::make_pair(std::string("keymeta"), vchPubKey), keyMeta);
+}
+
+bool CWalletDB::WriteZKeyMetadata(const libzcash::SproutPaymentAddress& addr, const CKeyMetadata &keyMeta)
+{
+    nWalletDBUpdated++;
+    return Write(std::make_pair(std::string("zkeymeta"), addr), keyMeta);
+}
+
+bool CWalletDB::WriteSaplingZKeyMetadata(const libzcash::SaplingIncomingViewingKey &ivk, const CKeyMetadata &keyMeta)
+{
+    nWalletDBUpdated++;
+    return Write(std::make_pair(std::string("sapzkeymeta"), ivk), keyMeta);
+}
+
 bool CWalletDB::WriteMasterKey(unsigned int nID, const CMasterKey& kMasterKey)
 {
     nWalletDBUpdated++;
@@ -302,7 +322,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error("CWalletDB::ListAccountCreditDebit(): cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
@@ -414,6 +434,8 @@ DBErrors CWalletDB::ReorderTransactions(CWallet* pwallet)
     }
     WriteOrderPosNext(nOrderPosNext);
 
+    pwallet->MarkTxIndexesStale();
+
     return DB_LOAD_OK;
 }
 
@@ -439,6 +461,72 @@ public:
     }
 };
 
+/** A "tx" record, deserialised and checked independently of the wallet. */
+struct CWalletTxRecord
+{
+    uint256 hash;
+    CWalletTx wtx;
+    bool fUpgraded;
+    string strErr;
+
+    CWalletTxRecord() : fUpgraded(false) { }
+};
+
+/**
+ * Deserialise and check the value of a "tx" record whose type has already
+ * been read from ssKey. Doesn't touch the wallet, so that records can be
+ * read on several threads at once.
+ */
+static bool
+ReadTxRecord(CDataStream& ssKey, CDataStream& ssValue, CWalletTxRecord& record)
+{
+    try {
+        uint256& hash = record.hash;
+        CWalletTx& wtx = record.wtx;
+        ssKey >> hash;
+        ssValue >> wtx;
+        CValidationState state;
+        auto verifier = libzcash::ProofVerifier::Strict();
+        if (!(CheckTransaction(wtx, state, verifier) && (wtx.GetHash() == hash) && state.IsValid()))
+            return false;
+
+        // Undo serialize changes in 31600
+        if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+        {
+            if (!ssValue.empty())
+            {
+                char fTmp;
+                char fUnused;
+                ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+                record.strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                                          wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+                wtx.fTimeReceivedIsTxTime = fTmp;
+            }
+            else
+            {
+                record.strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+                wtx.fTimeReceivedIsTxTime = 0;
+            }
+            record.fUpgraded = true;
+        }
+    } catch (...) {
+        return false;
+    }
+    return true;
+}
+
+static void
+AddTxRecord(CWallet* pwallet, const CWalletTxRecord& record, CWalletScanState &wss)
+{
+    if (record.fUpgraded)
+        wss.vWalletUpgrade.push_back(record.hash);
+
+    if (record.wtx.nOrderPos == -1)
+        wss.fAnyUnordered = true;
+
+    pwallet->AddToWallet(record.wtx, true, NULL);
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              CWalletScanState &wss, string& strType, string& strErr)
@@ -462,39 +550,11 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "tx")
         {
-            uint256 hash;
-            ssKey >> hash;
-            CWalletTx wtx;
-            ssValue >> wtx;
-            CValidationState state;
-            auto verifier = libzcash::ProofVerifier::Strict();
-            if (!(CheckTransaction(wtx, state, verifier) && (wtx.GetHash() == hash) && state.IsValid()))
+            CWalletTxRecord record;
+            if (!ReadTxRecord(ssKey, ssValue, record))
                 return false;
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                wss.vWalletUpgrade.push_back(hash);
-            }
-
-            if (wtx.nOrderPos == -1)
-                wss.fAnyUnordered = true;
-
-            pwallet->AddToWallet(wtx, true, NULL);
+            strErr = record.strErr;
+            AddTxRecord(pwallet, record, wss);
         }
         else if (strType == "acentry")
         {
@@ -885,13 +945,50 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
             return DB_CORRUPT;
         }
 
+        // Transaction records are by far the most expensive to read, mostly
+        // because of proof verification, so they are collected into batches
+        // that are deserialised and checked in parallel, and then added to the
+        // wallet in cursor order.
+        std::vector<std::pair<CDataStream, CDataStream>> vTxRecordData;
+        vTxRecordData.reserve(WALLET_LOAD_TX_BATCH_SIZE);
+        auto flushTxRecords = [&]() {
+            std::vector<CWalletTxRecord> vRecords(vTxRecordData.size());
+            std::vector<char> vfOk(vTxRecordData.size(), false);
+            std::atomic<size_t> nNext(0);
+            auto worker = [&]() {
+                for (size_t i = nNext++; i < vTxRecordData.size(); i = nNext++) {
+                    vfOk[i] = ReadTxRecord(vTxRecordData[i].first, vTxRecordData[i].second, vRecords[i]);
+                }
+            };
+            size_t nThreads = std::min<size_t>(std::max(GetNumCores(), 1), vTxRecordData.size());
+            boost::thread_group workers;
+            for (size_t i = 1; i < nThreads; i++) {
+                workers.create_thread(worker);
+            }
+            worker();
+            workers.join_all();
+
+            for (size_t i = 0; i < vRecords.size(); i++) {
+                if (vfOk[i]) {
+                    AddTxRecord(pwallet, vRecords[i], wss);
+                } else {
+                    // Leave bad transaction records alone, and rescan instead
+                    fNoncriticalErrors = true;
+                    SoftSetBoolArg("-rescan", true);
+                }
+                if (!vRecords[i].strErr.empty())
+                    LogPrintf("%s\n", vRecords[i].strErr);
+            }
+            vTxRecordData.clear();
+        };
+
         while (true)
         {
             // Read next record
@@ -906,8 +1003,23 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 return DB_CORRUPT;
             }
 
-            // Try to be tolerant of single corrupt records:
             string strType, strErr;
+            CDataStream ssTxKey(ssKey);
+            try {
+                ssTxKey >> strType;
+            } catch (...) {
+                // Left to ReadKeyValue below
+                strType.clear();
+            }
+            if (strType == "tx")
+            {
+                vTxRecordData.push_back(std::make_pair(ssTxKey, ssValue));
+                if (vTxRecordData.size() >= WALLET_LOAD_TX_BATCH_SIZE)
+                    flushTxRecords();
+                continue;
+            }
+
+            // Try to be tolerant of single corrupt records:
             if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
             {
                 // losing keys is considered a catastrophic error, anything else
@@ -918,14 +1030,13 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 {
                     // Leave other errors alone, if we try to fix them we might make things worse.
                     fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
-                    if (strType == "tx")
-                        // Rescan if there is a bad transaction record:
-                        SoftSetBoolArg("-rescan", true);
                 }
             }
             if (!strErr.empty())
                 LogPrintf("%s\n", strErr);
         }
+        if (!vTxRecordData.empty())
+            flushTxRecords();
         pcursor->close();
     }
     catch (const boost::thread_interrupted&) {
@@ -988,7 +1099,7 @@ DBErrors CWalletDB::FindWalletTxToZap(CWallet* pwallet, vector<uint256>& vTxHash
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
@@ -1113,8 +1224,11 @@ void ThreadFlushWalletDB(const string& strFile)
                         int64_t nStart = GetTimeMillis();
 
                         // Flush wallet.dat so it's self contained
-                        bitdb.CloseDb(strFile);
-                        bitdb.CheckpointLSN(strFile);
+                        if (!bitdb.FlushLog(strFile))
+                        {
+                            bitdb.CloseDb(strFile);
+                            bitdb.CheckpointLSN(strFile);
+                        }
 
                         bitdb.mapFileUseCount.erase(mi++);
                         LogPrint("db", "Flushed wallet.dat %dms\n", GetTimeMillis() - nStart);
@@ -1173,11 +1287,22 @@ bool CWalletDB::Recover(CDBEnv& dbenv, const std::string& filename, bool fOnlyKe
     // Rewrite salvaged data to wallet.dat
     // Set -rescan so any missing transactions will be
     // found.
+    // A wallet log is salvaged batch by batch, and rewritten as a log.
+    bool fLog = dbenv.IsLogFile(filename);
+
     int64_t now = GetTime();
     std::string newFilename = strprintf("wallet.%d.bak", now);
 
-    int result = dbenv.dbenv->dbrename(NULL, filename.c_str(), NULL,
+    int result = 0;
+    if (fLog) {
+        // A wallet log is a plain file, outside the database environment
+        boost::system::error_code ec;
+        boost::filesystem::rename(GetDataDir() / filename, GetDataDir() / newFilename, ec);
+        result = ec ? ec.value() : 0;
+    } else {
+        result = dbenv.dbenv->dbrename(NULL, filename.c_str(), NULL,
                                        newFilename.c_str(), DB_AUTO_COMMIT);
+    }
     if (result == 0)
         LogPrintf("Renamed %s to %s\n", filename, newFilename);
     else
@@ -1195,22 +1320,9 @@ bool CWalletDB::Recover(CDBEnv& dbenv, const std::string& filename, bool fOnlyKe
     }
     LogPrintf("Salvage(aggressive) found %u records\n", salvagedData.size());
 
-    boost::scoped_ptr<Db> pdbCopy(new Db(dbenv.dbenv, 0));
-    int ret = pdbCopy->open(NULL,               // Txn pointer
-                            filename.c_str(),   // Filename
-                            "main",             // Logical db name
-                            DB_BTREE,           // Database type
-                            DB_CREATE,          // Flags
-                            0);
-    if (ret > 0)
-    {
-        LogPrintf("Cannot create database file %s\n", filename);
-        return false;
-    }
     CWallet dummyWallet;
     CWalletScanState wss;
-
-    DbTxn* ptxn = dbenv.TxnBegin();
+    std::vector<CDBEnv::KeyValPair> vRecords;
     BOOST_FOREACH(CDBEnv::KeyValPair& row, salvagedData)
     {
         if (fOnlyKeys)
@@ -1228,6 +1340,41 @@ bool CWalletDB::Recover(CDBEnv& dbenv, const std::string& filename, bool fOnlyKe
                 continue;
             }
         }
+        vRecords.push_back(row);
+    }
+
+    if (fLog)
+    {
+        CWalletLog::Batch batch;
+        BOOST_FOREACH(const CDBEnv::KeyValPair& row, vRecords)
+            batch.push_back(std::make_pair(row.first, boost::optional<CWalletLog::Bytes>(row.second)));
+        CWalletLog log;
+        if (!log.Open(GetDataDir() / filename, true) || !log.Write(batch) || !log.Flush())
+        {
+            LogPrintf("Cannot create wallet log %s\n", filename);
+            return false;
+        }
+        // Salvage has logged any batches it had to skip; the new log holds
+        // everything else, so carry on starting up with it
+        return true;
+    }
+
+    boost::scoped_ptr<Db> pdbCopy(new Db(dbenv.dbenv, 0));
+    int ret = pdbCopy->open(NULL,               // Txn pointer
+                            filename.c_str(),   // Filename
+                            "main",             // Logical db name
+                            DB_BTREE,           // Database type
+                            DB_CREATE,          // Flags
+                            0);
+    if (ret > 0)
+    {
+        LogPrintf("Cannot create database file %s\n", filename);
+        return false;
+    }
+
+    DbTxn* ptxn = dbenv.TxnBegin();
+    BOOST_FOREACH(CDBEnv::KeyValPair& row, vRecords)
+    {
         Dbt datKey(&row.first[0], row.first.size());
         Dbt datValue(&row.second[0], row.second.size());
         int ret2 = pdbCopy->put(ptxn, &datKey, &datValue, DB_NOOVERWRITE);
@@ -30,6 +30,9 @@ class CWalletTx;
 class uint160;
 class uint256;
 
+/** Number of transaction records that LoadWallet() checks in parallel at a time */
+static const size_t WALLET_LOAD_TX_BATCH_SIZE = 1000;
+
 /** Error statuses for the wallet database */
 enum DBErrors
 {
@@ -79,11 +82,15 @@ class CKeyMetadata
 public:
     static const int VERSION_BASIC=1;
     static const int VERSION_WITH_HDDATA=10;
-    static const int CURRENT_VERSION=VERSION_WITH_HDDATA;
+    static const int VERSION_WITH_BIRTHHEIGHT=11;
+    static const int VERSION_WITH_DIVERSIFIER=12;
+    static const int CURRENT_VERSION=VERSION_WITH_DIVERSIFIER;
     int nVersion;
     int64_t nCreateTime; // 0 means unknown
     std::string hdKeypath; //optional HD/zip32 keypath
     uint256 seedFp;
+    int nBirthHeight; // first block that can involve the key, -1 means unknown
+    libzcash::diversifier_index_t nextDiversifierIndex; // Sapling keys only: where to look for new diversified addresses
 
     CKeyMetadata()
     {
@@ -106,6 +113,14 @@ public:
             READWRITE(hdKeypath);
             READWRITE(seedFp);
         }
+        if (this->nVersion >= VERSION_WITH_BIRTHHEIGHT)
+        {
+            READWRITE(nBirthHeight);
+        }
+        if (this->nVersion >= VERSION_WITH_DIVERSIFIER)
+        {
+            READWRITE(nextDiversifierIndex);
+        }
     }
 
     void SetNull()
@@ -114,6 +129,8 @@ public:
         nCreateTime = 0;
         hdKeypath.clear();
         seedFp.SetNull();
+        nBirthHeight = -1;
+        nextDiversifierIndex.SetNull();
     }
 };
 
@@ -197,6 +214,11 @@ public:
                           const std::vector<unsigned char>& vchCryptedSecret,
                           const CKeyMetadata &keyMeta);
 
+    //! overwrite the metadata of a key that is already in the database
+    bool WriteKeyMetadata(const CPubKey& vchPubKey, const CKeyMetadata &keyMeta);
+    bool WriteZKeyMetadata(const libzcash::SproutPaymentAddress& addr, const CKeyMetadata &keyMeta);
+    bool WriteSaplingZKeyMetadata(const libzcash::SaplingIncomingViewingKey &ivk, const CKeyMetadata &keyMeta);
+
     bool WriteSproutViewingKey(const libzcash::SproutViewingKey &vk);
     bool EraseSproutViewingKey(const libzcash::SproutViewingKey &vk);
 
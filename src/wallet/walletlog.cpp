@@ -0,0 +1,501 @@
+// Copyright (c) 2019 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "wallet/walletlog.h"
+
+#include "clientversion.h"
+#include "hash.h"
+#include "serialize.h"
+#include "streams.h"
+#include "util.h"
+
+#include <string.h>
+
+#include <boost/filesystem.hpp>
+
+const char CWalletLog::MAGIC[8] = {'z', 'w', 'a', 'l', 'l', 'o', 'g', '1'};
+
+// Each batch is preceded by the size of its payload, the first four bytes of
+// the payload's hash, and the first four bytes of the hash of those eight
+// bytes, so that a damaged size is never trusted.
+static const size_t BATCH_HEADER_SIZE = 12;
+static const size_t BATCH_HEADER_CHECKED_SIZE = 8;
+static const unsigned char RECORD_ERASE = 0;
+static const unsigned char RECORD_PUT = 1;
+
+static uint32_t Checksum(const unsigned char* pbegin, const unsigned char* pend)
+{
+    uint256 hash = Hash(pbegin, pend);
+    uint32_t nChecksum;
+    memcpy(&nChecksum, hash.begin(), sizeof(nChecksum));
+    return nChecksum;
+}
+
+static uint32_t BatchChecksum(const CDataStream& ssPayload)
+{
+    return Checksum((const unsigned char*)&ssPayload.begin()[0], (const unsigned char*)&ssPayload.begin()[0] + ssPayload.size());
+}
+
+CWalletLog::CWalletLog() : file(NULL), nFileSize(0), nLiveBytes(0)
+{
+}
+
+CWalletLog::~CWalletLog()
+{
+    Close();
+}
+
+bool CWalletLog::IsLogFile(const boost::filesystem::path& path)
+{
+    FILE* f = fopen(path.string().c_str(), "rb");
+    if (!f)
+        return false;
+    char magic[sizeof(MAGIC)];
+    bool fLog = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+                memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+    fclose(f);
+    return fLog;
+}
+
+bool CWalletLog::Open(const boost::filesystem::path& pathIn, bool fCreate)
+{
+    LOCK(cs_log);
+    if (file)
+        return false;
+
+    path = pathIn;
+    mapKeys.clear();
+    nLiveBytes = 0;
+    if (!boost::filesystem::exists(path)) {
+        if (!fCreate)
+            return false;
+        file = fopen(path.string().c_str(), "w+b");
+        if (!file)
+            return error("CWalletLog::Open: Can't create %s", path.string());
+        if (fwrite(MAGIC, 1, sizeof(MAGIC), file) != sizeof(MAGIC)) {
+            Close();
+            return error("CWalletLog::Open: Can't write to %s", path.string());
+        }
+        FileCommit(file);
+        DirectoryCommit(path.parent_path());
+        nFileSize = sizeof(MAGIC);
+        return true;
+    }
+
+    file = fopen(path.string().c_str(), "r+b");
+    if (!file)
+        return error("CWalletLog::Open: Can't open %s", path.string());
+    if (!Replay()) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+enum BatchStatus { BATCH_OK, BATCH_END, BATCH_TORN, BATCH_CORRUPT, BATCH_BAD_HEADER };
+
+/** Whether the file only holds zeros from nPos to nEnd. */
+static bool IsZeroTail(FILE* file, uint64_t nPos, uint64_t nEnd)
+{
+    if (fseek(file, nPos, SEEK_SET) != 0)
+        return false;
+    unsigned char buf[4096];
+    while (nPos < nEnd) {
+        size_t nRead = fread(buf, 1, std::min<uint64_t>(sizeof(buf), nEnd - nPos), file);
+        if (nRead == 0)
+            return false;
+        for (size_t i = 0; i < nRead; i++) {
+            if (buf[i] != 0)
+                return false;
+        }
+        nPos += nRead;
+    }
+    return true;
+}
+
+/**
+ * Read the batch at nPos of a log file that ends at nEnd.
+ *
+ * Only the last write can have been interrupted, so a bad batch is only torn
+ * if the file really ends inside it: its (checked) size runs past the end of
+ * the file, or everything from the damage to the end of the file is zeros, as
+ * a file system can extend a file before the data written to it lands. Any
+ * other bad batch means the file is corrupt. nNext is set to the position
+ * after the batch, unless its header is bad (BATCH_BAD_HEADER).
+ */
+static BatchStatus ReadBatch(FILE* file, uint64_t nPos, uint64_t nEnd, CDataStream& ssPayload, uint64_t& nNext)
+{
+    if (nPos >= nEnd)
+        return BATCH_END;
+    if (nEnd - nPos < BATCH_HEADER_SIZE)
+        return BATCH_TORN;
+    unsigned char header[BATCH_HEADER_SIZE];
+    if (fseek(file, nPos, SEEK_SET) != 0 ||
+        fread(header, 1, sizeof(header), file) != sizeof(header))
+        return BATCH_BAD_HEADER;
+    uint32_t nPayloadSize, nChecksum, nHeaderChecksum;
+    memcpy(&nPayloadSize, header, 4);
+    memcpy(&nChecksum, header + 4, 4);
+    memcpy(&nHeaderChecksum, header + 8, 4);
+    if (Checksum(header, header + BATCH_HEADER_CHECKED_SIZE) != nHeaderChecksum)
+        return IsZeroTail(file, nPos, nEnd) ? BATCH_TORN : BATCH_BAD_HEADER;
+    nPayloadSize = le32toh(nPayloadSize);
+    nNext = nPos + BATCH_HEADER_SIZE + nPayloadSize;
+    if (nNext > nEnd)
+        return BATCH_TORN;
+
+    ssPayload.clear();
+    ssPayload.resize(nPayloadSize);
+    if (nPayloadSize > 0 && fread(&ssPayload[0], 1, nPayloadSize, file) != nPayloadSize)
+        return BATCH_CORRUPT;
+    if (BatchChecksum(ssPayload) != nChecksum)
+        return IsZeroTail(file, nNext, nEnd) ? BATCH_TORN : BATCH_CORRUPT;
+    return BATCH_OK;
+}
+
+bool CWalletLog::Replay()
+{
+    AssertLockHeld(cs_log);
+
+    char magic[sizeof(MAGIC)];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+        return error("CWalletLog::Replay: %s is not a wallet log", path.string());
+    if (fseek(file, 0, SEEK_END) != 0)
+        return error("CWalletLog::Replay: Can't read %s", path.string());
+    uint64_t nEnd = ftell(file);
+
+    uint64_t nPos = sizeof(MAGIC);
+    while (true) {
+        CDataStream ssPayload(SER_DISK, CLIENT_VERSION);
+        uint64_t nNext;
+        BatchStatus status = ReadBatch(file, nPos, nEnd, ssPayload, nNext);
+        if (status == BATCH_END || status == BATCH_TORN)
+            break;
+        if (status == BATCH_CORRUPT || status == BATCH_BAD_HEADER) {
+            // Don't touch the file, so that it can be restored from a backup
+            // or salvaged (-salvagewallet)
+            return error("CWalletLog::Replay: The batch at offset %u of %s is corrupt", nPos, path.string());
+        }
+
+        // Apply the batch to the key directory
+        uint64_t nPayloadPos = nPos + BATCH_HEADER_SIZE;
+        uint64_t nPayloadSize = ssPayload.size();
+        try {
+            while (!ssPayload.empty()) {
+                unsigned char nType;
+                Bytes key;
+                ssPayload >> nType >> key;
+                auto it = mapKeys.find(key);
+                if (it != mapKeys.end()) {
+                    nLiveBytes -= it->first.size() + it->second.nSize;
+                    mapKeys.erase(it);
+                }
+                if (nType == RECORD_PUT) {
+                    uint64_t nSize = ReadCompactSize(ssPayload);
+                    if (nSize > ssPayload.size())
+                        throw std::ios_base::failure("CWalletLog::Replay: value out of range");
+                    CValuePos pos;
+                    pos.nPos = nPayloadPos + (nPayloadSize - ssPayload.size());
+                    pos.nSize = nSize;
+                    ssPayload.ignore(nSize);
+                    mapKeys[key] = pos;
+                    nLiveBytes += key.size() + nSize;
+                } else if (nType != RECORD_ERASE) {
+                    throw std::ios_base::failure("CWalletLog::Replay: unknown record type");
+                }
+            }
+        } catch (const std::exception& e) {
+            // The checksum matched, so this is not a torn write
+            return error("CWalletLog::Replay: %s in %s", e.what(), path.string());
+        }
+        nPos = nNext;
+    }
+
+    // Anything after the last complete batch was being written when we
+    // stopped; drop it so that new batches are appended to a valid log.
+    if (nEnd != nPos) {
+        LogPrintf("CWalletLog::Replay: Discarding %u bytes of incomplete writes at the end of %s\n", nEnd - nPos, path.string());
+        if (!TruncateFile(file, nPos))
+            return error("CWalletLog::Replay: Can't truncate %s", path.string());
+    }
+    nFileSize = nPos;
+    LogPrint("db", "CWalletLog::Replay: %s has %u records, %u of %u bytes live\n", path.string(), mapKeys.size(), nLiveBytes, nFileSize);
+    return true;
+}
+
+bool CWalletLog::Salvage(const boost::filesystem::path& path, std::vector<std::pair<Bytes, Bytes>>& vResult)
+{
+    FILE* file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return error("CWalletLog::Salvage: Can't open %s", path.string());
+    char magic[sizeof(MAGIC)];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        fseek(file, 0, SEEK_END) != 0) {
+        fclose(file);
+        return error("CWalletLog::Salvage: %s is not a wallet log", path.string());
+    }
+    uint64_t nEnd = ftell(file);
+
+    bool fGood = true;
+    std::map<Bytes, Bytes> mapRecords;
+    uint64_t nPos = sizeof(MAGIC);
+    while (true) {
+        CDataStream ssPayload(SER_DISK, CLIENT_VERSION);
+        uint64_t nNext;
+        BatchStatus status = ReadBatch(file, nPos, nEnd, ssPayload, nNext);
+        if (status == BATCH_END || status == BATCH_TORN)
+            break;
+        if (status == BATCH_CORRUPT) {
+            // Its header is good, so carry on after it
+            LogPrintf("CWalletLog::Salvage: Skipping the corrupt batch at offset %u of %s\n", nPos, path.string());
+            fGood = false;
+            nPos = nNext;
+            continue;
+        }
+        if (status == BATCH_BAD_HEADER) {
+            // Where the batch ends is unknown, so look for the next header
+            // that checks out
+            uint64_t nSkipFrom = nPos;
+            fGood = false;
+            for (nPos++; nPos < nEnd; nPos++) {
+                CDataStream ssNext(SER_DISK, CLIENT_VERSION);
+                uint64_t nNextAfter;
+                if (ReadBatch(file, nPos, nEnd, ssNext, nNextAfter) != BATCH_BAD_HEADER)
+                    break;
+            }
+            LogPrintf("CWalletLog::Salvage: Skipping %u bytes with a bad batch header at offset %u of %s\n", nPos - nSkipFrom, nSkipFrom, path.string());
+            continue;
+        }
+
+        // Apply the batch as a whole, or not at all
+        std::map<Bytes, boost::optional<Bytes>> mapBatch;
+        try {
+            while (!ssPayload.empty()) {
+                unsigned char nType;
+                Bytes key;
+                ssPayload >> nType >> key;
+                if (nType == RECORD_PUT) {
+                    Bytes value;
+                    ssPayload >> value;
+                    mapBatch[key] = value;
+                } else if (nType == RECORD_ERASE) {
+                    mapBatch[key] = boost::none;
+                } else {
+                    throw std::ios_base::failure("unknown record type");
+                }
+            }
+            for (const auto& update : mapBatch) {
+                if (update.second)
+                    mapRecords[update.first] = *update.second;
+                else
+                    mapRecords.erase(update.first);
+            }
+        } catch (const std::exception& e) {
+            LogPrintf("CWalletLog::Salvage: Skipping the batch at offset %u of %s: %s\n", nPos, path.string(), e.what());
+            fGood = false;
+        }
+        nPos = nNext;
+    }
+    fclose(file);
+
+    for (const auto& record : mapRecords)
+        vResult.push_back(record);
+    return fGood;
+}
+
+void CWalletLog::Close()
+{
+    LOCK(cs_log);
+    if (file) {
+        FileCommit(file);
+        fclose(file);
+        file = NULL;
+    }
+    mapKeys.clear();
+    nFileSize = 0;
+    nLiveBytes = 0;
+}
+
+bool CWalletLog::ReadValue(const CValuePos& pos, Bytes& value) const
+{
+    AssertLockHeld(cs_log);
+    value.resize(pos.nSize);
+    if (pos.nSize == 0)
+        return true;
+    if (fseek(file, pos.nPos, SEEK_SET) != 0)
+        return false;
+    return fread(&value[0], 1, pos.nSize, file) == pos.nSize;
+}
+
+bool CWalletLog::Read(const Bytes& key, Bytes& value) const
+{
+    LOCK(cs_log);
+    auto it = mapKeys.find(key);
+    if (!file || it == mapKeys.end())
+        return false;
+    return ReadValue(it->second, value);
+}
+
+bool CWalletLog::Exists(const Bytes& key) const
+{
+    LOCK(cs_log);
+    return mapKeys.count(key) > 0;
+}
+
+bool CWalletLog::Write(const Batch& batch)
+{
+    LOCK(cs_log);
+    if (!file)
+        return false;
+    if (batch.empty())
+        return true;
+
+    CDataStream ssPayload(SER_DISK, CLIENT_VERSION);
+    std::vector<uint64_t> vValueOffsets;
+    for (const Update& update : batch) {
+        if (update.second) {
+            ssPayload << RECORD_PUT << update.first;
+            WriteCompactSize(ssPayload, update.second->size());
+            vValueOffsets.push_back(ssPayload.size());
+            ssPayload.write((const char*)update.second->data(), update.second->size());
+        } else {
+            ssPayload << RECORD_ERASE << update.first;
+            vValueOffsets.push_back(0);
+        }
+    }
+
+    unsigned char header[BATCH_HEADER_SIZE];
+    uint32_t nPayloadSize = htole32(ssPayload.size());
+    uint32_t nChecksum = BatchChecksum(ssPayload);
+    memcpy(header, &nPayloadSize, 4);
+    memcpy(header + 4, &nChecksum, 4);
+    uint32_t nHeaderChecksum = Checksum(header, header + BATCH_HEADER_CHECKED_SIZE);
+    memcpy(header + 8, &nHeaderChecksum, 4);
+
+    if (fseek(file, nFileSize, SEEK_SET) != 0 ||
+        fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+        fwrite(&ssPayload[0], 1, ssPayload.size(), file) != ssPayload.size() ||
+        fflush(file) != 0) {
+        // Don't leave a partial batch behind for the next one to follow
+        TruncateFile(file, nFileSize);
+        return error("CWalletLog::Write: Can't append to %s", path.string());
+    }
+
+    uint64_t nPayloadPos = nFileSize + BATCH_HEADER_SIZE;
+    for (size_t i = 0; i < batch.size(); i++) {
+        const Update& update = batch[i];
+        auto it = mapKeys.find(update.first);
+        if (it != mapKeys.end()) {
+            nLiveBytes -= it->first.size() + it->second.nSize;
+            mapKeys.erase(it);
+        }
+        if (update.second) {
+            CValuePos pos;
+            pos.nPos = nPayloadPos + vValueOffsets[i];
+            pos.nSize = update.second->size();
+            mapKeys[update.first] = pos;
+            nLiveBytes += update.first.size() + pos.nSize;
+        }
+    }
+    nFileSize = nPayloadPos + ssPayload.size();
+    return true;
+}
+
+bool CWalletLog::Seek(const Bytes& key, bool fInclusive, Bytes& keyOut, Bytes& valueOut) const
+{
+    LOCK(cs_log);
+    auto it = fInclusive ? mapKeys.lower_bound(key) : mapKeys.upper_bound(key);
+    if (!file || it == mapKeys.end())
+        return false;
+    keyOut = it->first;
+    return ReadValue(it->second, valueOut);
+}
+
+bool CWalletLog::First(Bytes& keyOut, Bytes& valueOut) const
+{
+    return Seek(Bytes(), true, keyOut, valueOut);
+}
+
+bool CWalletLog::Flush()
+{
+    LOCK(cs_log);
+    if (!file)
+        return false;
+    FileCommit(file);
+    return true;
+}
+
+bool CWalletLog::Compact(const char* pszSkip)
+{
+    LOCK(cs_log);
+    if (!file)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path pathCompact = path;
+    pathCompact += ".compact";
+    boost::filesystem::remove(pathCompact);
+
+    Batch batch;
+    for (const auto& item : mapKeys) {
+        const Bytes& key = item.first;
+        if (pszSkip && key.size() >= strlen(pszSkip) && memcmp(key.data(), pszSkip, strlen(pszSkip)) == 0)
+            continue;
+        Bytes value;
+        if (!ReadValue(item.second, value))
+            return error("CWalletLog::Compact: Can't read %s", path.string());
+        batch.push_back(std::make_pair(key, value));
+    }
+
+    {
+        CWalletLog logCompact;
+        if (!logCompact.Open(pathCompact, true) || !logCompact.Write(batch) || !logCompact.Flush())
+            return error("CWalletLog::Compact: Can't write %s", pathCompact.string());
+    }
+
+    uint64_t nOldSize = nFileSize;
+    fclose(file);
+    file = NULL;
+    bool fReplaced = true;
+    try {
+        boost::filesystem::rename(pathCompact, path);
+        // Make the rename itself durable
+        DirectoryCommit(path.parent_path());
+    } catch (const boost::filesystem::filesystem_error& e) {
+        // Carry on with the old file
+        LogPrintf("CWalletLog::Compact: Can't replace %s: %s\n", path.string(), e.what());
+        fReplaced = false;
+    }
+    file = fopen(path.string().c_str(), "r+b");
+    if (!file)
+        return error("CWalletLog::Compact: Can't reopen %s", path.string());
+    mapKeys.clear();
+    nLiveBytes = 0;
+    if (!Replay()) {
+        fclose(file);
+        file = NULL;
+        return false;
+    }
+    if (!fReplaced)
+        return false;
+    LogPrint("db", "CWalletLog::Compact: Compacted %s from %u to %u bytes in %dms\n", path.string(), nOldSize, nFileSize, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CWalletLog::MaybeCompact()
+{
+    {
+        LOCK(cs_log);
+        uint64_t nDead = nFileSize - sizeof(MAGIC) - nLiveBytes;
+        if (!file || nDead < WALLET_LOG_COMPACT_MIN_DEAD || nDead <= nLiveBytes)
+            return true;
+    }
+    return Compact();
+}
+
+size_t CWalletLog::Size() const
+{
+    LOCK(cs_log);
+    return mapKeys.size();
+}
@@ -0,0 +1,122 @@
+// Copyright (c) 2019 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef BITCOIN_WALLET_WALLETLOG_H
+#define BITCOIN_WALLET_WALLETLOG_H
+
+#include "sync.h"
+
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/optional.hpp>
+
+/**
+ * Compact a wallet log once overwritten and erased records take up at least
+ * this many bytes, and more than the live records do.
+ */
+static const uint64_t WALLET_LOG_COMPACT_MIN_DEAD = 1 << 20;
+
+/**
+ * Append-only store for wallet records, used instead of a Berkeley database
+ * when a wallet is created with -walletformat=log.
+ *
+ * The file starts with a magic string and is followed by batches of record
+ * updates, each of them written in one go after a header with its length and
+ * checksum, which is checksummed itself. A batch is the unit of atomicity: a
+ * batch at the end of the file that was not written completely (because of a
+ * crash) is discarded when the file is opened again. A bad batch anywhere
+ * else means the file is corrupt, and it isn't opened (see Salvage).
+ *
+ * Only the keys and the positions of their current values are kept in memory
+ * (the key directory). Values are read from the file on demand. Overwritten
+ * and erased records stay in the file until it is compacted, which rewrites
+ * the live records to a new file and replaces the old one with it.
+ *
+ * Keys are ordered bytewise, like Berkeley DB's default btree comparison, so
+ * cursors visit records in the same order for both backends.
+ */
+class CWalletLog
+{
+public:
+    typedef std::vector<unsigned char> Bytes;
+    /** A record update; a missing value erases the key. */
+    typedef std::pair<Bytes, boost::optional<Bytes>> Update;
+    typedef std::vector<Update> Batch;
+
+    static const char MAGIC[8];
+
+private:
+    struct CValuePos
+    {
+        uint64_t nPos;
+        uint32_t nSize;
+    };
+    typedef std::map<Bytes, CValuePos> KeyDirectory;
+
+    mutable CCriticalSection cs_log;
+    boost::filesystem::path path;
+    FILE* file;
+    KeyDirectory mapKeys;
+    uint64_t nFileSize;
+    uint64_t nLiveBytes;  //!< bytes taken by the live records in the file
+
+    bool Replay();
+    bool ReadValue(const CValuePos& pos, Bytes& value) const;
+
+public:
+    CWalletLog();
+    ~CWalletLog();
+
+    /** Whether the file at path is a wallet log (as opposed to a Berkeley database) */
+    static bool IsLogFile(const boost::filesystem::path& path);
+
+    /**
+     * Open the log at path, creating it if fCreate is set. A torn batch at the
+     * end of the file is truncated away. Returns false, leaving the file as it
+     * is, if the file doesn't exist (and fCreate isn't set), isn't a log, or
+     * can't be read, or if a batch before the end of it is corrupt.
+     */
+    bool Open(const boost::filesystem::path& pathIn, bool fCreate);
+    /**
+     * Read the live records of the log at path into vResult, skipping any
+     * corrupt batches. Returns true if there were none.
+     */
+    static bool Salvage(const boost::filesystem::path& path, std::vector<std::pair<Bytes, Bytes>>& vResult);
+    void Close();
+    bool IsOpen() const { return file != NULL; }
+
+    bool Read(const Bytes& key, Bytes& value) const;
+    bool Exists(const Bytes& key) const;
+    /** Append a batch of updates to the log as a single atomic unit. */
+    bool Write(const Batch& batch);
+
+    /**
+     * First key that is greater than (or, if fInclusive is set, equal to)
+     * key, with its value. Used to implement cursors that stay valid while
+     * the log is being written to.
+     */
+    bool Seek(const Bytes& key, bool fInclusive, Bytes& keyOut, Bytes& valueOut) const;
+    /** First record in key order. */
+    bool First(Bytes& keyOut, Bytes& valueOut) const;
+
+    /** Write everything appended so far through to disk. */
+    bool Flush();
+    /**
+     * Rewrite the live records, except those whose key starts with pszSkip,
+     * to a new file and replace the log with it.
+     */
+    bool Compact(const char* pszSkip = NULL);
+    /** Compact the log if enough of it is taken by dead records. */
+    bool MaybeCompact();
+
+    size_t Size() const;
+};
+
+#endif // BITCOIN_WALLET_WALLETLOG_H
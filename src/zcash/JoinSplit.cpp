@@ -43,7 +43,8 @@ public:
         uint64_t vpub_new,
         const uint256& rt,
         bool computeProof,
-        uint256 *out_esk // Payment disclosure
+        uint256 *out_esk, // Payment disclosure
+        JSProofWitness<NumInputs, NumOutputs> *out_proofWitness
     ) {
         if (vpub_old > MAX_MONEY) {
             throw std::invalid_argument("nonsensical vpub_old value");
@@ -159,10 +160,30 @@ public:
             out_macs[i] = PRF_pk(inputs[i].key, i, h_sig);
         }
 
+        JSProofWitness<NumInputs, NumOutputs> witness;
+        witness.phi = phi;
+        witness.rt = rt;
+        witness.h_sig = h_sig;
+        witness.inputs = inputs;
+        witness.notes = out_notes;
+        witness.vpub_old = vpub_old;
+        witness.vpub_new = vpub_new;
+
+        if (out_proofWitness != nullptr) {
+            *out_proofWitness = witness;
+        }
+
         if (!computeProof) {
             return GrothProof();
         }
 
+        return prove(witness);
+    }
+
+    SproutProof prove(const JSProofWitness<NumInputs, NumOutputs>& witness) {
+        const std::array<JSInput, NumInputs>& inputs = witness.inputs;
+        const std::array<SproutNote, NumOutputs>& out_notes = witness.notes;
+
         GrothProof proof;
 
         CDataStream ss1(SER_NETWORK, PROTOCOL_VERSION);
@@ -176,9 +197,9 @@ public:
         librustzcash_sprout_prove(
             proof.begin(),
 
-            phi.begin(),
-            rt.begin(),
-            h_sig.begin(),
+            witness.phi.begin(),
+            witness.rt.begin(),
+            witness.h_sig.begin(),
 
             inputs[0].key.begin(),
             inputs[0].note.value(),
@@ -200,8 +221,8 @@ public:
             out_notes[1].value(),
             out_notes[1].r.begin(),
 
-            vpub_old,
-            vpub_new
+            witness.vpub_old,
+            witness.vpub_new
         );
 
         return proof;
@@ -51,6 +51,22 @@ public:
     SproutNote note(const uint252& phi, const uint256& r, size_t i, const uint256& h_sig) const;
 };
 
+// Everything needed to create the proof of a JoinSplit whose notes,
+// commitments and ciphertexts have already been computed. This lets the
+// proofs of a transaction's JoinSplits be created after the JoinSplits
+// themselves have been chained together, and independently of each other.
+template<size_t NumInputs, size_t NumOutputs>
+class JSProofWitness {
+public:
+    uint252 phi;
+    uint256 rt;
+    uint256 h_sig;
+    std::array<JSInput, NumInputs> inputs;
+    std::array<SproutNote, NumOutputs> notes;
+    uint64_t vpub_old = 0;
+    uint64_t vpub_new = 0;
+};
+
 template<size_t NumInputs, size_t NumOutputs>
 class JoinSplit {
 public:
@@ -82,9 +98,15 @@ public:
         // For paymentdisclosure, we need to retrieve the esk.
         // Reference as non-const parameter with default value leads to compile error.
         // So use pointer for simplicity.
-        uint256 *out_esk = nullptr
+        uint256 *out_esk = nullptr,
+        // If not null, receives what is needed to create the proof later
+        // (typically with computeProof = false).
+        JSProofWitness<NumInputs, NumOutputs> *out_proofWitness = nullptr
     ) = 0;
 
+    // Compute the SNARK proof for a JoinSplit from its proof witness
+    virtual SproutProof prove(const JSProofWitness<NumInputs, NumOutputs>& witness) = 0;
+
 protected:
     JoinSplit() {}
 };
@@ -93,5 +115,7 @@ protected:
 
 typedef libzcash::JoinSplit<ZC_NUM_JS_INPUTS,
                             ZC_NUM_JS_OUTPUTS> ZCJoinSplit;
+typedef libzcash::JSProofWitness<ZC_NUM_JS_INPUTS,
+                                 ZC_NUM_JS_OUTPUTS> ZCJSProofWitness;
 
 #endif // ZC_JOINSPLIT_H_